@@ -3,6 +3,7 @@
 #define ALL_H_06_01_2026
 ////////////////////////////////////////////////////////////////////////////////
 #include "amp.h"
+#include "bench.h"
 #include "client.h"
 #include "clip.h"
 #include "dispatcher.h"
@@ -17,6 +18,7 @@
 #include "telnet.h"
 #include "terminal.h"
 #include "utils.h"
+#include "worker.h"
 ////////////////////////////////////////////////////////////////////////////////
 
 #endif
@@ -0,0 +1,10 @@
+// SPDX-License-Identifier: MIT
+////////////////////////////////////////////////////////////////////////////////
+#include "all.h"
+////////////////////////////////////////////////////////////////////////////////
+
+
+struct amp_lut_type amp_lut = {
+    .rgb16_once = ONCE_FLAG_INIT,
+    .xterm256_once = ONCE_FLAG_INIT
+};
@@ -34,18 +34,60 @@
 #include <stdckdint.h>
 #include <limits.h>
 #include <ctype.h>
+#include <threads.h>
+#include "utils.h"
+////////////////////////////////////////////////////////////////////////////////
+#if SIMD_X86
+#include <immintrin.h>
+#define AMP_X86 1
+#else
+#define AMP_X86 0
+#endif
 ////////////////////////////////////////////////////////////////////////////////
 
 
 struct amp_type;
+struct amp_sgr_cache_type;
 struct amp_color_type;
 struct amp_mode_type;
-
-static constexpr size_t AMP_CELL_GLYPH_SIZE = 5; // 4 bytes for UTF8 + null byte
-static constexpr size_t AMP_CELL_MODE_SIZE  = 7;
+struct amp_writer_type;
+
+// The cells are stored as two separate arrays: one of 32-bit glyph words that
+// hold the UTF-8 encoding of a code point padded with zeros, and the other of
+// 64-bit mode words that hold the packed colors and styles. Both arrays begin
+// at an AMP_ALIGNMENT byte boundary.
+static constexpr size_t AMP_CELL_GLYPH_SIZE = sizeof(uint32_t);
+static constexpr size_t AMP_CELL_MODE_SIZE  = sizeof(uint64_t);
 static constexpr size_t AMP_CELL_SIZE       = (
     AMP_CELL_GLYPH_SIZE + AMP_CELL_MODE_SIZE
 );
+static constexpr size_t AMP_ALIGNMENT       = 16;
+
+// Layout of the mode word. The style bits are in the same order as the styles
+// in AMP_STYLE.
+static constexpr unsigned AMP_MODE_FG_SHIFT     = 0;
+static constexpr unsigned AMP_MODE_BG_SHIFT     = 24;
+static constexpr unsigned AMP_MODE_STYLE_SHIFT  = 48;
+static constexpr uint64_t AMP_MODE_STYLE_MASK   = 0x3fULL << 48;
+static constexpr uint64_t AMP_MODE_FG           = 1ULL << 54;
+static constexpr uint64_t AMP_MODE_BG           = 1ULL << 55;
+
+// The longest ANSI encoding of a single cell is a select graphic rendition
+// sequence that resets the mode, enables all of the styles and sets both of the
+// colors in 24-bit (50 bytes), followed by a 4 byte glyph.
+static constexpr size_t AMP_ANS_CELL_MAX_SIZE = 64;
+
+// The limited palettes quantize colors through lookup tables that are indexed
+// by the AMP_LUT_BITS most significant bits of each color channel.
+static constexpr unsigned AMP_LUT_BITS  = 5;
+static constexpr size_t AMP_LUT_SIZE    = 1 << (3 * AMP_LUT_BITS);
+
+// Encoded graphic rendition transitions are cached in a direct-mapped table of
+// AMP_SGR_CACHE_SIZE entries, keyed by the previous and the next mode word.
+static constexpr size_t AMP_SGR_CACHE_SIZE  = 512;
+static constexpr size_t AMP_SGR_MAX_SIZE    = (
+    AMP_ANS_CELL_MAX_SIZE - AMP_CELL_GLYPH_SIZE
+);
 
 typedef enum : uint8_t {
     AMP_COLOR_NONE = 0,
@@ -94,7 +136,8 @@ typedef enum : uint64_t {
 
 typedef enum : uint8_t {
     AMP_PAL_RGB16 = 0,
-    AMP_PAL_24BIT
+    AMP_PAL_24BIT,
+    AMP_PAL_256
 } AMP_PALETTE;
 
 typedef enum : uint8_t {
@@ -159,13 +202,29 @@ static inline size_t                    amp_row_cut_to_ans(
     char *                                  ans_dst,
     size_t                                  ans_dst_size
 );
+static inline void                      amp_to_writer(
+    const struct amp_type *                 amp,
+    struct amp_writer_type *                writer
+);
+static inline void                      amp_row_cut_to_writer(
+    const struct amp_type *                 amp,
+    uint32_t                                x,
+    uint32_t                                y,
+    uint32_t                                width,
+    struct amp_writer_type *                writer
+);
+static inline size_t                    amp_row_cut_max_ans_size(
+    const struct amp_type *                 amp,
+    uint32_t                                x,
+    uint32_t                                width
+);
 static inline size_t                    amp_glyph_row_to_str(
     const struct amp_type *                 amp,
     uint32_t                                y,
     char *                                  str_dst,
     size_t                                  str_dst_size
 );
-static inline const char *              amp_put_glyph(
+static inline bool                      amp_put_glyph(
     struct amp_type *                       amp,
     const char *                            glyph,
     uint32_t                                x,
@@ -174,7 +233,9 @@ static inline const char *              amp_put_glyph(
 static inline const char *              amp_get_glyph(
     const struct amp_type *                 amp,
     uint32_t                                x,
-    uint32_t                                y
+    uint32_t                                y,
+    char *                                  glyph_dst,
+    size_t                                  glyph_dst_size
 );
 static inline AMP_STYLE                 amp_get_style(
     const struct amp_type *                 amp,
@@ -201,6 +262,41 @@ static inline void                      amp_unmap_rgb(
 static inline struct amp_color_type     amp_lookup_color(
     AMP_COLOR                               index
 );
+static inline bool                      amp_cell_equals(
+    const struct amp_type *                 amp,
+    const struct amp_type *                 other,
+    uint32_t                                x,
+    uint32_t                                y
+);
+static inline bool                      amp_cell_is_blank(
+    const struct amp_type *                 amp,
+    uint32_t                                x,
+    uint32_t                                y
+);
+static inline bool                      amp_row_compare(
+    const struct amp_type *                 amp,
+    const struct amp_type *                 other,
+    uint32_t                                y,
+    uint32_t *                              first_x,
+    uint32_t *                              end_x
+);
+static inline uint32_t                  amp_row_skip_equal(
+    const struct amp_type *                 amp,
+    const struct amp_type *                 other,
+    uint32_t                                x,
+    uint32_t                                y,
+    uint32_t                                end_x
+);
+static inline uint32_t                  amp_row_skip_mode(
+    const struct amp_type *                 amp,
+    uint32_t                                x,
+    uint32_t                                y,
+    uint32_t                                end_x
+);
+static inline void                      amp_set_sgr_cache(
+    struct amp_type *                       amp,
+    struct amp_sgr_cache_type *             cache
+);
 ////////////////////////////////////////////////////////////////////////////////
 
 struct amp_type {
@@ -208,16 +304,37 @@ struct amp_type {
     uint32_t height;
 
     struct {
-        size_t size;
-        uint8_t *data;
+        size_t size; // in bytes
+        uint32_t *data;
     } glyph;
 
     struct {
-        size_t size;
-        uint8_t *data;
+        size_t size; // in bytes
+        uint64_t *data;
     } mode;
 
     AMP_PALETTE palette;
+    struct amp_sgr_cache_type *sgr_cache; // optional, may be shared
+};
+
+struct amp_sgr_cache_type {
+    struct amp_sgr_cache_entry_type {
+        uint64_t prev_mode_word;
+        uint64_t next_mode_word;
+        uint8_t size;
+        char data[AMP_SGR_MAX_SIZE];
+    } entry[AMP_SGR_CACHE_SIZE];
+
+    size_t hits;
+    size_t misses;
+    AMP_PALETTE palette; // the entries are only valid for this palette
+};
+
+struct amp_writer_type {
+    char *data;         // destination buffer of the encoder
+    size_t capacity;    // number of bytes that fit in the destination buffer
+    size_t size;        // number of bytes written, including those that did
+                        // not fit in the destination buffer
 };
 
 struct amp_mode_type {
@@ -599,7 +716,48 @@ static const struct amp_rgb16_type amp_rgb16_bg_table[] = {
     [AMP_MAX_COLOR] = {}
 };
 
+struct amp_sgr_type {
+    const char *fg;     // RGB16 code of the foreground color or nullptr
+    const char *bg;     // RGB16 code of the background color or nullptr
+    uint8_t fg_index;   // xterm-256 index of the foreground color
+    uint8_t bg_index;   // xterm-256 index of the background color
+    bool bold:1;        // bright foreground
+    bool reverse:1;     // bright background, shown by swapping the colors
+};
+
+static const uint8_t amp_xterm256_cube_levels[] = { 0, 95, 135, 175, 215, 255 };
+
+// The quantization tables are built on first use of the palette they are for,
+// once even if several threads need them at the same time. There is a single
+// instance of them, defined in amp.c.
+struct amp_lut_type {
+    uint8_t rgb16[AMP_LUT_SIZE];    // AMP_COLOR of the closest basic color
+    uint8_t xterm256[AMP_LUT_SIZE]; // closest color of the xterm-256 palette
+    once_flag rgb16_once;
+    once_flag xterm256_once;
+};
+
+extern struct amp_lut_type amp_lut;
+
 // Private API: ////////////////////////////////////////////////////////////////
+static inline size_t                    amp_cells_find_mismatch(
+    const uint32_t *                        glyphs,
+    const uint32_t *                        other_glyphs,
+    const uint64_t *                        modes,
+    const uint64_t *                        other_modes,
+    size_t                                  count
+);
+static inline size_t                    amp_cells_rfind_mismatch(
+    const uint32_t *                        glyphs,
+    const uint32_t *                        other_glyphs,
+    const uint64_t *                        modes,
+    const uint64_t *                        other_modes,
+    size_t                                  count
+);
+static inline size_t                    amp_modes_span(
+    const uint64_t *                        modes,
+    size_t                                  count
+);
 static inline bool                      amp_set_mode(
     struct amp_type *                       amp,
     uint32_t                                x,
@@ -624,32 +782,73 @@ static inline size_t                    amp_utf8_code_point_count(
     const char *                            utf8_str,
     size_t                                  utf8_str_size
 );
-static inline size_t                    amp_mode_to_ans(
+static inline void                      amp_writer_append(
+    struct amp_writer_type *                writer,
+    const char *                            src,
+    size_t                                  src_size
+);
+static inline size_t                    amp_writer_terminate(
+    struct amp_writer_type *                writer
+);
+static inline char *                    amp_ans_put_param(
+    char *                                  dst,
+    const char *                            str,
+    size_t                                  str_size
+);
+static inline char *                    amp_ans_put_number_param(
+    char *                                  dst,
+    uint8_t                                 number
+);
+static inline char *                    amp_ans_put_rgb_param(
+    char *                                  dst,
+    const char *                            prefix,
+    struct amp_color_type                   color
+);
+static inline struct amp_sgr_type       amp_mode_to_sgr(
     struct amp_mode_type                    mode,
-    AMP_PALETTE                             palette,
-    char *                                  ans_dst,
-    size_t                                  ans_dst_size
+    AMP_PALETTE                             palette
 );
-static inline size_t                    amp_mode_update_to_ans(
+static inline char *                    amp_mode_update_to_sgr(
     struct amp_mode_type                    prev_mode,
     struct amp_mode_type                    next_mode,
+    struct amp_sgr_type                     prev_sgr,
+    struct amp_sgr_type                     next_sgr,
     AMP_PALETTE                             palette,
-    char *                                  ans_dst,
-    size_t                                  ans_dst_size
+    char *                                  dst
 );
-static inline struct amp_mode_type     amp_mode_cell_deserialize(
-    const uint8_t *                         src,
-    size_t                                  src_size
+static inline const struct amp_sgr_cache_entry_type *amp_sgr_cache_get(
+    struct amp_sgr_cache_type *             cache,
+    struct amp_sgr_cache_entry_type *       scratch,
+    uint64_t                                prev_mode_word,
+    uint64_t                                next_mode_word,
+    AMP_PALETTE                             palette
 );
-static inline bool                      amp_mode_cell_serialize(
-    struct amp_mode_type                    mode,
-    uint8_t *                               dst,
-    size_t                                  dst_size
+static inline uint32_t *                amp_get_glyph_word(
+    const struct amp_type *                 amp,
+    uint32_t                                x,
+    uint32_t                                y
+);
+static inline uint64_t *                amp_get_mode_word(
+    const struct amp_type *                 amp,
+    uint32_t                                x,
+    uint32_t                                y
+);
+static inline size_t                    amp_glyph_word_size(
+    uint32_t                                glyph_word
+);
+static inline struct amp_mode_type      amp_mode_unpack(
+    uint64_t                                mode_word
+);
+static inline uint64_t                  amp_mode_pack(
+    struct amp_mode_type                    mode
 );
 static inline size_t                    amp_sub_size(
     size_t                                  a,
     size_t                                  b
 );
+static inline size_t                    amp_align_size(
+    size_t                                  size
+);
 static inline size_t                    amp_str_append(
     char *                                  str_dst,
     size_t                                  str_dst_size,
@@ -659,6 +858,28 @@ static inline struct amp_rgb16_type     amp_find_rgb16(
     const struct amp_rgb16_type *           table,
     struct amp_color_type                   color
 );
+static inline struct amp_color_type     amp_xterm256_color(
+    uint8_t                                 index
+);
+static inline uint8_t                   amp_find_xterm256(
+    struct amp_color_type                   color
+);
+static inline size_t                    amp_lut_index(
+    struct amp_color_type                   color
+);
+static inline struct amp_color_type     amp_lut_color(
+    size_t                                  lut_index
+);
+static inline void                      amp_lut_build_rgb16(
+);
+static inline void                      amp_lut_build_xterm256(
+);
+static inline AMP_COLOR                 amp_quantize_rgb16(
+    struct amp_color_type                   color
+);
+static inline uint8_t                   amp_quantize_xterm256(
+    struct amp_color_type                   color
+);
 static inline const char *              amp_str_seg_first_line_size(
     const char *                            str,
     size_t                                  str_size,
@@ -714,36 +935,73 @@ static inline const char *              amp_str_seg_skip_width(
 static inline size_t amp_init(
     struct amp_type *amp, void *buf, size_t buf_size
 ) {
+    // The mode words come first and the glyph words follow them at the next
+    // AMP_ALIGNMENT byte boundary. The required size includes the worst case
+    // padding for aligning the beginning of the buffer.
+
+    const size_t cells = (size_t) amp->width * amp->height;
     const size_t bytes_required = (
-        AMP_CELL_SIZE * amp->width * amp->height
+        AMP_ALIGNMENT - 1 + amp_align_size(cells * AMP_CELL_MODE_SIZE) +
+        cells * AMP_CELL_GLYPH_SIZE
+    );
+    const size_t padding = (
+        buf ? (AMP_ALIGNMENT - (uintptr_t) buf % AMP_ALIGNMENT) % AMP_ALIGNMENT
+        : 0
     );
-    const size_t cell_count = (
-        (buf_size < bytes_required ? buf_size : bytes_required) /
-        AMP_CELL_SIZE
+    const size_t available = amp_sub_size(buf_size, padding);
+    size_t cell_count = (
+        available / AMP_CELL_SIZE < cells ? available / AMP_CELL_SIZE : cells
     );
-    const size_t glyph_size = cell_count * AMP_CELL_GLYPH_SIZE;
-    const size_t mode_size = cell_count * AMP_CELL_MODE_SIZE;
 
-    amp->glyph.data = (uint8_t *) buf;
-    amp->glyph.size = glyph_size;
+    while (cell_count
+    &&  amp_align_size(cell_count * AMP_CELL_MODE_SIZE) +
+        cell_count * AMP_CELL_GLYPH_SIZE > available) {
+        --cell_count;
+    }
+
+    uint8_t *data = buf && cell_count ? (uint8_t *) buf + padding : nullptr;
 
-    amp->mode.data = (uint8_t *) buf + amp->glyph.size;
-    amp->mode.size = mode_size;
+    amp->mode.data = (uint64_t *) data;
+    amp->mode.size = cell_count * AMP_CELL_MODE_SIZE;
+
+    amp->glyph.data = (uint32_t *) (
+        data ? data + amp_align_size(amp->mode.size) : nullptr
+    );
+    amp->glyph.size = cell_count * AMP_CELL_GLYPH_SIZE;
 
     amp_clear(amp);
 
     return bytes_required;
 }
 
+static inline size_t amp_align_size(size_t size) {
+    return (size + AMP_ALIGNMENT - 1) / AMP_ALIGNMENT * AMP_ALIGNMENT;
+}
+
 static inline void amp_clear(struct amp_type *amp) {
-    memset(amp->glyph.data, 0, amp->glyph.size);
-    memset(amp->mode.data, 0, amp->mode.size);
+    if (amp->glyph.size) {
+        memset(amp->glyph.data, 0, amp->glyph.size);
+    }
+
+    if (amp->mode.size) {
+        memset(amp->mode.data, 0, amp->mode.size);
+    }
 }
 
 static inline void amp_set_palette(struct amp_type *amp, AMP_PALETTE palette) {
     amp->palette = palette;
 }
 
+static inline void amp_set_sgr_cache(
+    struct amp_type *amp, struct amp_sgr_cache_type *cache
+) {
+    // The cache remembers the encoded transitions between the modes of the
+    // cells. It can be shared by the frames that are encoded by the same
+    // thread, and it is emptied whenever it is used with another palette.
+
+    amp->sgr_cache = cache;
+}
+
 static inline ssize_t amp_get_cell_index(
     const struct amp_type *amp, long x, long y
 ) {
@@ -816,39 +1074,70 @@ static inline size_t amp_utf8_code_point_count(
     return code_point_count;
 }
 
-static inline const char *amp_get_glyph(
+static inline uint32_t *amp_get_glyph_word(
     const struct amp_type *amp, uint32_t x, uint32_t y
 ) {
     ssize_t cell_index = amp_get_cell_index(amp, x, y);
 
-    if (cell_index < 0) {
+    if (cell_index < 0
+    ||  (size_t) cell_index >= amp->glyph.size / AMP_CELL_GLYPH_SIZE) {
         return nullptr;
     }
 
-    if ((size_t) cell_index * AMP_CELL_GLYPH_SIZE >= amp->glyph.size) {
+    return amp->glyph.data + cell_index;
+}
+
+static inline uint64_t *amp_get_mode_word(
+    const struct amp_type *amp, uint32_t x, uint32_t y
+) {
+    ssize_t cell_index = amp_get_cell_index(amp, x, y);
+
+    if (cell_index < 0
+    ||  (size_t) cell_index >= amp->mode.size / AMP_CELL_MODE_SIZE) {
         return nullptr;
     }
 
+    return amp->mode.data + cell_index;
+}
+
+static inline size_t amp_glyph_word_size(uint32_t glyph_word) {
+    uint8_t lead;
+
+    memcpy(&lead, &glyph_word, sizeof(lead));
+
     return (
-        (const char *) amp->glyph.data +
-        (size_t) cell_index * AMP_CELL_GLYPH_SIZE
+        lead < 0x80 ? (lead ? 1 : 0) :
+        lead < 0xe0 ? 2 :
+        lead < 0xf0 ? 3 : 4
     );
 }
 
-static inline const char *amp_put_glyph(
-    struct amp_type *amp, const char *glyph, uint32_t x, uint32_t y
+static inline const char *amp_get_glyph(
+    const struct amp_type *amp, uint32_t x, uint32_t y,
+    char *glyph_dst, size_t glyph_dst_size
 ) {
-    ssize_t cell_index = amp_get_cell_index(amp, x, y);
+    const uint32_t *glyph_word = amp_get_glyph_word(amp, x, y);
 
-    if (cell_index < 0) {
+    if (!glyph_word || glyph_dst_size <= AMP_CELL_GLYPH_SIZE) {
         return nullptr;
     }
 
-    if ((size_t) cell_index * AMP_CELL_GLYPH_SIZE >= amp->glyph.size) {
-        return nullptr;
+    memcpy(glyph_dst, glyph_word, AMP_CELL_GLYPH_SIZE);
+    glyph_dst[AMP_CELL_GLYPH_SIZE] = '\0';
+
+    return glyph_dst;
+}
+
+static inline bool amp_put_glyph(
+    struct amp_type *amp, const char *glyph, uint32_t x, uint32_t y
+) {
+    uint32_t *glyph_word = amp_get_glyph_word(amp, x, y);
+
+    if (!glyph_word) {
+        return false;
     }
 
-    uint8_t data[AMP_CELL_GLYPH_SIZE] = {};
+    uint8_t data[AMP_CELL_GLYPH_SIZE + 1] = {};
     uint8_t glyph_length = 0;
 
     for (; glyph_length < sizeof(data); ++glyph_length) {
@@ -860,47 +1149,44 @@ static inline const char *amp_put_glyph(
     }
 
     if (glyph_length >= sizeof(data)) {
-        return nullptr;
+        return false;
     }
 
     int cpsz = amp_utf8_code_point_size((const char *) data, glyph_length + 1);
 
     if (cpsz < 0 || cpsz > 4) {
-        return nullptr;
+        return false;
     }
 
     if (cpsz < glyph_length) {
-        data[cpsz] = 0;
-        glyph_length = (uint8_t) cpsz;
+        memset(data + cpsz, 0, sizeof(data) - (size_t) cpsz);
     }
 
-    char *dst = (char *) (
-        amp->glyph.data + (size_t) cell_index * AMP_CELL_GLYPH_SIZE
-    );
+    if (data[0] == ' ') {
+        // A space is stored the same way as an empty cell, so that the blank
+        // cells would compare equal as integers.
+
+        data[0] = 0;
+    }
 
-    memcpy(dst, data, glyph_length + 1);
+    memcpy(glyph_word, data, AMP_CELL_GLYPH_SIZE);
 
-    return dst;
+    return true;
 }
 
 static inline bool amp_set_mode(
     struct amp_type *amp, uint32_t x, uint32_t y,
     struct amp_mode_type mode
 ) {
-    ssize_t cell_index = amp_get_cell_index(amp, x, y);
+    uint64_t *mode_word = amp_get_mode_word(amp, x, y);
 
-    if (cell_index < 0) {
+    if (!mode_word) {
         return false;
     }
 
-    if ((size_t) cell_index * AMP_CELL_MODE_SIZE >= amp->mode.size) {
-        return false;
-    }
+    *mode_word = amp_mode_pack(mode);
 
-    return amp_mode_cell_serialize(
-        mode, amp->mode.data + (size_t) cell_index * AMP_CELL_MODE_SIZE,
-        AMP_CELL_MODE_SIZE
-    );
+    return true;
 }
 
 static inline struct amp_mode_type amp_get_mode(
@@ -910,146 +1196,555 @@ static inline struct amp_mode_type amp_get_mode(
         .bitset = { .broken = true }
     };
 
-    ssize_t cell_index = amp_get_cell_index(amp, x, y);
+    const uint64_t *mode_word = amp_get_mode_word(amp, x, y);
 
-    if (cell_index < 0) {
-        return broken_cell;
-    }
+    return mode_word ? amp_mode_unpack(*mode_word) : broken_cell;
+}
+
+static inline bool amp_cell_equals(
+    const struct amp_type *amp, const struct amp_type *other,
+    uint32_t x, uint32_t y
+) {
+    const uint32_t *glyph_word = amp_get_glyph_word(amp, x, y);
+    const uint32_t *other_glyph_word = amp_get_glyph_word(other, x, y);
+    const uint64_t *mode_word = amp_get_mode_word(amp, x, y);
+    const uint64_t *other_mode_word = amp_get_mode_word(other, x, y);
 
-    if ((size_t) cell_index * AMP_CELL_MODE_SIZE >= amp->mode.size) {
-        return broken_cell;
+    if (!glyph_word || !other_glyph_word || !mode_word || !other_mode_word
+    ||  amp->width != other->width) {
+        return false;
     }
 
-    return amp_mode_cell_deserialize(
-        amp->mode.data + (size_t) cell_index * AMP_CELL_MODE_SIZE,
-        AMP_CELL_MODE_SIZE
-    );
+    return *glyph_word == *other_glyph_word && *mode_word == *other_mode_word;
 }
 
-static inline AMP_STYLE amp_get_style(
+static inline bool amp_cell_is_blank(
     const struct amp_type *amp, uint32_t x, uint32_t y
 ) {
-    auto mode = amp_get_mode(amp, x, y);
+    // A cell is blank if it looks the same as a cell that has been erased with
+    // the default graphic rendition.
 
-    return (
-        (mode.bitset.hidden         ? AMP_HIDDEN        : 0) |
-        (mode.bitset.faint          ? AMP_FAINT         : 0) |
-        (mode.bitset.italic         ? AMP_ITALIC        : 0) |
-        (mode.bitset.underline      ? AMP_UNDERLINE     : 0) |
-        (mode.bitset.blinking       ? AMP_BLINKING      : 0) |
-        (mode.bitset.strikethrough  ? AMP_STRIKETHROUGH : 0)
-    );
+    const uint32_t *glyph_word = amp_get_glyph_word(amp, x, y);
+    const uint64_t *mode_word = amp_get_mode_word(amp, x, y);
+
+    return glyph_word && mode_word && !*glyph_word && !*mode_word;
 }
 
-static inline bool amp_put_style(
-    struct amp_type *amp, AMP_STYLE style, uint32_t x, uint32_t y
+static inline bool amp_row_compare(
+    const struct amp_type *amp, const struct amp_type *other, uint32_t y,
+    uint32_t *first_x, uint32_t *end_x
 ) {
-    auto mode = amp_get_mode(amp, x, y);
-
-    constexpr AMP_STYLE bg_colors = (
-        AMP_BG_NONE|AMP_BG_BLACK|AMP_BG_MAROON| AMP_BG_GREEN|AMP_BG_OLIVE|
-        AMP_BG_NAVY|AMP_BG_PURPLE|AMP_BG_TEAL|AMP_BG_SILVER|AMP_BG_GRAY|
-        AMP_BG_RED|AMP_BG_LIME|AMP_BG_YELLOW|AMP_BG_BLUE|AMP_BG_MAGENTA|
-        AMP_BG_CYAN|AMP_BG_WHITE
-    );
+    // Finds the span of cells on row y that differ between the two frames and
+    // returns false if there is none. Frames of different sizes differ on the
+    // whole row.
 
-    constexpr AMP_STYLE fg_colors = (
-        AMP_FG_NONE|AMP_FG_BLACK|AMP_FG_MAROON| AMP_FG_GREEN|AMP_FG_OLIVE|
-        AMP_FG_NAVY|AMP_FG_PURPLE|AMP_FG_TEAL|AMP_FG_SILVER|AMP_FG_GRAY|
-        AMP_FG_RED|AMP_FG_LIME|AMP_FG_YELLOW|AMP_FG_BLUE|AMP_FG_MAGENTA|
-        AMP_FG_CYAN|AMP_FG_WHITE
-    );
+    const uint32_t width = amp->width;
 
-    if (style & bg_colors) {
-        if (style & AMP_BG_NONE) {
-            mode.bitset.bg = false;
-        }
-        else {
-            unsigned bg_r = 0;
-            unsigned bg_g = 0;
-            unsigned bg_b = 0;
-            unsigned bg_colors = 0;
+    if (y >= amp->height) {
+        return false;
+    }
 
-            mode.bitset.bg = true;
+    const size_t row_index = (size_t) y * width;
+    const size_t row_end = row_index + width;
 
-            for (AMP_COLOR i = AMP_COLOR_NONE + 1; i < AMP_MAX_COLOR; ++i) {
-                auto row = amp_color_table[i];
+    if (width != other->width || y >= other->height
+    ||  row_end > amp->glyph.size / AMP_CELL_GLYPH_SIZE
+    ||  row_end > amp->mode.size / AMP_CELL_MODE_SIZE
+    ||  row_end > other->glyph.size / AMP_CELL_GLYPH_SIZE
+    ||  row_end > other->mode.size / AMP_CELL_MODE_SIZE) {
+        *first_x = 0;
+        *end_x = width;
 
-                if (row.style.bg & style) {
-                    bg_r += row.color.r;
-                    bg_g += row.color.g;
-                    bg_b += row.color.b;
+        return width > 0;
+    }
 
-                    ++bg_colors;
-                }
-            }
+    const uint32_t *glyphs = amp->glyph.data + row_index;
+    const uint32_t *other_glyphs = other->glyph.data + row_index;
+    const uint64_t *modes = amp->mode.data + row_index;
+    const uint64_t *other_modes = other->mode.data + row_index;
 
-            bg_r /= bg_colors;
-            bg_g /= bg_colors;
-            bg_b /= bg_colors;
+    const size_t begin = amp_cells_find_mismatch(
+        glyphs, other_glyphs, modes, other_modes, width
+    );
 
-            mode.bg = amp_map_rgb(
-                (uint8_t) bg_r, (uint8_t) bg_g, (uint8_t) bg_b
-            );
-        }
+    if (begin == width) {
+        return false;
     }
-    else mode.bitset.bg = false;
 
-    if (style & fg_colors) {
-        if (style & AMP_FG_NONE) {
-            mode.bitset.fg = false;
-        }
-        else {
-            unsigned fg_r = 0;
-            unsigned fg_g = 0;
-            unsigned fg_b = 0;
-            unsigned fg_colors = 0;
+    const size_t end = begin + amp_cells_rfind_mismatch(
+        glyphs + begin, other_glyphs + begin, modes + begin,
+        other_modes + begin, width - begin
+    );
 
-            mode.bitset.fg = true;
+    *first_x = (uint32_t) begin;
+    *end_x = (uint32_t) end;
 
-            for (AMP_COLOR i = AMP_COLOR_NONE + 1; i < AMP_MAX_COLOR; ++i) {
-                auto row = amp_color_table[i];
+    return true;
+}
 
-                if (row.style.fg & style) {
-                    fg_r += row.color.r;
-                    fg_g += row.color.g;
-                    fg_b += row.color.b;
+static inline uint32_t amp_row_skip_equal(
+    const struct amp_type *amp, const struct amp_type *other,
+    uint32_t x, uint32_t y, uint32_t end_x
+) {
+    // Returns the first cell from x onwards that differs between the frames,
+    // or end_x if there is none.
 
-                    ++fg_colors;
-                }
-            }
+    end_x = end_x < amp->width ? end_x : amp->width;
 
-            fg_r /= fg_colors;
-            fg_g /= fg_colors;
-            fg_b /= fg_colors;
+    if (x >= end_x) {
+        return end_x;
+    }
 
-            mode.fg = amp_map_rgb(
-                (uint8_t) fg_r, (uint8_t) fg_g, (uint8_t) fg_b
-            );
-        }
+    const size_t row_index = (size_t) y * amp->width;
+
+    if (amp->width != other->width || y >= amp->height || y >= other->height
+    ||  row_index + end_x > amp->glyph.size / AMP_CELL_GLYPH_SIZE
+    ||  row_index + end_x > amp->mode.size / AMP_CELL_MODE_SIZE
+    ||  row_index + end_x > other->glyph.size / AMP_CELL_GLYPH_SIZE
+    ||  row_index + end_x > other->mode.size / AMP_CELL_MODE_SIZE) {
+        return x;
     }
-    else mode.bitset.fg = false;
 
-    mode.bitset.hidden          = style & AMP_HIDDEN;
-    mode.bitset.faint           = style & AMP_FAINT;
-    mode.bitset.italic          = style & AMP_ITALIC;
-    mode.bitset.underline       = style & AMP_UNDERLINE;
-    mode.bitset.blinking        = style & AMP_BLINKING;
-    mode.bitset.strikethrough   = style & AMP_STRIKETHROUGH;
+    const size_t index = row_index + x;
 
-    return amp_set_mode(amp, x, y, mode);
+    return x + (uint32_t) amp_cells_find_mismatch(
+        amp->glyph.data + index, other->glyph.data + index,
+        amp->mode.data + index, other->mode.data + index, end_x - x
+    );
 }
 
-static inline void amp_draw_glyph(
-    struct amp_type *amp, AMP_STYLE style, long x, long y, const char *glyph_str
+static inline uint32_t amp_row_skip_mode(
+    const struct amp_type *amp, uint32_t x, uint32_t y, uint32_t end_x
 ) {
-    if (x < 0 || x >= amp->width || y < 0 || y >= amp->height
-    ||  x > UINT32_MAX || y > UINT32_MAX) {
-        return;
-    }
+    // Returns the first cell from x onwards that has a different mode than the
+    // cell at x, or end_x if there is none.
 
-    char glyph[AMP_CELL_GLYPH_SIZE] = {};
-    size_t glyph_size = 0;
+    end_x = end_x < amp->width ? end_x : amp->width;
+
+    if (x >= end_x) {
+        return end_x;
+    }
+
+    const size_t row_index = (size_t) y * amp->width;
+
+    if (y >= amp->height
+    ||  row_index + end_x > amp->mode.size / AMP_CELL_MODE_SIZE) {
+        return x + 1;
+    }
+
+    return x + (uint32_t) amp_modes_span(
+        amp->mode.data + row_index + x, end_x - x
+    );
+}
+
+static inline size_t amp_cells_find_mismatch_scalar(
+    const uint32_t *glyphs, const uint32_t *other_glyphs,
+    const uint64_t *modes, const uint64_t *other_modes, size_t count
+) {
+    size_t i = 0;
+
+    while (i < count
+    && glyphs[i] == other_glyphs[i]
+    && modes[i] == other_modes[i]) {
+        ++i;
+    }
+
+    return i;
+}
+
+static inline size_t amp_cells_rfind_mismatch_scalar(
+    const uint32_t *glyphs, const uint32_t *other_glyphs,
+    const uint64_t *modes, const uint64_t *other_modes, size_t count
+) {
+    size_t i = count;
+
+    while (i
+    && glyphs[i - 1] == other_glyphs[i - 1]
+    && modes[i - 1] == other_modes[i - 1]) {
+        --i;
+    }
+
+    return i;
+}
+
+static inline size_t amp_modes_span_scalar(
+    const uint64_t *modes, size_t count
+) {
+    size_t i = 1;
+
+    while (i < count && modes[i] == modes[0]) {
+        ++i;
+    }
+
+    return count ? i : 0;
+}
+
+#if AMP_X86
+static inline bool amp_cells_match_sse2(
+    const uint32_t *glyphs, const uint32_t *other_glyphs,
+    const uint64_t *modes, const uint64_t *other_modes
+) {
+    // Compares 4 cells at once. The 64-bit mode words are compared as pairs
+    // of 32-bit lanes, which is equivalent when all of the lanes must match.
+
+    const __m128i glyph_eq = _mm_cmpeq_epi32(
+        _mm_loadu_si128((const __m128i *) glyphs),
+        _mm_loadu_si128((const __m128i *) other_glyphs)
+    );
+    const __m128i mode_eq_lo = _mm_cmpeq_epi32(
+        _mm_loadu_si128((const __m128i *) modes),
+        _mm_loadu_si128((const __m128i *) other_modes)
+    );
+    const __m128i mode_eq_hi = _mm_cmpeq_epi32(
+        _mm_loadu_si128((const __m128i *) (modes + 2)),
+        _mm_loadu_si128((const __m128i *) (other_modes + 2))
+    );
+
+    return _mm_movemask_epi8(
+        _mm_and_si128(glyph_eq, _mm_and_si128(mode_eq_lo, mode_eq_hi))
+    ) == 0xffff;
+}
+
+static inline size_t amp_cells_find_mismatch_sse2(
+    const uint32_t *glyphs, const uint32_t *other_glyphs,
+    const uint64_t *modes, const uint64_t *other_modes, size_t count
+) {
+    size_t i = 0;
+
+    for (; i + 4 <= count; i += 4) {
+        if (!amp_cells_match_sse2(
+            glyphs + i, other_glyphs + i, modes + i, other_modes + i
+        )) {
+            break;
+        }
+    }
+
+    return i + amp_cells_find_mismatch_scalar(
+        glyphs + i, other_glyphs + i, modes + i, other_modes + i, count - i
+    );
+}
+
+static inline size_t amp_cells_rfind_mismatch_sse2(
+    const uint32_t *glyphs, const uint32_t *other_glyphs,
+    const uint64_t *modes, const uint64_t *other_modes, size_t count
+) {
+    size_t i = count;
+
+    for (; i >= 4; i -= 4) {
+        if (!amp_cells_match_sse2(
+            glyphs + i - 4, other_glyphs + i - 4,
+            modes + i - 4, other_modes + i - 4
+        )) {
+            break;
+        }
+    }
+
+    return amp_cells_rfind_mismatch_scalar(
+        glyphs, other_glyphs, modes, other_modes, i
+    );
+}
+
+static inline size_t amp_modes_span_sse2(const uint64_t *modes, size_t count) {
+    if (!count) {
+        return 0;
+    }
+
+    const __m128i first = _mm_set1_epi64x((long long) modes[0]);
+    size_t i = 0;
+
+    for (; i + 2 <= count; i += 2) {
+        const __m128i eq = _mm_cmpeq_epi32(
+            _mm_loadu_si128((const __m128i *) (modes + i)), first
+        );
+
+        if (_mm_movemask_epi8(eq) != 0xffff) {
+            break;
+        }
+    }
+
+    while (i < count && modes[i] == modes[0]) {
+        ++i;
+    }
+
+    return i;
+}
+
+__attribute__((target("avx2")))
+static inline bool amp_cells_match_avx2(
+    const uint32_t *glyphs, const uint32_t *other_glyphs,
+    const uint64_t *modes, const uint64_t *other_modes
+) {
+    // Compares 8 cells at once.
+
+    const __m256i glyph_eq = _mm256_cmpeq_epi32(
+        _mm256_loadu_si256((const __m256i *) glyphs),
+        _mm256_loadu_si256((const __m256i *) other_glyphs)
+    );
+    const __m256i mode_eq_lo = _mm256_cmpeq_epi64(
+        _mm256_loadu_si256((const __m256i *) modes),
+        _mm256_loadu_si256((const __m256i *) other_modes)
+    );
+    const __m256i mode_eq_hi = _mm256_cmpeq_epi64(
+        _mm256_loadu_si256((const __m256i *) (modes + 4)),
+        _mm256_loadu_si256((const __m256i *) (other_modes + 4))
+    );
+
+    return _mm256_movemask_epi8(
+        _mm256_and_si256(glyph_eq, _mm256_and_si256(mode_eq_lo, mode_eq_hi))
+    ) == -1;
+}
+
+__attribute__((target("avx2")))
+static inline size_t amp_cells_find_mismatch_avx2(
+    const uint32_t *glyphs, const uint32_t *other_glyphs,
+    const uint64_t *modes, const uint64_t *other_modes, size_t count
+) {
+    size_t i = 0;
+
+    for (; i + 8 <= count; i += 8) {
+        if (!amp_cells_match_avx2(
+            glyphs + i, other_glyphs + i, modes + i, other_modes + i
+        )) {
+            break;
+        }
+    }
+
+    return i + amp_cells_find_mismatch_scalar(
+        glyphs + i, other_glyphs + i, modes + i, other_modes + i, count - i
+    );
+}
+
+__attribute__((target("avx2")))
+static inline size_t amp_cells_rfind_mismatch_avx2(
+    const uint32_t *glyphs, const uint32_t *other_glyphs,
+    const uint64_t *modes, const uint64_t *other_modes, size_t count
+) {
+    size_t i = count;
+
+    for (; i >= 8; i -= 8) {
+        if (!amp_cells_match_avx2(
+            glyphs + i - 8, other_glyphs + i - 8,
+            modes + i - 8, other_modes + i - 8
+        )) {
+            break;
+        }
+    }
+
+    return amp_cells_rfind_mismatch_scalar(
+        glyphs, other_glyphs, modes, other_modes, i
+    );
+}
+
+__attribute__((target("avx2")))
+static inline size_t amp_modes_span_avx2(const uint64_t *modes, size_t count) {
+    if (!count) {
+        return 0;
+    }
+
+    const __m256i first = _mm256_set1_epi64x((long long) modes[0]);
+    size_t i = 0;
+
+    for (; i + 4 <= count; i += 4) {
+        const __m256i eq = _mm256_cmpeq_epi64(
+            _mm256_loadu_si256((const __m256i *) (modes + i)), first
+        );
+
+        if (_mm256_movemask_epi8(eq) != -1) {
+            break;
+        }
+    }
+
+    while (i < count && modes[i] == modes[0]) {
+        ++i;
+    }
+
+    return i;
+}
+#endif
+
+static inline size_t amp_cells_find_mismatch(
+    const uint32_t *glyphs, const uint32_t *other_glyphs,
+    const uint64_t *modes, const uint64_t *other_modes, size_t count
+) {
+    switch (get_simd()) {
+#if AMP_X86
+        case SIMD_AVX2: {
+            return amp_cells_find_mismatch_avx2(
+                glyphs, other_glyphs, modes, other_modes, count
+            );
+        }
+        case SIMD_SSE2: {
+            return amp_cells_find_mismatch_sse2(
+                glyphs, other_glyphs, modes, other_modes, count
+            );
+        }
+#endif
+        default: {
+            return amp_cells_find_mismatch_scalar(
+                glyphs, other_glyphs, modes, other_modes, count
+            );
+        }
+    }
+}
+
+static inline size_t amp_cells_rfind_mismatch(
+    const uint32_t *glyphs, const uint32_t *other_glyphs,
+    const uint64_t *modes, const uint64_t *other_modes, size_t count
+) {
+    switch (get_simd()) {
+#if AMP_X86
+        case SIMD_AVX2: {
+            return amp_cells_rfind_mismatch_avx2(
+                glyphs, other_glyphs, modes, other_modes, count
+            );
+        }
+        case SIMD_SSE2: {
+            return amp_cells_rfind_mismatch_sse2(
+                glyphs, other_glyphs, modes, other_modes, count
+            );
+        }
+#endif
+        default: {
+            return amp_cells_rfind_mismatch_scalar(
+                glyphs, other_glyphs, modes, other_modes, count
+            );
+        }
+    }
+}
+
+static inline size_t amp_modes_span(const uint64_t *modes, size_t count) {
+    if (count < 2 || modes[1] != modes[0]) {
+        return count ? 1 : 0; // short runs are common in busy frames
+    }
+
+    switch (get_simd()) {
+#if AMP_X86
+        case SIMD_AVX2: return amp_modes_span_avx2(modes, count);
+        case SIMD_SSE2: return amp_modes_span_sse2(modes, count);
+#endif
+        default: return amp_modes_span_scalar(modes, count);
+    }
+}
+
+static inline AMP_STYLE amp_get_style(
+    const struct amp_type *amp, uint32_t x, uint32_t y
+) {
+    const uint64_t *mode_word = amp_get_mode_word(amp, x, y);
+
+    return mode_word ? (
+        (AMP_STYLE) ((*mode_word & AMP_MODE_STYLE_MASK) >> AMP_MODE_STYLE_SHIFT)
+    ) : AMP_STYLE_NONE;
+}
+
+static inline bool amp_put_style(
+    struct amp_type *amp, AMP_STYLE style, uint32_t x, uint32_t y
+) {
+    auto mode = amp_get_mode(amp, x, y);
+
+    constexpr AMP_STYLE bg_colors = (
+        AMP_BG_NONE|AMP_BG_BLACK|AMP_BG_MAROON| AMP_BG_GREEN|AMP_BG_OLIVE|
+        AMP_BG_NAVY|AMP_BG_PURPLE|AMP_BG_TEAL|AMP_BG_SILVER|AMP_BG_GRAY|
+        AMP_BG_RED|AMP_BG_LIME|AMP_BG_YELLOW|AMP_BG_BLUE|AMP_BG_MAGENTA|
+        AMP_BG_CYAN|AMP_BG_WHITE
+    );
+
+    constexpr AMP_STYLE fg_colors = (
+        AMP_FG_NONE|AMP_FG_BLACK|AMP_FG_MAROON| AMP_FG_GREEN|AMP_FG_OLIVE|
+        AMP_FG_NAVY|AMP_FG_PURPLE|AMP_FG_TEAL|AMP_FG_SILVER|AMP_FG_GRAY|
+        AMP_FG_RED|AMP_FG_LIME|AMP_FG_YELLOW|AMP_FG_BLUE|AMP_FG_MAGENTA|
+        AMP_FG_CYAN|AMP_FG_WHITE
+    );
+
+    if (style & bg_colors) {
+        if (style & AMP_BG_NONE) {
+            mode.bitset.bg = false;
+        }
+        else {
+            unsigned bg_r = 0;
+            unsigned bg_g = 0;
+            unsigned bg_b = 0;
+            unsigned bg_colors = 0;
+
+            mode.bitset.bg = true;
+
+            for (AMP_COLOR i = AMP_COLOR_NONE + 1; i < AMP_MAX_COLOR; ++i) {
+                auto row = amp_color_table[i];
+
+                if (row.style.bg & style) {
+                    bg_r += row.color.r;
+                    bg_g += row.color.g;
+                    bg_b += row.color.b;
+
+                    ++bg_colors;
+                }
+            }
+
+            bg_r /= bg_colors;
+            bg_g /= bg_colors;
+            bg_b /= bg_colors;
+
+            mode.bg = amp_map_rgb(
+                (uint8_t) bg_r, (uint8_t) bg_g, (uint8_t) bg_b
+            );
+        }
+    }
+    else mode.bitset.bg = false;
+
+    if (style & fg_colors) {
+        if (style & AMP_FG_NONE) {
+            mode.bitset.fg = false;
+        }
+        else {
+            unsigned fg_r = 0;
+            unsigned fg_g = 0;
+            unsigned fg_b = 0;
+            unsigned fg_colors = 0;
+
+            mode.bitset.fg = true;
+
+            for (AMP_COLOR i = AMP_COLOR_NONE + 1; i < AMP_MAX_COLOR; ++i) {
+                auto row = amp_color_table[i];
+
+                if (row.style.fg & style) {
+                    fg_r += row.color.r;
+                    fg_g += row.color.g;
+                    fg_b += row.color.b;
+
+                    ++fg_colors;
+                }
+            }
+
+            fg_r /= fg_colors;
+            fg_g /= fg_colors;
+            fg_b /= fg_colors;
+
+            mode.fg = amp_map_rgb(
+                (uint8_t) fg_r, (uint8_t) fg_g, (uint8_t) fg_b
+            );
+        }
+    }
+    else mode.bitset.fg = false;
+
+    mode.bitset.hidden          = style & AMP_HIDDEN;
+    mode.bitset.faint           = style & AMP_FAINT;
+    mode.bitset.italic          = style & AMP_ITALIC;
+    mode.bitset.underline       = style & AMP_UNDERLINE;
+    mode.bitset.blinking        = style & AMP_BLINKING;
+    mode.bitset.strikethrough   = style & AMP_STRIKETHROUGH;
+
+    return amp_set_mode(amp, x, y, mode);
+}
+
+static inline void amp_draw_glyph(
+    struct amp_type *amp, AMP_STYLE style, long x, long y, const char *glyph_str
+) {
+    if (x < 0 || x >= amp->width || y < 0 || y >= amp->height
+    ||  x > UINT32_MAX || y > UINT32_MAX) {
+        return;
+    }
+
+    char glyph[AMP_CELL_GLYPH_SIZE + 1] = {};
+    size_t glyph_size = 0;
 
     for (const char *c = glyph_str; *c; ++c) {
         if (++glyph_size >= sizeof(glyph)) {
@@ -1206,7 +1901,8 @@ static inline size_t amp_glyph_row_to_str(
     size_t str_size = 0;
 
     for (uint32_t x = 0, w = amp->width; x < w; ++x) {
-        const char *glyph_str = amp_get_glyph(amp, x, y);
+        char glyph[AMP_CELL_GLYPH_SIZE + 1];
+        const char *glyph_str = amp_get_glyph(amp, x, y, glyph, sizeof(glyph));
 
         if (!glyph_str || *glyph_str == '\0') {
             str_size += amp_str_append(
@@ -1251,215 +1947,120 @@ static inline size_t amp_str_append(
     );
 }
 
-static inline size_t amp_mode_to_ans(
-    struct amp_mode_type mode, AMP_PALETTE pal,
-    char *ans_dst, size_t ans_dst_size
+static inline void amp_writer_append(
+    struct amp_writer_type *writer, const char *src, size_t src_size
 ) {
-    char ans[256];
-    size_t ans_size = 0;
-
-    const char *options[] = {
-        mode.bitset.reset           ? "0" : nullptr,
-        mode.bitset.hidden          ? "8" : nullptr,
-        mode.bitset.faint           ? "2" : nullptr,
-        mode.bitset.italic          ? "3" : nullptr,
-        mode.bitset.underline       ? "4" : nullptr,
-        mode.bitset.blinking        ? "5" : nullptr,
-        mode.bitset.strikethrough   ? "9" : nullptr
-    };
-
-    for (size_t i=0; i<sizeof(options)/sizeof(options[0]); ++i) {
-        const char *value = options[i];
-
-        if (!value) {
-            continue;
-        }
-
-        ans_size += (
-            ans_size ? amp_str_append(
-                ans + ans_size, amp_sub_size(sizeof(ans), ans_size), ";"
-            ) : 0
-        );
+    if (writer->size < writer->capacity) {
+        const size_t space = writer->capacity - writer->size;
 
-        ans_size += amp_str_append(
-            ans + ans_size, amp_sub_size(sizeof(ans), ans_size), value
+        memcpy(
+            writer->data + writer->size, src,
+            src_size < space ? src_size : space
         );
     }
 
-    if (pal == AMP_PAL_24BIT) {
-        if (mode.bitset.fg) {
-            ans_size += (
-                ans_size ? amp_str_append(
-                    ans + ans_size, amp_sub_size(sizeof(ans), ans_size), ";"
-                ) : 0
-            );
-
-            ans_size += amp_str_append(
-                ans + ans_size, amp_sub_size(sizeof(ans), ans_size), "38;2;"
-            );
-
-            ans_size += amp_str_append(
-                ans + ans_size, amp_sub_size(sizeof(ans), ans_size),
-                amp_number_table[mode.fg.r]
-            );
-
-            ans_size += (
-                ans_size ? amp_str_append(
-                    ans + ans_size, amp_sub_size(sizeof(ans), ans_size), ";"
-                ) : 0
-            );
-
-            ans_size += amp_str_append(
-                ans + ans_size, amp_sub_size(sizeof(ans), ans_size),
-                amp_number_table[mode.fg.g]
-            );
-
-            ans_size += (
-                ans_size ? amp_str_append(
-                    ans + ans_size, amp_sub_size(sizeof(ans), ans_size), ";"
-                ) : 0
-            );
+    writer->size += src_size;
+}
 
-            ans_size += amp_str_append(
-                ans + ans_size, amp_sub_size(sizeof(ans), ans_size),
-                amp_number_table[mode.fg.b]
-            );
-        }
+static inline size_t amp_writer_terminate(struct amp_writer_type *writer) {
+    if (writer->capacity) {
+        writer->data[
+            writer->size < writer->capacity ? (
+                writer->size
+            ) : writer->capacity - 1
+        ] = '\0';
+    }
 
-        if (mode.bitset.bg) {
-            ans_size += (
-                ans_size ? amp_str_append(
-                    ans + ans_size, amp_sub_size(sizeof(ans), ans_size), ";"
-                ) : 0
-            );
+    return writer->size;
+}
 
-            ans_size += amp_str_append(
-                ans + ans_size, amp_sub_size(sizeof(ans), ans_size), "48;2;"
-            );
+static inline char *amp_ans_put_param(char *dst, const char *str, size_t size) {
+    *dst++ = ';';
+    memcpy(dst, str, size);
 
+    return dst + size;
+}
 
-            ans_size += amp_str_append(
-                ans + ans_size, amp_sub_size(sizeof(ans), ans_size),
-                amp_number_table[mode.bg.r]
-            );
+static inline char *amp_ans_put_number_param(char *dst, uint8_t number) {
+    return amp_ans_put_param(
+        dst, amp_number_table[number], number < 10 ? 1 : number < 100 ? 2 : 3
+    );
+}
 
-            ans_size += (
-                ans_size ? amp_str_append(
-                    ans + ans_size, amp_sub_size(sizeof(ans), ans_size), ";"
-                ) : 0
-            );
+static inline char *amp_ans_put_rgb_param(
+    char *dst, const char *prefix, struct amp_color_type color
+) {
+    dst = amp_ans_put_param(dst, prefix, 4);
+    dst = amp_ans_put_number_param(dst, color.r);
+    dst = amp_ans_put_number_param(dst, color.g);
 
-            ans_size += amp_str_append(
-                ans + ans_size, amp_sub_size(sizeof(ans), ans_size),
-                amp_number_table[mode.bg.g]
-            );
+    return amp_ans_put_number_param(dst, color.b);
+}
 
-            ans_size += (
-                ans_size ? amp_str_append(
-                    ans + ans_size, amp_sub_size(sizeof(ans), ans_size), ";"
-                ) : 0
-            );
+static inline struct amp_sgr_type amp_mode_to_sgr(
+    struct amp_mode_type mode, AMP_PALETTE palette
+) {
+    struct amp_sgr_type sgr = {};
 
-            ans_size += amp_str_append(
-                ans + ans_size, amp_sub_size(sizeof(ans), ans_size),
-                amp_number_table[mode.bg.b]
-            );
+    if (palette == AMP_PAL_256) {
+        if (mode.bitset.fg) {
+            sgr.fg_index = amp_quantize_xterm256(mode.fg);
         }
-    }
-    else {
-        if (mode.bitset.bg) {
-            auto bg_rgb_row = amp_find_rgb16(amp_rgb16_bg_table, mode.bg);
-
-            if (bg_rgb_row.bright) {
-                struct amp_color_type buf = mode.bg;
-                mode.bg = mode.fg;
-                mode.fg = buf;
-                mode.bitset.bg = mode.bitset.fg;
-                mode.bitset.fg = true;
-
-                ans_size += (
-                    ans_size ? amp_str_append(
-                        ans + ans_size, amp_sub_size(sizeof(ans), ans_size), ";"
-                    ) : 0
-                );
 
-                ans_size += amp_str_append(
-                    ans + ans_size, amp_sub_size(sizeof(ans), ans_size), "7"
-                );
-            }
+        if (mode.bitset.bg) {
+            sgr.bg_index = amp_quantize_xterm256(mode.bg);
         }
 
-        if (mode.bitset.fg) {
-            auto fg_rgb_row = amp_find_rgb16(amp_rgb16_fg_table, mode.fg);
-
-            if (fg_rgb_row.bright) {
-                ans_size += (
-                    ans_size ? amp_str_append(
-                        ans + ans_size, amp_sub_size(sizeof(ans), ans_size), ";"
-                    ) : 0
-                );
-
-                ans_size += amp_str_append(
-                    ans + ans_size, amp_sub_size(sizeof(ans), ans_size), "1"
-                );
-            }
+        return sgr;
+    }
 
-            ans_size += (
-                ans_size ? amp_str_append(
-                    ans + ans_size, amp_sub_size(sizeof(ans), ans_size), ";"
-                ) : 0
-            );
+    if (palette != AMP_PAL_RGB16) {
+        return sgr;
+    }
 
-            ans_size += amp_str_append(
-                ans + ans_size, amp_sub_size(sizeof(ans), ans_size),
-                fg_rgb_row.code
-            );
-        }
+    if (mode.bitset.bg) {
+        auto bg_rgb_row = amp_rgb16_bg_table[amp_quantize_rgb16(mode.bg)];
 
-        if (mode.bitset.bg) {
-            auto bg_rgb_row = amp_find_rgb16(amp_rgb16_bg_table, mode.bg);
+        if (bg_rgb_row.bright) {
+            // There are no bright backgrounds among the 16 basic colors, so
+            // the colors are swapped and shown in reverse video instead.
 
-            ans_size += (
-                ans_size ? amp_str_append(
-                    ans + ans_size, amp_sub_size(sizeof(ans), ans_size), ";"
-                ) : 0
-            );
+            struct amp_color_type buf = mode.bg;
+            mode.bg = mode.fg;
+            mode.fg = buf;
+            mode.bitset.bg = mode.bitset.fg;
+            mode.bitset.fg = true;
+            sgr.reverse = true;
 
-            ans_size += amp_str_append(
-                ans + ans_size, amp_sub_size(sizeof(ans), ans_size),
-                bg_rgb_row.code
-            );
+            if (mode.bitset.bg) {
+                sgr.bg = amp_rgb16_bg_table[amp_quantize_rgb16(mode.bg)].code;
+            }
         }
+        else sgr.bg = bg_rgb_row.code;
     }
 
-    if (ans_size) {
-        size_t written = 0;
-
-        written += amp_str_append(
-            ans_dst + written, amp_sub_size(ans_dst_size, written), "\x1b["
-        );
-
-        written += amp_str_append(
-            ans_dst + written, amp_sub_size(ans_dst_size, written), ans
-        );
-
-        written += amp_str_append(
-            ans_dst + written, amp_sub_size(ans_dst_size, written), "m"
-        );
+    if (mode.bitset.fg) {
+        auto fg_rgb_row = amp_rgb16_fg_table[amp_quantize_rgb16(mode.fg)];
 
-        return written;
-    }
-    else if (ans_dst_size) {
-        *ans_dst = '\0';
+        sgr.fg = fg_rgb_row.code;
+        sgr.bold = fg_rgb_row.bright;
     }
 
-    return 0;
+    return sgr;
 }
 
-static inline size_t amp_mode_update_to_ans(
-    struct amp_mode_type prev, struct amp_mode_type next, AMP_PALETTE pal,
-    char *ans_dst, size_t ans_dst_size
+static inline char *amp_mode_update_to_sgr(
+    struct amp_mode_type prev, struct amp_mode_type next,
+    struct amp_sgr_type prev_sgr, struct amp_sgr_type next_sgr,
+    AMP_PALETTE pal, char *dst
 ) {
+    // The parameters are written with a leading separator each, and the first
+    // separator is overwritten with the control sequence introducer later.
+    // The SGR parameters are expected to come from amp_mode_to_sgr.
+
+    char *const params = dst + 1;
+    char *p = params;
+
     if ((prev.bitset.hidden         && !next.bitset.hidden)
     ||  (prev.bitset.faint          && !next.bitset.faint)
     ||  (prev.bitset.italic         && !next.bitset.italic)
@@ -1467,175 +2068,278 @@ static inline size_t amp_mode_update_to_ans(
     ||  (prev.bitset.blinking       && !next.bitset.blinking)
     ||  (prev.bitset.strikethrough  && !next.bitset.strikethrough)
     ||  (prev.bitset.fg             && !next.bitset.fg)
-    ||  (prev.bitset.bg             && !next.bitset.bg)) {
-        struct amp_mode_type mode = next;
+    ||  (prev.bitset.bg             && !next.bitset.bg)
+    ||  (prev_sgr.reverse           && !next_sgr.reverse)
+    ||  (prev_sgr.bold              && !next_sgr.bold)
+    ||  (prev_sgr.fg                && !next_sgr.fg)
+    ||  (prev_sgr.bg                && !next_sgr.bg)) {
+        p = amp_ans_put_param(p, "0", 1);
+        prev = (struct amp_mode_type) {};
+        prev_sgr = (struct amp_sgr_type) {};
+    }
 
-        mode.bitset.reset = true;
+    if (!prev.bitset.hidden && next.bitset.hidden) {
+        p = amp_ans_put_param(p, "8", 1);
+    }
 
-        return amp_mode_to_ans(mode, pal, ans_dst, ans_dst_size);
+    if (!prev.bitset.faint && next.bitset.faint) {
+        p = amp_ans_put_param(p, "2", 1);
     }
 
-    char buf[256];
-    char ans[256];
-    size_t ans_size = 0;
+    if (!prev.bitset.italic && next.bitset.italic) {
+        p = amp_ans_put_param(p, "3", 1);
+    }
 
-    const struct amp_mode_type modes[] = {
-        {
-            .bitset = {
-                .hidden = (
-                    !prev.bitset.hidden && next.bitset.hidden
-                )
-            }
-        },
-        {
-            .bitset = {
-                .faint = (
-                    !prev.bitset.faint && next.bitset.faint
-                )
-            }
-        },
-        {
-            .bitset = {
-                .italic = (
-                    !prev.bitset.italic && next.bitset.italic
-                )
-            }
-        },
-        {
-            .bitset = {
-                .underline = (
-                    !prev.bitset.underline && next.bitset.underline
-                )
-            }
-        },
-        {
-            .bitset = {
-                .blinking = (
-                    !prev.bitset.blinking && next.bitset.blinking
-                )
-            }
-        },
-        {
-            .bitset = {
-                .strikethrough = (
-                    !prev.bitset.strikethrough && next.bitset.strikethrough
-                )
-            }
-        },
-        {
-            .fg = next.fg,
-            .bg = next.bg,
-            .bitset = {
-                .fg = (
-                    !prev.bitset.fg && next.bitset.fg
-                ),
-                .bg = (
-                    !prev.bitset.bg && next.bitset.bg
-                )
-            }
-        }
-    };
+    if (!prev.bitset.underline && next.bitset.underline) {
+        p = amp_ans_put_param(p, "4", 1);
+    }
 
-    for (size_t i=0; i<sizeof(modes)/sizeof(modes[0]); ++i) {
-        size_t buf_size = amp_mode_to_ans(modes[i], pal, buf, sizeof(buf));
+    if (!prev.bitset.blinking && next.bitset.blinking) {
+        p = amp_ans_put_param(p, "5", 1);
+    }
 
-        if (buf_size > 3 && buf_size < sizeof(buf)) {
-            buf[buf_size - 1] = '\0'; // delete the 'm' terminator
+    if (!prev.bitset.strikethrough && next.bitset.strikethrough) {
+        p = amp_ans_put_param(p, "9", 1);
+    }
 
-            ans_size += (
-                ans_size ? amp_str_append(
-                    ans + ans_size, amp_sub_size(sizeof(ans), ans_size), ";"
-                ) : 0
-            );
+    if (pal == AMP_PAL_24BIT) {
+        if (next.bitset.fg && (
+            !prev.bitset.fg || memcmp(&prev.fg, &next.fg, sizeof(next.fg))
+        )) {
+            p = amp_ans_put_rgb_param(p, "38;2", next.fg);
+        }
 
-            ans_size += amp_str_append(
-                ans + ans_size, amp_sub_size(sizeof(ans), ans_size), buf + 2
-            );
+        if (next.bitset.bg && (
+            !prev.bitset.bg || memcmp(&prev.bg, &next.bg, sizeof(next.bg))
+        )) {
+            p = amp_ans_put_rgb_param(p, "48;2", next.bg);
         }
     }
+    else if (pal == AMP_PAL_256) {
+        if (next.bitset.fg && (
+            !prev.bitset.fg || prev_sgr.fg_index != next_sgr.fg_index
+        )) {
+            p = amp_ans_put_param(p, "38;5", 4);
+            p = amp_ans_put_number_param(p, next_sgr.fg_index);
+        }
 
-    if (ans_size) {
-        size_t written = 0;
+        if (next.bitset.bg && (
+            !prev.bitset.bg || prev_sgr.bg_index != next_sgr.bg_index
+        )) {
+            p = amp_ans_put_param(p, "48;5", 4);
+            p = amp_ans_put_number_param(p, next_sgr.bg_index);
+        }
+    }
+    else {
+        if (!prev_sgr.reverse && next_sgr.reverse) {
+            p = amp_ans_put_param(p, "7", 1);
+        }
 
-        written += amp_str_append(
-            ans_dst + written, amp_sub_size(ans_dst_size, written), "\x1b["
-        );
+        if (!prev_sgr.bold && next_sgr.bold) {
+            p = amp_ans_put_param(p, "1", 1);
+        }
 
-        written += amp_str_append(
-            ans_dst + written, amp_sub_size(ans_dst_size, written), ans
-        );
+        if (next_sgr.fg && next_sgr.fg != prev_sgr.fg) {
+            p = amp_ans_put_param(p, next_sgr.fg, strlen(next_sgr.fg));
+        }
 
-        written += amp_str_append(
-            ans_dst + written, amp_sub_size(ans_dst_size, written), "m"
-        );
+        if (next_sgr.bg && next_sgr.bg != prev_sgr.bg) {
+            p = amp_ans_put_param(p, next_sgr.bg, strlen(next_sgr.bg));
+        }
+    }
 
-        return written;
+    if (p == params) {
+        return dst;
     }
-    else if (ans_dst_size) {
-        *ans_dst = '\0';
+
+    dst[0] = '\x1b';
+    dst[1] = '[';
+    *p++ = 'm';
+
+    return p;
+}
+
+static inline const struct amp_sgr_cache_entry_type *amp_sgr_cache_get(
+    struct amp_sgr_cache_type *cache, struct amp_sgr_cache_entry_type *scratch,
+    uint64_t prev_mode_word, uint64_t next_mode_word, AMP_PALETTE palette
+) {
+    // Returns the encoding of the transition between the given modes. Without
+    // a cache the transition is encoded into the scratch entry every time.
+
+    struct amp_sgr_cache_entry_type *entry = scratch;
+
+    if (cache) {
+        if (cache->palette != palette) {
+            memset(cache->entry, 0, sizeof(cache->entry));
+            cache->palette = palette;
+        }
+
+        uint64_t hash = prev_mode_word * 0x9e3779b97f4a7c15ULL ^ next_mode_word;
+
+        hash = (hash ^ hash >> 30) * 0xbf58476d1ce4e5b9ULL;
+        hash = (hash ^ hash >> 27) * 0x94d049bb133111ebULL;
+        hash ^= hash >> 31;
+
+        entry = &cache->entry[hash % AMP_SGR_CACHE_SIZE];
+
+        // The zeroed entries hold the transition between two empty modes,
+        // which is encoded as nothing, so they need no separate valid flag.
+
+        if (entry->prev_mode_word == prev_mode_word
+        &&  entry->next_mode_word == next_mode_word) {
+            ++cache->hits;
+            return entry;
+        }
+
+        ++cache->misses;
     }
 
-    return 0;
+    struct amp_mode_type prev_mode = amp_mode_unpack(prev_mode_word);
+    struct amp_mode_type next_mode = amp_mode_unpack(next_mode_word);
+    const char *sgr_end = amp_mode_update_to_sgr(
+        prev_mode, next_mode, amp_mode_to_sgr(prev_mode, palette),
+        amp_mode_to_sgr(next_mode, palette), palette, entry->data
+    );
+
+    entry->prev_mode_word = prev_mode_word;
+    entry->next_mode_word = next_mode_word;
+    entry->size = (uint8_t) (sgr_end - entry->data);
+
+    return entry;
 }
 
-static inline size_t amp_row_cut_to_ans(
+static inline void amp_row_cut_to_writer(
     const struct amp_type *amp, uint32_t x, uint32_t y, uint32_t width,
-    char *ans_dst, size_t ans_dst_size
+    struct amp_writer_type *writer
 ) {
     const uint32_t amp_width = amp->width;
     const uint32_t end_x = (
         width ? (x + width > amp_width ? amp_width : x + width) : amp_width
     );
 
-    char mode_ans[256];
-    struct amp_mode_type prev_mode_state = {};
-    size_t ans_size = 0;
+    // Cells that do not fit in the buffers are encoded as blank cells. This is
+    // figured out once per row so that the loop below could access the cells
+    // directly.
+
+    const size_t row_index = (size_t) y * amp_width;
+    const size_t glyph_count = (
+        y < amp->height ? amp->glyph.size / AMP_CELL_GLYPH_SIZE : 0
+    );
+    const size_t mode_count = (
+        y < amp->height ? amp->mode.size / AMP_CELL_MODE_SIZE : 0
+    );
+
+    uint64_t prev_mode_word = 0;
 
-    for (; x < end_x; ++x) {
-        struct amp_mode_type next_mode_state = amp_get_mode(amp, x, y);
+    while (x < end_x) {
+        // The row is encoded in runs of cells that share the same mode, so the
+        // graphic rendition is updated once per run and the bounds are checked
+        // once per run for its glyphs.
 
-        size_t mode_ans_size = amp_mode_update_to_ans(
-            prev_mode_state, next_mode_state, amp->palette,
-            mode_ans, sizeof(mode_ans)
-        );
+        const size_t index = row_index + x;
+        uint64_t mode_word = 0;
+        size_t run_size = end_x - x;
 
-        prev_mode_state = next_mode_state;
+        if (index < mode_count) {
+            const size_t count = mode_count - index;
 
-        if (mode_ans_size) {
-            ans_size += amp_str_append(
-                ans_dst + ans_size, amp_sub_size(ans_dst_size, ans_size),
-                mode_ans
+            mode_word = amp->mode.data[index];
+            run_size = amp_modes_span(
+                amp->mode.data + index, count < run_size ? count : run_size
             );
         }
 
-        const char *glyph_str = amp_get_glyph(amp, x, y);
-
-        if (!glyph_str || *glyph_str == '\0') {
-            ans_size += amp_str_append(
-                ans_dst + ans_size, amp_sub_size(ans_dst_size, ans_size), " "
+        if (mode_word != prev_mode_word) {
+            struct amp_sgr_cache_entry_type scratch;
+            auto sgr = amp_sgr_cache_get(
+                amp->sgr_cache, &scratch, prev_mode_word, mode_word,
+                amp->palette
             );
 
-            continue;
+            amp_writer_append(writer, sgr->data, sgr->size);
+            prev_mode_word = mode_word;
         }
 
-        ans_size += amp_str_append(
-            ans_dst + ans_size, amp_sub_size(ans_dst_size, ans_size), glyph_str
+        const bool direct = (
+            writer->size <= writer->capacity &&
+            writer->capacity - writer->size >= run_size * AMP_CELL_GLYPH_SIZE
         );
+
+        for (const size_t run_end_x = x + run_size; x < run_end_x; ++x) {
+            const size_t i = row_index + x;
+            const uint32_t glyph_word = (
+                i < glyph_count ? amp->glyph.data[i] : 0
+            );
+
+            if (!glyph_word) {
+                amp_writer_append(writer, " ", 1);
+            }
+            else if (direct) {
+                // All of the glyph word is copied, but only the bytes of its
+                // code point are kept.
+
+                memcpy(
+                    writer->data + writer->size, &glyph_word,
+                    sizeof(glyph_word)
+                );
+
+                writer->size += amp_glyph_word_size(glyph_word);
+            }
+            else {
+                amp_writer_append(
+                    writer, (const char *) &glyph_word,
+                    amp_glyph_word_size(glyph_word)
+                );
+            }
+        }
     }
 
-    ans_size += amp_str_append(
-        ans_dst + ans_size, amp_sub_size(ans_dst_size, ans_size), "\x1b[0m"
-    );
+    amp_writer_append(writer, "\x1b[0m", 4);
+}
 
-    if (!ans_size && ans_dst_size) {
-        *ans_dst = '\0';
+static inline void amp_to_writer(
+    const struct amp_type *amp, struct amp_writer_type *writer
+) {
+    for (uint32_t y = 0; y < amp->height; ++y) {
+        amp_row_cut_to_writer(amp, 0, y, amp->width, writer);
+
+        if (y + 1 < amp->height) {
+            amp_writer_append(writer, "\r\n", 2);
+        }
     }
+}
+
+static inline size_t amp_row_cut_max_ans_size(
+    const struct amp_type *amp, uint32_t x, uint32_t width
+) {
+    const uint32_t cells = (
+        x < amp->width ? (
+            width && width < amp->width - x ? width : amp->width - x
+        ) : 0
+    );
+
+    return (
+        // One more cell is accounted for the reset sequence at the end.
+        ((size_t) cells + 1) * AMP_ANS_CELL_MAX_SIZE
+    );
+}
+
+static inline size_t amp_row_cut_to_ans(
+    const struct amp_type *amp, uint32_t x, uint32_t y, uint32_t width,
+    char *ans_dst, size_t ans_dst_size
+) {
+    struct amp_writer_type writer = {
+        .data = ans_dst,
+        .capacity = ans_dst_size
+    };
+
+    amp_row_cut_to_writer(amp, x, y, width, &writer);
 
     return (
         // The number of characters that would have been written if
         // ans_dst_size had been sufficiently large, not counting the
         // terminating null character.
-        ans_size
+        amp_writer_terminate(&writer)
     );
 }
 
@@ -1658,80 +2362,66 @@ static inline size_t amp_sub_size(size_t a, size_t b) {
 static inline size_t amp_to_ans(
     const struct amp_type *amp, char *ans_dst, size_t ans_dst_size
 ) {
-    size_t ans_size = 0;
-
-    for (uint32_t y = 0; y < amp->height; ++y) {
-        ans_size += amp_row_to_ans(
-            amp, y, ans_dst + ans_size, amp_sub_size(ans_dst_size, ans_size)
-        );
-
-        if (y + 1 < amp->height) {
-            ans_size += amp_str_append(
-                ans_dst + ans_size, amp_sub_size(ans_dst_size, ans_size), "\r\n"
-            );
-        }
-    }
+    struct amp_writer_type writer = {
+        .data = ans_dst,
+        .capacity = ans_dst_size
+    };
 
-    if (!ans_size && ans_dst_size) {
-        *ans_dst = '\0';
-    }
+    amp_to_writer(amp, &writer);
 
-    return ans_size;
+    return amp_writer_terminate(&writer);
 }
 
-static inline struct amp_mode_type amp_mode_cell_deserialize(
-    const uint8_t *data, size_t data_size
-) {
+static inline struct amp_mode_type amp_mode_unpack(uint64_t mode_word) {
+    const uint64_t style = (
+        (mode_word & AMP_MODE_STYLE_MASK) >> AMP_MODE_STYLE_SHIFT
+    );
+
     return (struct amp_mode_type) {
         .fg = {
-            .r = data_size > 0 ? data[0] : 0,
-            .g = data_size > 1 ? data[1] : 0,
-            .b = data_size > 2 ? data[2] : 0
+            .r = (uint8_t) (mode_word >> (AMP_MODE_FG_SHIFT + 16)),
+            .g = (uint8_t) (mode_word >> (AMP_MODE_FG_SHIFT + 8)),
+            .b = (uint8_t) (mode_word >> AMP_MODE_FG_SHIFT)
         },
         .bg = {
-            .r = data_size > 3 ? data[3] : 0,
-            .g = data_size > 4 ? data[4] : 0,
-            .b = data_size > 5 ? data[5] : 0
+            .r = (uint8_t) (mode_word >> (AMP_MODE_BG_SHIFT + 16)),
+            .g = (uint8_t) (mode_word >> (AMP_MODE_BG_SHIFT + 8)),
+            .b = (uint8_t) (mode_word >> AMP_MODE_BG_SHIFT)
         },
         .bitset = {
-            .fg             = data_size > 6 ? data[6] & (1 << 0) : 0,
-            .bg             = data_size > 6 ? data[6] & (1 << 1) : 0,
-            .hidden         = data_size > 6 ? data[6] & (1 << 2) : 0,
-            .faint          = data_size > 6 ? data[6] & (1 << 3) : 0,
-            .italic         = data_size > 6 ? data[6] & (1 << 4) : 0,
-            .underline      = data_size > 6 ? data[6] & (1 << 5) : 0,
-            .blinking       = data_size > 6 ? data[6] & (1 << 6) : 0,
-            .strikethrough  = data_size > 6 ? data[6] & (1 << 7) : 0,
-            .broken         = data_size < AMP_CELL_MODE_SIZE
+            .fg             = (mode_word & AMP_MODE_FG) != 0,
+            .bg             = (mode_word & AMP_MODE_BG) != 0,
+            .hidden         = (style & AMP_HIDDEN) != 0,
+            .faint          = (style & AMP_FAINT) != 0,
+            .italic         = (style & AMP_ITALIC) != 0,
+            .underline      = (style & AMP_UNDERLINE) != 0,
+            .blinking       = (style & AMP_BLINKING) != 0,
+            .strikethrough  = (style & AMP_STRIKETHROUGH) != 0
         }
     };
 }
 
-static inline bool amp_mode_cell_serialize(
-    struct amp_mode_type cell, uint8_t *dst, size_t dst_size
-) {
-    if (dst_size < AMP_CELL_MODE_SIZE) {
-        return false;
-    }
-
-    dst[0] = cell.fg.r;
-    dst[1] = cell.fg.g;
-    dst[2] = cell.fg.b;
-    dst[3] = cell.bg.r;
-    dst[4] = cell.bg.g;
-    dst[5] = cell.bg.b;
-    dst[6] = (
-        (cell.bitset.fg             ? (1 << 0) : 0) |
-        (cell.bitset.bg             ? (1 << 1) : 0) |
-        (cell.bitset.hidden         ? (1 << 2) : 0) |
-        (cell.bitset.faint          ? (1 << 3) : 0) |
-        (cell.bitset.italic         ? (1 << 4) : 0) |
-        (cell.bitset.underline      ? (1 << 5) : 0) |
-        (cell.bitset.blinking       ? (1 << 6) : 0) |
-        (cell.bitset.strikethrough  ? (1 << 7) : 0)
+static inline uint64_t amp_mode_pack(struct amp_mode_type mode) {
+    const uint64_t style = (
+        (mode.bitset.hidden         ? AMP_HIDDEN        : 0) |
+        (mode.bitset.faint          ? AMP_FAINT         : 0) |
+        (mode.bitset.italic         ? AMP_ITALIC        : 0) |
+        (mode.bitset.underline      ? AMP_UNDERLINE     : 0) |
+        (mode.bitset.blinking       ? AMP_BLINKING      : 0) |
+        (mode.bitset.strikethrough  ? AMP_STRIKETHROUGH : 0)
     );
 
-    return true;
+    return (
+        ((uint64_t) mode.fg.r << (AMP_MODE_FG_SHIFT + 16)) |
+        ((uint64_t) mode.fg.g << (AMP_MODE_FG_SHIFT + 8)) |
+        ((uint64_t) mode.fg.b << AMP_MODE_FG_SHIFT) |
+        ((uint64_t) mode.bg.r << (AMP_MODE_BG_SHIFT + 16)) |
+        ((uint64_t) mode.bg.g << (AMP_MODE_BG_SHIFT + 8)) |
+        ((uint64_t) mode.bg.b << AMP_MODE_BG_SHIFT) |
+        (style << AMP_MODE_STYLE_SHIFT) |
+        (mode.bitset.fg ? AMP_MODE_FG : 0) |
+        (mode.bitset.bg ? AMP_MODE_BG : 0)
+    );
 }
 
 static inline struct amp_rgb16_type amp_find_rgb16(
@@ -1758,12 +2448,144 @@ static inline struct amp_rgb16_type amp_find_rgb16(
          if (d < best_d) {
             best_d = d;
             best_row = table;
+
+            if (!d) {
+                break; // nothing can be closer than an exact match
+            }
          }
     }
 
     return *best_row;
 }
 
+static inline struct amp_color_type amp_xterm256_color(uint8_t index) {
+    // The first 16 colors of the xterm-256 palette are the basic colors, which
+    // are followed by a 6x6x6 color cube and a ramp of 24 shades of gray.
+
+    if (index < 16) {
+        return amp_color_table[index + 1].color;
+    }
+
+    if (index >= 232) {
+        uint8_t gray = (uint8_t) (8 + 10 * (index - 232));
+
+        return (struct amp_color_type) { .r = gray, .g = gray, .b = gray };
+    }
+
+    index -= 16;
+
+    return (struct amp_color_type) {
+        .r = amp_xterm256_cube_levels[index / 36],
+        .g = amp_xterm256_cube_levels[index / 6 % 6],
+        .b = amp_xterm256_cube_levels[index % 6]
+    };
+}
+
+static inline uint8_t amp_find_xterm256(struct amp_color_type color) {
+    // The basic colors are left out because terminals tend to redefine them.
+    // The distance to the color cube is minimized for each channel separately
+    // and the distance to the gray ramp is minimized by the shades closest to
+    // the mean of the channels. The closer of the two candidates is returned.
+
+    const uint8_t channels[] = { color.r, color.g, color.b };
+    long cube_d = 0;
+    long cube_index = 0;
+
+    for (size_t i=0; i<sizeof(channels); ++i) {
+        long best_d = LONG_MAX;
+        long best_level = 0;
+
+        for (long level=0; level<6; ++level) {
+            long d = (long) channels[i] - amp_xterm256_cube_levels[level];
+
+            if (d * d < best_d) {
+                best_d = d * d;
+                best_level = level;
+            }
+        }
+
+        cube_d += best_d;
+        cube_index = cube_index * 6 + best_level;
+    }
+
+    const long mean = ((long) color.r + color.g + color.b) / 3;
+    const long nearest_shade = (mean - 8) / 10;
+    long gray_d = LONG_MAX;
+    long gray_index = 0;
+
+    for (long shade = nearest_shade - 1; shade <= nearest_shade + 1; ++shade) {
+        if (shade < 0 || shade > 23) {
+            continue;
+        }
+
+        long dr = (long) color.r - (8 + 10 * shade);
+        long dg = (long) color.g - (8 + 10 * shade);
+        long db = (long) color.b - (8 + 10 * shade);
+        long d = dr * dr + dg * dg + db * db;
+
+        if (d < gray_d) {
+            gray_d = d;
+            gray_index = shade;
+        }
+    }
+
+    return (uint8_t) (gray_d < cube_d ? 232 + gray_index : 16 + cube_index);
+}
+
+static inline size_t amp_lut_index(struct amp_color_type color) {
+    constexpr unsigned shift = 8 - AMP_LUT_BITS;
+
+    return (
+        ((size_t) (color.r >> shift) << (2 * AMP_LUT_BITS)) |
+        ((size_t) (color.g >> shift) << AMP_LUT_BITS) |
+        ((size_t) (color.b >> shift))
+    );
+}
+
+static inline struct amp_color_type amp_lut_color(size_t lut_index) {
+    // Returns the color that represents all the colors sharing the lookup table
+    // index. The low bits are filled with the high bits so that both black and
+    // white are represented exactly.
+
+    constexpr unsigned shift = 8 - AMP_LUT_BITS;
+    constexpr size_t mask = (1 << AMP_LUT_BITS) - 1;
+    uint8_t r = (uint8_t) ((lut_index >> (2 * AMP_LUT_BITS)) & mask);
+    uint8_t g = (uint8_t) ((lut_index >> AMP_LUT_BITS) & mask);
+    uint8_t b = (uint8_t) (lut_index & mask);
+
+    return (struct amp_color_type) {
+        .r = (uint8_t) (r << shift | r >> (AMP_LUT_BITS - shift)),
+        .g = (uint8_t) (g << shift | g >> (AMP_LUT_BITS - shift)),
+        .b = (uint8_t) (b << shift | b >> (AMP_LUT_BITS - shift))
+    };
+}
+
+static inline void amp_lut_build_rgb16() {
+    for (size_t i=0; i<AMP_LUT_SIZE; ++i) {
+        amp_lut.rgb16[i] = amp_find_rgb16(
+            amp_rgb16_fg_table, amp_lut_color(i)
+        ).index;
+    }
+}
+
+static inline void amp_lut_build_xterm256() {
+    for (size_t i=0; i<AMP_LUT_SIZE; ++i) {
+        amp_lut.xterm256[i] = amp_find_xterm256(amp_lut_color(i));
+    }
+}
+
+static inline AMP_COLOR amp_quantize_rgb16(struct amp_color_type color) {
+    call_once(&amp_lut.rgb16_once, amp_lut_build_rgb16);
+
+    return (AMP_COLOR) amp_lut.rgb16[amp_lut_index(color)];
+}
+
+static inline uint8_t amp_quantize_xterm256(struct amp_color_type color) {
+    call_once(&amp_lut.xterm256_once, amp_lut_build_xterm256);
+
+    return amp_lut.xterm256[amp_lut_index(color)];
+}
+
 static inline struct amp_color_type amp_lookup_color(AMP_COLOR index) {
     return (
         index < AMP_MAX_COLOR ? (
@@ -0,0 +1,2690 @@
+// SPDX-License-Identifier: MIT
+////////////////////////////////////////////////////////////////////////////////
+#include "all.h"
+////////////////////////////////////////////////////////////////////////////////
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <zlib.h>
+////////////////////////////////////////////////////////////////////////////////
+
+
+static bool bench_pipeline();
+static bool bench_amp();
+static bool bench_diff();
+static bool bench_sgr();
+static bool bench_server();
+static bool bench_mem();
+static bool bench_waste();
+static bool bench_trim();
+static bool bench_keys();
+static bool bench_growth();
+static bool bench_share();
+static bool bench_telnet();
+static bool bench_esc();
+static bool bench_paste();
+static bool bench_mccp();
+static bool bench_backlog();
+
+static const struct bench_type {
+    const char *name;
+    bool (*run)();
+} bench_table[] = {
+    { .name = "pipeline",   .run = bench_pipeline   },
+    { .name = "amp",        .run = bench_amp        },
+    { .name = "diff",       .run = bench_diff       },
+    { .name = "sgr",        .run = bench_sgr        },
+    { .name = "server",     .run = bench_server     },
+    { .name = "mem",        .run = bench_mem        },
+    { .name = "waste",      .run = bench_waste      },
+    { .name = "trim",       .run = bench_trim       },
+    { .name = "keys",       .run = bench_keys       },
+    { .name = "growth",     .run = bench_growth     },
+    { .name = "share",      .run = bench_share      },
+    { .name = "telnet",     .run = bench_telnet     },
+    { .name = "esc",        .run = bench_esc        },
+    { .name = "paste",      .run = bench_paste      },
+    { .name = "mccp",       .run = bench_mccp       },
+    { .name = "backlog",    .run = bench_backlog    },
+    ////////////////////////////////////////////////////////////////////////////
+    {}
+};
+
+static int bench_stderr = -1;
+
+bool bench_run(const char *name) {
+    bool found = false;
+    bool success = true;
+
+    for (const struct bench_type *bench = bench_table; bench->name; ++bench) {
+        if (name && strcmp(name, bench->name)) {
+            continue;
+        }
+
+        found = true;
+
+        LOG("bench: running %s", bench->name);
+
+        if (!bench->run()) {
+            WARN("bench: %s failed", bench->name);
+            success = false;
+        }
+    }
+
+    if (!found) {
+        WARN("bench: %s not found", name);
+        return false;
+    }
+
+    mem_recycle();
+
+    if (mem_get_usage()) {
+        WARN("%lu bytes of memory left hanging", mem_get_usage());
+        mem_clear();
+    }
+
+    return success;
+}
+
+static double bench_time() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+static uint64_t bench_random(uint64_t *state) {
+    uint64_t x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+
+    return (*state = x);
+}
+
+static void bench_mute() {
+    // The code under measurement logs every token it handles. Formatting the
+    // log lines is part of the real cost, but writing them to a terminal is
+    // not, so stderr is redirected to /dev/null for the duration.
+
+    int devnull = open("/dev/null", O_WRONLY);
+
+    if (devnull == -1) {
+        return;
+    }
+
+    bench_stderr = dup(STDERR_FILENO);
+    dup2(devnull, STDERR_FILENO);
+    close(devnull);
+}
+
+static void bench_unmute() {
+    if (bench_stderr == -1) {
+        return;
+    }
+
+    dup2(bench_stderr, STDERR_FILENO);
+    close(bench_stderr);
+    bench_stderr = -1;
+}
+
+static void bench_report(const char *what, size_t bytes, double seconds) {
+    LOG(
+        "bench: %s: %lu bytes in %.3f ms (%.1f MiB/s)", what, bytes,
+        seconds * 1e3, seconds > 0.0 ? (
+            (double) bytes / (1024.0 * 1024.0) / seconds
+        ) : 0.0
+    );
+}
+
+struct bench_options_type {
+    uint16_t width; // the window size that is reported, unless zero
+    uint16_t height;
+    uint8_t mccp; // TELNET_DO or TELNET_DONT, unless compression is answered
+};
+
+static struct bench_hello_type {
+    uint8_t data[32];
+    size_t size;
+} bench_hello(struct bench_options_type options) {
+    // Serializes what a peer says first to negotiate its options with the
+    // session.
+
+    struct bench_hello_type hello = {
+        .data = {
+            TELNET_IAC, TELNET_WILL, TELNET_OPT_NAWS,
+            TELNET_IAC, TELNET_DO, TELNET_OPT_EOR
+        },
+        .size = 6
+    };
+
+    if (options.mccp) {
+        hello.data[hello.size++] = TELNET_IAC;
+        hello.data[hello.size++] = options.mccp;
+        hello.data[hello.size++] = TELNET_OPT_MCCP;
+    }
+
+    if (options.width) {
+        auto naws = telnet_serialize_naws_message(
+            options.width, options.height
+        );
+
+        memcpy(hello.data + hello.size, naws.data, naws.size);
+        hello.size += naws.size;
+    }
+
+    return hello;
+}
+
+static USER *bench_session_create(struct bench_options_type options) {
+    // Returns a session that has been greeted by its peer and initialized. Its
+    // output is left in the outgoing queue of the user.
+
+    USER *user = user_create();
+
+    if (!user) {
+        return nullptr;
+    }
+
+    const struct bench_hello_type hello = bench_hello(options);
+
+    if (!clip_append_byte_array(
+        user->client->io.terminal.incoming.clip, hello.data, hello.size
+    )) {
+        user_destroy(user);
+        return nullptr;
+    }
+
+    client_init(user->client);
+
+    return user;
+}
+
+static void bench_session_update(CLIENT *client) {
+    // Lets the session handle everything it has been sent.
+
+    mem_arena_begin();
+
+    while (client_update(client));
+
+    mem_arena_reset();
+}
+
+static bool bench_pipeline_generate(CLIP *clip, size_t size) {
+    static const uint8_t iac_naws[] = {
+        TELNET_IAC, TELNET_SB, TELNET_OPT_NAWS, 0, 80, 0, 24,
+        TELNET_IAC, TELNET_SE
+    };
+    static const uint8_t iac_commands[] = {
+        TELNET_WILL, TELNET_WONT, TELNET_DO, TELNET_DONT
+    };
+    static const uint8_t iac_options[] = {
+        TELNET_OPT_ECHO, TELNET_OPT_SGA, TELNET_OPT_TTYPE, TELNET_OPT_MSSP
+    };
+    static const char *esc_keys[] = {
+        "\x1b[A", "\x1b[B", "\x1b[C", "\x1b[D", "\x1b[5~", "\x1b[6~"
+    };
+
+    uint64_t seed = 0x9e3779b97f4a7c15;
+
+    if (!clip_reserve(clip, size + sizeof(iac_naws) + 128)) {
+        return false;
+    }
+
+    while (clip_get_size(clip) < size) {
+        uint64_t r = bench_random(&seed);
+        bool appended = true;
+
+        switch (r % 4) {
+            case 0: {
+                uint8_t iac[] = {
+                    TELNET_IAC,
+                    iac_commands[(r >> 8) % ARRAY_LENGTH(iac_commands)],
+                    iac_options[(r >> 16) % ARRAY_LENGTH(iac_options)]
+                };
+
+                appended = clip_append_byte_array(clip, iac, sizeof(iac));
+                break;
+            }
+            case 1: {
+                appended = clip_append_byte_array(
+                    clip, iac_naws, sizeof(iac_naws)
+                );
+                break;
+            }
+            case 2: {
+                const char *esc = esc_keys[(r >> 8) % ARRAY_LENGTH(esc_keys)];
+
+                appended = clip_append_byte_array(
+                    clip, (const uint8_t *) esc, strlen(esc)
+                );
+                break;
+            }
+            default: {
+                size_t length = 1 + (r >> 8) % 128;
+
+                for (size_t i=0; i<length && appended; ++i) {
+                    appended = clip_push_byte(
+                        clip, (uint8_t) (' ' + (r >> (16 + i % 32)) % 95)
+                    );
+                }
+
+                break;
+            }
+        }
+
+        if (!appended) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool bench_pipeline_feed(
+    const CLIP *data, size_t chunk_size, double *seconds
+) {
+    CLIENT *client = client_create();
+
+    if (!client) {
+        return false;
+    }
+
+    CLIP *incoming = client->io.terminal.incoming.clip;
+    const uint8_t *bytes = clip_get_byte_array(data);
+    const size_t size = clip_get_size(data);
+    bool success = true;
+
+    bench_mute();
+
+    double started = bench_time();
+
+    for (size_t i=0; i<size && success; i += chunk_size) {
+        size_t count = size - i < chunk_size ? size - i : chunk_size;
+
+        mem_arena_begin();
+        success = clip_append_byte_array(incoming, bytes + i, count);
+        client_update(client);
+        clip_clear(global.io.outgoing.queue);
+        mem_arena_reset();
+    }
+
+    *seconds = bench_time() - started;
+
+    bench_unmute();
+
+    if (!clip_is_empty(incoming)) {
+        WARN("bench: %lu bytes left unparsed", clip_get_size(incoming));
+        success = false;
+    }
+
+    client_destroy(client);
+
+    return success;
+}
+
+static bool bench_pipeline() {
+    // Feeds 1 MiB of mixed text, IAC and ESC sequences through the terminal to
+    // client input path, once as a single paste and once in read-sized
+    // chunks.
+
+    constexpr size_t data_size = 1024 * 1024;
+    const size_t chunk_sizes[] = { data_size, MAX_STACKBUF_SIZE };
+    CLIP *data = clip_create_byte_array();
+    bool success = data && bench_pipeline_generate(data, data_size);
+
+    global.io.outgoing.queue = clip_create_clip_array();
+
+    for (size_t i=0; i<ARRAY_LENGTH(chunk_sizes) && success; ++i) {
+        double seconds = 0.0;
+        char what[64];
+
+        success = bench_pipeline_feed(data, chunk_sizes[i], &seconds);
+
+        FORMAT(what, "terminal -> client (%lu byte chunks)", chunk_sizes[i]);
+        bench_report(what, clip_get_size(data), seconds);
+    }
+
+    clip_destroy(global.io.outgoing.queue);
+    global.io.outgoing.queue = nullptr;
+
+    clip_destroy(data);
+
+    return success;
+}
+
+static bool bench_telnet() {
+    // Feeds subnegotiations of growing length through the terminal to client
+    // input path one byte at a time, the way a slow or hostile peer would send
+    // them. The last one is longer than the parser lets through.
+
+    const size_t sb_sizes[] = {
+        1024, 2048, TELNET_SB_MAX_SIZE - 8, 16 * TELNET_SB_MAX_SIZE
+    };
+    CLIP *data = clip_create_byte_array();
+    bool success = data != nullptr;
+
+    global.io.outgoing.queue = clip_create_clip_array();
+
+    for (size_t i=0; i<ARRAY_LENGTH(sb_sizes) && success; ++i) {
+        const uint8_t head[] = { TELNET_IAC, TELNET_SB, TELNET_OPT_MSDP };
+        const uint8_t tail[] = { TELNET_IAC, TELNET_SE, 'o', 'k' };
+        double seconds = 0.0;
+        char what[64];
+
+        clip_clear(data);
+
+        success = (
+            clip_append_byte_array(data, head, sizeof(head)) &&
+            clip_reserve_extra(data, sb_sizes[i])
+        );
+
+        for (size_t j=sizeof(head); j<sb_sizes[i] - 2 && success; ++j) {
+            success = clip_push_byte(data, 'x');
+        }
+
+        success = (
+            success &&
+            clip_append_byte_array(data, tail, sizeof(tail)) &&
+            bench_pipeline_feed(data, 1, &seconds)
+        );
+
+        FORMAT(what, "drip %lu byte SB", sb_sizes[i]);
+        bench_report(what, clip_get_size(data), seconds);
+    }
+
+    clip_destroy(global.io.outgoing.queue);
+    global.io.outgoing.queue = nullptr;
+
+    clip_destroy(data);
+
+    return success;
+}
+
+static bool bench_esc() {
+    // Feeds 256 KiB of key presses through the terminal to client input path
+    // as a single paste and one byte at a time. The keys are a mix of cursor
+    // and editing keys with and without modifiers, in CSI and SS3 form.
+
+    constexpr size_t data_size = 256 * 1024;
+    static const char *keys[] = {
+        "\x1b[A", "\x1b[1;5B", "\x1bOC", "\x1b[3~", "\x1b[5;2~", "\x1b[1;3H",
+        "\x1bOF", "\x1b[6~"
+    };
+    const size_t chunk_sizes[] = { data_size, 1 };
+    CLIP *data = clip_create_byte_array();
+    uint64_t state = 0x9e3779b97f4a7c15;
+    bool success = data != nullptr;
+
+    while (success && clip_get_size(data) < data_size) {
+        const char *key = keys[bench_random(&state) % ARRAY_LENGTH(keys)];
+
+        success = clip_append_byte_array(
+            data, (const uint8_t *) key, strlen(key)
+        );
+    }
+
+    global.io.outgoing.queue = clip_create_clip_array();
+
+    for (size_t i=0; i<ARRAY_LENGTH(chunk_sizes) && success; ++i) {
+        double seconds = 0.0;
+        char what[64];
+
+        success = bench_pipeline_feed(data, chunk_sizes[i], &seconds);
+
+        FORMAT(what, "keys (%lu byte chunks)", chunk_sizes[i]);
+        bench_report(what, clip_get_size(data), seconds);
+    }
+
+    clip_destroy(global.io.outgoing.queue);
+    global.io.outgoing.queue = nullptr;
+
+    clip_destroy(data);
+
+    return success;
+}
+
+static bool bench_paste() {
+    // Feeds 4 MiB of pasted lines of text through the terminal to client input
+    // path, once as a single paste and once in read-sized chunks. Then the
+    // control character scan on its own is compared against memchr, which is
+    // about as fast as a single pass over memory gets.
+
+    constexpr size_t data_size = 4 * 1024 * 1024;
+    constexpr size_t scan_count = 64;
+    const size_t chunk_sizes[] = { data_size, MAX_STACKBUF_SIZE };
+    static const char *words[] = {
+        "the", "dungeon", "crawl", "käärme", "of", "a", "lantern", "goblin",
+        "ščit", "and", "torch"
+    };
+    CLIP *data = clip_create_byte_array();
+    uint64_t state = 0x853c49e6748fea9b;
+    bool success = data && clip_reserve_extra(data, data_size);
+
+    while (success && clip_get_size(data) < data_size) {
+        const size_t line_size = 40 + bench_random(&state) % 80;
+
+        for (size_t i=0; i<line_size && success; ) {
+            const char *word = words[
+                bench_random(&state) % ARRAY_LENGTH(words)
+            ];
+
+            i += strlen(word) + 1;
+            success = (
+                clip_append_byte_array(
+                    data, (const uint8_t *) word, strlen(word)
+                ) && clip_push_byte(data, ' ')
+            );
+        }
+
+        success = success && clip_append_byte_array(
+            data, (const uint8_t *) "\r\n", 2
+        );
+    }
+
+    global.io.outgoing.queue = clip_create_clip_array();
+
+    for (size_t i=0; i<ARRAY_LENGTH(chunk_sizes) && success; ++i) {
+        double seconds = 0.0;
+        char what[64];
+
+        success = bench_pipeline_feed(data, chunk_sizes[i], &seconds);
+
+        FORMAT(what, "paste (%lu byte chunks)", chunk_sizes[i]);
+        bench_report(what, clip_get_size(data), seconds);
+    }
+
+    clip_destroy(global.io.outgoing.queue);
+    global.io.outgoing.queue = nullptr;
+
+    if (success) {
+        // The lines are joined into one so that the scans cover all of it.
+
+        char *text = (char *) clip_get_byte_array(data);
+        const size_t text_size = clip_get_size(data);
+        size_t found = 0;
+
+        for (size_t i=0; i<text_size; ++i) {
+            text[i] = (unsigned char) text[i] < ' ' ? ' ' : text[i];
+        }
+
+        double started = bench_time();
+
+        for (size_t i=0; i<scan_count; ++i) {
+            found += str_seg_find_ctrl(text, text_size);
+        }
+
+        bench_report(
+            "control character scan", text_size * scan_count,
+            bench_time() - started
+        );
+
+        started = bench_time();
+
+        for (size_t i=0; i<scan_count; ++i) {
+            const char *iac = memchr(text, TELNET_IAC, text_size);
+
+            found += iac ? SIZEVAL(iac - text) : text_size;
+        }
+
+        bench_report(
+            "memchr for IAC", text_size * scan_count, bench_time() - started
+        );
+
+        success = found == 2 * scan_count * text_size;
+    }
+
+    clip_destroy(data);
+
+    return success;
+}
+
+static bool bench_mccp_session(
+    bool compress, size_t frame_count, CLIP *output,
+    struct client_mccp_stats_type *stats
+) {
+    // Runs a session that redraws the screen in full for every frame by
+    // changing the window size back and forth, and collects all of its output.
+    // The compression counters of the session are copied to the stats.
+
+    const uint8_t reply[] = {
+        // The answer to our offer of compression comes with the first frame.
+        TELNET_IAC, compress ? TELNET_DO : TELNET_DONT, TELNET_OPT_MCCP
+    };
+    USER *user = bench_session_create((struct bench_options_type) {});
+
+    if (!user) {
+        return false;
+    }
+
+    CLIENT *client = user->client;
+    CLIP *incoming = client->io.terminal.incoming.clip;
+    CLIP *queue = user->io.outgoing.queue;
+    bool success = true;
+
+    for (size_t i=0; i<=frame_count + 1 && success; ++i) {
+        if (i == frame_count + 1) {
+            client_shutdown(client);
+        }
+        else if (i > 0) {
+            auto naws = telnet_serialize_naws_message(
+                (uint16_t) (160 - i % 2), 48
+            );
+
+            success = (
+                (i > 1 || clip_append_byte_array(
+                    incoming, reply, sizeof(reply)
+                )) && clip_append_byte_array(incoming, naws.data, naws.size)
+            );
+        }
+
+        bench_session_update(client);
+
+        for (size_t j=0; j<clip_get_size(queue) && success; ++j) {
+            success = clip_append_clip(output, clip_get_clip_at(queue, j));
+        }
+
+        clip_clear(queue);
+    }
+
+    *stats = client->mccp.stats;
+    user_destroy(user);
+
+    return success;
+}
+
+static bool bench_mccp_inflate(const CLIP *packed, CLIP *unpacked) {
+    // The output up to the start of compression is copied as it is and the
+    // rest is inflated, which must end exactly where the compressed stream
+    // does.
+
+    const uint8_t *data = clip_get_byte_array(packed);
+    const size_t size = clip_get_size(packed);
+    const size_t marker_size = strlen(TELNET_IAC_SB_MCCP_SE);
+    size_t start = 0;
+
+    while (start + marker_size <= size
+    &&  memcmp(data + start, TELNET_IAC_SB_MCCP_SE, marker_size)) {
+        ++start;
+    }
+
+    if (start + marker_size > size
+    ||  !clip_append_byte_array(unpacked, data, start)) {
+        return false;
+    }
+
+    start += marker_size;
+
+    z_stream stream = {
+        .next_in = (Bytef *) data + start,
+        .avail_in = (uInt) (size - start)
+    };
+    int result = inflateInit(&stream);
+
+    while (result == Z_OK) {
+        const size_t used = clip_get_size(unpacked);
+
+        if (!clip_reserve_extra(unpacked, 64 * 1024)) {
+            break;
+        }
+
+        stream.next_out = clip_get_byte_array(unpacked) + used;
+        stream.avail_out = (uInt) (clip_get_capacity(unpacked) - used);
+
+        result = inflate(&stream, Z_NO_FLUSH);
+
+        clip_resize(
+            unpacked, SIZEVAL(stream.next_out - clip_get_byte_array(unpacked))
+        );
+    }
+
+    inflateEnd(&stream);
+
+    return result == Z_STREAM_END && stream.avail_in == 0;
+}
+
+static bool bench_mccp() {
+    // Checks that the output of a compressed session inflates back to the
+    // output of the same session without compression, and reports how well
+    // and how fast the frames compress at a few levels.
+
+    constexpr size_t frame_count = 200;
+    const int levels[] = { 1, 6, 9 };
+    struct client_policy_type policy;
+    CLIP *plain = clip_create_byte_array();
+    CLIP *packed = clip_create_byte_array();
+    CLIP *unpacked = clip_create_byte_array();
+    struct client_mccp_stats_type stats = {};
+    bool success = plain && packed && unpacked;
+
+    client_get_policy(&policy);
+
+    bench_mute();
+
+    success = success && bench_mccp_session(
+        false, frame_count, plain, &stats
+    );
+
+    bench_unmute();
+
+    for (size_t i=0; i<ARRAY_LENGTH(levels) && success; ++i) {
+        client_set_policy(&(struct client_policy_type) {
+            .mccp_level = levels[i],
+            .mccp_flush = CLIENT_FLUSH_SYNC,
+            .palette = policy.palette
+        });
+
+        clip_clear(packed);
+        clip_clear(unpacked);
+
+        bench_mute();
+
+        double started = bench_time();
+
+        success = bench_mccp_session(true, frame_count, packed, &stats);
+
+        double seconds = bench_time() - started;
+
+        bench_unmute();
+
+        success = (
+            success && bench_mccp_inflate(packed, unpacked) &&
+            clip_get_size(unpacked) == clip_get_size(plain) && !memcmp(
+                clip_get_byte_array(unpacked), clip_get_byte_array(plain),
+                clip_get_size(plain)
+            )
+        );
+
+        if (!success) {
+            WARN("bench: level %d does not inflate to the output", levels[i]);
+            break;
+        }
+
+        LOG(
+            "bench: level %d: %lu bytes into %lu (%.1f:1), %.3f ms of CPU "
+            "in deflate, %.3f ms per session", levels[i], stats.in,
+            stats.out, (double) stats.in / (double) stats.out,
+            (double) stats.nsec / 1e6, seconds * 1e3
+        );
+    }
+
+    client_set_policy(&policy);
+
+    clip_destroy(plain);
+    clip_destroy(packed);
+    clip_destroy(unpacked);
+
+    return success;
+}
+
+static bool bench_backlog() {
+    // A peer that reads only a few hundred bytes between window size changes
+    // falls behind the session. The frames it has no room for are skipped,
+    // the unsent output stays bounded and the newest frame is still drawn
+    // once the peer has read everything.
+
+    constexpr size_t round_count = 2000;
+    constexpr size_t drain_size = 256;
+    USER *user = bench_session_create(
+        (struct bench_options_type) { .mccp = TELNET_DONT }
+    );
+
+    if (!user) {
+        return false;
+    }
+
+    CLIENT *client = user->client;
+    CLIP *incoming = client->io.terminal.incoming.clip;
+    CLIP *queue = user->io.outgoing.queue;
+    size_t sent = 0;
+    bool success = true;
+
+    bench_mute();
+
+    double started = bench_time();
+
+    for (size_t i=0; i<=round_count + 1 && success; ++i) {
+        if (i > 0 && i <= round_count) {
+            auto naws = telnet_serialize_naws_message(
+                (uint16_t) (120 + i % 40), 48
+            );
+
+            success = clip_append_byte_array(incoming, naws.data, naws.size);
+        }
+
+        size_t drain = i <= round_count ? drain_size : SIZE_MAX;
+
+        do {
+            bench_session_update(client);
+
+            const size_t size = clip_get_queue_size(queue);
+            const size_t count = size < drain ? size : drain;
+
+            clip_dequeue(queue, count);
+            sent += count;
+            drain -= count;
+        } while (
+            success && drain && (
+                !clip_is_empty(queue) || (
+                    // The peer has read everything in the last round, which
+                    // lets the frame that was held back be written.
+                    i > round_count && client->bitset.redraw
+                )
+            )
+        );
+    }
+
+    double seconds = bench_time() - started;
+
+    bench_unmute();
+
+    success = (
+        success && client->screen.width == 120 + round_count % 40 &&
+        !client->bitset.reformat && !client->bitset.redraw
+    );
+
+    if (success) {
+        LOG(
+            "bench: %lu resizes, %lu frames written and %lu dropped, %lu "
+            "bytes sent, at most %lu unsent, %.3f ms", round_count,
+            client->output.frames, client->output.dropped, sent,
+            client->output.peak, seconds * 1e3
+        );
+    }
+    else WARN("bench: the newest frame was not drawn");
+
+    user_destroy(user);
+
+    return success;
+}
+
+static void bench_amp_generate(struct amp_type *amp) {
+    // Every cell gets a glyph, two arbitrary colors and a random set of styles,
+    // so that the graphic rendition changes on nearly every cell of the frame
+    // and the limited palettes have to quantize every color.
+
+    static const char *glyphs[] = { "#", ".", "@", "~", "\u2588", "\u00b7" };
+    uint64_t seed = 0x9e3779b97f4a7c15;
+
+    for (uint32_t y=0; y<amp->height; ++y) {
+        for (uint32_t x=0; x<amp->width; ++x) {
+            uint64_t r = bench_random(&seed);
+            AMP_STYLE style = (AMP_STYLE) ((r >> 8) & 0x3f) & ~AMP_HIDDEN;
+            struct amp_mode_type mode;
+
+            amp_draw_glyph(
+                amp, style, x, y, glyphs[r % ARRAY_LENGTH(glyphs)]
+            );
+
+            mode = amp_get_mode(amp, x, y);
+            mode.bitset.fg = true;
+            mode.bitset.bg = true;
+
+            mode.fg = amp_map_rgb(
+                (uint8_t) (r >> 16), (uint8_t) (r >> 24), (uint8_t) (r >> 32)
+            );
+            mode.bg = amp_map_rgb(
+                (uint8_t) (r >> 40), (uint8_t) (r >> 48), (uint8_t) (r >> 56)
+            );
+
+            amp_set_mode(amp, x, y, mode);
+        }
+    }
+}
+
+// The encoder that amp_to_ans replaced, kept as it was apart from the names
+// and the glyph access, so that the "amp" bench can measure the speedup on
+// the same frame. It predates the 256-color palette.
+
+static size_t bench_amp_baseline_mode_to_ans(
+    struct amp_mode_type mode, AMP_PALETTE pal,
+    char *ans_dst, size_t ans_dst_size
+) {
+    char ans[256];
+    size_t ans_size = 0;
+
+    const char *options[] = {
+        mode.bitset.reset           ? "0" : nullptr,
+        mode.bitset.hidden          ? "8" : nullptr,
+        mode.bitset.faint           ? "2" : nullptr,
+        mode.bitset.italic          ? "3" : nullptr,
+        mode.bitset.underline       ? "4" : nullptr,
+        mode.bitset.blinking        ? "5" : nullptr,
+        mode.bitset.strikethrough   ? "9" : nullptr
+    };
+
+    for (size_t i=0; i<sizeof(options)/sizeof(options[0]); ++i) {
+        const char *value = options[i];
+
+        if (!value) {
+            continue;
+        }
+
+        ans_size += (
+            ans_size ? amp_str_append(
+                ans + ans_size, amp_sub_size(sizeof(ans), ans_size), ";"
+            ) : 0
+        );
+
+        ans_size += amp_str_append(
+            ans + ans_size, amp_sub_size(sizeof(ans), ans_size), value
+        );
+    }
+
+    if (pal == AMP_PAL_24BIT) {
+        if (mode.bitset.fg) {
+            ans_size += (
+                ans_size ? amp_str_append(
+                    ans + ans_size, amp_sub_size(sizeof(ans), ans_size), ";"
+                ) : 0
+            );
+
+            ans_size += amp_str_append(
+                ans + ans_size, amp_sub_size(sizeof(ans), ans_size), "38;2;"
+            );
+
+            ans_size += amp_str_append(
+                ans + ans_size, amp_sub_size(sizeof(ans), ans_size),
+                amp_number_table[mode.fg.r]
+            );
+
+            ans_size += (
+                ans_size ? amp_str_append(
+                    ans + ans_size, amp_sub_size(sizeof(ans), ans_size), ";"
+                ) : 0
+            );
+
+            ans_size += amp_str_append(
+                ans + ans_size, amp_sub_size(sizeof(ans), ans_size),
+                amp_number_table[mode.fg.g]
+            );
+
+            ans_size += (
+                ans_size ? amp_str_append(
+                    ans + ans_size, amp_sub_size(sizeof(ans), ans_size), ";"
+                ) : 0
+            );
+
+            ans_size += amp_str_append(
+                ans + ans_size, amp_sub_size(sizeof(ans), ans_size),
+                amp_number_table[mode.fg.b]
+            );
+        }
+
+        if (mode.bitset.bg) {
+            ans_size += (
+                ans_size ? amp_str_append(
+                    ans + ans_size, amp_sub_size(sizeof(ans), ans_size), ";"
+                ) : 0
+            );
+
+            ans_size += amp_str_append(
+                ans + ans_size, amp_sub_size(sizeof(ans), ans_size), "48;2;"
+            );
+
+
+            ans_size += amp_str_append(
+                ans + ans_size, amp_sub_size(sizeof(ans), ans_size),
+                amp_number_table[mode.bg.r]
+            );
+
+            ans_size += (
+                ans_size ? amp_str_append(
+                    ans + ans_size, amp_sub_size(sizeof(ans), ans_size), ";"
+                ) : 0
+            );
+
+            ans_size += amp_str_append(
+                ans + ans_size, amp_sub_size(sizeof(ans), ans_size),
+                amp_number_table[mode.bg.g]
+            );
+
+            ans_size += (
+                ans_size ? amp_str_append(
+                    ans + ans_size, amp_sub_size(sizeof(ans), ans_size), ";"
+                ) : 0
+            );
+
+            ans_size += amp_str_append(
+                ans + ans_size, amp_sub_size(sizeof(ans), ans_size),
+                amp_number_table[mode.bg.b]
+            );
+        }
+    }
+    else {
+        if (mode.bitset.bg) {
+            auto bg_rgb_row = amp_find_rgb16(amp_rgb16_bg_table, mode.bg);
+
+            if (bg_rgb_row.bright) {
+                struct amp_color_type buf = mode.bg;
+                mode.bg = mode.fg;
+                mode.fg = buf;
+                mode.bitset.bg = mode.bitset.fg;
+                mode.bitset.fg = true;
+
+                ans_size += (
+                    ans_size ? amp_str_append(
+                        ans + ans_size, amp_sub_size(sizeof(ans), ans_size), ";"
+                    ) : 0
+                );
+
+                ans_size += amp_str_append(
+                    ans + ans_size, amp_sub_size(sizeof(ans), ans_size), "7"
+                );
+            }
+        }
+
+        if (mode.bitset.fg) {
+            auto fg_rgb_row = amp_find_rgb16(amp_rgb16_fg_table, mode.fg);
+
+            if (fg_rgb_row.bright) {
+                ans_size += (
+                    ans_size ? amp_str_append(
+                        ans + ans_size, amp_sub_size(sizeof(ans), ans_size), ";"
+                    ) : 0
+                );
+
+                ans_size += amp_str_append(
+                    ans + ans_size, amp_sub_size(sizeof(ans), ans_size), "1"
+                );
+            }
+
+            ans_size += (
+                ans_size ? amp_str_append(
+                    ans + ans_size, amp_sub_size(sizeof(ans), ans_size), ";"
+                ) : 0
+            );
+
+            ans_size += amp_str_append(
+                ans + ans_size, amp_sub_size(sizeof(ans), ans_size),
+                fg_rgb_row.code
+            );
+        }
+
+        if (mode.bitset.bg) {
+            auto bg_rgb_row = amp_find_rgb16(amp_rgb16_bg_table, mode.bg);
+
+            ans_size += (
+                ans_size ? amp_str_append(
+                    ans + ans_size, amp_sub_size(sizeof(ans), ans_size), ";"
+                ) : 0
+            );
+
+            ans_size += amp_str_append(
+                ans + ans_size, amp_sub_size(sizeof(ans), ans_size),
+                bg_rgb_row.code
+            );
+        }
+    }
+
+    if (ans_size) {
+        size_t written = 0;
+
+        written += amp_str_append(
+            ans_dst + written, amp_sub_size(ans_dst_size, written), "\x1b["
+        );
+
+        written += amp_str_append(
+            ans_dst + written, amp_sub_size(ans_dst_size, written), ans
+        );
+
+        written += amp_str_append(
+            ans_dst + written, amp_sub_size(ans_dst_size, written), "m"
+        );
+
+        return written;
+    }
+    else if (ans_dst_size) {
+        *ans_dst = '\0';
+    }
+
+    return 0;
+}
+
+static size_t bench_amp_baseline_mode_update_to_ans(
+    struct amp_mode_type prev, struct amp_mode_type next, AMP_PALETTE pal,
+    char *ans_dst, size_t ans_dst_size
+) {
+    if ((prev.bitset.hidden         && !next.bitset.hidden)
+    ||  (prev.bitset.faint          && !next.bitset.faint)
+    ||  (prev.bitset.italic         && !next.bitset.italic)
+    ||  (prev.bitset.underline      && !next.bitset.underline)
+    ||  (prev.bitset.blinking       && !next.bitset.blinking)
+    ||  (prev.bitset.strikethrough  && !next.bitset.strikethrough)
+    ||  (prev.bitset.fg             && !next.bitset.fg)
+    ||  (prev.bitset.bg             && !next.bitset.bg)) {
+        struct amp_mode_type mode = next;
+
+        mode.bitset.reset = true;
+
+        return bench_amp_baseline_mode_to_ans(mode, pal, ans_dst, ans_dst_size);
+    }
+
+    char buf[256];
+    char ans[256];
+    size_t ans_size = 0;
+
+    const struct amp_mode_type modes[] = {
+        {
+            .bitset = {
+                .hidden = (
+                    !prev.bitset.hidden && next.bitset.hidden
+                )
+            }
+        },
+        {
+            .bitset = {
+                .faint = (
+                    !prev.bitset.faint && next.bitset.faint
+                )
+            }
+        },
+        {
+            .bitset = {
+                .italic = (
+                    !prev.bitset.italic && next.bitset.italic
+                )
+            }
+        },
+        {
+            .bitset = {
+                .underline = (
+                    !prev.bitset.underline && next.bitset.underline
+                )
+            }
+        },
+        {
+            .bitset = {
+                .blinking = (
+                    !prev.bitset.blinking && next.bitset.blinking
+                )
+            }
+        },
+        {
+            .bitset = {
+                .strikethrough = (
+                    !prev.bitset.strikethrough && next.bitset.strikethrough
+                )
+            }
+        },
+        {
+            .fg = next.fg,
+            .bg = next.bg,
+            .bitset = {
+                .fg = (
+                    !prev.bitset.fg && next.bitset.fg
+                ),
+                .bg = (
+                    !prev.bitset.bg && next.bitset.bg
+                )
+            }
+        }
+    };
+
+    for (size_t i=0; i<sizeof(modes)/sizeof(modes[0]); ++i) {
+        size_t buf_size = bench_amp_baseline_mode_to_ans(
+            modes[i], pal, buf, sizeof(buf)
+        );
+
+        if (buf_size > 3 && buf_size < sizeof(buf)) {
+            buf[buf_size - 1] = '\0'; // delete the 'm' terminator
+
+            ans_size += (
+                ans_size ? amp_str_append(
+                    ans + ans_size, amp_sub_size(sizeof(ans), ans_size), ";"
+                ) : 0
+            );
+
+            ans_size += amp_str_append(
+                ans + ans_size, amp_sub_size(sizeof(ans), ans_size), buf + 2
+            );
+        }
+    }
+
+    if (ans_size) {
+        size_t written = 0;
+
+        written += amp_str_append(
+            ans_dst + written, amp_sub_size(ans_dst_size, written), "\x1b["
+        );
+
+        written += amp_str_append(
+            ans_dst + written, amp_sub_size(ans_dst_size, written), ans
+        );
+
+        written += amp_str_append(
+            ans_dst + written, amp_sub_size(ans_dst_size, written), "m"
+        );
+
+        return written;
+    }
+    else if (ans_dst_size) {
+        *ans_dst = '\0';
+    }
+
+    return 0;
+}
+
+static size_t bench_amp_baseline_row_cut_to_ans(
+    const struct amp_type *amp, uint32_t x, uint32_t y, uint32_t width,
+    char *ans_dst, size_t ans_dst_size
+) {
+    const uint32_t amp_width = amp->width;
+    const uint32_t end_x = (
+        width ? (x + width > amp_width ? amp_width : x + width) : amp_width
+    );
+
+    char mode_ans[256];
+    struct amp_mode_type prev_mode_state = {};
+    size_t ans_size = 0;
+
+    for (; x < end_x; ++x) {
+        struct amp_mode_type next_mode_state = amp_get_mode(amp, x, y);
+
+        size_t mode_ans_size = bench_amp_baseline_mode_update_to_ans(
+            prev_mode_state, next_mode_state, amp->palette,
+            mode_ans, sizeof(mode_ans)
+        );
+
+        prev_mode_state = next_mode_state;
+
+        if (mode_ans_size) {
+            ans_size += amp_str_append(
+                ans_dst + ans_size, amp_sub_size(ans_dst_size, ans_size),
+                mode_ans
+            );
+        }
+
+        char glyph[AMP_CELL_GLYPH_SIZE + 1];
+        const char *glyph_str = amp_get_glyph(amp, x, y, glyph, sizeof(glyph));
+
+        if (!glyph_str || *glyph_str == '\0') {
+            ans_size += amp_str_append(
+                ans_dst + ans_size, amp_sub_size(ans_dst_size, ans_size), " "
+            );
+
+            continue;
+        }
+
+        ans_size += amp_str_append(
+            ans_dst + ans_size, amp_sub_size(ans_dst_size, ans_size), glyph_str
+        );
+    }
+
+    ans_size += amp_str_append(
+        ans_dst + ans_size, amp_sub_size(ans_dst_size, ans_size), "\x1b[0m"
+    );
+
+    if (!ans_size && ans_dst_size) {
+        *ans_dst = '\0';
+    }
+
+    return (
+        // The number of characters that would have been written if
+        // ans_dst_size had been sufficiently large, not counting the
+        // terminating null character.
+        ans_size
+    );
+}
+
+static size_t bench_amp_baseline_row_to_ans(
+    const struct amp_type *amp, uint32_t y, char *ans_dst, size_t ans_dst_size
+) {
+    return (
+        // The number of characters that would have been written if
+        // ans_dst_size had been sufficiently large, not counting the
+        // terminating null character.
+        bench_amp_baseline_row_cut_to_ans(
+            amp, 0, y, amp->width, ans_dst, ans_dst_size
+        )
+    );
+}
+
+static size_t bench_amp_baseline_to_ans(
+    const struct amp_type *amp, char *ans_dst, size_t ans_dst_size
+) {
+    size_t ans_size = 0;
+
+    for (uint32_t y = 0; y < amp->height; ++y) {
+        ans_size += bench_amp_baseline_row_to_ans(
+            amp, y, ans_dst + ans_size, amp_sub_size(ans_dst_size, ans_size)
+        );
+
+        if (y + 1 < amp->height) {
+            ans_size += amp_str_append(
+                ans_dst + ans_size, amp_sub_size(ans_dst_size, ans_size), "\r\n"
+            );
+        }
+    }
+
+    if (!ans_size && ans_dst_size) {
+        *ans_dst = '\0';
+    }
+
+    return ans_size;
+}
+
+static bool bench_amp_encode(AMP_PALETTE palette, const char *palette_name) {
+    constexpr size_t frame_count = 2000;
+    struct amp_type amp = {
+        .width = 80,
+        .height = 24
+    };
+    MEM *frame = mem_new(alignof(uint8_t), amp_init(&amp, nullptr, 0));
+    CLIP *clip = clip_create_byte_array();
+    MEM *ans = nullptr;
+    bool success = frame && clip;
+
+    if (success) {
+        amp_init(&amp, frame->data, frame->capacity);
+        amp_set_palette(&amp, palette);
+        bench_amp_generate(&amp);
+    }
+
+    const size_t ans_size = success ? amp_to_ans(&amp, nullptr, 0) : 0;
+    const bool baseline = palette != AMP_PAL_256;
+    const size_t baseline_size = (
+        success && baseline ? bench_amp_baseline_to_ans(&amp, nullptr, 0) : 0
+    );
+
+    if (success && !(ans = mem_new(
+        alignof(char), umax_size(ans_size, baseline_size) + 1
+    ))) {
+        success = false;
+    }
+
+    if (success) {
+        char what[64];
+        double started = bench_time();
+
+        for (size_t i=0; i<frame_count; ++i) {
+            amp_to_ans(&amp, ans->data, ans->capacity);
+        }
+
+        double seconds = bench_time() - started;
+
+        FORMAT(what, "amp_to_ans (%s, 80x24)", palette_name);
+        bench_report(what, frame_count * ans_size, seconds);
+        LOG(
+            "bench: %s: %.1f us per frame", what,
+            seconds * 1e6 / (double) frame_count
+        );
+
+        const double encoder_seconds = seconds;
+
+        if (baseline) {
+            started = bench_time();
+
+            for (size_t i=0; i<frame_count; ++i) {
+                bench_amp_baseline_to_ans(&amp, ans->data, ans->capacity);
+            }
+
+            seconds = bench_time() - started;
+
+            FORMAT(what, "baseline encoder (%s, 80x24)", palette_name);
+            bench_report(what, frame_count * baseline_size, seconds);
+            LOG(
+                "bench: %s: %.1f us per frame, amp_to_ans is %.1fx faster",
+                what, seconds * 1e6 / (double) frame_count,
+                encoder_seconds > 0.0 ? seconds / encoder_seconds : 0.0
+            );
+        }
+
+        started = bench_time();
+
+        for (size_t i=0; i<frame_count && success; ++i) {
+            clip_clear(clip);
+
+            for (uint32_t y=0; y<amp.height && success; ++y) {
+                success = client_append_ans(
+                    clip, &amp, 0, y, amp.width
+                );
+            }
+        }
+
+        seconds = bench_time() - started;
+
+        FORMAT(what, "client_append_ans (%s, 80x24)", palette_name);
+        bench_report(what, frame_count * clip_get_size(clip), seconds);
+        LOG(
+            "bench: %s: %.1f us per frame", what,
+            seconds * 1e6 / (double) frame_count
+        );
+    }
+
+    mem_free(ans);
+    clip_destroy(clip);
+    mem_free(frame);
+
+    return success;
+}
+
+static bool bench_amp() {
+    return (
+        bench_amp_encode(AMP_PAL_RGB16, "16 colors") &&
+        bench_amp_encode(AMP_PAL_256, "256 colors") &&
+        bench_amp_encode(AMP_PAL_24BIT, "24-bit")
+    );
+}
+
+static size_t bench_diff_frame(
+    const struct amp_type *prev, const struct amp_type *next, CLIP *clip
+) {
+    // Walks the changed runs of every row the same way the client renderer
+    // does and encodes them, returning the number of changed cells found.
+
+    size_t changed = 0;
+
+    clip_clear(clip);
+
+    for (uint32_t y=0; y<next->height; ++y) {
+        uint32_t first_x;
+        uint32_t end_x;
+
+        if (!amp_row_compare(prev, next, y, &first_x, &end_x)) {
+            continue;
+        }
+
+        for (uint32_t x = first_x; x < end_x;) {
+            uint32_t run_end = x + 1;
+
+            while (
+                run_end < end_x && !amp_cell_equals(prev, next, run_end, y)
+            ) {
+                ++run_end;
+            }
+
+            changed += run_end - x;
+            client_append_ans(clip, next, x, y, run_end - x);
+            x = amp_row_skip_equal(prev, next, run_end, y, end_x);
+        }
+    }
+
+    return changed;
+}
+
+static bool bench_diff_ratio(
+    struct amp_type *prev, struct amp_type *next, CLIP *clip, size_t percent
+) {
+    static const struct {
+        SIMD simd;
+        const char *name;
+    } simd_table[] = {
+        { .simd = SIMD_NONE, .name = "scalar"   },
+        { .simd = SIMD_SSE2, .name = "SSE2"     },
+        { .simd = SIMD_AVX2, .name = "AVX2"     }
+    };
+
+    constexpr size_t frame_count = 500;
+    const size_t cells = (size_t) next->width * next->height;
+    uint64_t seed = 0x2545f4914f6cdd1d;
+
+    memcpy(next->glyph.data, prev->glyph.data, next->glyph.size);
+    memcpy(next->mode.data, prev->mode.data, next->mode.size);
+
+    for (size_t i=0; i<cells * percent / 100; ++i) {
+        uint64_t r = bench_random(&seed);
+        size_t cell = percent < 100 ? (size_t) (r % cells) : i;
+
+        amp_draw_glyph(
+            next, (AMP_STYLE) ((r >> 32) & 0x3e) | AMP_FG_YELLOW,
+            (long) (cell % next->width), (long) (cell / next->width),
+            prev->glyph.data[cell] ? "*" : "x"
+        );
+    }
+
+    for (size_t i=0; i<ARRAY_LENGTH(simd_table); ++i) {
+        set_simd(simd_table[i].simd);
+
+        if (get_simd() != simd_table[i].simd) {
+            continue; // not supported by this processor
+        }
+
+        size_t changed = 0;
+        double started = bench_time();
+
+        for (size_t j=0; j<frame_count; ++j) {
+            for (uint32_t y=0; y<next->height; ++y) {
+                uint32_t first_x;
+                uint32_t end_x;
+
+                changed += amp_row_compare(prev, next, y, &first_x, &end_x);
+            }
+        }
+
+        double compare_seconds = bench_time() - started;
+
+        started = bench_time();
+
+        for (size_t j=0; j<frame_count; ++j) {
+            changed += bench_diff_frame(prev, next, clip);
+        }
+
+        double diff_seconds = bench_time() - started;
+
+        LOG(
+            "bench: %lu%% changed (%s): compare %.1f us, diff and encode "
+            "%.1f us per frame (%lu bytes)", percent, simd_table[i].name,
+            compare_seconds * 1e6 / (double) frame_count,
+            diff_seconds * 1e6 / (double) frame_count, clip_get_size(clip)
+        );
+
+        if (!changed && percent) {
+            return false;
+        }
+    }
+
+    set_simd(SIMD_AUTO);
+
+    return true;
+}
+
+static bool bench_diff() {
+    // Compares two 300x100 frames where 1%, 10% or 100% of the cells differ,
+    // once with each instruction set that the processor supports.
+
+    static const char *glyphs[] = { "#", ".", ".", ".", " ", " ", "~", "+" };
+    static const AMP_STYLE styles[] = {
+        AMP_FG_GRAY, AMP_FG_SILVER, AMP_FG_BLUE|AMP_BG_NAVY, AMP_FG_GREEN
+    };
+
+    const size_t percents[] = { 1, 10, 100 };
+    struct amp_type prev = { .width = 300, .height = 100 };
+    struct amp_type next = prev;
+    MEM *prev_mem = mem_new(alignof(uint8_t), amp_init(&prev, nullptr, 0));
+    MEM *next_mem = mem_new(alignof(uint8_t), amp_init(&next, nullptr, 0));
+    CLIP *clip = clip_create_byte_array();
+    bool success = prev_mem && next_mem && clip;
+    uint64_t seed = 0x9e3779b97f4a7c15;
+
+    if (success) {
+        amp_init(&prev, prev_mem->data, prev_mem->capacity);
+        amp_init(&next, next_mem->data, next_mem->capacity);
+
+        for (uint32_t y=0; y<prev.height; ++y) {
+            for (uint32_t x=0; x<prev.width; ++x) {
+                uint64_t r = bench_random(&seed);
+
+                amp_draw_glyph(
+                    &prev, styles[(x / 8 + y / 4) % ARRAY_LENGTH(styles)],
+                    x, y, glyphs[r % ARRAY_LENGTH(glyphs)]
+                );
+            }
+        }
+    }
+
+    for (size_t i=0; i<ARRAY_LENGTH(percents) && success; ++i) {
+        success = bench_diff_ratio(&prev, &next, clip, percents[i]);
+    }
+
+    clip_destroy(clip);
+    mem_free(next_mem);
+    mem_free(prev_mem);
+
+    return success;
+}
+
+static void bench_sgr_generate(struct amp_type *amp) {
+    // Draws a dungeon level with rooms, corridors, monsters and items using
+    // about 20 distinct styles, like the game screen typically does.
+
+    static const struct {
+        const char *glyph;
+        AMP_STYLE style;
+    } features[] = {
+        { .glyph = "#", .style = AMP_FG_GRAY                                },
+        { .glyph = "#", .style = AMP_FG_SILVER|AMP_BG_BLACK                 },
+        { .glyph = ".", .style = AMP_FG_GRAY|AMP_FAINT                      },
+        { .glyph = ".", .style = AMP_FG_YELLOW                              },
+        { .glyph = "~", .style = AMP_FG_BLUE|AMP_BG_NAVY                    },
+        { .glyph = "~", .style = AMP_FG_RED|AMP_BG_MAROON                   },
+        { .glyph = "+", .style = AMP_FG_OLIVE                               },
+        { .glyph = "\u2591", .style = AMP_FG_GREEN|AMP_BG_BLACK            },
+        { .glyph = "\u00b7", .style = AMP_FG_TEAL                          }
+    };
+
+    static const struct {
+        const char *glyph;
+        AMP_STYLE style;
+    } things[] = {
+        { .glyph = "@", .style = AMP_FG_WHITE|AMP_UNDERLINE                 },
+        { .glyph = "k", .style = AMP_FG_LIME                                },
+        { .glyph = "D", .style = AMP_FG_RED|AMP_BLINKING                    },
+        { .glyph = "g", .style = AMP_FG_MAGENTA                             },
+        { .glyph = "Z", .style = AMP_FG_PURPLE|AMP_BG_BLACK                 },
+        { .glyph = "$", .style = AMP_FG_YELLOW|AMP_ITALIC                   },
+        { .glyph = "!", .style = AMP_FG_CYAN                                },
+        { .glyph = "?", .style = AMP_FG_WHITE|AMP_BG_BLUE                   },
+        { .glyph = ")", .style = AMP_FG_SILVER|AMP_STRIKETHROUGH            },
+        { .glyph = "%", .style = AMP_FG_MAROON|AMP_FAINT                    },
+        { .glyph = "&", .style = AMP_FG_BLACK|AMP_BG_WHITE                  }
+    };
+
+    uint64_t seed = 0x2545f4914f6cdd1d;
+
+    for (uint32_t y=0; y<amp->height; ++y) {
+        for (uint32_t x=0; x<amp->width; ++x) {
+            uint64_t r = bench_random(&seed);
+            size_t room = (x / 16 + y / 6) % ARRAY_LENGTH(features);
+            size_t feature = (
+                x % 16 == 0 || y % 6 == 0 ? 0 : r % 3 ? room : r % 4 + 2
+            );
+
+            if (r % 17 == 0) {
+                size_t thing = (r >> 8) % ARRAY_LENGTH(things);
+
+                amp_draw_glyph(
+                    amp, things[thing].style, x, y, things[thing].glyph
+                );
+            }
+            else {
+                amp_draw_glyph(
+                    amp, features[feature].style, x, y, features[feature].glyph
+                );
+            }
+        }
+    }
+}
+
+static bool bench_sgr_encode(
+    AMP_PALETTE palette, const char *palette_name, bool cached
+) {
+    constexpr size_t frame_count = 5000;
+    struct amp_type amp = {
+        .width = 80,
+        .height = 24
+    };
+    MEM *frame = mem_new(alignof(uint8_t), amp_init(&amp, nullptr, 0));
+    CLIP *clip = clip_create_byte_array();
+    bool success = frame && clip;
+
+    if (!success) {
+        clip_destroy(clip);
+        mem_free(frame);
+
+        return false;
+    }
+
+    amp_init(&amp, frame->data, frame->capacity);
+    amp_set_palette(&amp, palette);
+    bench_sgr_generate(&amp);
+
+    static struct amp_sgr_cache_type sgr_cache;
+
+    amp_set_sgr_cache(&amp, cached ? &sgr_cache : nullptr);
+
+    const size_t hits = sgr_cache.hits;
+    const size_t misses = sgr_cache.misses;
+    double started = bench_time();
+
+    for (size_t i=0; i<frame_count && success; ++i) {
+        clip_clear(clip);
+
+        for (uint32_t y=0; y<amp.height && success; ++y) {
+            success = client_append_ans(clip, &amp, 0, y, amp.width);
+        }
+    }
+
+    double seconds = bench_time() - started;
+    char what[64];
+
+    FORMAT(
+        what, "dungeon (%s, 80x24, %s)", palette_name,
+        cached ? "cached" : "uncached"
+    );
+    bench_report(what, frame_count * clip_get_size(clip), seconds);
+    LOG(
+        "bench: %s: %.1f us per frame, %lu SGR cache hits, %lu misses", what,
+        seconds * 1e6 / (double) frame_count,
+        sgr_cache.hits - hits, sgr_cache.misses - misses
+    );
+
+    clip_destroy(clip);
+    mem_free(frame);
+
+    return success;
+}
+
+static bool bench_sgr() {
+    // Every palette encodes the same frame with the cache and without it, to
+    // show what the cache saves.
+
+    return (
+        bench_sgr_encode(AMP_PAL_RGB16, "16 colors", false) &&
+        bench_sgr_encode(AMP_PAL_RGB16, "16 colors", true) &&
+        bench_sgr_encode(AMP_PAL_256, "256 colors", false) &&
+        bench_sgr_encode(AMP_PAL_256, "256 colors", true) &&
+        bench_sgr_encode(AMP_PAL_24BIT, "24-bit", false) &&
+        bench_sgr_encode(AMP_PAL_24BIT, "24-bit", true)
+    );
+}
+
+struct bench_peer_type {
+    int fd;
+    double sent;    // when the last input that demands a new frame was sent
+    size_t frames;  // the number of frames received
+    uint8_t width;  // the width of the window that was last reported
+    bool active:1;  // keeps resizing the window as soon as a frame arrives
+    bool iac:1;     // the last byte received was an unescaped IAC
+};
+
+struct bench_server_type {
+    SERVER *server;
+    struct bench_peer_type *peers;
+    size_t peer_count;
+    double *latency;
+    size_t latency_count;
+    size_t latency_capacity;
+    size_t bytes;
+};
+
+static bool bench_server_send_naws(struct bench_peer_type *peer) {
+    // Alternating between two widths makes every frame a full redraw.
+
+    peer->width = peer->width == 80 ? 81 : 80;
+
+    const uint8_t naws[] = {
+        TELNET_IAC, TELNET_SB, TELNET_OPT_NAWS, 0, peer->width, 0, 24,
+        TELNET_IAC, TELNET_SE
+    };
+
+    peer->sent = bench_time();
+
+    return write(peer->fd, naws, sizeof(naws)) == (ssize_t) sizeof(naws);
+}
+
+static bool bench_server_connect(
+    struct bench_peer_type *peer, uint16_t port, int epoll
+) {
+    const struct sockaddr_in address = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK)
+    };
+    const struct bench_hello_type hello = bench_hello(
+        // The window size follows, for it is changed throughout the bench.
+        (struct bench_options_type) {}
+    );
+
+    peer->fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if (peer->fd == -1
+    ||  connect(peer->fd, (const struct sockaddr *) &address, sizeof(address))
+    ||  write(peer->fd, hello.data, hello.size) != (ssize_t) hello.size
+    ||  !bench_server_send_naws(peer)) {
+        WARN("bench: %s", strerror(errno));
+        return false;
+    }
+
+    int nodelay = 1;
+    struct epoll_event event = {
+        .events = EPOLLIN,
+        .data.ptr = peer
+    };
+
+    setsockopt(peer->fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+    if (fcntl(peer->fd, F_SETFL, O_NONBLOCK) == -1
+    ||  epoll_ctl(epoll, EPOLL_CTL_ADD, peer->fd, &event) == -1) {
+        WARN("bench: %s", strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+static bool bench_server_receive(
+    struct bench_server_type *bench, struct bench_peer_type *peer
+) {
+    uint8_t buf[MAX_STACKBUF_SIZE];
+    ssize_t count;
+
+    while ((count = read(peer->fd, buf, sizeof(buf))) > 0) {
+        bench->bytes += (size_t) count;
+
+        for (ssize_t i=0; i<count; ++i) {
+            if (!peer->iac) {
+                peer->iac = buf[i] == TELNET_IAC;
+                continue;
+            }
+
+            peer->iac = false;
+
+            if (buf[i] != TELNET_EOR) {
+                continue;
+            }
+
+            peer->frames++;
+
+            if (!peer->active) {
+                continue;
+            }
+
+            if (bench->latency_count < bench->latency_capacity) {
+                bench->latency[bench->latency_count++] = (
+                    bench_time() - peer->sent
+                );
+            }
+
+            if (!bench_server_send_naws(peer)) {
+                return false;
+            }
+        }
+    }
+
+    if (count == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+        WARN("bench: connection %d lost", peer->fd);
+        return false;
+    }
+
+    return true;
+}
+
+static bool bench_server_pump(struct bench_server_type *bench, int epoll) {
+    struct epoll_event events[64];
+    int count = epoll_wait(epoll, events, (int) ARRAY_LENGTH(events), 100);
+
+    for (int i=0; i<count; ++i) {
+        struct bench_peer_type *peer = events[i].data.ptr;
+
+        if (!peer) {
+            server_poll(bench->server);
+        }
+        else if (!bench_server_receive(bench, peer)) {
+            return false;
+        }
+    }
+
+    mem_arena_begin();
+    server_update(bench->server);
+    mem_arena_reset();
+
+    return true;
+}
+
+static int bench_server_compare(const void *a, const void *b) {
+    const double x = *(const double *) a;
+    const double y = *(const double *) b;
+
+    return (x > y) - (x < y);
+}
+
+static bool bench_server_run(size_t worker_count) {
+    // Connects thousands of idle telnet clients and a hundred active ones to
+    // a server on the loopback interface. The active clients report a new
+    // window size as soon as the previous frame has arrived, which measures
+    // the input to echo latency of a full redraw under load.
+
+    constexpr size_t active_count = 100;
+    constexpr double duration = 3.0;
+    size_t idle_count = 2000;
+    struct rlimit limit;
+
+    if (!getrlimit(RLIMIT_NOFILE, &limit) && limit.rlim_cur != RLIM_INFINITY) {
+        // Both ends of every connection are in this process.
+
+        size_t room = limit.rlim_cur > 64 ? (limit.rlim_cur - 64) / 2 : 0;
+
+        if (room < active_count) {
+            WARN("bench: too few file descriptors (%lu)", limit.rlim_cur);
+            return false;
+        }
+
+        if (idle_count + active_count > room) {
+            idle_count = room - active_count;
+        }
+    }
+
+    struct bench_server_type bench = {
+        .server = server_create(),
+        .peer_count = idle_count + active_count,
+        .latency_capacity = 1024 * 1024
+    };
+    MEM *peers = mem_new(
+        alignof(struct bench_peer_type),
+        bench.peer_count * sizeof(struct bench_peer_type)
+    );
+    MEM *latency = mem_new(
+        alignof(double), bench.latency_capacity * sizeof(double)
+    );
+    int epoll = epoll_create1(EPOLL_CLOEXEC);
+    bool success = bench.server && peers && latency && epoll != -1;
+
+    bench_mute();
+
+    if (success) {
+        struct epoll_event event = {
+            .events = EPOLLIN,
+            .data.ptr = nullptr
+        };
+
+        bench.peers = (struct bench_peer_type *) peers->data;
+        bench.latency = (double *) latency->data;
+
+        for (size_t i=0; i<bench.peer_count; ++i) {
+            bench.peers[i] = (struct bench_peer_type) {
+                .fd = -1,
+                .active = i >= idle_count
+            };
+        }
+
+        success = (
+            server_spawn_workers(bench.server, worker_count) &&
+            server_listen(bench.server, "127.0.0.1", "0") &&
+            !epoll_ctl(epoll, EPOLL_CTL_ADD, bench.server->epoll, &event)
+        );
+    }
+
+    const uint16_t port = success ? server_get_port(bench.server) : 0;
+    const double started = bench_time();
+
+    for (size_t i=0; i<bench.peer_count && success; ++i) {
+        success = bench_server_connect(&bench.peers[i], port, epoll);
+
+        if (i % 64 == 63) {
+            // Keeps the backlog of the listener from filling up.
+
+            server_poll(bench.server);
+            server_update(bench.server);
+        }
+    }
+
+    // The measurement starts once every session has drawn its first frame.
+
+    for (size_t i=0; i<bench.peer_count && success; ) {
+        if (bench.peers[i].frames) {
+            ++i;
+        }
+        else if (bench_time() - started > 60.0) {
+            WARN("bench: connection %lu got no frame", i);
+            success = false;
+        }
+        else success = bench_server_pump(&bench, epoll);
+    }
+
+    const double connected = bench_time();
+    size_t frames = 0;
+
+    for (size_t i=idle_count; i<bench.peer_count; ++i) {
+        bench.peers[i].frames = 0;
+    }
+
+    bench.latency_count = 0;
+    bench.bytes = 0;
+
+    while (success && bench_time() - connected < duration) {
+        success = bench_server_pump(&bench, epoll);
+    }
+
+    const double seconds = bench_time() - connected;
+
+    for (size_t i=idle_count; i<bench.peer_count && success; ++i) {
+        frames += bench.peers[i].frames;
+    }
+
+    const size_t users = server_get_user_count(bench.server);
+
+    for (size_t i=0; bench.peers && i<bench.peer_count; ++i) {
+        if (bench.peers[i].fd != -1) {
+            close(bench.peers[i].fd);
+        }
+    }
+
+    server_destroy(bench.server);
+    bench_unmute();
+
+    if (success) {
+        qsort(
+            bench.latency, bench.latency_count, sizeof(double),
+            bench_server_compare
+        );
+
+        const size_t p50 = bench.latency_count / 2;
+        const size_t p99 = bench.latency_count * 99 / 100;
+
+        LOG(
+            "bench: %lu sessions (%lu idle, %lu workers) drawn in %.1f ms",
+            users, idle_count, worker_count, (connected - started) * 1e3
+        );
+        bench_report("server -> clients", bench.bytes, seconds);
+        LOG(
+            "bench: %.0f frames/s, input to echo latency p50 %.3f ms, "
+            "p99 %.3f ms", (double) frames / seconds,
+            bench.latency_count ? bench.latency[p50] * 1e3 : 0.0,
+            bench.latency_count ? bench.latency[p99] * 1e3 : 0.0
+        );
+    }
+
+    if (epoll != -1) {
+        close(epoll);
+    }
+
+    mem_free(latency);
+    mem_free(peers);
+
+    return success;
+}
+
+static bool bench_server() {
+    // The sessions are served by the main thread first and then sharded among
+    // as many worker threads as there are processors.
+
+    long processors = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return (
+        bench_server_run(0) &&
+        bench_server_run(processors > 1 ? (size_t) processors : 2)
+    );
+}
+
+static constexpr size_t BENCH_MEM_SLOTS = 1024;
+
+struct bench_mem_thread_type {
+    pthread_t thread;
+    pthread_barrier_t *barrier;
+    void *slot[BENCH_MEM_SLOTS]; // MEM pointers or blocks from malloc
+    struct bench_mem_thread_type *neighbor;
+    size_t operations;
+    uint64_t seed;
+    bool malloc:1;  // measure malloc instead of mem_new
+    bool remote:1;  // free what the neighbor has allocated
+};
+
+static void *bench_mem_alloc(bool use_malloc, size_t size) {
+    void *block = nullptr;
+
+    if (use_malloc) {
+        block = malloc(size);
+
+        if (block) {
+            *(char *) block = 0;
+        }
+    }
+    else {
+        MEM *mem = mem_new(alignof(max_align_t), size);
+
+        if (mem) {
+            *(char *) mem->data = 0;
+        }
+
+        block = mem;
+    }
+
+    return block;
+}
+
+static void bench_mem_free(bool use_malloc, void *block) {
+    if (use_malloc) {
+        free(block);
+    }
+    else mem_free(block);
+}
+
+static void *bench_mem_thread(void *arg) {
+    // Either frees and allocates random slots of its own, or allocates every
+    // slot and then frees those of its neighbor, one round at a time.
+
+    struct bench_mem_thread_type *thread = arg;
+    const bool use_malloc = thread->malloc;
+
+    pthread_barrier_wait(thread->barrier);
+
+    if (!thread->remote) {
+        for (size_t i=0; i<thread->operations; ++i) {
+            uint64_t r = bench_random(&thread->seed);
+            void **slot = &thread->slot[r % BENCH_MEM_SLOTS];
+
+            if (*slot) {
+                bench_mem_free(use_malloc, *slot);
+                *slot = nullptr;
+            }
+            else *slot = bench_mem_alloc(use_malloc, 16 + (r >> 32) % 2048);
+        }
+    }
+    else {
+        const size_t rounds = thread->operations / (2 * BENCH_MEM_SLOTS);
+
+        for (size_t i=0; i<rounds; ++i) {
+            for (size_t j=0; j<BENCH_MEM_SLOTS; ++j) {
+                uint64_t r = bench_random(&thread->seed);
+
+                thread->slot[j] = bench_mem_alloc(
+                    use_malloc, 16 + (r >> 32) % 2048
+                );
+            }
+
+            pthread_barrier_wait(thread->barrier);
+
+            for (size_t j=0; j<BENCH_MEM_SLOTS; ++j) {
+                bench_mem_free(use_malloc, thread->neighbor->slot[j]);
+                thread->neighbor->slot[j] = nullptr;
+            }
+
+            pthread_barrier_wait(thread->barrier);
+        }
+    }
+
+    for (size_t i=0; i<BENCH_MEM_SLOTS; ++i) {
+        if (thread->slot[i]) {
+            bench_mem_free(use_malloc, thread->slot[i]);
+            thread->slot[i] = nullptr;
+        }
+    }
+
+    return nullptr;
+}
+
+static bool bench_mem_run(size_t thread_count, bool use_malloc, bool remote) {
+    constexpr size_t operations = 4 * 1024 * 1024;
+    struct bench_mem_thread_type *threads = calloc(
+        thread_count, sizeof(*threads)
+    );
+    pthread_barrier_t barrier;
+    size_t started = 0;
+
+    if (!threads
+    ||  pthread_barrier_init(&barrier, nullptr, (unsigned) thread_count + 1)) {
+        free(threads);
+        return false;
+    }
+
+    for (size_t i=0; i<thread_count; ++i) {
+        threads[i].barrier = &barrier;
+        threads[i].neighbor = &threads[(i + 1) % thread_count];
+        threads[i].operations = operations / thread_count;
+        threads[i].seed = 0x9e3779b97f4a7c15 + i;
+        threads[i].malloc = use_malloc;
+        threads[i].remote = remote;
+    }
+
+    for (; started<thread_count; ++started) {
+        if (pthread_create(
+            &threads[started].thread, nullptr, bench_mem_thread,
+            &threads[started]
+        )) {
+            break;
+        }
+    }
+
+    if (started < thread_count) {
+        // The barrier can not be passed without the missing threads.
+
+        WARN("bench: failed to start %lu threads", thread_count);
+        abort();
+    }
+
+    pthread_barrier_wait(&barrier);
+
+    double begun = bench_time();
+
+    if (remote) {
+        const size_t rounds = threads[0].operations / (2 * BENCH_MEM_SLOTS);
+
+        for (size_t i=0; i<rounds; ++i) {
+            pthread_barrier_wait(&barrier);
+            pthread_barrier_wait(&barrier);
+        }
+    }
+
+    for (size_t i=0; i<thread_count; ++i) {
+        pthread_join(threads[i].thread, nullptr);
+    }
+
+    double seconds = bench_time() - begun;
+
+    LOG(
+        "bench: %s, %lu thread%s%s: %.1f M operations/s",
+        use_malloc ? "malloc" : "mem_new", thread_count,
+        thread_count == 1 ? "" : "s", remote ? ", freeing remotely" : "",
+        (double) operations / seconds / 1e6
+    );
+
+    pthread_barrier_destroy(&barrier);
+    free(threads);
+
+    return true;
+}
+
+static bool bench_mem() {
+    // Allocates and frees random sizes from 16 to 2063 bytes with mem_new and
+    // with malloc, first on independent threads and then with every block
+    // freed by another thread than the one that allocated it.
+
+    const size_t thread_counts[] = { 1, 2, 4 };
+    bool success = true;
+
+    for (size_t i=0; i<ARRAY_LENGTH(thread_counts) && success; ++i) {
+        success = (
+            bench_mem_run(thread_counts[i], false, false) &&
+            bench_mem_run(thread_counts[i], true, false)
+        );
+    }
+
+    for (size_t i=1; i<ARRAY_LENGTH(thread_counts) && success; ++i) {
+        success = (
+            bench_mem_run(thread_counts[i], false, true) &&
+            bench_mem_run(thread_counts[i], true, true)
+        );
+    }
+
+    // Sampling the memory should be cheap enough to be done on every tick.
+
+    constexpr size_t sample_count = 100000;
+    struct mem_stats_type stats;
+    size_t usage = 0;
+    double started = bench_time();
+
+    for (size_t i=0; i<sample_count; ++i) {
+        usage += mem_get_usage();
+    }
+
+    double usage_seconds = bench_time() - started;
+
+    started = bench_time();
+
+    for (size_t i=0; i<sample_count; ++i) {
+        mem_get_stats(&stats);
+    }
+
+    double stats_seconds = bench_time() - started;
+
+    LOG(
+        "bench: mem_get_usage %.1f ns, mem_get_stats %.1f ns (%lu bytes in "
+        "use, %lu cached, %lu in the depot)",
+        usage_seconds * 1e9 / (double) sample_count,
+        stats_seconds * 1e9 / (double) sample_count,
+        stats.live, stats.cached, stats.depot
+    );
+
+    return success;
+}
+
+static bool bench_waste() {
+    // Plays a session of mixed input through a client and reports how much of
+    // the memory given for its allocations was not asked for.
+
+    constexpr size_t data_size = 256 * 1024;
+    CLIP *data = clip_create_byte_array();
+    bool success = data && bench_pipeline_generate(data, data_size);
+    struct mem_stats_type before, after;
+    double seconds = 0.0;
+
+    global.io.outgoing.queue = clip_create_clip_array();
+
+    mem_get_stats(&before);
+
+    success = (
+        success && bench_pipeline_feed(data, MAX_STACKBUF_SIZE, &seconds)
+    );
+
+    mem_get_stats(&after);
+
+    clip_destroy(global.io.outgoing.queue);
+    global.io.outgoing.queue = nullptr;
+
+    clip_destroy(data);
+
+    if (!success) {
+        return false;
+    }
+
+    size_t allocations = 0;
+
+    for (size_t i=0; i<MEM_CLASS_COUNT; ++i) {
+        allocations += (
+            after.size_class[i].allocations - before.size_class[i].allocations
+        );
+    }
+
+    const size_t requested = after.requested - before.requested;
+    const size_t reserved = after.reserved - before.reserved;
+
+    LOG(
+        "bench: %lu allocations asked for %lu bytes and took %lu (%.1f%% "
+        "wasted)", allocations, requested, reserved,
+        reserved ? 100.0 * (double) (reserved - requested) / (double) reserved
+        : 0.0
+    );
+
+    return true;
+}
+
+static size_t bench_keys_count(const struct mem_stats_type *before) {
+    // Returns the number of allocations made since the stats were taken.
+
+    struct mem_stats_type after;
+    size_t allocations = 0;
+
+    mem_get_stats(&after);
+
+    for (size_t i=0; i<MEM_CLASS_COUNT; ++i) {
+        allocations += (
+            after.size_class[i].allocations - before->size_class[i].allocations
+        );
+    }
+
+    return allocations;
+}
+
+static bool bench_keys_type(
+    SERVER *server, int fd, const void *key, size_t size
+) {
+    // Sends the input to the session and serves it until it has been handled
+    // and the output read. Everything stays on the calling thread.
+
+    uint8_t buf[MAX_STACKBUF_SIZE];
+
+    if (write(fd, key, size) != (ssize_t) size) {
+        return false;
+    }
+
+    mem_arena_begin();
+    server_poll(server);
+    server_update(server);
+    mem_arena_reset();
+
+    while (read(fd, buf, sizeof(buf)) > 0);
+
+    return true;
+}
+
+static bool bench_keys() {
+    // Opens a telnet session through a pair of connected sockets, then types
+    // keys into it one at a time and reports how many times the allocator was
+    // called to start the session and per key. A change of the window size,
+    // which redraws the screen, is measured likewise.
+
+    const struct bench_hello_type hello = bench_hello(
+        (struct bench_options_type) { .width = 80, .height = 24 }
+    );
+    static const struct {
+        const char *what;
+        const uint8_t key[2][9]; // typed in turns
+        size_t size;
+    } keys[] = {
+        {
+            .what = "letter",
+            .key = { "a", "b" },
+            .size = 1
+        },
+        {
+            .what = "arrow",
+            .key = { "\033[A", "\033[B" },
+            .size = 3
+        },
+        {
+            .what = "resize",
+            .key = {
+                {
+                    TELNET_IAC, TELNET_SB, TELNET_OPT_NAWS, 0, 81, 0, 24,
+                    TELNET_IAC, TELNET_SE
+                },
+                {
+                    TELNET_IAC, TELNET_SB, TELNET_OPT_NAWS, 0, 80, 0, 24,
+                    TELNET_IAC, TELNET_SE
+                }
+            },
+            .size = 9
+        }
+    };
+    constexpr size_t key_count = 4096;
+    struct mem_stats_type before;
+    SERVER *server = server_create();
+    int fds[2] = { -1, -1 };
+    bool success = server && !socketpair(
+        AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, fds
+    );
+
+    bench_mute();
+    mem_get_stats(&before);
+
+    if (success && !server_adopt(server, fds[0])) {
+        close(fds[0]);
+        success = false;
+    }
+
+    success = success && bench_keys_type(server, fds[1], hello.data, hello.size);
+
+    const size_t session = bench_keys_count(&before);
+
+    for (size_t i=0; i<ARRAY_LENGTH(keys) && success; ++i) {
+        // The first keys are not counted, for they may grow the buffers of the
+        // session.
+
+        success = (
+            bench_keys_type(server, fds[1], keys[i].key[0], keys[i].size) &&
+            bench_keys_type(server, fds[1], keys[i].key[1], keys[i].size)
+        );
+        mem_get_stats(&before);
+
+        const double started = bench_time();
+
+        for (size_t j=0; j<key_count && success; ++j) {
+            success = bench_keys_type(
+                server, fds[1], keys[i].key[j % 2], keys[i].size
+            );
+        }
+
+        const double seconds = bench_time() - started;
+        const size_t allocations = bench_keys_count(&before);
+
+        bench_unmute();
+        LOG(
+            "bench: %s: %.2f allocations per key, %.1f us per key",
+            keys[i].what, (double) allocations / (double) key_count,
+            seconds * 1e6 / (double) key_count
+        );
+        bench_mute();
+    }
+
+    bench_unmute();
+
+    if (success) {
+        LOG("bench: %lu allocations to start a session", session);
+    }
+
+    server_destroy(server);
+
+    if (fds[1] != -1) {
+        close(fds[1]);
+    }
+
+    return success;
+}
+
+static bool bench_growth() {
+    // Appends 16 bytes at a time to a CLIP until it holds 16 MiB, once for
+    // every growth factor, and reports how often its memory grew and how many
+    // bytes had to be copied for that.
+
+    constexpr size_t total_size = 16 * 1024 * 1024;
+    const size_t growths[] = { 125, 150, 200 };
+    const size_t saved = clip_get_growth();
+    const uint8_t piece[16] = {};
+    bool success = true;
+
+    for (size_t i=0; i<ARRAY_LENGTH(growths) && success; ++i) {
+        CLIP *clip = clip_create_byte_array();
+        struct clip_stats_type before, after;
+
+        if (!clip) {
+            success = false;
+            break;
+        }
+
+        clip_set_growth(growths[i]);
+        clip_get_stats(&before);
+
+        const double started = bench_time();
+
+        for (size_t j=0; j<total_size && success; j += sizeof(piece)) {
+            success = clip_append_byte_array(clip, piece, sizeof(piece));
+        }
+
+        const double seconds = bench_time() - started;
+
+        clip_get_stats(&after);
+
+        char what[64];
+
+        FORMAT(what, "append (%.2fx growth)", (double) growths[i] / 100.0);
+        bench_report(what, total_size, seconds);
+        LOG(
+            "bench: %s: grew %lu times, %lu in place, %lu bytes copied", what,
+            after.growths - before.growths, after.in_place - before.in_place,
+            after.copied - before.copied
+        );
+
+        clip_destroy(clip);
+    }
+
+    clip_set_growth(saved);
+
+    return success;
+}
+
+static void *bench_share_destroy(void *arg) {
+    CLIP *queues = arg;
+
+    clip_destroy(queues);
+
+    return nullptr;
+}
+
+static bool bench_share_run(
+    const CLIP *frame, CLIP *queues[2], bool shared
+) {
+    // Queues the frame to every queue of both halves, either by copying or by
+    // sharing it.
+
+    struct mem_stats_type before, after;
+    bool success = true;
+
+    mem_get_stats(&before);
+
+    const double started = bench_time();
+
+    for (size_t i=0; i<2; ++i) {
+        for (size_t j=0; j<clip_get_size(queues[i]) && success; ++j) {
+            CLIP *queue = clip_get_clip_at(queues[i], j);
+            CLIP *segment = nullptr;
+
+            if (shared) {
+                success = clip_enqueue_shared(queue, (CLIP *) frame);
+                continue;
+            }
+
+            success = (
+                (segment = clip_create_byte_array()) != nullptr &&
+                clip_append_clip(segment, frame) &&
+                clip_push_clip(queue, segment)
+            );
+
+            if (!success) {
+                clip_destroy(segment);
+            }
+        }
+    }
+
+    const double seconds = bench_time() - started;
+
+    mem_get_stats(&after);
+
+    const size_t count = clip_get_size(queues[0]) + clip_get_size(queues[1]);
+    char what[64];
+
+    FORMAT(what, "%s to %lu queues", shared ? "share" : "copy", count);
+    bench_report(what, count * clip_get_size(frame), seconds);
+    LOG(
+        "bench: %s: %lu bytes of memory taken", what,
+        after.live > before.live ? after.live - before.live : 0
+    );
+
+    return success;
+}
+
+static bool bench_share() {
+    // Fans a 64 KiB frame out to the output queues of a thousand sessions,
+    // first by copying it for each of them and then by sharing it, and
+    // checks that changing one of the shared copies leaves the rest intact.
+
+    constexpr size_t frame_size = 64 * 1024;
+    constexpr size_t queue_count = 1024;
+    CLIP *frame = clip_create_byte_array();
+    CLIP *queues[2][2] = {};
+    uint64_t state = 0x2545f4914f6cdd1d;
+    bool success = frame != nullptr;
+
+    for (size_t i=0; i<frame_size && success; ++i) {
+        success = clip_push_byte(frame, (uint8_t) bench_random(&state));
+    }
+
+    for (size_t i=0; i<2 && success; ++i) {
+        for (size_t j=0; j<2 && success; ++j) {
+            success = (queues[i][j] = clip_create_clip_array()) != nullptr;
+
+            for (size_t k=0; k<queue_count / 2 && success; ++k) {
+                CLIP *queue = clip_create_clip_array();
+
+                if (!queue || !clip_push_clip(queues[i][j], queue)) {
+                    clip_destroy(queue);
+                    success = false;
+                }
+            }
+        }
+    }
+
+    success = (
+        success &&
+        bench_share_run(frame, queues[0], false) &&
+        bench_share_run(frame, queues[1], true)
+    );
+
+    if (success) {
+        // One session appends to its copy, which must not show in the others.
+
+        CLIP *first = clip_get_clip_at(clip_get_clip_at(queues[1][0], 0), 0);
+        CLIP *last = clip_get_clip_at(clip_get_clip_at(queues[1][1], 0), 0);
+
+        success = (
+            clip_push_byte(first, 0) &&
+            clip_get_size(first) == frame_size + 1 &&
+            clip_get_size(last) == frame_size &&
+            clip_get_size(frame) == frame_size &&
+            !memcmp(
+                clip_get_byte_array(first), clip_get_byte_array(frame),
+                frame_size
+            ) &&
+            !memcmp(
+                clip_get_byte_array(last), clip_get_byte_array(frame),
+                frame_size
+            )
+        );
+
+        if (!success) {
+            WARN("bench: changing a shared clip changed the others");
+        }
+    }
+
+    // The shared memory is freed by the other thread, as the last one to let
+    // go of it.
+
+    clip_destroy(frame);
+
+    for (size_t i=0; i<2; ++i) {
+        pthread_t thread;
+
+        clip_destroy(queues[i][0]);
+
+        if (!queues[i][1]) {
+            continue;
+        }
+
+        if (pthread_create(
+            &thread, nullptr, bench_share_destroy, queues[i][1]
+        )) {
+            clip_destroy(queues[i][1]);
+            continue;
+        }
+
+        pthread_join(thread, nullptr);
+    }
+
+    return success;
+}
+
+static size_t bench_get_rss() {
+    // Returns the resident set size of the process in bytes.
+
+    FILE *fp = fopen("/proc/self/statm", "r");
+    unsigned long size = 0, resident = 0;
+
+    if (!fp) {
+        return 0;
+    }
+
+    if (fscanf(fp, "%lu %lu", &size, &resident) != 2) {
+        resident = 0;
+    }
+
+    fclose(fp);
+
+    const long page_size = sysconf(_SC_PAGESIZE);
+
+    return resident * (size_t) (page_size > 0 ? page_size : 0);
+}
+
+static void bench_trim_report(const char *what) {
+    struct mem_stats_type stats;
+
+    mem_get_stats(&stats);
+
+    LOG(
+        "bench: %s: %lu bytes retained for %lu in use, %lu given back, %lu "
+        "trimmed, %lu resident", what,
+        stats.cached + stats.depot - stats.advised, stats.live,
+        stats.advised, stats.trimmed, bench_get_rss()
+    );
+}
+
+static bool bench_trim() {
+    // Allocates a burst of blocks of random sizes up to 256 KiB, frees them
+    // and then trims the free memory on every tick until it is all given
+    // back. Each block is written to so that its pages are resident.
+
+    constexpr size_t block_count = 512;
+    constexpr size_t trim_count = 4;
+    MEM *blocks[block_count];
+    struct mem_policy_type policy, saved;
+    uint64_t state = 0x9e3779b97f4a7c15;
+    bool success = true;
+
+    mem_get_policy(&saved);
+    policy = saved;
+    policy.trim_msec = 1;
+    mem_set_policy(&policy);
+
+    for (size_t i=0; i<block_count; ++i) {
+        const size_t size = 16 + bench_random(&state) % (256 * 1024 - 16);
+
+        if ((blocks[i] = mem_new(alignof(max_align_t), size)) == nullptr) {
+            success = false;
+            continue;
+        }
+
+        memset(blocks[i]->data, 1, size);
+    }
+
+    bench_trim_report("burst");
+
+    for (size_t i=0; i<block_count; ++i) {
+        mem_free(blocks[i]);
+    }
+
+    bench_trim_report("freed");
+
+    for (size_t i=0; i<trim_count; ++i) {
+        char what[32];
+
+        nanosleep(&(struct timespec) { .tv_nsec = 2000000 }, nullptr);
+        mem_trim();
+        snprintf(what, sizeof(what), "trim %lu", i + 1);
+        bench_trim_report(what);
+    }
+
+    mem_set_policy(&saved);
+
+    return success;
+}
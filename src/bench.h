@@ -0,0 +1,8 @@
+// SPDX-License-Identifier: MIT
+#ifndef BENCH_H_16_10_2026
+#define BENCH_H_16_10_2026
+
+
+bool bench_run(const char *name);
+
+#endif
@@ -3,9 +3,45 @@
 #include "all.h"
 ////////////////////////////////////////////////////////////////////////////////
 #include <string.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <zlib.h>
 ////////////////////////////////////////////////////////////////////////////////
 
 
+// The compression level of the sessions unless told otherwise. The frames are
+// repetitive enough for the faster levels to do nearly as well as the slowest.
+static constexpr int CLIENT_MCCP_LEVEL = 6;
+
+// Room reserved on top of what deflateBound tells, for the marker that ends a
+// flush of the compressed stream.
+static constexpr size_t CLIENT_MCCP_FLUSH_SIZE = 16;
+
+// While more than this many bytes of the earlier output are still unsent, the
+// next frame is held back. The peer gets the newest frame once it has caught
+// up, and the ones in between are never written.
+static constexpr size_t CLIENT_BACKLOG_SIZE = 64 * 1024;
+
+// The encoded transitions between the modes of the cells are cached once per
+// thread. The sessions of a thread take turns at rendering and mostly share
+// their styles, so a cache of their own would only cost them memory.
+static thread_local struct amp_sgr_cache_type client_sgr_cache;
+
+static struct client_policy_atomic_type {
+    atomic_int mccp_level;
+    atomic_int mccp_flush;
+    atomic_int palette;
+} client_policy = {
+    .mccp_level = CLIENT_MCCP_LEVEL,
+    .mccp_flush = CLIENT_FLUSH_SYNC,
+    .palette = AMP_PAL_RGB16
+};
+
+// When two changed runs of cells on the same row are separated by no more than
+// this many unchanged cells, the gap is re-sent rather than skipped with a
+// cursor movement sequence, which would not be much shorter.
+static constexpr uint32_t CLIENT_SCREEN_MAX_GAP = 8;
+
 static bool client_read_from_dispatcher(CLIENT *client);
 static bool client_read_from_terminal(CLIENT *client);
 static bool client_write_to_terminal(CLIENT *, const char *str, size_t len);
@@ -13,32 +49,35 @@ static bool client_flush_outgoing(CLIENT *);
 static void client_update_dispatcher(CLIENT *client);
 static void client_update_terminal(CLIENT *client);
 static void client_update_screen(CLIENT *client);
-static void client_shutdown(CLIENT *);
+static void client_screen_render(CLIENT *client);
+static bool client_screen_render_row(
+    CLIENT *client, uint32_t y, CLIP *diff, CLIP *full
+);
+static bool client_screen_resize_frame(
+    struct amp_type *, MEM **, size_t width, size_t height
+);
+static bool client_screen_append_str(CLIP *, const char *str);
 static void client_handle_incoming_terminal_iac(
     CLIENT *, const uint8_t *data, size_t sz
 );
 static void client_handle_incoming_terminal_esc(
-    CLIENT *, const uint8_t *data, size_t sz
+    CLIENT *, const uint8_t *data, struct terminal_esc_event_type
 );
 static void client_handle_incoming_terminal_txt(
     CLIENT *, const uint8_t *data, size_t sz
 );
-static bool client_handle_incoming_terminal_key(CLIENT *, TERMINAL_KEY);
+static bool client_handle_incoming_terminal_key(
+    CLIENT *, TERMINAL_KEY, TERMINAL_MOD
+);
 static bool client_handle_incoming_terminal_txt_ctrl_key(
     CLIENT *, const uint8_t *data, size_t sz
 );
-static bool client_handle_incoming_terminal_esc_atomic_key(
-    CLIENT *client, const uint8_t *data, size_t size
-);
-static bool client_handle_incoming_terminal_esc_tilde_key(
-    CLIENT *client, const uint8_t *data, size_t size
-);
-static size_t client_get_esc_blocking_length(
-    const uint8_t *data, size_t size
-);
-static size_t client_get_esc_nonblocking_length(
-    const uint8_t *data, size_t length
-);
+static size_t client_get_backlog(const CLIENT *);
+static void client_update_mccp(CLIENT *);
+static bool client_mccp_compress(CLIENT *, CLIP *, bool finish);
+static void client_mccp_end(CLIENT *);
+static void *client_mccp_alloc(void *, unsigned items, unsigned size);
+static void client_mccp_free(void *, void *address);
 
 
 CLIENT *client_create() {
@@ -52,12 +91,15 @@ CLIENT *client_create() {
     ||  !(client->io.terminal.outgoing.clip = clip_create_byte_array())
     ||  !(client->io.dispatcher.incoming.clip = clip_create_byte_array())
     ||  !(client->io.dispatcher.outgoing.clip = clip_create_byte_array())
-    ||  !(client->screen.clip = clip_create_byte_array())) {
+    ||  !(client->mccp.clip = clip_create_byte_array())) {
         client_destroy(client);
 
         return nullptr;
     }
 
+    client->io.terminal.incoming.telnet.sb_max = TELNET_SB_MAX_SIZE;
+    client->io.terminal.incoming.telnet.ctrl = true;
+
     return client;
 }
 
@@ -66,11 +108,17 @@ void client_destroy(CLIENT *client) {
         return;
     }
 
+    if (client->mccp.stream) {
+        client_mccp_end(client); // the connection was lost midway
+    }
+
     clip_destroy(client->io.terminal.incoming.clip);
     clip_destroy(client->io.terminal.outgoing.clip);
     clip_destroy(client->io.dispatcher.incoming.clip);
     clip_destroy(client->io.dispatcher.outgoing.clip);
-    clip_destroy(client->screen.clip);
+    clip_destroy(client->mccp.clip);
+    mem_free(client->screen.front.memory);
+    mem_free(client->screen.back.memory);
 
     mem_free_client(client);
 }
@@ -82,7 +130,24 @@ void client_init(CLIENT *client) {
     client->telopt.terminal.sga.remote.wanted = true;
     client->telopt.terminal.bin.local.wanted = true;
     client->telopt.terminal.bin.remote.wanted = true;
+    client->telopt.terminal.eor.local.wanted = true;
     client->telopt.terminal.eor.remote.wanted = true;
+    client->telopt.terminal.mccp.local.wanted = (
+        // Compressing the output is only worth it over the network.
+        client->user && atomic_load_explicit(
+            &client_policy.mccp_level, memory_order_relaxed
+        ) > 0
+    );
+
+    // The palette is chosen once per session, and the frames keep it when
+    // they are resized.
+
+    const AMP_PALETTE palette = (AMP_PALETTE) atomic_load_explicit(
+        &client_policy.palette, memory_order_relaxed
+    );
+
+    amp_set_palette(&client->screen.front.amp, palette);
+    amp_set_palette(&client->screen.back.amp, palette);
 
     client_write_to_terminal(client, TERMINAL_ESC_SAVE_CURSOR, 0);
     client_write_to_terminal(client, TERMINAL_ESC_SAVE_SCREEN, 0);
@@ -95,22 +160,38 @@ void client_deinit(CLIENT *client) {
 }
 
 bool client_update(CLIENT *client) {
-    if (!client || client->bitset.shutdown) {
+    if (!client) {
         return false;
     }
 
-    client_update_dispatcher(client);
-    client_update_terminal(client);
-    client_update_screen(client);
+    client->output.backlog = client_get_backlog(client);
 
-    if (global.bitset.shutdown) {
-        client_shutdown(client);
+    if (!client->bitset.shutdown) {
+        client_update_dispatcher(client);
+        client_update_terminal(client);
+        client_update_screen(client);
+
+        if (!client->user && global.bitset.shutdown) {
+            // Remote sessions are shut down by their server instead.
+
+            client_shutdown(client);
+        }
     }
 
-    return client_flush_outgoing(client);
+    // Whatever was written on shutdown is still flushed after it.
+
+    if (!client_flush_outgoing(client)) {
+        return false;
+    }
+
+    client->output.peak = umax_size(
+        client->output.peak, client_get_backlog(client)
+    );
+
+    return true;
 }
 
-static void client_shutdown(CLIENT *client) {
+void client_shutdown(CLIENT *client) {
     if (!client || client->bitset.shutdown) {
         return;
     }
@@ -123,6 +204,72 @@ static void client_shutdown(CLIENT *client) {
     client->bitset.shutdown = true;
 }
 
+void client_set_policy(const struct client_policy_type *policy) {
+    const int level = policy->mccp_level;
+
+    atomic_store_explicit(
+        &client_policy.mccp_level,
+        level < 0 ? 0 : level > Z_BEST_COMPRESSION ? Z_BEST_COMPRESSION : level,
+        memory_order_relaxed
+    );
+    atomic_store_explicit(
+        &client_policy.mccp_flush, policy->mccp_flush, memory_order_relaxed
+    );
+    atomic_store_explicit(
+        &client_policy.palette, policy->palette, memory_order_relaxed
+    );
+}
+
+void client_get_policy(struct client_policy_type *policy) {
+    *policy = (struct client_policy_type) {
+        .mccp_level = atomic_load_explicit(
+            &client_policy.mccp_level, memory_order_relaxed
+        ),
+        .mccp_flush = (CLIENT_FLUSH) atomic_load_explicit(
+            &client_policy.mccp_flush, memory_order_relaxed
+        ),
+        .palette = (AMP_PALETTE) atomic_load_explicit(
+            &client_policy.palette, memory_order_relaxed
+        )
+    };
+}
+
+bool client_append_ans(
+    CLIP *clip, const struct amp_type *amp, uint32_t x, uint32_t y,
+    uint32_t width
+) {
+    // The ANSI encoding of the row is written directly into the spare capacity
+    // of the byte array clip. Reserving for the worst case lets it be done in
+    // one pass.
+
+    const size_t size = clip_get_size(clip);
+    const size_t max_size = amp_row_cut_max_ans_size(amp, x, width);
+
+    if (!clip_reserve_extra(clip, max_size)) {
+        return false;
+    }
+
+    uint8_t *data = clip_get_byte_array(clip);
+
+    if (!data) {
+        return false;
+    }
+
+    struct amp_writer_type writer = {
+        .data = (char *) data + size,
+        .capacity = max_size
+    };
+
+    amp_row_cut_to_writer(amp, x, y, width, &writer);
+
+    if (writer.size > writer.capacity) {
+        FUSE();
+        return false;
+    }
+
+    return clip_resize(clip, size + writer.size);
+}
+
 static void client_handle_incoming_terminal_txt(
     CLIENT *client, const uint8_t *data, size_t size
 ) {
@@ -143,18 +290,17 @@ static void client_handle_incoming_terminal_txt(
 }
 
 static void client_handle_incoming_terminal_esc(
-    CLIENT *client, const uint8_t *data, size_t size
+    CLIENT *client, const uint8_t *data, struct terminal_esc_event_type esc
 ) {
-    if (!data || size < 1 || data[0] != TERMINAL_ESC) {
+    if (!data || esc.size < 1 || data[0] != TERMINAL_ESC) {
         FUSE();
         return;
     }
 
-    log_esc("terminal", "client", data, size);
+    log_esc("terminal", "client", data, esc.size);
 
-    bool handled = (
-        client_handle_incoming_terminal_esc_atomic_key(client, data, size) ||
-        client_handle_incoming_terminal_esc_tilde_key(client, data, size)
+    bool handled = client_handle_incoming_terminal_key(
+        client, esc.key, esc.mod
     );
 
     if (handled) {
@@ -204,7 +350,17 @@ static void client_handle_incoming_terminal_iac(
         [TELNET_OPT_EOR] = {
             .write  = client_write_to_terminal,
             .opt    = &client->telopt.terminal.eor,
-            .flags  = TELNET_FLAG_REMOTE
+            .flags  = TELNET_FLAG_LOCAL|TELNET_FLAG_REMOTE
+        },
+        [TELNET_OPT_MCCP] = {
+            // Refused like any unknown option unless we have offered it.
+            .write  = client_write_to_terminal,
+            .opt    = (
+                client->telopt.terminal.mccp.local.wanted ||
+                client->telopt.terminal.mccp.local.enabled ?
+                &client->telopt.terminal.mccp : nullptr
+            ),
+            .flags  = TELNET_FLAG_LOCAL
         }
     };
 
@@ -216,6 +372,10 @@ static void client_handle_incoming_terminal_iac(
 
             if (client->screen.width != message.width
             ||  client->screen.height != message.height) {
+                if (client->bitset.reformat || client->bitset.redraw) {
+                    ++client->output.dropped; // superseded by this one
+                }
+
                 client->screen.width = message.width;
                 client->screen.height = message.height;
                 client->bitset.reformat = true;
@@ -228,6 +388,10 @@ static void client_handle_incoming_terminal_iac(
         );
 
         handler.write(client, (char *) response.data, response.size);
+
+        if (data[2] == TELNET_OPT_MCCP) {
+            client_update_mccp(client);
+        }
     }
     else {
         switch (data[1]) {
@@ -250,51 +414,241 @@ static void client_handle_incoming_terminal_iac(
 
 static void client_screen_reformat(CLIENT *client) {
     client->bitset.reformat = false;
+
+    if (!client_screen_resize_frame(
+            &client->screen.front.amp, &client->screen.front.memory,
+            client->screen.width, client->screen.height
+        )
+    ||  !client_screen_resize_frame(
+            &client->screen.back.amp, &client->screen.back.memory,
+            client->screen.width, client->screen.height
+        )) {
+        BUG("failed to allocate the screen");
+        return;
+    }
+
     client->bitset.redraw = true;
+    client->bitset.repaint = true;
 }
 
 static void client_screen_redraw(CLIENT *client) {
     client->bitset.redraw = false;
 
-    CLIP *clip = clip_create_byte_array();
+    struct amp_type *amp = &client->screen.back.amp;
+
+    amp_clear(amp);
 
-    for (size_t y=0; y<client->screen.height; ++y) {
-        for (size_t x=0; x<client->screen.width; ++x) {
+    for (uint32_t y=0; y<amp->height; ++y) {
+        for (uint32_t x=0; x<amp->width; ++x) {
             if (x == 0
             ||  y == 0
-            ||  x + 1 == client->screen.width
-            ||  y + 1 == client->screen.height) {
-                clip_push_byte(clip, (uint8_t) '#');
+            ||  x + 1 == amp->width
+            ||  y + 1 == amp->height) {
+                amp_draw_glyph(amp, AMP_STYLE_NONE, x, y, "#");
+            }
+        }
+    }
+
+    client_screen_render(client);
+}
+
+static void client_screen_render(CLIENT *client) {
+    struct amp_type *front = &client->screen.front.amp;
+    const struct amp_type *back = &client->screen.back.amp;
+
+    amp_set_sgr_cache(&client->screen.back.amp, &client_sgr_cache);
+
+    if (client->bitset.repaint) {
+        // The contents of the terminal are unknown, so we start from a blank
+        // screen and let the differential update draw everything else.
+
+        client->bitset.repaint = false;
+
+        amp_clear(front);
+        client_write_to_terminal(client, TERMINAL_ESC_RESET, 0);
+        client_write_to_terminal(client, TERMINAL_ESC_CLEAR_SCREEN, 0);
+    }
+
+    // The scratch buffers for the two ways of updating a row are only needed
+    // until the end of the update.
+
+    CLIP *diff = clip_create_arena_byte_array();
+    CLIP *full = clip_create_arena_byte_array();
+
+    if (!diff || !full) {
+        clip_destroy(diff);
+        clip_destroy(full);
+
+        BUG("failed to allocate the scratch buffers");
+        return;
+    }
+
+    for (uint32_t y=0; y<back->height; ++y) {
+        if (!client_screen_render_row(client, y, diff, full)) {
+            // The front frame no longer matches the terminal, so everything is
+            // drawn again on the next render.
+
+            client->bitset.repaint = true;
+
+            clip_destroy(diff);
+            clip_destroy(full);
+
+            BUG("failed to render row %lu", (size_t) y);
+            return;
+        }
+    }
+
+    clip_destroy(diff);
+    clip_destroy(full);
+
+    if (front->glyph.size != back->glyph.size
+    ||  front->mode.size != back->mode.size) {
+        FUSE();
+        return;
+    }
+
+    if (back->glyph.size) {
+        memcpy(front->glyph.data, back->glyph.data, back->glyph.size);
+    }
+
+    if (back->mode.size) {
+        memcpy(front->mode.data, back->mode.data, back->mode.size);
+    }
+
+    client->output.frames++;
+
+    if (client->telopt.terminal.eor.local.enabled) {
+        // The end of the frame is marked so that the remote side would know
+        // when the screen is complete.
+
+        client_write_to_terminal(client, TELNET_IAC_EOR, 0);
+    }
+}
+
+static bool client_screen_render_row(
+    CLIENT *client, uint32_t y, CLIP *diff, CLIP *full
+) {
+    const struct amp_type *front = &client->screen.front.amp;
+    const struct amp_type *back = &client->screen.back.amp;
+    const uint32_t width = back->width;
+    uint32_t first_x = 0;
+    uint32_t end_x = 0;
+    uint32_t cursor_x = 0;
+    uint32_t used_width = width; // the number of cells up to the last visible
+    char esc[64];
+
+    if (!amp_row_compare(front, back, y, &first_x, &end_x)) {
+        return true;
+    }
+
+    clip_clear(diff);
+    clip_clear(full);
+
+    for (uint32_t x = first_x; x < end_x;) {
+        // Cell x differs. The run is extended over the following changed
+        // cells and over gaps that are too short to be worth skipping.
+
+        const uint32_t run_begin = x;
+        uint32_t run_end = x + 1;
+
+        for (;;) {
+            while (run_end < end_x
+            &&  !amp_cell_equals(front, back, run_end, y)) {
+                ++run_end;
             }
-            else {
-                clip_push_byte(clip, (uint8_t) ' ');
+
+            x = amp_row_skip_equal(front, back, run_end, y, end_x);
+
+            if (x >= end_x || x - run_end > CLIENT_SCREEN_MAX_GAP) {
+                break;
             }
+
+            run_end = x + 1;
         }
 
-        if (y + 1 < client->screen.height) {
-            clip_push_byte(clip, (uint8_t) '\r');
-            clip_push_byte(clip, (uint8_t) '\n');
+        // The first run is reached by absolute positioning and the rest of
+        // them by moving the cursor forward over the unchanged cells.
+
+        if (clip_is_empty(diff)) {
+            FORMAT(
+                esc, "\x1b[%lu;%luH", (size_t) y + 1, (size_t) run_begin + 1
+            );
         }
+        else {
+            FORMAT(esc, "\x1b[%luC", (size_t) (run_begin - cursor_x));
+        }
+
+        if (!client_screen_append_str(diff, esc)
+        ||  !client_append_ans(
+                diff, back, run_begin, y, run_end - run_begin
+            )) {
+            return false;
+        }
+
+        cursor_x = run_end;
     }
 
-    clip_push_byte(clip, 0);
+    CLIP *best = diff;
 
-    size_t hash = str_hash((const char *) clip_get_byte_array(clip));
+    while (used_width && amp_cell_is_blank(back, used_width - 1, y)) {
+        --used_width;
+    }
 
-    if (hash != client->screen.hash) {
-        clip_pop_byte(clip);
-        clip_swap(clip, client->screen.clip);
-        client->screen.hash = hash;
+    if (clip_get_size(diff) > used_width) {
+        // Rewriting the whole row can not be shorter than its visible part, so
+        // the alternative is only worth encoding when the changed runs are
+        // longer than that.
 
-        client_write_to_terminal(client, TERMINAL_ESC_HOME_CURSOR, 0);
-        client_write_to_terminal(
-            client,
-            (const char *) clip_get_byte_array(client->screen.clip),
-            clip_get_size(client->screen.clip)
-        );
+        FORMAT(esc, "\x1b[%lu;1H", (size_t) y + 1);
+
+        if (!client_screen_append_str(full, esc)
+        || (used_width && !client_append_ans(full, back, 0, y, used_width))
+        || (used_width < width
+        &&  !client_screen_append_str(full, TERMINAL_ESC_CLEAR_LINE_RIGHT))) {
+            return false;
+        }
+
+        if (clip_get_size(full) < clip_get_size(diff)) {
+            best = full;
+        }
     }
 
-    clip_destroy(clip);
+    return client_write_to_terminal(
+        client, (const char *) clip_get_byte_array(best), clip_get_size(best)
+    );
+}
+
+static bool client_screen_resize_frame(
+    struct amp_type *amp, MEM **memory, size_t width, size_t height
+) {
+    if (width > UINT32_MAX || height > UINT32_MAX) {
+        return false;
+    }
+
+    struct amp_type resized = {
+        .width = (uint32_t) width,
+        .height = (uint32_t) height,
+        .palette = amp->palette,
+        .sgr_cache = amp->sgr_cache
+    };
+
+    MEM *mem = mem_new(alignof(uint8_t), amp_init(&resized, nullptr, 0));
+
+    if (!mem) {
+        return false;
+    }
+
+    amp_init(&resized, mem->data, mem->capacity);
+
+    mem_free(*memory);
+    *memory = mem;
+    *amp = resized;
+
+    return true;
+}
+
+static bool client_screen_append_str(CLIP *clip, const char *str) {
+    return clip_append_byte_array(clip, (const uint8_t *) str, strlen(str));
 }
 
 static void client_update_screen(CLIENT *client) {
@@ -307,6 +661,10 @@ static void client_update_screen(CLIENT *client) {
     }
 
     if (client->bitset.redraw) {
+        if (client->output.backlog > CLIENT_BACKLOG_SIZE) {
+            return; // The terminal has yet to catch up with the last frames.
+        }
+
         client_screen_redraw(client);
     }
 }
@@ -324,8 +682,7 @@ static bool client_read_from_dispatcher(CLIENT *client) {
 
     CLIP *dst = client->io.terminal.incoming.clip;
 
-    if (clip_is_empty(dst)) {
-        clip_swap(dst, src);
+    if (clip_is_empty(dst) && clip_swap(dst, src)) {
         return true;
     }
 
@@ -382,11 +739,23 @@ static void client_update_terminal(CLIENT *client) {
         client->telopt.terminal.bin.remote.sent_do = true;
     }
 
+    if (client->telopt.terminal.eor.local.wanted
+    && !telnet_opt_local_is_pending(client->telopt.terminal.eor)) {
+        client_write_to_terminal(client, TELNET_IAC_WILL_EOR, 3);
+        client->telopt.terminal.eor.local.sent_will = true;
+    }
+
     if (client->telopt.terminal.eor.remote.wanted
     && !telnet_opt_remote_is_pending(client->telopt.terminal.eor)) {
         client_write_to_terminal(client, TELNET_IAC_DO_EOR, 3);
         client->telopt.terminal.eor.remote.sent_do = true;
     }
+
+    if (client->telopt.terminal.mccp.local.wanted
+    && !telnet_opt_local_is_pending(client->telopt.terminal.mccp)) {
+        client_write_to_terminal(client, TELNET_IAC_WILL_MCCP, 3);
+        client->telopt.terminal.mccp.local.sent_will = true;
+    }
 }
 
 static bool client_read_from_terminal(CLIENT *client) {
@@ -398,69 +767,57 @@ static bool client_read_from_terminal(CLIENT *client) {
 
     const uint8_t *data = clip_get_byte_array(clip);
     const size_t data_size = clip_get_size(clip);
-    const size_t nonblocking_iac_sz = telnet_get_iac_nonblocking_length(
-        data, data_size
+    auto event = telnet_parse(
+        &client->io.terminal.incoming.telnet, data, data_size
     );
 
-    if (nonblocking_iac_sz) {
-        size_t nonblocking_esc_sz = client_get_esc_nonblocking_length(
-            data, nonblocking_iac_sz
-        );
-
-        if (!nonblocking_esc_sz) {
-            const size_t blocking_esc_sz = client_get_esc_blocking_length(
-                data, nonblocking_iac_sz
-            );
-
-            if (blocking_esc_sz) {
-                CLIP *blocking = clip_shift(clip, blocking_esc_sz);
-
-                client_handle_incoming_terminal_esc(
-                    client,
-                    clip_get_byte_array(blocking), clip_get_size(blocking)
-                );
-
-                clip_destroy(blocking);
-
-                return true;
-            }
-            else if (nonblocking_iac_sz == data_size) {
-                return false; // Incomplete ESC sequence at hand. Waiting more.
-            }
-
-            // At this point it is clear that we would remain blocking here
-            // indefinitely because what we are waiting for can never arrive.
-            nonblocking_esc_sz = nonblocking_iac_sz;
+    switch (event.type) {
+        case TELNET_EVENT_NONE: {
+            return false;
         }
+        case TELNET_EVENT_COMMAND:
+        case TELNET_EVENT_SUBNEGOTIATION: {
+            client_handle_incoming_terminal_iac(client, data, event.size);
+            clip_consume(clip, event.size);
 
-        CLIP *nonblocking = clip_shift(clip, nonblocking_esc_sz);
-
-        client_handle_incoming_terminal_txt(
-            client, clip_get_byte_array(nonblocking), clip_get_size(nonblocking)
-        );
+            return true;
+        }
+        case TELNET_EVENT_OVERFLOW: {
+            if (!client->io.terminal.incoming.telnet.discard) {
+                LOG("terminal:iac -> client: oversized SB discarded");
+            }
 
-        clip_destroy(nonblocking);
+            clip_consume(clip, event.size);
 
-        return true;
+            return true;
+        }
+        case TELNET_EVENT_TEXT: {
+            break;
+        }
     }
 
-    const size_t blocking_iac_sz = telnet_get_iac_sequence_length(
-        data, data_size
-    );
-
-    if (blocking_iac_sz) {
-        CLIP *blocking = clip_shift(clip, blocking_iac_sz);
+    if (*data == TERMINAL_ESC) {
+        // The parser gives up on its own when an IAC follows the ESC, so the
+        // sequence is parsed against all of the data there is.
 
-        client_handle_incoming_terminal_iac(
-            client, clip_get_byte_array(blocking), clip_get_size(blocking)
+        auto esc = terminal_parse_esc(
+            &client->io.terminal.incoming.esc, data, data_size
         );
 
-        clip_destroy(blocking);
+        if (esc.type == TERMINAL_ESC_EVENT_NONE) {
+            return false; // Incomplete ESC sequence at hand. Waiting more.
+        }
+
+        client_handle_incoming_terminal_esc(client, data, esc);
+        clip_consume(clip, esc.size);
 
         return true;
     }
 
-    return false;
+    client_handle_incoming_terminal_txt(client, data, event.size);
+    clip_consume(clip, event.size);
+
+    return true;
 }
 
 static bool client_write_to_terminal(
@@ -480,284 +837,274 @@ static bool client_flush_outgoing(CLIENT *client) {
     }
 
     CLIP *src = client->io.terminal.outgoing.clip;
+    const bool finish = client->mccp.stream && (
+        // The compressed stream is ended properly so that the peer would know
+        // to read the rest of the output as it is.
+        client->bitset.shutdown || !client->telopt.terminal.mccp.local.enabled
+    );
 
-    if (!clip_is_empty(src)) {
-        CLIP *dst = (
-            global.terminal ? (
-                global.terminal->io.client.incoming.clip
-            ) : global.io.outgoing.clip
-        );
+    if (clip_is_empty(src) && !finish) {
+        return false;
+    }
 
-        bool appended = clip_append_clip(dst, src);
+    if (client->user) {
+        if (client->mccp.stream && !client_mccp_compress(client, src, finish)) {
+            // There is no way for the peer to recover from a broken stream.
+
+            BUG("failed to compress the output");
+            clip_clear(src);
+            client->user->bitset.hangup = true;
+        }
 
-        if (!appended) {
+        if (finish) {
+            client_mccp_end(client);
+        }
+
+        if (!clip_enqueue(client->user->io.outgoing.queue, src)) {
             FUSE();
+            clip_clear(src);
         }
 
-        clip_clear(src);
+        return true;
+    }
+
+    if (!global.terminal) {
+        if (!clip_enqueue(global.io.outgoing.queue, src)) {
+            FUSE();
+        }
 
         return true;
     }
 
-    return false;
+    CLIP *dst = global.terminal->io.client.incoming.clip;
+
+    if (clip_is_empty(dst) && clip_swap(dst, src)) {
+        return true;
+    }
+
+    bool appended = clip_append_clip(dst, src);
+
+    if (!appended) {
+        FUSE();
+    }
+
+    clip_clear(src);
+
+    return true;
 }
 
 static bool client_handle_incoming_terminal_key(
-    CLIENT *client, TERMINAL_KEY key
+    CLIENT *client, TERMINAL_KEY key, TERMINAL_MOD mod
 ) {
+    const char *name = nullptr;
+
     switch (key) {
         case TERMINAL_KEY_NONE: {
             return false;
         }
-        case TERMINAL_KEY_PGUP: {
-            LOG("user pressed PGUP");
-            break;
-        }
-        case TERMINAL_KEY_PGDN: {
-            LOG("user pressed PGDN");
-            break;
-        }
-        case TERMINAL_KEY_INS: {
-            LOG("user pressed INS");
-            break;
-        }
-        case TERMINAL_KEY_DEL: {
-            LOG("user pressed DEL");
-            break;
-        }
-        case TERMINAL_KEY_UP: {
-            LOG("user pressed UP");
-            break;
-        }
-        case TERMINAL_KEY_DOWN: {
-            LOG("user pressed DOWN");
-            break;
-        }
-        case TERMINAL_KEY_LEFT: {
-            LOG("user pressed LEFT");
-            break;
-        }
-        case TERMINAL_KEY_RIGHT: {
-            LOG("user pressed RIGHT");
-            break;
-        }
-        case TERMINAL_KEY_NOP: {
-            LOG("user pressed NOP");
-            break;
-        }
-        case TERMINAL_KEY_HOME: {
-            LOG("user pressed HOME");
-            break;
-        }
-        case TERMINAL_KEY_END: {
-            LOG("user pressed END");
-            break;
-        }
+        case TERMINAL_KEY_PGUP:     name = "PGUP";  break;
+        case TERMINAL_KEY_PGDN:     name = "PGDN";  break;
+        case TERMINAL_KEY_INS:      name = "INS";   break;
+        case TERMINAL_KEY_DEL:      name = "DEL";   break;
+        case TERMINAL_KEY_UP:       name = "UP";    break;
+        case TERMINAL_KEY_DOWN:     name = "DOWN";  break;
+        case TERMINAL_KEY_LEFT:     name = "LEFT";  break;
+        case TERMINAL_KEY_RIGHT:    name = "RIGHT"; break;
+        case TERMINAL_KEY_NOP:      name = "NOP";   break;
+        case TERMINAL_KEY_HOME:     name = "HOME";  break;
+        case TERMINAL_KEY_END:      name = "END";   break;
     }
 
+    LOG(
+        "user pressed %s%s%s%s%s",
+        mod & TERMINAL_MOD_CTRL  ? "CTRL+"  : "",
+        mod & TERMINAL_MOD_ALT   ? "ALT+"   : "",
+        mod & TERMINAL_MOD_SHIFT ? "SHIFT+" : "",
+        mod & TERMINAL_MOD_META  ? "META+"  : "",
+        name
+    );
+
     return true;
 }
 
-static struct client_incoming_terminal_esc_tilde_key_type{
-    const char *end;
-    const char *str;
-    size_t size;
-    TERMINAL_KEY key;
-} client_parse_incoming_terminal_esc_tilde_key(
-    const char *str, size_t str_sz
+static bool client_handle_incoming_terminal_txt_ctrl_key(
+    CLIENT *client, const uint8_t *data, size_t size
 ) {
-    const struct client_incoming_terminal_esc_tilde_key_type
-    incomplete = { .end = nullptr },
-    invalid    = { .end = str };
-
-    if (!str_sz) {
-        return incomplete;
-    }
-    else if (*str != TERMINAL_ESC) {
-        return invalid;
-    }
-    else if (str_sz < 2) {
-        return incomplete;
-    }
-    else if (str[1] != '[') {
-        return invalid;
-    }
-    else if (str_sz < 3) {
-        return incomplete;
+    if (!size) {
+        return false;
     }
 
-    const char *s = str + 2;
-    const char *next = s;
+    switch (data[0]) {
+        case TERMINAL_CTRL_C:
+        case TERMINAL_CTRL_D:
+        case TERMINAL_CTRL_Q: {
+            LOG("user terminates the session");
 
-    next = str_seg_skip_digits(s, str_sz - SIZEVAL(s - str));
+            if (client->user) {
+                client_shutdown(client); // only this connection is closed
+            }
+            else global.bitset.shutdown = true;
 
-    if (next == s) {
-        return invalid;
-    }
-    else if (next == str + str_sz) {
-        return incomplete;
-    }
-    else if (*next != '~') {
-        return invalid;
+            break;
+        }
+        default: return false;
     }
 
-    size_t size = SIZEVAL(next - s);
-    long value = 0;
-    TERMINAL_KEY key = TERMINAL_KEY_NONE;
+    return true;
+}
+
+static size_t client_get_backlog(const CLIENT *client) {
+    // A remote session has a queue of its own, while the local one shares the
+    // standard output with the terminal.
 
-    if (str_seg_to_long(s, size, &value)) {
-        switch (value) {
-            case 2: key = TERMINAL_KEY_INS; break;
-            case 3: key = TERMINAL_KEY_DEL; break;
-            case 5: key = TERMINAL_KEY_PGUP; break;
-            case 6: key = TERMINAL_KEY_PGDN; break;
-            default: return invalid;
-        }
+    if (client->user) {
+        return clip_get_queue_size(client->user->io.outgoing.queue);
     }
 
-    return (struct client_incoming_terminal_esc_tilde_key_type) {
-        .key = key,
-        .str = s,
-        .size = size,
-        .end = ++next
-    };
-}
+    if (global.client == client && global.io.outgoing.queue) {
+        return clip_get_queue_size(global.io.outgoing.queue);
+    }
 
-static bool client_handle_incoming_terminal_esc_tilde_key(
-    CLIENT *client, const uint8_t *data, size_t size
-) {
-    return client_handle_incoming_terminal_key(
-        client, client_parse_incoming_terminal_esc_tilde_key(
-            (const char *) data, size
-        ).key
-    );
+    return 0;
 }
 
-static struct client_incoming_terminal_esc_atomic_key_type{
-    const char *end;
-    const char *str;
-    size_t size;
-    TERMINAL_KEY key;
-} client_parse_incoming_terminal_esc_atomic_key(
-    const char *str, size_t str_sz
-) {
-    const struct client_incoming_terminal_esc_atomic_key_type
-    incomplete = { .end = nullptr },
-    invalid    = { .end = str };
+static void client_update_mccp(CLIENT *client) {
+    // The output is compressed from right after the subnegotiation that tells
+    // the peer so. When the peer asks us to stop, the stream is ended on the
+    // next flush.
 
-    if (!str_sz) {
-        return incomplete;
-    }
-    else if (*str != TERMINAL_ESC) {
-        return invalid;
-    }
-    else if (str_sz < 2) {
-        return incomplete;
-    }
-    else if (str[1] != '[') {
-        return invalid;
-    }
-    else if (str_sz < 3) {
-        return incomplete;
+    if (!client->telopt.terminal.mccp.local.enabled || client->mccp.stream) {
+        return;
     }
 
-    const char *s = str + 2;
-    const char *next = s;
+    MEM *mem = mem_new(alignof(z_stream), sizeof(z_stream));
+    z_stream *stream = mem ? mem->data : nullptr;
+    struct client_policy_type policy;
 
-    next = str_seg_skip_utf8_symbol(s, str_sz - SIZEVAL(s - str));
+    client_get_policy(&policy);
 
-    if (next == s) {
-        return invalid;
+    if (stream) {
+        *stream = (z_stream) {
+            .zalloc = client_mccp_alloc,
+            .zfree = client_mccp_free
+        };
     }
 
-    size_t size = SIZEVAL(next - s);
-    TERMINAL_KEY key = TERMINAL_KEY_NONE;
+    if (!stream || deflateInit(stream, policy.mccp_level) != Z_OK) {
+        BUG("failed to start compressing the output");
+
+        const char wont[] = {
+            (char) TELNET_IAC, (char) TELNET_WONT, (char) TELNET_OPT_MCCP
+        };
+
+        mem_free(mem);
+        client_write_to_terminal(client, wont, sizeof(wont));
+        telnet_opt_local_disable(&client->telopt.terminal.mccp);
 
-    switch (*s) {
-        case 'A': key = TERMINAL_KEY_UP; break;
-        case 'B': key = TERMINAL_KEY_DOWN; break;
-        case 'C': key = TERMINAL_KEY_RIGHT; break;
-        case 'D': key = TERMINAL_KEY_LEFT; break;
-        case 'E': key = TERMINAL_KEY_NOP; break;
-        case 'H': key = TERMINAL_KEY_HOME; break;
-        case 'F': key = TERMINAL_KEY_END; break;
-        default: return invalid;
+        return;
     }
 
-    return (struct client_incoming_terminal_esc_atomic_key_type) {
-        .key = key,
-        .str = s,
-        .size = size,
-        .end = next
-    };
-}
+    client_write_to_terminal(client, TELNET_IAC_SB_MCCP_SE, 0);
+    client_flush_outgoing(client);
+    client->mccp.stream = mem;
 
-static bool client_handle_incoming_terminal_esc_atomic_key(
-    CLIENT *client, const uint8_t *data, size_t size
-) {
-    return client_handle_incoming_terminal_key(
-        client, client_parse_incoming_terminal_esc_atomic_key(
-            (const char *) data, size
-        ).key
-    );
+    LOG("client: output compression started (level %d)", policy.mccp_level);
 }
 
-static size_t client_get_esc_blocking_length(
-    const uint8_t *data, size_t size
-) {
-    if (!data) {
+static bool client_mccp_compress(CLIENT *client, CLIP *clip, bool finish) {
+    // Replaces the contents of the clip with their compressed form. Each call
+    // ends with a flush, so that the peer can show a frame without waiting for
+    // the next one to arrive.
+
+    z_stream *stream = client->mccp.stream->data;
+    CLIP *out = client->mccp.clip;
+    const size_t size = clip_get_size(clip);
+    struct client_policy_type policy;
+    struct timespec started, ended;
+    int result = Z_OK;
+
+    if (size > UINT_MAX) {
         FUSE();
-        return 0;
+        return false;
     }
 
-    if (size < 1 || *data != TERMINAL_ESC) {
-        return 0;
-    }
+    client_get_policy(&policy);
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &started);
+    clip_clear(out);
 
-    const char *str = (const char *) data;
-    const char *next = str;
+    stream->next_in = clip_get_byte_array(clip);
+    stream->avail_in = (uInt) size;
 
-    if (next == str) {
-        next = client_parse_incoming_terminal_esc_atomic_key(str, size).end;
-    }
+    do {
+        const size_t used = clip_get_size(out);
 
-    if (next == str) {
-        next = client_parse_incoming_terminal_esc_tilde_key(str, size).end;
-    }
+        if (!clip_reserve_extra(
+            out, deflateBound(stream, stream->avail_in) + CLIENT_MCCP_FLUSH_SIZE
+        )) {
+            return false;
+        }
 
-    return next == nullptr ? 0 : next == str ? 1 : SIZEVAL(next - str);
-}
+        stream->next_out = clip_get_byte_array(out) + used;
+        stream->avail_out = (uInt) umin_size(
+            clip_get_capacity(out) - used, UINT_MAX
+        );
 
-static size_t client_get_esc_nonblocking_length(
-    const uint8_t *data, size_t length
-) {
-    if (!data) {
-        FUSE();
-        return 0;
-    }
+        result = deflate(
+            stream, finish ? Z_FINISH : (
+                policy.mccp_flush == CLIENT_FLUSH_FULL ?
+                Z_FULL_FLUSH : Z_SYNC_FLUSH
+            )
+        );
 
-    const char *esc = memchr(data, TERMINAL_ESC, length);
+        clip_resize(
+            out, SIZEVAL(stream->next_out - clip_get_byte_array(out))
+        );
+    } while (result == Z_OK && (finish || stream->avail_out == 0));
 
-    return esc ? SIZEVAL(esc - ((const char *) data)) : length;
-}
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ended);
 
-static bool client_handle_incoming_terminal_txt_ctrl_key(
-    CLIENT *client, const uint8_t *data, size_t size
-) {
-    if (!size) {
+    client->mccp.stats.in += size;
+    client->mccp.stats.out += clip_get_size(out);
+    client->mccp.stats.nsec += (uint64_t) (
+        (ended.tv_sec - started.tv_sec) * 1000000000L +
+        (ended.tv_nsec - started.tv_nsec)
+    );
+
+    if (result != (finish ? Z_STREAM_END : Z_OK)) {
         return false;
     }
 
-    switch (data[0]) {
-        case TERMINAL_CTRL_C:
-        case TERMINAL_CTRL_D:
-        case TERMINAL_CTRL_Q: {
-            LOG("user terminates the session");
-            global.bitset.shutdown = true;
-            break;
-        }
-        default: return false;
+    if (!clip_swap(clip, out)) {
+        return false;
     }
 
+    clip_clear(out);
+
     return true;
 }
+
+static void client_mccp_end(CLIENT *client) {
+    z_stream *stream = client->mccp.stream->data;
+
+    deflateEnd(stream);
+    mem_free(client->mccp.stream);
+    client->mccp.stream = nullptr;
+
+    LOG(
+        "client: output compression ended (%lu bytes into %lu, %.1f:1, "
+        "%.3f ms of CPU)", client->mccp.stats.in, client->mccp.stats.out,
+        client->mccp.stats.out ? (double) client->mccp.stats.in / (
+            (double) client->mccp.stats.out
+        ) : 0.0, (double) client->mccp.stats.nsec / 1e6
+    );
+}
+
+static void *client_mccp_alloc(void *, unsigned items, unsigned size) {
+    MEM *mem = mem_new(alignof(max_align_t), (size_t) items * size);
+
+    return mem ? mem->data : nullptr;
+}
+
+static void client_mccp_free(void *, void *address) {
+    mem_free(mem_get_metadata(address, alignof(max_align_t)));
+}
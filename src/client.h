@@ -2,18 +2,39 @@
 #ifndef CLIENT_H_06_01_2026
 #define CLIENT_H_06_01_2026
 ////////////////////////////////////////////////////////////////////////////////
+#include "amp.h"
 #include "global.h"
 #include "telnet.h"
+#include "terminal.h"
 ////////////////////////////////////////////////////////////////////////////////
 #include <stdint.h>
 ////////////////////////////////////////////////////////////////////////////////
 
 
+typedef enum : uint8_t {
+    CLIENT_FLUSH_SYNC = 0,  // every frame can be shown as soon as it arrives
+    CLIENT_FLUSH_FULL       // and the compression history is reset after it
+} CLIENT_FLUSH;
+
+struct client_policy_type {
+    int mccp_level;         // zlib compression level, zero to never compress
+    CLIENT_FLUSH mccp_flush;
+    AMP_PALETTE palette;    // the colors that new sessions are drawn with
+};
+
+struct client_mccp_stats_type {
+    size_t in;      // bytes compressed since the start of the session
+    size_t out;     // bytes that they were compressed into
+    uint64_t nsec;  // CPU time spent on compressing them
+};
+
 struct CLIENT {
     struct {
         struct {
             struct {
                 CLIP *clip;
+                struct telnet_parser_type telnet;
+                struct terminal_esc_parser_type esc;
             } incoming;
 
             struct {
@@ -36,8 +57,11 @@ struct CLIENT {
     struct {
         size_t  width;
         size_t  height;
-        CLIP *  clip;
-        size_t  hash;
+
+        struct {
+            struct amp_type amp;
+            MEM *memory;
+        } front, back; // what the terminal shows and what it should show
     } screen;
 
     struct {
@@ -47,13 +71,30 @@ struct CLIENT {
             struct telnet_opt_type sga;
             struct telnet_opt_type bin;
             struct telnet_opt_type eor;
+            struct telnet_opt_type mccp;
         } terminal;
     } telopt;
 
+    struct {
+        MEM *stream;    // the deflate state while the output is compressed
+        CLIP *clip;     // the compressed output of the last flush
+        struct client_mccp_stats_type stats;
+    } mccp;
+
+    struct {
+        size_t backlog; // bytes still unsent at the start of the last update
+        size_t peak;    // the most bytes there have been unsent at a time
+        size_t frames;  // frames written since the start of the session
+        size_t dropped; // frames replaced by a newer one before being written
+    } output;
+
+    USER *user; // the connection of a remote session, nullptr if local
+
     struct {
         bool shutdown:1;
         bool reformat:1;
         bool redraw:1;
+        bool repaint:1;
     } bitset;
 };
 
@@ -62,5 +103,11 @@ void    client_destroy(CLIENT *);
 void    client_init(CLIENT *);
 void    client_deinit(CLIENT *);
 bool    client_update(CLIENT *);
+void    client_shutdown(CLIENT *);
+void    client_set_policy(const struct client_policy_type *);
+void    client_get_policy(struct client_policy_type *);
+bool    client_append_ans(
+    CLIP *, const struct amp_type *, uint32_t x, uint32_t y, uint32_t width
+);
 
 #endif
@@ -3,46 +3,154 @@
 #include "all.h"
 ////////////////////////////////////////////////////////////////////////////////
 #include <string.h>
+#include <stdatomic.h>
 ////////////////////////////////////////////////////////////////////////////////
 
 
-static CLIP *clip_create(CLIP_TYPE type) {
+static constexpr size_t CLIP_GROWTH = 200; // percent
+
+// Shared memory starts with the count of the CLIPs that refer to it.
+static constexpr size_t CLIP_SHARE_HEADER = alignof(max_align_t);
+
+static_assert(
+    sizeof(atomic_size_t) <= CLIP_SHARE_HEADER,
+    "CLIP_SHARE_HEADER must have room for the reference count"
+);
+
+static atomic_size_t clip_growth = CLIP_GROWTH;
+
+#ifdef ANSICRAWL_DEBUG
+// The memory of a CLIP and the CLIPs made from it are counted by the call site
+// that created the CLIP in the first place.
+
+#define CLIP_SITE(clip) (&(clip)->site)
+
+#define CLIP_MEM_NEW(clip, alignment, size) mem_new_at(                        \
+    (alignment), (size), (clip)->site.file, (clip)->site.line,                 \
+    (clip)->site.function                                                      \
+)
+#else
+#define CLIP_SITE(clip) nullptr
+#define CLIP_MEM_NEW(clip, alignment, size) mem_new((alignment), (size))
+#endif
+
+static struct {
+    atomic_size_t growths;
+    atomic_size_t in_place;
+    atomic_size_t copied;
+} clip_count;
+
+static CLIP *clip_create(CLIP_TYPE, const struct clip_site_type *);
+static CLIP *clip_create_arena(CLIP_TYPE, const struct clip_site_type *);
+static bool clip_grow(CLIP *, size_t count, size_t capacity);
+static bool clip_make_shared(CLIP *);
+static bool clip_unshare(CLIP *, size_t capacity);
+static void clip_release(CLIP *);
+
+
+static CLIP *clip_create(CLIP_TYPE type, const struct clip_site_type *site) {
+    // The site is only used in the debug build, where it must not be null.
+
+#ifdef ANSICRAWL_DEBUG
+    CLIP *clip = mem_new_clip_at(site->file, site->line, site->function);
+#else
     CLIP *clip = mem_new_clip();
+#endif
 
     if (clip) {
         clip->type = type;
+        clip->capacity = CLIP_BUFFER_SIZE / clip_type_get_size(type);
     }
     else FUSE();
 
     return clip;
 }
 
+static CLIP *clip_create_arena(
+    CLIP_TYPE type, const struct clip_site_type *site
+) {
+    // A CLIP of the arena is only valid until the arena is reset and may not
+    // be handed over to anything that outlives the current update. Destroying
+    // it costs nothing. Outside of an arena scope, an ordinary CLIP is made.
+
+    static CLIP zero;
+    CLIP *clip = mem_arena_alloc(alignof(typeof(zero)), sizeof(zero));
+
+    if (!clip) {
+        return clip_create(type, site);
+    }
+
+    *clip = zero;
+    clip->type = type;
+    clip->capacity = CLIP_BUFFER_SIZE / clip_type_get_size(type);
+    clip->arena = true;
+#ifdef ANSICRAWL_DEBUG
+    clip->site = *site;
+#endif
+
+    return clip;
+}
+
+#ifdef ANSICRAWL_DEBUG
+CLIP *clip_create_at(
+    CLIP_TYPE type, bool arena, const char *file, int line,
+    const char *function
+) {
+    const struct clip_site_type site = {
+        .file = file,
+        .function = function,
+        .line = line
+    };
+
+    return arena ? clip_create_arena(type, &site) : clip_create(type, &site);
+}
+#else
 CLIP * clip_create_byte_array() {
-    return clip_create(CLIP_BYTE);
+    return clip_create(CLIP_BYTE, nullptr);
 }
 
 CLIP * clip_create_char_array() {
-    return clip_create(CLIP_CHAR);
+    return clip_create(CLIP_CHAR, nullptr);
 }
 
 CLIP * clip_create_long_array() {
-    return clip_create(CLIP_LONG);
+    return clip_create(CLIP_LONG, nullptr);
 }
 
 CLIP * clip_create_voidptr_array() {
-    return clip_create(CLIP_VOIDPTR);
+    return clip_create(CLIP_VOIDPTR, nullptr);
 }
 
 CLIP * clip_create_ucs4_array() {
-    return clip_create(CLIP_UCS4);
+    return clip_create(CLIP_UCS4, nullptr);
+}
+
+CLIP * clip_create_clip_array() {
+    // An array of CLIPs owns its elements. They are destroyed when they are
+    // cleared or consumed from the array, or when the array is destroyed.
+
+    return clip_create(CLIP_CLIP, nullptr);
 }
 
+CLIP * clip_create_arena_byte_array() {
+    return clip_create_arena(CLIP_BYTE, nullptr);
+}
+
+CLIP * clip_create_arena_char_array() {
+    return clip_create_arena(CLIP_CHAR, nullptr);
+}
+#endif
+
 void clip_destroy(CLIP *clip) {
     if (!clip) {
         return;
     }
 
-    mem_free_clip(clip);
+    clip_clear(clip);
+
+    if (!clip->arena) {
+        mem_free_clip(clip);
+    }
 }
 
 size_t clip_type_get_alignment(CLIP_TYPE type) {
@@ -52,6 +160,7 @@ size_t clip_type_get_alignment(CLIP_TYPE type) {
         case CLIP_LONG: return alignof(long);
         case CLIP_VOIDPTR: return alignof(void *);
         case CLIP_UCS4: return alignof(ucs4_t);
+        case CLIP_CLIP: return alignof(CLIP *);
         case CLIP_NONE:
         case MAX_CLIP_TYPE: {
             break;
@@ -68,6 +177,7 @@ size_t clip_type_get_size(CLIP_TYPE type) {
         case CLIP_LONG: return sizeof(long);
         case CLIP_VOIDPTR: return sizeof(void *);
         case CLIP_UCS4: return sizeof(ucs4_t);
+        case CLIP_CLIP: return sizeof(CLIP *);
         case CLIP_NONE:
         case MAX_CLIP_TYPE: {
             break;
@@ -77,11 +187,66 @@ size_t clip_type_get_size(CLIP_TYPE type) {
     return 0;
 }
 
+static void *clip_get_buffer(const CLIP *clip) {
+    // Returns the start of the memory of the contents, which is the buffer of
+    // the CLIP itself until the contents outgrow it.
+
+    if (!clip->memory) {
+        return (void *) clip->buffer;
+    }
+
+    return (
+        ((uint8_t *) clip->memory->data) +
+        (clip->shared ? CLIP_SHARE_HEADER : 0)
+    );
+}
+
+static void *clip_get_data(const CLIP *clip) {
+    return (
+        ((uint8_t *) clip_get_buffer(clip)) +
+        clip->offset * clip_type_get_size(clip->type)
+    );
+}
+
 bool clip_reserve(CLIP *clip, size_t count) {
-    if (clip->capacity >= count) {
+    // Makes room for count elements in total. The memory is grown to just as
+    // much as asked for, which suits knowing the size in advance.
+
+    return clip_grow(clip, count, count);
+}
+
+bool clip_reserve_extra(CLIP *clip, size_t count) {
+    // Makes room for count elements more than there are. If the memory has to
+    // grow, its capacity is multiplied by the growth factor at least, so that
+    // appending takes amortized constant time.
+
+    if (count > SIZE_MAX - clip->offset - clip->size) {
+        FUSE();
+        return false;
+    }
+
+    const size_t needed = clip->size + count;
+
+    if (clip->capacity >= clip->offset + needed && !clip->shared) {
         return true;
     }
 
+    const size_t growth = atomic_load_explicit(
+        &clip_growth, memory_order_relaxed
+    );
+    const size_t capacity = (
+        clip->capacity > SIZE_MAX / growth ? SIZE_MAX :
+        clip->capacity * growth / 100
+    );
+
+    return clip_grow(clip, needed, umax_size(needed, capacity));
+}
+
+bool clip_shrink_to_fit(CLIP *clip) {
+    // Gives back the memory that the contents do not need. The contents that
+    // fit in the buffer of the CLIP are moved there. The memory of the arena
+    // can not be given back, so it is only left for the buffer.
+
     const size_t el_align = clip_type_get_alignment(clip->type);
     const size_t el_size = clip_type_get_size(clip->type);
 
@@ -90,53 +255,248 @@ bool clip_reserve(CLIP *clip, size_t count) {
         return false;
     }
 
-    MEM *new_mem = mem_new(el_align, el_size * count);
+    if (!clip->memory || clip->shared) {
+        return true;
+    }
+
+    const size_t size = clip->size * el_size;
+
+    if (size <= CLIP_BUFFER_SIZE) {
+        memcpy(clip->buffer, clip_get_data(clip), size);
+
+        if (!clip->arena) {
+            mem_free(clip->memory);
+        }
+
+        clip->memory = nullptr;
+        clip->capacity = CLIP_BUFFER_SIZE / el_size;
+        clip->offset = 0;
+
+        return true;
+    }
+
+    if (clip->arena) {
+        return true;
+    }
+
+    MEM *new_mem = CLIP_MEM_NEW(clip, el_align, size);
 
     if (!new_mem) {
         return false;
     }
 
-    if (clip->memory) {
-        memcpy(new_mem->data, clip->memory->data, clip->size * el_size);
+    if (new_mem->capacity >= clip->memory->capacity) {
+        // The contents take up a size class as big as they already have.
+
+        mem_free(new_mem);
+
+        return true;
+    }
+
+    memcpy(new_mem->data, clip_get_data(clip), size);
+    mem_free(clip->memory);
+
+    clip->memory = new_mem;
+    clip->capacity = new_mem->capacity / el_size;
+    clip->offset = 0;
+
+    return true;
+}
+
+void clip_set_growth(size_t percent) {
+    // Sets by how many percent the capacity of a CLIP is at least multiplied
+    // when appending makes its memory grow, such as 150 or 200.
+
+    if (percent < 100) {
+        FUSE();
+        return;
+    }
+
+    atomic_store_explicit(&clip_growth, percent, memory_order_relaxed);
+}
+
+size_t clip_get_growth() {
+    return atomic_load_explicit(&clip_growth, memory_order_relaxed);
+}
+
+void clip_get_stats(struct clip_stats_type *stats) {
+    *stats = (struct clip_stats_type) {
+        .growths = atomic_load_explicit(
+            &clip_count.growths, memory_order_relaxed
+        ),
+        .in_place = atomic_load_explicit(
+            &clip_count.in_place, memory_order_relaxed
+        ),
+        .copied = atomic_load_explicit(
+            &clip_count.copied, memory_order_relaxed
+        )
+    };
+}
+
+static bool clip_grow(CLIP *clip, size_t count, size_t capacity) {
+    // Makes room for count elements from the offset on. If the memory has to
+    // grow, it is given room for capacity elements. Shared contents are
+    // copied first, for the room is there to be written to.
+
+    if (clip->shared) {
+        return clip_unshare(clip, umax_size(count, capacity));
+    }
+
+    if (clip->capacity >= clip->offset + count) {
+        return true;
+    }
+
+    const size_t el_align = clip_type_get_alignment(clip->type);
+    const size_t el_size = clip_type_get_size(clip->type);
+
+    if (!el_align || !el_size) {
+        FUSE();
+        return false;
+    }
+
+    if (clip->capacity >= count && clip->offset >= clip->size) {
+        // The consumed head is at least as large as the remaining contents, so
+        // compacting in place costs no more than what has been consumed since
+        // the last compaction.
+
+        memmove(
+            clip_get_buffer(clip), clip_get_data(clip), clip->size * el_size
+        );
+
+        clip->offset = 0;
+
+        return true;
+    }
+
+    MEM *new_mem = nullptr;
+
+    if (clip->arena) {
+        // The arena can not take back the old buffer, so the capacity is at
+        // least doubled to leave few of them behind.
+
+        capacity = umax_size(capacity, 2 * clip->capacity);
+    }
+
+    if (capacity > SIZE_MAX / el_size) {
+        FUSE();
+        return false;
+    }
+
+    atomic_fetch_add_explicit(&clip_count.growths, 1, memory_order_relaxed);
+
+    if (clip->arena) {
+        new_mem = mem_arena_alloc(alignof(MEM), sizeof(MEM));
+
+        if (new_mem) {
+            *new_mem = (MEM) {
+                .data = mem_arena_alloc(el_align, el_size * capacity),
+                .capacity = el_size * capacity
+            };
+        }
+
+        if (!new_mem || !new_mem->data) {
+            return false;
+        }
+    }
+    else if (clip->memory && !clip->offset) {
+        // With the contents at the start of the memory, the memory may be
+        // grown without moving them.
+
+        const void *data = clip->memory->data;
+
+        if ((new_mem = mem_resize(
+            clip->memory, el_align, el_size * capacity
+        )) == nullptr) {
+            return false;
+        }
+
+        if (new_mem->data == data) {
+            atomic_fetch_add_explicit(
+                &clip_count.in_place, 1, memory_order_relaxed
+            );
+        }
+        else {
+            atomic_fetch_add_explicit(
+                &clip_count.copied, clip->size * el_size, memory_order_relaxed
+            );
+        }
+
+        clip->memory = new_mem;
+        clip->capacity = new_mem->capacity / el_size;
+
+        return true;
+    }
+    else if ((new_mem = CLIP_MEM_NEW(
+        clip, el_align, el_size * capacity
+    )) == nullptr) {
+        return false;
+    }
+
+    memcpy(new_mem->data, clip_get_data(clip), clip->size * el_size);
+    atomic_fetch_add_explicit(
+        &clip_count.copied, clip->size * el_size, memory_order_relaxed
+    );
+
+    if (clip->memory && !clip->arena) {
         mem_free(clip->memory);
     }
 
     clip->memory = new_mem;
-    clip->capacity = count;
+    clip->capacity = new_mem->capacity / el_size;
+    clip->offset = 0;
+
+    return true;
+}
+
+bool clip_resize(CLIP *clip, size_t count) {
+    // Elements past the previous size are left as they are in the buffer. This
+    // lets the caller write into the reserved capacity first and then commit
+    // the written elements by resizing.
+
+    if (clip->type == CLIP_CLIP && count != clip->size) {
+        FUSE();
+        return false;
+    }
+
+    if (!clip_reserve(clip, count)) {
+        return false;
+    }
+
+    clip->size = count;
 
     return true;
 }
 
 void clip_set_byte_at(const CLIP *clip, size_t index, uint8_t value) {
-    if (index < clip_get_size(clip)) {
+    if (index < clip_get_size(clip) && !clip->shared) {
         clip_get_byte_array(clip)[index] = value;
     }
     else FUSE();
 }
 
 void clip_set_char_at(const CLIP *clip, size_t index, char value) {
-    if (index < clip_get_size(clip)) {
+    if (index < clip_get_size(clip) && !clip->shared) {
         clip_get_char_array(clip)[index] = value;
     }
     else FUSE();
 }
 
 void clip_set_long_at(const CLIP *clip, size_t index, long value) {
-    if (index < clip_get_size(clip)) {
+    if (index < clip_get_size(clip) && !clip->shared) {
         clip_get_long_array(clip)[index] = value;
     }
     else FUSE();
 }
 
 void clip_set_voidptr_at(const CLIP *clip, size_t index, void *value) {
-    if (index < clip_get_size(clip)) {
+    if (index < clip_get_size(clip) && !clip->shared) {
         clip_get_voidptr_array(clip)[index] = value;
     }
     else FUSE();
 }
 
 void clip_set_ucs4_at(const CLIP *clip, size_t index, ucs4_t value) {
-    if (index < clip_get_size(clip)) {
+    if (index < clip_get_size(clip) && !clip->shared) {
         clip_get_ucs4_array(clip)[index] = value;
     }
     else FUSE();
@@ -148,7 +508,7 @@ uint8_t *clip_get_byte_array(const CLIP *clip) {
         return nullptr;
     }
 
-    return clip->memory->data;
+    return clip_get_data(clip);
 }
 
 char *clip_get_char_array(const CLIP *clip) {
@@ -157,7 +517,7 @@ char *clip_get_char_array(const CLIP *clip) {
         return nullptr;
     }
 
-    return clip->memory->data;
+    return clip_get_data(clip);
 }
 
 long *clip_get_long_array(const CLIP *clip) {
@@ -166,7 +526,7 @@ long *clip_get_long_array(const CLIP *clip) {
         return nullptr;
     }
 
-    return clip->memory->data;
+    return clip_get_data(clip);
 }
 
 void **clip_get_voidptr_array(const CLIP *clip) {
@@ -175,7 +535,7 @@ void **clip_get_voidptr_array(const CLIP *clip) {
         return nullptr;
     }
 
-    return clip->memory->data;
+    return clip_get_data(clip);
 }
 
 ucs4_t *clip_get_ucs4_array(const CLIP *clip) {
@@ -184,7 +544,16 @@ ucs4_t *clip_get_ucs4_array(const CLIP *clip) {
         return nullptr;
     }
 
-    return clip->memory->data;
+    return clip_get_data(clip);
+}
+
+CLIP **clip_get_clip_array(const CLIP *clip) {
+    if (clip->type != CLIP_CLIP) {
+        FUSE();
+        return nullptr;
+    }
+
+    return clip_get_data(clip);
 }
 
 uint8_t clip_get_byte_at(const CLIP *clip, size_t index) {
@@ -237,6 +606,16 @@ ucs4_t clip_get_ucs4_at(const CLIP *clip, size_t index) {
     return 0;
 }
 
+CLIP *clip_get_clip_at(const CLIP *clip, size_t index) {
+    if (clip_get_size(clip) > index) {
+        return clip_get_clip_array(clip)[index];
+    }
+
+    FUSE();
+
+    return nullptr;
+}
+
 static bool clip_set_array(CLIP *clip, const void *data, size_t count) {
     if (clip->type == CLIP_NONE) {
         FUSE();
@@ -250,14 +629,19 @@ static bool clip_set_array(CLIP *clip, const void *data, size_t count) {
         return false;
     }
 
-    if (count > clip->capacity) {
+    clip->size = 0;
+    clip->offset = 0;
+
+    if (count > clip->capacity || clip->shared) {
+        // The shared contents are replaced, so nothing of them is copied.
+
         if (!clip_reserve(clip, count)) {
             return false;
         }
     }
 
     if (count) {
-        memcpy(clip->memory->data, data, count * element_size);
+        memmove(clip_get_buffer(clip), data, count * element_size);
     }
 
     clip->size = count;
@@ -327,14 +711,12 @@ static bool clip_append_array(CLIP *clip, const void *data, size_t count) {
         return true;
     }
 
-    if (clip->size + count > clip->capacity) {
-        if (!clip_reserve(clip, clip->size + count)) {
-            return false;
-        }
+    if (!clip_reserve_extra(clip, count)) {
+        return false;
     }
 
     memcpy(
-        ((uint8_t *) clip->memory->data) + clip->size * element_size,
+        ((uint8_t *) clip_get_data(clip)) + clip->size * element_size,
         data, count * element_size
     );
 
@@ -408,6 +790,15 @@ bool clip_push_ucs4(CLIP *clip, ucs4_t value) {
     return clip_append_ucs4_array(clip, &value, 1);
 }
 
+bool clip_push_clip(CLIP *clip, CLIP *value) {
+    if (clip->type != CLIP_CLIP) {
+        FUSE();
+        return false;
+    }
+
+    return clip_append_array(clip, &value, 1);
+}
+
 bool clip_pop_byte(CLIP *clip) {
     if (clip->type != CLIP_BYTE) {
         FUSE();
@@ -489,7 +880,7 @@ bool clip_pop_ucs4(CLIP *clip) {
 }
 
 bool clip_append_clip(CLIP *dst, const CLIP *src) {
-    if (dst->type != src->type) {
+    if (dst->type != src->type || dst->type == CLIP_CLIP) {
         FUSE();
         return false;
     }
@@ -498,17 +889,30 @@ bool clip_append_clip(CLIP *dst, const CLIP *src) {
         return true;
     }
 
-    return clip_append_array(dst, src->memory->data, src->size);
+    return clip_append_array(dst, clip_get_data(src), src->size);
 }
 
-void clip_swap(CLIP *a, CLIP *b) {
+bool clip_swap(CLIP *a, CLIP *b) {
+    if (a->arena != b->arena) {
+        // The memory of the arena must not outlive the current update.
+
+        FUSE();
+        return false;
+    }
+
     struct CLIP buf = *a;
     *a = *b;
     *b = buf;
+
+    return true;
 }
 
 CLIP *clip_shift(CLIP *clip, size_t count) {
-    CLIP *new_clip = clip_create(clip->type);
+    CLIP *new_clip = (
+        clip->arena ? (
+            clip_create_arena(clip->type, CLIP_SITE(clip))
+        ) : clip_create(clip->type, CLIP_SITE(clip))
+    );
 
     if (!new_clip) {
         FUSE();
@@ -519,27 +923,164 @@ CLIP *clip_shift(CLIP *clip, size_t count) {
         return new_clip;
     }
 
-    clip_swap(clip, new_clip);
-
-    if (count >= new_clip->size) {
+    if (count >= clip->size && clip_swap(clip, new_clip)) {
         return new_clip;
     }
 
-    const size_t element_size = clip_type_get_size(clip->type);
+    count = umin_size(count, clip->size);
 
-    clip_set_array(
-        clip,
-        ((uint8_t *) new_clip->memory->data) + count * element_size,
-        new_clip->size - count
-    );
+    if (!clip_set_array(new_clip, clip_get_data(clip), count)) {
+        FUSE();
+    }
 
-    new_clip->size = count;
+    clip_consume(clip, count);
 
     return new_clip;
 }
 
+void clip_consume(CLIP *clip, size_t count) {
+    if (count >= clip->size) {
+        if (count > clip->size) {
+            FUSE();
+        }
+
+        clip_clear(clip);
+        return;
+    }
+
+    if (clip->type == CLIP_CLIP) {
+        for (size_t i=0; i<count; ++i) {
+            clip_destroy(clip_get_clip_at(clip, i));
+        }
+    }
+
+    clip->offset += count;
+    clip->size -= count;
+}
+
 void clip_clear(CLIP *clip) {
+    if (clip->type == CLIP_CLIP) {
+        for (size_t i=0; i<clip->size; ++i) {
+            clip_destroy(clip_get_clip_at(clip, i));
+        }
+    }
+
     clip->size = 0;
+    clip->offset = 0;
+    clip->queued = 0;
+
+    if (clip->shared) {
+        clip_release(clip);
+    }
+}
+
+bool clip_enqueue(CLIP *queue, CLIP *clip) {
+    if (queue->type != CLIP_CLIP || clip->type == CLIP_CLIP) {
+        FUSE();
+        return false;
+    }
+
+    if (clip_is_empty(clip)) {
+        return true;
+    }
+
+    const size_t size = clip->size;
+    const size_t segments = clip_get_size(queue);
+    CLIP *tail = segments ? clip_get_clip_at(queue, segments - 1) : nullptr;
+
+    if (tail
+    &&  tail->type == clip->type
+    &&  clip->size < CLIP_QUEUE_COPY_LIMIT
+    &&  clip_get_capacity(tail) - tail->size >= clip->size) {
+        // Small pieces such as telnet option replies are cheaper to copy into
+        // the spare capacity of the last segment than to queue on their own.
+
+        if (!clip_append_clip(tail, clip)) {
+            return false;
+        }
+
+        clip_clear(clip);
+        queue->queued += size;
+
+        return true;
+    }
+
+    CLIP *segment = clip_create(clip->type, CLIP_SITE(clip));
+
+    if (!segment) {
+        return false;
+    }
+
+    if (clip->arena || clip->size <= clip_get_capacity(segment)) {
+        // The queue outlives the arena, so the contents are copied instead.
+        // Contents that fit in the buffer of the segment are copied as well,
+        // which leaves the memory of the clip to be reused.
+
+        if (!clip_append_clip(segment, clip)
+        ||  !clip_push_clip(queue, segment)) {
+            clip_destroy(segment);
+
+            return false;
+        }
+
+        clip_clear(clip);
+        queue->queued += size;
+
+        return true;
+    }
+
+    if (!clip_swap(segment, clip)) {
+        clip_destroy(segment);
+
+        return false;
+    }
+
+    if (!clip_push_clip(queue, segment)) {
+        // The contents are given back, which cannot fail right after the same
+        // pair has been swapped.
+
+        (void) clip_swap(segment, clip);
+        clip_destroy(segment);
+
+        return false;
+    }
+
+    queue->queued += size;
+
+    return true;
+}
+
+void clip_dequeue(CLIP *queue, size_t count) {
+    if (queue->type != CLIP_CLIP) {
+        FUSE();
+        return;
+    }
+
+    queue->queued = count < queue->queued ? queue->queued - count : 0;
+
+    while (!clip_is_empty(queue)) {
+        CLIP *segment = clip_get_clip_at(queue, 0);
+        const size_t size = clip_get_size(segment);
+
+        if (count < size) {
+            clip_consume(segment, count);
+            return;
+        }
+
+        count -= size;
+        clip_consume(queue, 1);
+    }
+
+    if (count) {
+        FUSE();
+    }
+}
+
+size_t clip_get_queue_size(const CLIP *queue) {
+    // The count is kept up to date by clip_enqueue, clip_enqueue_shared and
+    // clip_dequeue, so that the backlog of a session costs nothing to check.
+
+    return queue->queued;
 }
 
 size_t clip_get_size(const CLIP *clip) {
@@ -547,9 +1088,196 @@ size_t clip_get_size(const CLIP *clip) {
 }
 
 size_t clip_get_capacity(const CLIP *clip) {
-    return clip->capacity;
+    return clip->capacity - clip->offset;
 }
 
 bool clip_is_empty(const CLIP *clip) {
     return clip_get_size(clip) == 0;
 }
+
+bool clip_enqueue_shared(CLIP *queue, CLIP *clip) {
+    // Queues the contents of the clip without taking them, so that the same
+    // contents can be queued to any number of queues. Small contents are
+    // copied like clip_enqueue does, while the rest are shared.
+
+    if (queue->type != CLIP_CLIP || clip->type == CLIP_CLIP) {
+        FUSE();
+        return false;
+    }
+
+    if (clip_is_empty(clip)) {
+        return true;
+    }
+
+    const size_t segments = clip_get_size(queue);
+    CLIP *tail = segments ? clip_get_clip_at(queue, segments - 1) : nullptr;
+    const bool small = clip->size < CLIP_QUEUE_COPY_LIMIT;
+
+    if (tail
+    &&  tail->type == clip->type
+    &&  !tail->shared
+    &&  small
+    &&  clip_get_capacity(tail) - tail->size >= clip->size) {
+        if (!clip_append_clip(tail, clip)) {
+            return false;
+        }
+
+        queue->queued += clip->size;
+
+        return true;
+    }
+
+    CLIP *segment = nullptr;
+
+    if (small || clip->arena) {
+        if ((segment = clip_create(clip->type, CLIP_SITE(clip))) != nullptr
+        &&  !clip_append_clip(segment, clip)) {
+            clip_destroy(segment);
+            return false;
+        }
+    }
+    else segment = clip_share(clip);
+
+    if (!segment) {
+        return false;
+    }
+
+    if (!clip_push_clip(queue, segment)) {
+        clip_destroy(segment);
+        return false;
+    }
+
+    queue->queued += clip->size;
+
+    return true;
+}
+
+CLIP *clip_share(CLIP *clip) {
+    // Returns a new CLIP of the same contents as the clip without copying
+    // them. From then on, the contents are shared by both and may not be
+    // changed in place. Whichever CLIP is changed next gets a copy of its
+    // own, and the memory is freed along with the last CLIP to let go of it.
+    // The CLIPs may be passed to other threads.
+
+    if (clip->type == CLIP_CLIP || clip->arena) {
+        // The elements of an array of CLIPs can not have two owners, and the
+        // memory of the arena does not outlive the current update.
+
+        FUSE();
+        return nullptr;
+    }
+
+    if (!clip->shared && !clip_is_empty(clip) && !clip_make_shared(clip)) {
+        return nullptr;
+    }
+
+    CLIP *new_clip = clip_create(clip->type, CLIP_SITE(clip));
+
+    if (!new_clip) {
+        return nullptr;
+    }
+
+    if (clip->shared) {
+        atomic_fetch_add_explicit(
+            (atomic_size_t *) clip->memory->data, 1, memory_order_relaxed
+        );
+
+        new_clip->memory = clip->memory;
+        new_clip->size = clip->size;
+        new_clip->capacity = clip->capacity;
+        new_clip->offset = clip->offset;
+        new_clip->shared = true;
+    }
+
+    return new_clip;
+}
+
+static bool clip_make_shared(CLIP *clip) {
+    // Moves the contents of the clip to memory that can be shared. Its size
+    // is exactly that of the contents, so that appending to the clip makes a
+    // copy.
+
+    const size_t el_size = clip_type_get_size(clip->type);
+    const size_t size = clip->size * el_size;
+    MEM *mem = CLIP_MEM_NEW(
+        clip, alignof(max_align_t), CLIP_SHARE_HEADER + size
+    );
+
+    if (!mem) {
+        return false;
+    }
+
+    atomic_init((atomic_size_t *) mem->data, 1);
+    memcpy(
+        (uint8_t *) mem->data + CLIP_SHARE_HEADER, clip_get_data(clip), size
+    );
+
+    if (clip->memory) {
+        mem_free(clip->memory);
+    }
+
+    clip->memory = mem;
+    clip->capacity = clip->size;
+    clip->offset = 0;
+    clip->shared = true;
+
+    return true;
+}
+
+static bool clip_unshare(CLIP *clip, size_t capacity) {
+    // Copies the shared contents of the clip to memory of its own that has
+    // room for capacity elements, and lets go of the shared memory.
+
+    const size_t el_align = clip_type_get_alignment(clip->type);
+    const size_t el_size = clip_type_get_size(clip->type);
+
+    capacity = umax_size(capacity, clip->size);
+
+    if (!el_align || !el_size || capacity > SIZE_MAX / el_size) {
+        FUSE();
+        return false;
+    }
+
+    MEM *new_mem = nullptr;
+
+    if (capacity * el_size > CLIP_BUFFER_SIZE
+    &&  (new_mem = CLIP_MEM_NEW(
+            clip, el_align, capacity * el_size
+        )) == nullptr) {
+        return false;
+    }
+
+    const size_t size = clip->size;
+    void *data = new_mem ? new_mem->data : (void *) clip->buffer;
+
+    memcpy(data, clip_get_data(clip), size * el_size);
+    atomic_fetch_add_explicit(
+        &clip_count.copied, size * el_size, memory_order_relaxed
+    );
+
+    clip_release(clip);
+
+    clip->memory = new_mem;
+    clip->size = size;
+    clip->capacity = (
+        new_mem ? new_mem->capacity / el_size : CLIP_BUFFER_SIZE / el_size
+    );
+
+    return true;
+}
+
+static void clip_release(CLIP *clip) {
+    // Lets go of the shared memory of the clip, which is left empty.
+
+    atomic_size_t *count = clip->memory->data;
+
+    if (atomic_fetch_sub_explicit(count, 1, memory_order_acq_rel) == 1) {
+        mem_free(clip->memory);
+    }
+
+    clip->memory = nullptr;
+    clip->size = 0;
+    clip->capacity = CLIP_BUFFER_SIZE / clip_type_get_size(clip->type);
+    clip->offset = 0;
+    clip->shared = false;
+}
@@ -12,18 +12,47 @@
 typedef enum : unsigned char {
     CLIP_NONE = 0,
     ////////////////////////////////////////////////////////////////////////////
-    CLIP_BYTE, CLIP_CHAR, CLIP_LONG, CLIP_VOIDPTR, CLIP_UCS4,
+    CLIP_BYTE, CLIP_CHAR, CLIP_LONG, CLIP_VOIDPTR, CLIP_UCS4, CLIP_CLIP,
     ////////////////////////////////////////////////////////////////////////////
     MAX_CLIP_TYPE
 } CLIP_TYPE;
 
 typedef struct CLIP CLIP;
 
+// Segments smaller than this are copied into the tail of an output queue
+// instead of being handed over by reference.
+static constexpr size_t CLIP_QUEUE_COPY_LIMIT = 256;
+
+// Contents of up to this many bytes are kept in the CLIP itself, so that the
+// short ones such as telnet replies and single keys need no memory of their
+// own.
+static constexpr size_t CLIP_BUFFER_SIZE = 32;
+
+struct clip_stats_type {
+    size_t growths;     // times that the memory of a CLIP had to grow
+    size_t in_place;    // of those, times that the contents did not move
+    size_t copied;      // bytes of contents moved by growing since the start
+};
+
+struct clip_site_type {
+    const char *file;
+    const char *function;
+    int line;
+};
+
 struct CLIP {
-    MEM *memory;
+    MEM *memory; // null while the contents fit in the buffer
     size_t size;
     size_t capacity;
+    size_t offset; // index of the first element, advanced by clip_consume
+    size_t queued; // bytes in the segments, if the CLIP is an output queue
     CLIP_TYPE type;
+    bool arena; // drawn from the arena of the thread along with its memory
+    bool shared; // the memory is shared with other CLIPs and may not change
+#ifdef ANSICRAWL_DEBUG
+    struct clip_site_type site; // of the call that created the CLIP
+#endif
+    alignas(max_align_t) uint8_t buffer[CLIP_BUFFER_SIZE];
 };
 
 CLIP *      clip_create_byte_array      ();
@@ -31,10 +60,20 @@ CLIP *      clip_create_char_array      ();
 CLIP *      clip_create_long_array      ();
 CLIP *      clip_create_voidptr_array   ();
 CLIP *      clip_create_ucs4_array      ();
+CLIP *      clip_create_clip_array      ();
+CLIP *      clip_create_arena_byte_array();
+CLIP *      clip_create_arena_char_array();
 void        clip_destroy                (CLIP *);
 bool        clip_reserve                (CLIP *, size_t);
-void        clip_swap                   (CLIP *, CLIP *);
+bool        clip_reserve_extra          (CLIP *, size_t);
+bool        clip_shrink_to_fit          (CLIP *);
+void        clip_set_growth             (size_t percent);
+size_t      clip_get_growth             ();
+void        clip_get_stats              (struct clip_stats_type *);
+bool        clip_resize                 (CLIP *, size_t);
+[[nodiscard]] bool clip_swap            (CLIP *, CLIP *);
 void        clip_clear                  (CLIP *clip);
+void        clip_consume                (CLIP *, size_t count);
 size_t      clip_type_get_alignment     (CLIP_TYPE);
 size_t      clip_type_get_size          (CLIP_TYPE);
 uint8_t *   clip_get_byte_array         (const CLIP *);
@@ -42,11 +81,13 @@ char *      clip_get_char_array         (const CLIP *);
 long *      clip_get_long_array         (const CLIP *);
 void **     clip_get_voidptr_array      (const CLIP *);
 ucs4_t *    clip_get_ucs4_array         (const CLIP *);
+CLIP **     clip_get_clip_array         (const CLIP *);
 uint8_t     clip_get_byte_at            (const CLIP *, size_t index);
 char        clip_get_char_at            (const CLIP *, size_t index);
 long        clip_get_long_at            (const CLIP *, size_t index);
 void *      clip_get_voidptr_at         (const CLIP *, size_t index);
 ucs4_t      clip_get_ucs4_at            (const CLIP *, size_t index);
+CLIP *      clip_get_clip_at            (const CLIP *, size_t index);
 void        clip_set_byte_at            (const CLIP *, size_t index, uint8_t);
 void        clip_set_char_at            (const CLIP *, size_t index, char);
 void        clip_set_long_at            (const CLIP *, size_t index, long);
@@ -67,6 +108,7 @@ bool        clip_push_char              (CLIP *, char);
 bool        clip_push_long              (CLIP *, long);
 bool        clip_push_voidptr           (CLIP *, const void *);
 bool        clip_push_ucs4              (CLIP *, ucs4_t);
+bool        clip_push_clip              (CLIP *, CLIP *);
 bool        clip_pop_byte               (CLIP *);
 bool        clip_pop_char               (CLIP *);
 bool        clip_pop_long               (CLIP *);
@@ -76,7 +118,34 @@ bool        clip_append_clip            (CLIP *, const CLIP *);
 size_t      clip_get_size               (const CLIP *);
 size_t      clip_get_capacity           (const CLIP *);
 bool        clip_is_empty               (const CLIP *);
+bool        clip_enqueue                (CLIP *queue, CLIP *);
+bool        clip_enqueue_shared         (CLIP *queue, CLIP *);
+void        clip_dequeue                (CLIP *queue, size_t count);
+size_t      clip_get_queue_size         (const CLIP *queue);
 
 [[nodiscard]] CLIP *clip_shift          (CLIP *, size_t);
+[[nodiscard]] CLIP *clip_share          (CLIP *);
+
+#ifdef ANSICRAWL_DEBUG
+CLIP *      clip_create_at              (
+    CLIP_TYPE, bool arena, const char *file, int line, const char *function
+);
+
+// In the debug build, a CLIP is counted by the call site that created it, and
+// so is all the memory that it takes for its contents later on.
+
+#define CLIP_CREATE_AT(type, arena) clip_create_at(                            \
+    (type), (arena), __builtin_FILE(), __builtin_LINE(), __builtin_FUNCTION()  \
+)
+
+#define clip_create_byte_array()        CLIP_CREATE_AT(CLIP_BYTE, false)
+#define clip_create_char_array()        CLIP_CREATE_AT(CLIP_CHAR, false)
+#define clip_create_long_array()        CLIP_CREATE_AT(CLIP_LONG, false)
+#define clip_create_voidptr_array()     CLIP_CREATE_AT(CLIP_VOIDPTR, false)
+#define clip_create_ucs4_array()        CLIP_CREATE_AT(CLIP_UCS4, false)
+#define clip_create_clip_array()        CLIP_CREATE_AT(CLIP_CLIP, false)
+#define clip_create_arena_byte_array()  CLIP_CREATE_AT(CLIP_BYTE, true)
+#define clip_create_arena_char_array()  CLIP_CREATE_AT(CLIP_CHAR, true)
+#endif
 
 #endif
@@ -66,10 +66,7 @@ bool dispatcher_update(DISPATCHER *dispatcher) {
         if (dst == nullptr) {
             clip_clear(src);
         }
-        else if (clip_is_empty(dst)) {
-            clip_swap(dst, src);
-        }
-        else {
+        else if (!clip_is_empty(dst) || !clip_swap(dst, src)) {
             bool appended = clip_append_clip(dst, src);
 
             if (!appended) {
@@ -101,20 +98,11 @@ static bool dispatcher_read_from_terminal(DISPATCHER *dispatcher) {
         return false;
     }
 
-    CLIP *dst = global.io.outgoing.clip;
-
-    if (clip_is_empty(dst)) {
-        clip_swap(dst, src);
-        return true;
-    }
-
-    bool appended = clip_append_clip(dst, src);
-
-    if (!appended) {
+    if (!clip_enqueue(global.io.outgoing.queue, src)) {
         FUSE();
+        clip_clear(src);
     }
 
-    clip_clear(src);
     return true;
 }
 
@@ -125,20 +113,11 @@ static bool dispatcher_read_from_client(DISPATCHER *dispatcher) {
         return false;
     }
 
-    CLIP *dst = global.io.outgoing.clip;
-
-    if (clip_is_empty(dst)) {
-        clip_swap(dst, src);
-        return true;
-    }
-
-    bool appended = clip_append_clip(dst, src);
-
-    if (!appended) {
+    if (!clip_enqueue(global.io.outgoing.queue, src)) {
         FUSE();
+        clip_clear(src);
     }
 
-    clip_clear(src);
     return true;
 }
 
@@ -6,5 +6,12 @@
 
 
 struct global_type global = {
-    .signal = {}
+    .signal = {
+        .fd = -1
+    },
+    .io = {
+        .epoll = -1,
+        .timer = -1,
+        .log = -1
+    }
 };
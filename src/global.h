@@ -21,33 +21,33 @@ typedef struct SERVER       SERVER;
 typedef struct CLIP         CLIP;
 typedef struct TERMINAL     TERMINAL;
 typedef struct DISPATCHER   DISPATCHER;
+typedef struct WORKER       WORKER;
 
 struct global_type {
     struct {
-        volatile sig_atomic_t interrupt;
-        volatile sig_atomic_t terminate;
-        volatile sig_atomic_t alarm;
-        volatile sig_atomic_t pipe;
-        volatile sig_atomic_t quit;
-        volatile sig_atomic_t window;
+        int fd; // signalfd of the signals that the main loop reacts to
+        bool interrupt:1;
     } signal;
 
-    struct {
-        MEM *memory;
-    } list;
-
-    struct {
-        MEM *memory[32][8];
-    } free;
-
     struct {
         struct {
             CLIP *clip;
+            int flags;      // file status flags of stdin before the start
+            bool polled:1;  // stdin is watched by the event loop
+            bool ended:1;   // stdin has ended but remote sessions go on
         } incoming;
 
         struct {
-            CLIP *clip;
+            CLIP *queue; // byte array CLIPs waiting to be written to stdout
+            int flags;      // file status flags of stdout before the start
+            bool polled:1;  // stdout can be watched by the event loop
+            bool waiting:1; // the event loop waits for stdout to be writable
         } outgoing;
+
+        int epoll;  // file descriptor of the event loop
+        int timer;  // timerfd of the next memory trim
+        int log;    // eventfd of the lines that other threads have queued
+        bool armed:1; // the timer is set to expire
     } io;
 
     struct {
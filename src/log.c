@@ -7,10 +7,114 @@
 #include <time.h>
 #include <stdarg.h>
 #include <limits.h>
+#include <pthread.h>
 ////////////////////////////////////////////////////////////////////////////////
 
 
+static constexpr size_t LOG_QUEUE_SIZE = 64 * 1024;
+
+static thread_local struct log_thread_type {
+    char line[1024];
+    size_t size;
+    bool detached:1;
+    bool queued:1;
+} log_thread;
+
+// The lines of the threads that may not write to stderr themselves wait here
+// until the main thread adds them to its own log.
+static struct log_queue_type {
+    pthread_mutex_t lock;
+    char data[LOG_QUEUE_SIZE];
+    size_t size;
+    size_t lost; // lines that did not fit in the queue
+} log_queue = {
+    .lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+static void log_enqueue(const char *str, size_t len);
+
+void log_detach(bool queued) {
+    // A thread other than the main one must not touch the log buffer. Its
+    // lines are collected separately and written out whole, so that they would
+    // not get mixed up with the lines of other threads. While the screen
+    // belongs to the local session, they are handed over to the main thread.
+
+    log_thread.detached = true;
+    log_thread.queued = queued;
+}
+
+void log_collect() {
+    // Called from the main thread to add the lines that the other threads have
+    // queued to the log.
+
+    pthread_mutex_lock(&log_queue.lock);
+
+    const size_t lost = log_queue.lost;
+
+    if (log_queue.size) {
+        log_part(log_queue.data, log_queue.size);
+    }
+
+    log_queue.size = 0;
+    log_queue.lost = 0;
+
+    pthread_mutex_unlock(&log_queue.lock);
+
+    if (lost) {
+        WARN("log: %lu lines of other threads were lost", lost);
+    }
+}
+
+static void log_enqueue(const char *str, size_t len) {
+    pthread_mutex_lock(&log_queue.lock);
+
+    const bool was_empty = !log_queue.size && !log_queue.lost;
+
+    if (len <= LOG_QUEUE_SIZE - log_queue.size) {
+        memcpy(log_queue.data + log_queue.size, str, len);
+        log_queue.size += len;
+    }
+    else ++log_queue.lost;
+
+    pthread_mutex_unlock(&log_queue.lock);
+
+    if (was_empty && global.io.log != -1) {
+        const uint64_t one = 1;
+
+        (void)!write(global.io.log, &one, sizeof(one)); // wakes the main loop
+    }
+}
+
+static void log_part_detached(const char *str, size_t len) {
+    while (len) {
+        size_t room = sizeof(log_thread.line) - log_thread.size;
+        size_t count = len < room ? len : room;
+
+        memcpy(log_thread.line + log_thread.size, str, count);
+        log_thread.size += count;
+        str += count;
+        len -= count;
+
+        if (log_thread.size == sizeof(log_thread.line)
+        ||  log_thread.line[log_thread.size - 1] == '\n') {
+            if (log_thread.queued) {
+                log_enqueue(log_thread.line, log_thread.size);
+            }
+            else {
+                (void)!write(STDERR_FILENO, log_thread.line, log_thread.size);
+            }
+
+            log_thread.size = 0;
+        }
+    }
+}
+
 void log_part(const char *str, size_t len) {
+    if (log_thread.detached) {
+        log_part_detached(str, len);
+        return;
+    }
+
     if (!global.terminal
     || (!global.terminal->bitset.raw)) {
         if (!global.logbuf || clip_is_empty(global.logbuf)) {
@@ -30,13 +134,13 @@ void log_text(const char *str) {
 
 void log_time() {
     time_t rawtime;
-    struct tm *timeinfo;
+    struct tm timeinfo;
     char now[80];
 
     time (&rawtime);
-    timeinfo = localtime(&rawtime);
+    localtime_r(&rawtime, &timeinfo);
 
-    strftime(now, sizeof(now), "%d-%m-%Y %H:%M:%S", timeinfo);
+    strftime(now, sizeof(now), "%d-%m-%Y %H:%M:%S", &timeinfo);
     size_t len = strlen(now);
 
     log_part(now, len && now[len-1] == '\n' ? len-1 : len);
@@ -164,6 +268,7 @@ void log_iac(
     const char *src, const char *dst, const uint8_t *data, size_t size
 ) {
     char stackbuf[MAX_STACKBUF_SIZE] = "";
+    size_t length = 0;
 
     for (size_t i = 0; i<size; ++i) {
         const char *code = telnet_get_iac_sequence_code(data, size, i);
@@ -173,19 +278,22 @@ void log_iac(
             FUSE();
         }
 
-        if (strlen(stackbuf) + strlen(code) + 2 >= sizeof(stackbuf)) {
+        const size_t code_length = strlen(code);
+
+        if (length + code_length + 2 >= sizeof(stackbuf)) {
             LOG("%s: long IAC sequence (size %lu)", dst, size);
 
             break;
         }
 
-        strncat(stackbuf, code, sizeof(stackbuf) - (strlen(stackbuf) + 1));
+        memcpy(stackbuf + length, code, code_length);
+        length += code_length;
 
         if (i + 1 < size) {
-            strncat(
-                stackbuf, " ",  sizeof(stackbuf) - (strlen(stackbuf) + 1)
-            );
+            stackbuf[length++] = ' ';
         }
+
+        stackbuf[length] = '\0';
     }
 
     LOG("%s:iac -> %s: %s", src, dst, stackbuf);
@@ -195,6 +303,7 @@ void log_txt(
     const char *src, const char *dst, const uint8_t *data, size_t size
 ) {
     char stackbuf[MAX_STACKBUF_SIZE] = "";
+    size_t length = 0;
 
     for (size_t i = 0; i<size; ++i) {
         const char *code = telnet_uchar_to_printable(data[i]);
@@ -208,19 +317,22 @@ void log_txt(
             FUSE();
         }
 
-        if (strlen(stackbuf) + strlen(code) + 2 >= sizeof(stackbuf)) {
+        const size_t code_length = strlen(code);
+
+        if (length + code_length + 2 >= sizeof(stackbuf)) {
             LOG("%s: long TXT sequence (size %lu)", dst, size);
 
             break;
         }
 
-        strncat(stackbuf, code, sizeof(stackbuf) - (strlen(stackbuf) + 1));
+        memcpy(stackbuf + length, code, code_length);
+        length += code_length;
 
         if (i + 1 < size) {
-            strncat(
-                stackbuf, " ",  sizeof(stackbuf) - (strlen(stackbuf) + 1)
-            );
+            stackbuf[length++] = ' ';
         }
+
+        stackbuf[length] = '\0';
     }
 
     LOG("%s:txt -> %s: %s", src, dst, stackbuf);
@@ -242,6 +354,7 @@ void log_esc(
     const char *src, const char *dst, const uint8_t *data, size_t size
 ) {
     char stackbuf[MAX_STACKBUF_SIZE] = "";
+    size_t length = 0;
 
     for (size_t i = 0; i<size; ++i) {
         const char *code = log_get_esc_sequence_code(data, size, i);
@@ -251,19 +364,22 @@ void log_esc(
             FUSE();
         }
 
-        if (strlen(stackbuf) + strlen(code) + 2 >= sizeof(stackbuf)) {
+        const size_t code_length = strlen(code);
+
+        if (length + code_length + 2 >= sizeof(stackbuf)) {
             LOG("%s: long ESC sequence (size %lu)", dst, size);
 
             break;
         }
 
-        strncat(stackbuf, code, sizeof(stackbuf) - (strlen(stackbuf) + 1));
+        memcpy(stackbuf + length, code, code_length);
+        length += code_length;
 
         if (i + 1 < size) {
-            strncat(
-                stackbuf, " ",  sizeof(stackbuf) - (strlen(stackbuf) + 1)
-            );
+            stackbuf[length++] = ' ';
         }
+
+        stackbuf[length] = '\0';
     }
 
     LOG("%s:esc -> %s: %s", src, dst, stackbuf);
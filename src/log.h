@@ -20,6 +20,8 @@ void log_txt(
     const char *src, const char *dst, const uint8_t *data, size_t size
 );
 
+void log_detach (bool queued);
+void log_collect();
 void log_part   (const char *str, size_t len);
 void log_text   (const char *str);
 void log_time   ();
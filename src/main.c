@@ -8,15 +8,30 @@
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <fcntl.h>
 ////////////////////////////////////////////////////////////////////////////////
 
 
+static constexpr size_t MAIN_IOV_COUNT = 64;
+static constexpr size_t MAIN_EVENT_COUNT = 8;
+
 static void main_loop();
 static bool main_update();
 static void main_init(int argc, char **argv);
 static void main_deinit();
 static bool main_fetch_incoming();
 static bool main_flush_outgoing();
+static void main_flush_logbuf();
+static bool main_init_events();
+static void main_deinit_events();
+static bool main_wait_events();
+static void main_schedule_trim();
+static bool main_watch(int op, int fd, uint32_t events);
+static bool main_set_nonblocking(int fd, int *flags);
 
 
 int main(int argc, char **argv) {
@@ -59,6 +74,12 @@ int main(int argc, char **argv) {
 
     return EXIT_SUCCESS;
 */
+    if (argc > 1 && !strcmp(argv[1], "--bench")) {
+        return bench_run(argc > 2 ? argv[2] : nullptr) ? (
+            EXIT_SUCCESS
+        ) : EXIT_FAILURE;
+    }
+
     main_init(argc, argv);
     main_loop();
     main_deinit();
@@ -67,6 +88,68 @@ int main(int argc, char **argv) {
 }
 
 static void main_init(int argc, char **argv) {
+    const char *port = nullptr;
+    size_t workers = 0;
+
+    for (int i=1; i<argc; ++i) {
+        if (!strcmp(argv[i], "--listen") && i + 1 < argc) {
+            port = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--workers") && i + 1 < argc) {
+            workers = (size_t) strtoul(argv[++i], nullptr, 10);
+        }
+        else if (!strcmp(argv[i], "--mem-trim") && i + 1 < argc) {
+            struct mem_policy_type policy;
+
+            mem_get_policy(&policy);
+            policy.trim_msec = (size_t) strtoul(argv[++i], nullptr, 10);
+            mem_set_policy(&policy);
+        }
+        else if (!strcmp(argv[i], "--mccp-level") && i + 1 < argc) {
+            struct client_policy_type policy;
+
+            client_get_policy(&policy);
+            policy.mccp_level = (int) strtol(argv[++i], nullptr, 10);
+            client_set_policy(&policy);
+        }
+        else if (!strcmp(argv[i], "--mccp-flush") && i + 1 < argc) {
+            struct client_policy_type policy;
+
+            client_get_policy(&policy);
+
+            if (!strcmp(argv[++i], "sync")) {
+                policy.mccp_flush = CLIENT_FLUSH_SYNC;
+            }
+            else if (!strcmp(argv[i], "full")) {
+                policy.mccp_flush = CLIENT_FLUSH_FULL;
+            }
+            else WARN("unknown flush policy: %s", argv[i]);
+
+            client_set_policy(&policy);
+        }
+        else if (!strcmp(argv[i], "--palette") && i + 1 < argc) {
+            struct client_policy_type policy;
+
+            client_get_policy(&policy);
+
+            if (!strcmp(argv[++i], "16")) {
+                policy.palette = AMP_PAL_RGB16;
+            }
+            else if (!strcmp(argv[i], "256")) {
+                policy.palette = AMP_PAL_256;
+            }
+            else if (!strcmp(argv[i], "24bit")) {
+                policy.palette = AMP_PAL_24BIT;
+            }
+            else WARN("unknown palette: %s", argv[i]);
+
+            client_set_policy(&policy);
+        }
+        else {
+            WARN("unknown argument: %s", argv[i]);
+        }
+    }
+
     const char *locales[] = { "C.UTF8", "C.utf8", "en_US.UTF-8", "en_US.utf8" };
 
     for (size_t i=0; i<ARRAY_LENGTH(locales); ++i) {
@@ -84,6 +167,10 @@ static void main_init(int argc, char **argv) {
         BUG("failed to initialize signals");
         global.bitset.broken = true;
     }
+    else if (!main_init_events()) {
+        BUG("failed to initialize the event loop");
+        global.bitset.broken = true;
+    }
 
     LOG(
         "starting up (compiled %s, %s)%s\033]0;ANSI Crawl\007%s",
@@ -91,7 +178,7 @@ static void main_init(int argc, char **argv) {
     );
 
     global.io.incoming.clip = clip_create_byte_array();
-    global.io.outgoing.clip = clip_create_byte_array();
+    global.io.outgoing.queue = clip_create_clip_array();
     global.dispatcher = dispatcher_create();
     global.terminal = isatty(STDIN_FILENO) ? terminal_create() : nullptr;
     global.logbuf = clip_create_char_array();
@@ -100,6 +187,17 @@ static void main_init(int argc, char **argv) {
 
     terminal_init(global.terminal);
     client_init(global.client);
+
+    if (port && global.server) {
+        // Remote players are served over telnet next to the local session.
+
+        if (!server_spawn_workers(global.server, workers)
+        ||  !server_listen(global.server, nullptr, port)
+        ||  !main_watch(EPOLL_CTL_ADD, global.server->epoll, EPOLLIN)) {
+            BUG("failed to listen on port %s", port);
+            global.bitset.broken = true;
+        }
+    }
 }
 
 static void main_deinit() {
@@ -107,7 +205,13 @@ static void main_deinit() {
     terminal_deinit(global.terminal);
     dispatcher_deinit(global.dispatcher);
 
-    main_flush_outgoing();
+    // The standard streams are made blocking again before the last flush so
+    // that none of the remaining output would get lost.
+
+    main_deinit_events();
+    signals_deinit();
+
+    while (main_flush_outgoing());
 
     if (global.bitset.broken) {
         WARN("%s", "abnormal termination");
@@ -119,6 +223,17 @@ static void main_deinit() {
     server_destroy(global.server);
     global.server = nullptr;
 
+    // The workers have stopped by now, and the eventfd that they woke the
+    // main loop up with is no longer needed. Their last lines are logged.
+
+    if (global.io.log != -1) {
+        close(global.io.log);
+        global.io.log = -1;
+    }
+
+    log_collect();
+    main_flush_logbuf();
+
     client_destroy(global.client);
     global.client = nullptr;
 
@@ -134,11 +249,17 @@ static void main_deinit() {
     clip_destroy(global.io.incoming.clip);
     global.io.incoming.clip = nullptr;
 
-    clip_destroy(global.io.outgoing.clip);
-    global.io.outgoing.clip = nullptr;
+    clip_destroy(global.io.outgoing.queue);
+    global.io.outgoing.queue = nullptr;
 
     mem_recycle();
 
+#ifdef ANSICRAWL_DEBUG
+    // Whatever is still in use by now has leaked.
+
+    mem_report();
+#endif
+
     if (mem_get_usage()) {
         WARN("%lu bytes of memory left hanging", mem_get_usage());
         mem_clear();
@@ -147,13 +268,240 @@ static void main_deinit() {
 
 static void main_loop() {
     while (!global.bitset.broken) {
-        if (!main_update()) {
+        // Whatever is allocated from the arena during an update is released
+        // in one go at the end of it.
+
+        mem_arena_begin();
+
+        const bool updated = main_update();
+
+        mem_arena_reset();
+
+        if (!updated) {
             LOG("shutting down");
             break;
         }
     }
 }
 
+static bool main_init_events() {
+    // The main loop sleeps in epoll_wait until there is input, a signal, a
+    // memory trim that is due, log lines queued by the workers or room for the
+    // output that could not be written right away. A regular file can not be
+    // watched by epoll, so it is read and written directly instead.
+
+    global.io.epoll = epoll_create1(EPOLL_CLOEXEC);
+
+    if (global.io.epoll == -1) {
+        BUG("%s", strerror(errno));
+        return false;
+    }
+
+    global.io.timer = timerfd_create(
+        CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC
+    );
+
+    if (global.io.timer == -1) {
+        BUG("%s", strerror(errno));
+        return false;
+    }
+
+    global.io.log = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    if (global.io.log == -1) {
+        BUG("%s", strerror(errno));
+        return false;
+    }
+
+    if (!main_watch(EPOLL_CTL_ADD, global.io.timer, EPOLLIN)
+    ||  !main_watch(EPOLL_CTL_ADD, global.io.log, EPOLLIN)
+    ||  !main_watch(EPOLL_CTL_ADD, global.signal.fd, EPOLLIN)) {
+        return false;
+    }
+
+    if (main_watch(EPOLL_CTL_ADD, STDIN_FILENO, EPOLLIN)) {
+        global.io.incoming.polled = main_set_nonblocking(
+            STDIN_FILENO, &global.io.incoming.flags
+        );
+    }
+    else if (errno != EPERM) {
+        return false;
+    }
+
+    if (main_watch(EPOLL_CTL_ADD, STDOUT_FILENO, 0)) {
+        global.io.outgoing.polled = main_set_nonblocking(
+            STDOUT_FILENO, &global.io.outgoing.flags
+        );
+    }
+    else if (errno != EPERM) {
+        return false;
+    }
+
+    return true;
+}
+
+static void main_deinit_events() {
+    if (global.io.outgoing.polled) {
+        fcntl(STDOUT_FILENO, F_SETFL, global.io.outgoing.flags);
+        global.io.outgoing.polled = false;
+        global.io.outgoing.waiting = false;
+    }
+
+    if (global.io.incoming.polled) {
+        fcntl(STDIN_FILENO, F_SETFL, global.io.incoming.flags);
+        global.io.incoming.polled = false;
+    }
+
+    if (global.io.timer != -1) {
+        close(global.io.timer);
+        global.io.timer = -1;
+    }
+
+    if (global.io.epoll != -1) {
+        close(global.io.epoll);
+        global.io.epoll = -1;
+    }
+}
+
+static bool main_watch(int op, int fd, uint32_t events) {
+    struct epoll_event event = {
+        .events = events,
+        .data.fd = fd
+    };
+
+    if (epoll_ctl(global.io.epoll, op, fd, &event) == -1) {
+        if (errno != EPERM) {
+            BUG("%s", strerror(errno));
+        }
+
+        return false;
+    }
+
+    return true;
+}
+
+static bool main_set_nonblocking(int fd, int *flags) {
+    *flags = fcntl(fd, F_GETFL);
+
+    if (*flags == -1 || fcntl(fd, F_SETFL, *flags | O_NONBLOCK) == -1) {
+        BUG("%s", strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+static bool main_wait_events() {
+    // Returns false if the input has come to an end.
+
+    struct epoll_event events[MAIN_EVENT_COUNT];
+
+    main_schedule_trim();
+
+    const int count = epoll_wait(
+        global.io.epoll, events, (int) ARRAY_LENGTH(events), (
+            global.io.incoming.polled || global.io.incoming.ended ? -1 : 0
+        )
+    );
+
+    if (count == -1) {
+        if (errno == EINTR) {
+            return true;
+        }
+
+        BUG("%s", strerror(errno));
+        global.bitset.broken = true;
+
+        return false;
+    }
+
+    bool open = true;
+
+    for (int i=0; i<count; ++i) {
+        const int fd = events[i].data.fd;
+
+        if (fd == STDIN_FILENO) {
+            const size_t size = clip_get_size(global.io.incoming.clip);
+
+            open = main_fetch_incoming();
+
+            if ((events[i].events & (EPOLLHUP | EPOLLERR))
+            &&  clip_get_size(global.io.incoming.clip) == size) {
+                LOG("%s", "input has been hung up");
+                open = false;
+            }
+        }
+        else if (fd == STDOUT_FILENO) {
+            main_flush_outgoing();
+        }
+        else if (fd == global.io.timer) {
+            uint64_t expirations;
+
+            if (read(fd, &expirations, sizeof(expirations)) > 0) {
+                global.io.armed = false;
+            }
+        }
+        else if (fd == global.io.log) {
+            uint64_t wakeups;
+
+            (void)!read(fd, &wakeups, sizeof(wakeups));
+            log_collect();
+        }
+        else if (global.server && fd == global.server->epoll) {
+            server_poll(global.server);
+        }
+    }
+
+    if (!global.io.incoming.polled && !global.io.incoming.ended) {
+        open = main_fetch_incoming();
+    }
+
+    if (!open && server_is_listening(global.server)) {
+        // The remote sessions keep the program running without local input.
+
+        LOG("%s", "input has ended, serving the remote sessions only");
+
+        if (global.io.incoming.polled) {
+            main_watch(EPOLL_CTL_DEL, STDIN_FILENO, 0);
+        }
+
+        global.io.incoming.ended = true;
+        open = true;
+    }
+
+    return open;
+}
+
+static void main_schedule_trim() {
+    // The timer is armed for a single expiry only while the free memory has
+    // yet to be trimmed, so that an idle process sleeps until there is input
+    // or a signal. The trim is done here once it is due.
+
+    if (global.io.armed) {
+        return;
+    }
+
+    const size_t msec = mem_trim();
+
+    if (!msec) {
+        return;
+    }
+
+    const struct itimerspec trim = {
+        .it_value = {
+            .tv_sec  = (time_t) (msec / 1000),
+            .tv_nsec = (long) (msec % 1000 * 1000000)
+        }
+    };
+
+    if (timerfd_settime(global.io.timer, 0, &trim, nullptr) == -1) {
+        BUG("%s", strerror(errno));
+        return;
+    }
+
+    global.io.armed = true;
+}
+
 static bool main_fetch_incoming() {
     uint8_t buf[MAX_STACKBUF_SIZE];
     ssize_t count = read(STDIN_FILENO, buf, ARRAY_LENGTH(buf));
@@ -168,7 +516,6 @@ static bool main_fetch_incoming() {
         switch (read_errno) {
             case EAGAIN:
             case EINTR: {
-                LOG("%s: %s", __func__, strerror(read_errno));
                 return true;
             }
             default: {
@@ -208,43 +555,73 @@ static void main_flush_logbuf() {
 }
 
 static bool main_flush_outgoing() {
-    CLIP *clip = global.io.outgoing.clip;
+    CLIP *queue = global.io.outgoing.queue;
 
-    if (!clip || clip_is_empty(clip)) {
+    if (!queue || clip_is_empty(queue)) {
         main_flush_logbuf();
         return false;
     }
 
-    auto written = write(
-        STDOUT_FILENO, clip_get_byte_array(clip), clip_get_size(clip)
-    );
-    auto write_errno = errno;
+    struct iovec iov[MAIN_IOV_COUNT];
+    size_t iov_count = 0;
 
-    if (written != (ssize_t) clip_get_size(clip)) {
-        if (written > 0) {
-            clip_destroy(clip_shift(clip, (size_t) written));
+    for (size_t i=0; i<clip_get_size(queue); ++i) {
+        CLIP *segment = clip_get_clip_at(queue, i);
+
+        if (clip_is_empty(segment)) {
+            continue;
         }
-        else {
-            if (written == -1) {
-                switch (write_errno) {
-                    case EAGAIN:
-                    case EINTR: {
-                        break;
-                    }
-                    default: {
-                        global.bitset.broken = true;
-                        BUG("%s", strerror(write_errno));
-                    }
-                }
+
+        if (iov_count >= ARRAY_LENGTH(iov)) {
+            break;
+        }
+
+        iov[iov_count++] = (struct iovec) {
+            .iov_base = clip_get_byte_array(segment),
+            .iov_len  = clip_get_size(segment)
+        };
+    }
+
+    auto written = iov_count ? writev(
+        STDOUT_FILENO, iov, (int) iov_count
+    ) : 0;
+    auto write_errno = errno;
+
+    if (written > 0) {
+        // Fully written segments are released and the first partially written
+        // one is advanced in place, so a short write costs no copying.
+
+        clip_dequeue(queue, (size_t) written);
+    }
+    else if (!iov_count) {
+        clip_clear(queue); // Only empty segments were queued.
+    }
+    else if (written == -1) {
+        switch (write_errno) {
+            case EAGAIN:
+            case EINTR: {
+                break;
             }
-            else {
+            default: {
                 global.bitset.broken = true;
-                FUSE();
+                BUG("%s", strerror(write_errno));
             }
         }
     }
     else {
-        clip_clear(clip);
+        global.bitset.broken = true;
+        FUSE();
+    }
+
+    if (global.io.outgoing.polled
+    &&  global.io.outgoing.waiting != !clip_is_empty(queue)) {
+        // Whatever did not fit is written once stdout becomes writable again.
+
+        global.io.outgoing.waiting = !clip_is_empty(queue);
+        main_watch(
+            EPOLL_CTL_MOD, STDOUT_FILENO,
+            global.io.outgoing.waiting ? EPOLLOUT : 0
+        );
     }
 
     main_flush_logbuf();
@@ -268,6 +645,10 @@ static bool main_update() {
             }
             case SIGPIPE: break;
             case SIGALRM: break;
+            case SIGUSR1: {
+                mem_report();
+                break;
+            }
             case SIGWINCH: {
                 if (global.terminal) {
                     global.terminal->bitset.reformat = true;
@@ -289,11 +670,16 @@ static bool main_update() {
     updated |= client_update(global.client);
     updated |= terminal_update(global.terminal);
 
+    if (global.bitset.shutdown) {
+        server_shutdown(global.server);
+    }
+
+    updated |= server_update(global.server);
+
     main_flush_outgoing();
 
     if (!updated && !global.bitset.shutdown) {
-        LOG("waiting for user input");
-        updated |= main_fetch_incoming();
+        updated |= main_wait_events();
 
         if (!updated) {
             global.bitset.shutdown = true;
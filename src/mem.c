@@ -4,230 +4,1780 @@
 ////////////////////////////////////////////////////////////////////////////////
 #include <stdbit.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
 ////////////////////////////////////////////////////////////////////////////////
 
 
-MEM *mem_new(size_t alignment, size_t size) {
+static constexpr size_t MEM_CACHE_SIZE = 256 * 1024; // bytes per class
+static constexpr size_t MEM_DEPOT_SIZE = 4 * 1024 * 1024; // bytes per class
+static constexpr size_t MEM_ADVISE_SIZE = 64 * 1024;
+static constexpr size_t MEM_TRIM_MSEC = 10000;
+static constexpr size_t MEM_SIZE_MAX = (size_t) 1 << 31;
+static constexpr size_t MEM_SLAB_CLASS_COUNT = 36; // classes up to 8 KiB
+static constexpr size_t MEM_PAGE_SIZE = 64 * 1024;
+static constexpr size_t MEM_PAGE_COUNT = 16 * 1024; // pages in the region
+static constexpr uint32_t MEM_PAGE_NONE = UINT32_MAX;
+static constexpr size_t MEM_ARENA_SIZE = 64 * 1024; // bytes per chunk
+static constexpr size_t MEM_ARENA_HEADER = alignof(max_align_t);
+static constexpr size_t MEM_REPORT_COUNT = 20; // call sites in a report
+
+// Every thread allocates from a pool of its own without locking. A thread
+// keeps a limited amount of freed blocks per class and returns the surplus in
+// batches to the depot that is shared by all the threads, which has a limit
+// of its own per class. Memory
+// freed by another thread than the one that allocated it is pushed to the
+// remote list of its pool, which the owner collects on its next allocation.
+// The pool of a thread that exits is orphaned and adopted by the next new
+// thread, so the blocks that are still in use always have a pool to go back to.
+//
+// The blocks of the classes up to 8 KiB are cut out of slab pages instead. A
+// page holds the slots of a single class and belongs to a single pool. Its
+// metadata is kept apart from the page, so that the slots are packed without
+// headers. A pool keeps one empty page per class and gives the rest to the
+// depot.
+//
+// Free memory that has not been needed for a while is trimmed periodically.
+// The lowest number of free blocks that a list has had since the last trim
+// is how many of them went unused, and those are the ones at the end of the
+// list. A thread hands its unused blocks and empty pages over to the depot.
+// The depot gives back the pages of its unused big blocks with madvise first
+// and frees them if they stay unused until the next trim. The unused slab
+// pages are given back right away.
+
+static struct mem_policy_atomic_type {
+    atomic_size_t cache_size;
+    atomic_size_t depot_size;
+    atomic_size_t advise_size;
+    atomic_size_t trim_msec;
+} mem_policy = {
+    .cache_size = MEM_CACHE_SIZE,
+    .depot_size = MEM_DEPOT_SIZE,
+    .advise_size = MEM_ADVISE_SIZE,
+    .trim_msec = MEM_TRIM_MSEC
+};
+
+struct mem_block_type {
+    // Precedes the data of every block that is not cut out of a slab page.
+
+    MEM     mem;
+    struct mem_block_type *next;
+    struct mem_block_type *prev;
+    struct mem_pool_type *pool; // of the thread that allocated the memory
+    size_t  alignment;
+    size_t  advised;    // bytes of the data given back to the system
+};
+
+struct mem_page_type {
+    struct mem_pool_type *pool; // of the thread that cuts the page
+    struct mem_page_type *next; // in the list of the pages with free slots
+    struct mem_page_type *prev;
+    char    *data;
+    MEM     *free;      // the first freed slot, linked through the slots
+    size_t  class;
+    size_t  slot_size;
+    size_t  slot_count;
+    size_t  carved;     // slots that have been handed out at least once
+    size_t  used;
+    MEM     mem[];      // the metadata of every slot
+};
+
+struct mem_pool_type {
+    struct {
+        struct mem_block_type *memory;
+    } list;
+
+    struct {
+        struct mem_block_type *memory[MEM_CLASS_COUNT][MEM_ALIGN_COUNT];
+        size_t count[MEM_CLASS_COUNT][MEM_ALIGN_COUNT];
+        size_t low[MEM_CLASS_COUNT][MEM_ALIGN_COUNT]; // since the last trim
+    } free;
+
+    struct {
+        struct mem_page_type *page[MEM_SLAB_CLASS_COUNT]; // with free slots
+        size_t empty[MEM_SLAB_CLASS_COUNT]; // pages without slots in use
+        size_t low[MEM_SLAB_CLASS_COUNT];   // empty pages since the last trim
+    } slab;
+
+    // The counters are only written by the owner of the pool, or by whoever
+    // holds the lock of the depot if the pool is orphaned, but they can be
+    // read by any thread.
+
+    struct {
+        atomic_size_t live;     // footprint of the blocks in use
+        atomic_size_t cached;   // footprint of the free blocks and slots
+        atomic_size_t peak;     // the highest footprint of the blocks in use
+        atomic_size_t requested;    // bytes asked for since the start
+        atomic_size_t reserved;     // footprint given for those requests
+        atomic_size_t blocks[MEM_CLASS_COUNT];      // in use
+        atomic_size_t allocations[MEM_CLASS_COUNT]; // since the start
+        atomic_size_t aligned[MEM_ALIGN_COUNT];     // allocations by alignment
+    } count;
+
+    MEM *_Atomic remote; // freed by other threads, linked through their data
+    struct mem_pool_type *next; // in the registry of the depot
+    bool orphaned;
+
+    struct {
+        uint64_t time;      // of the last trim in milliseconds
+        size_t requested;   // bytes asked for as of the last trim
+        size_t live;        // footprint in use as of the last trim
+        bool due;           // the last trim may have left some for the next
+    } trim;
+};
+
+static struct mem_depot_type {
+    pthread_mutex_t lock;
+    pthread_once_t once;
+    pthread_key_t key;
+    struct mem_pool_type *pools;
+
+    struct {
+        struct mem_block_type *memory[MEM_CLASS_COUNT][MEM_ALIGN_COUNT];
+        size_t count[MEM_CLASS_COUNT][MEM_ALIGN_COUNT];
+        size_t low[MEM_CLASS_COUNT][MEM_ALIGN_COUNT]; // since the last trim
+    } free;
+
+    // The counters are written when locked.
+
+    atomic_size_t cached;   // footprint of the free blocks and pages
+    atomic_size_t advised;  // bytes of the free blocks given back
+    atomic_size_t trimmed;  // footprint released by the limits and trims
+    uint64_t time;          // of the last trim in milliseconds
+    size_t page_size;       // of the system
+} mem_depot = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .once = PTHREAD_ONCE_INIT
+};
+
+// The slab pages come from a region of address space that is reserved once,
+// so that the page of any slot is found from its address alone.
+
+static struct mem_slab_type {
+    char *base; // of the region, or nullptr if it could not be reserved
+    struct mem_page_type *page[MEM_PAGE_COUNT]; // written by the owners
+
+    // The stacks of free pages are only touched when the depot is locked.
+
+    uint32_t next[MEM_PAGE_COUNT];
+    uint32_t free;      // the top of the stack of free pages
+    uint32_t released;  // the top of the stack of pages given to the system
+    uint32_t carved;    // pages that have been used at least once
+    size_t count;       // free pages
+    size_t low;         // free pages since the last trim
+} mem_slab;
+
+// Every thread has an arena for the memory that is only needed until the end
+// of the current update. It is cut from chunks that are linked through their
+// headers, so that all of it is released at once.
+
+static thread_local struct mem_arena_type {
+    MEM *chunk;     // the chunk being cut, the previous one in its header
+    size_t used;    // bytes cut from the chunk
+    bool begun;
+} mem_arena;
+
+static thread_local struct mem_pool_type *mem_pool;
+
+#ifdef ANSICRAWL_DEBUG
+static constexpr size_t MEM_SITE_COUNT = 1024;
+
+// The call sites are kept in a table that only grows. A site is looked up
+// without locking and only added under the lock. The allocations of a call
+// site are counted from any thread.
+
+static struct mem_site_type {
+    _Atomic(const char *) file; // nullptr until the site is added
+    const char *function;
+    int line;
+    atomic_size_t allocations;  // since the start
+    atomic_size_t bytes;        // asked for since the start
+    atomic_size_t live;         // blocks in use
+    atomic_size_t live_bytes;   // asked for the blocks in use
+} mem_site[MEM_SITE_COUNT];
+
+static pthread_mutex_t mem_site_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct mem_site_type *mem_find_site(const char *, int, const char *);
+static void mem_report_site(const struct mem_site_type *);
+static int mem_compare_allocations(const void *, const void *);
+static int mem_compare_live_bytes(const void *, const void *);
+#endif
+
+static struct mem_pool_type *mem_get_pool();
+static void mem_init_depot();
+static void mem_orphan_pool(void *);
+static void mem_collect(struct mem_pool_type *);
+static void mem_release(struct mem_pool_type *, MEM *);
+static void mem_refill(struct mem_pool_type *, size_t, size_t);
+static MEM *mem_take(struct mem_pool_type *, size_t class, size_t alignment);
+static MEM *mem_carve(struct mem_pool_type *, size_t class);
+static struct mem_page_type *mem_new_page(struct mem_pool_type *, size_t);
+static struct mem_page_type *mem_find_page(const void *data);
+static void mem_drop_page(struct mem_pool_type *, struct mem_page_type *, bool);
+static void mem_drop_empty_pages(struct mem_pool_type *, bool lock);
+static void mem_link_page(struct mem_pool_type *, struct mem_page_type *);
+static void mem_unlink_page(struct mem_pool_type *, struct mem_page_type *);
+static size_t mem_get_page_footprint(const struct mem_page_type *);
+static size_t mem_get_class(size_t size);
+static size_t mem_get_class_size(size_t class);
+static size_t mem_get_padding(size_t alignment);
+static size_t mem_get_block_size(size_t capacity, size_t alignment);
+static void mem_link_block(struct mem_pool_type *, struct mem_block_type *);
+static void mem_unlink_block(struct mem_pool_type *, struct mem_block_type *);
+static struct mem_block_type *mem_split(struct mem_block_type **, size_t);
+static void mem_deposit(struct mem_block_type *, size_t, size_t, size_t);
+static void mem_trim_pool(struct mem_pool_type *);
+static void mem_trim_depot();
+static bool mem_is_trim_due(const struct mem_pool_type *);
+static size_t mem_advise(struct mem_block_type *);
+static void mem_release_pages(size_t keep);
+static struct mem_block_type *mem_cut(struct mem_block_type **, size_t);
+static uint64_t mem_get_msec();
+static size_t mem_free_list(struct mem_block_type *);
+static void mem_count(atomic_size_t *, size_t add, size_t sub);
+
+MEM *(mem_new)(size_t alignment, size_t size) {
+    // The name is in parentheses to keep the macro of the debug build from
+    // replacing it.
+
+    if (!size || size > MEM_SIZE_MAX) {
+        FUSE();
+        return nullptr;
+    }
+
+    if (!stdc_has_single_bit(alignment)
+    || alignof(max_align_t) < alignment) {
+        BUG_ONCE("alignment of %lu is unacceptable", alignment);
+        return nullptr;
+    }
+
+    alignment = umax_size(alignment, alignof(struct mem_block_type));
+
+    const size_t align_index = stdc_trailing_zeros(alignment);
+
+    if (align_index >= MEM_ALIGN_COUNT) {
+        FUSE();
+        return nullptr;
+    }
+
+    struct mem_pool_type *pool = mem_get_pool();
+
+    if (!pool) {
+        return nullptr;
+    }
+
+    if (atomic_load_explicit(&pool->remote, memory_order_relaxed)) {
+        mem_collect(pool);
+    }
+
+    // The slots of a page are aligned to 16 bytes at least, which is as much
+    // as can be asked for. Should the slab pages run out, the small classes
+    // are allocated one by one like the others.
+
+    const size_t class = mem_get_class(size);
+    MEM *mem = class < MEM_SLAB_CLASS_COUNT ? mem_carve(pool, class) : nullptr;
+
+    if (!mem && (mem = mem_take(pool, class, alignment)) == nullptr) {
+        return nullptr;
+    }
+
+    const size_t footprint = mem_get_footprint(mem);
+
+    mem_count(&pool->count.live, footprint, 0);
+    mem_count(&pool->count.blocks[class], 1, 0);
+    mem_count(&pool->count.allocations[class], 1, 0);
+    mem_count(&pool->count.aligned[align_index], 1, 0);
+    mem_count(&pool->count.requested, size, 0);
+    mem_count(&pool->count.reserved, footprint, 0);
+
+    if (atomic_load_explicit(&pool->count.live, memory_order_relaxed)
+    >   atomic_load_explicit(&pool->count.peak, memory_order_relaxed)) {
+        atomic_store_explicit(
+            &pool->count.peak,
+            atomic_load_explicit(&pool->count.live, memory_order_relaxed),
+            memory_order_relaxed
+        );
+    }
+
+    return mem;
+}
+
+void mem_free(MEM *mem) {
+    if (!mem) {
+        return;
+    }
+
+    if (!mem->capacity) {
+        FUSE();
+        return;
+    }
+
+#ifdef ANSICRAWL_DEBUG
+    if (mem->site) {
+        atomic_fetch_sub_explicit(&mem->site->live, 1, memory_order_relaxed);
+        atomic_fetch_sub_explicit(
+            &mem->site->live_bytes, mem->size, memory_order_relaxed
+        );
+        mem->site = nullptr;
+    }
+#endif
+
+    const struct mem_page_type *page = mem_find_page(mem->data);
+    struct mem_pool_type *owner = (
+        page ? page->pool : ((struct mem_block_type *) mem)->pool
+    );
+
+    if (owner != mem_pool) {
+        // Only the owner may touch the lists of its blocks, so the block is
+        // handed back to it without taking any locks. The data of the freed
+        // block links the list.
+
+        MEM **next = mem->data;
+
+        *next = atomic_load_explicit(&owner->remote, memory_order_relaxed);
+
+        while (!atomic_compare_exchange_weak_explicit(
+            &owner->remote, next, mem,
+            memory_order_release, memory_order_relaxed
+        ));
+
+        return;
+    }
+
+    mem_release(owner, mem);
+}
+
+MEM *mem_resize(MEM *mem, size_t alignment, size_t size) {
+    // Returns memory of at least size bytes that starts with the contents of
+    // the given memory, which is freed unless it is returned itself. On
+    // failure, nullptr is returned and the given memory is left as it is.
+    // The blocks too big for the slabs are grown in place by realloc when
+    // the heap has room after them.
+
+    if (size <= mem->capacity) {
+        return mem;
+    }
+
+    const size_t class = mem_get_class(size);
+    struct mem_block_type *block = (struct mem_block_type *) mem;
+
+    if (size > MEM_SIZE_MAX
+    ||  class < MEM_SLAB_CLASS_COUNT
+    ||  mem_find_page(mem->data)
+    ||  block->pool != mem_pool
+    ||  block->alignment != umax_size(
+            alignment, alignof(struct mem_block_type)
+        )) {
+        MEM *new_mem = (mem_new)(alignment, size);
+
+        if (!new_mem) {
+            return nullptr;
+        }
+
+        memcpy(new_mem->data, mem->data, mem->capacity);
+
+#ifdef ANSICRAWL_DEBUG
+        if ((new_mem->site = mem->site) != nullptr) {
+            atomic_fetch_add_explicit(
+                &new_mem->site->live, 1, memory_order_relaxed
+            );
+            atomic_fetch_add_explicit(
+                &new_mem->site->live_bytes, size, memory_order_relaxed
+            );
+        }
+
+        new_mem->size = size;
+#endif
+
+        mem_free(mem);
+
+        return new_mem;
+    }
+
+    // The block is taken out of the list of the pool while it may move.
+
+    struct mem_pool_type *pool = block->pool;
+    const size_t old_class = mem_get_class(mem->capacity);
+    const size_t old_footprint = mem_get_footprint(mem);
+    const size_t capacity = mem_get_class_size(class);
+    const size_t footprint = mem_get_block_size(capacity, block->alignment);
+
+    mem_unlink_block(pool, block);
+
+    struct mem_block_type *new_block = realloc(block, footprint);
+
+    if (!new_block) {
+        BUG_ONCE("failed to allocate %lu bytes", footprint);
+        mem_link_block(pool, block);
+        return nullptr;
+    }
+
+    const size_t padding = mem_get_padding(new_block->alignment);
+
+    new_block->mem.data = ((char *) new_block) + sizeof(*new_block) + padding;
+    new_block->mem.capacity = capacity;
+    mem_link_block(pool, new_block);
+
+#ifdef ANSICRAWL_DEBUG
+    if (new_block->mem.site) {
+        atomic_fetch_add_explicit(
+            &new_block->mem.site->live_bytes, size - new_block->mem.size,
+            memory_order_relaxed
+        );
+    }
+
+    new_block->mem.size = size;
+#endif
+
+    mem_count(&pool->count.live, footprint, old_footprint);
+    mem_count(&pool->count.blocks[old_class], 0, 1);
+    mem_count(&pool->count.blocks[class], 1, 0);
+    mem_count(&pool->count.allocations[class], 1, 0);
+    mem_count(&pool->count.requested, size, 0);
+    mem_count(&pool->count.reserved, footprint, 0);
+
+    if (atomic_load_explicit(&pool->count.live, memory_order_relaxed)
+    >   atomic_load_explicit(&pool->count.peak, memory_order_relaxed)) {
+        atomic_store_explicit(
+            &pool->count.peak,
+            atomic_load_explicit(&pool->count.live, memory_order_relaxed),
+            memory_order_relaxed
+        );
+    }
+
+    return &new_block->mem;
+}
+
+size_t mem_get_footprint(const MEM *mem) {
+    if (mem_find_page(mem->data)) {
+        return sizeof(*mem) + mem->capacity;
+    }
+
+    const struct mem_block_type *block = (const struct mem_block_type *) mem;
+
+    return mem_get_block_size(mem->capacity, block->alignment);
+}
+
+size_t mem_get_usage() {
+    // Counts the memory of the calling thread and whatever the depot holds.
+
+    return mem_get_thread_usage() + atomic_load_explicit(
+        &mem_depot.cached, memory_order_relaxed
+    );
+}
+
+size_t mem_get_thread_usage() {
+    // Counts only the memory of the calling thread, which is unaffected by
+    // what the other threads leave in the depot.
+
+    struct mem_pool_type *pool = mem_get_pool();
+
+    if (!pool) {
+        return 0;
+    }
+
+    mem_collect(pool);
+
+    return (
+        atomic_load_explicit(&pool->count.live, memory_order_relaxed) +
+        atomic_load_explicit(&pool->count.cached, memory_order_relaxed)
+    );
+}
+
+void mem_get_stats(struct mem_stats_type *stats) {
+    // Sums up the counters of every pool. The counters of the other threads
+    // may be a moment old, but reading them costs nothing to their owners.
+
+    static struct mem_stats_type zero;
+
+    *stats = zero;
+
+    pthread_mutex_lock(&mem_depot.lock);
+
+    stats->depot = atomic_load_explicit(
+        &mem_depot.cached, memory_order_relaxed
+    );
+    stats->advised = atomic_load_explicit(
+        &mem_depot.advised, memory_order_relaxed
+    );
+    stats->trimmed = atomic_load_explicit(
+        &mem_depot.trimmed, memory_order_relaxed
+    );
+
+    for (auto pool = mem_depot.pools; pool; pool = pool->next) {
+        stats->live += atomic_load_explicit(
+            &pool->count.live, memory_order_relaxed
+        );
+        stats->cached += atomic_load_explicit(
+            &pool->count.cached, memory_order_relaxed
+        );
+        stats->peak += atomic_load_explicit(
+            &pool->count.peak, memory_order_relaxed
+        );
+        stats->requested += atomic_load_explicit(
+            &pool->count.requested, memory_order_relaxed
+        );
+        stats->reserved += atomic_load_explicit(
+            &pool->count.reserved, memory_order_relaxed
+        );
+
+        for (size_t i=0; i<MEM_CLASS_COUNT; ++i) {
+            stats->size_class[i].blocks += atomic_load_explicit(
+                &pool->count.blocks[i], memory_order_relaxed
+            );
+            stats->size_class[i].allocations += atomic_load_explicit(
+                &pool->count.allocations[i], memory_order_relaxed
+            );
+        }
+
+        for (size_t i=0; i<MEM_ALIGN_COUNT; ++i) {
+            stats->align_class[i].allocations += atomic_load_explicit(
+                &pool->count.aligned[i], memory_order_relaxed
+            );
+        }
+    }
+
+    pthread_mutex_unlock(&mem_depot.lock);
+}
+
+void mem_report() {
+    // Logs the counters of the memory and, in the debug build, the call sites
+    // that have allocated the most and the ones whose memory is in use.
+
+    struct mem_stats_type stats;
+
+    mem_get_stats(&stats);
+
+    LOG(
+        "mem: %lu bytes in use (%lu at peak), %lu cached, %lu in the depot",
+        stats.live, stats.peak, stats.cached, stats.depot
+    );
+
+    LOG(
+        "mem: %lu bytes retained for %lu in use, %lu given back, %lu trimmed",
+        stats.cached + stats.depot - stats.advised, stats.live,
+        stats.advised, stats.trimmed
+    );
+
+    LOG(
+        "mem: %lu bytes asked for and %lu reserved since the start",
+        stats.requested, stats.reserved
+    );
+
+#ifdef ANSICRAWL_DEBUG
+    struct mem_site_type *sites[MEM_SITE_COUNT];
+    size_t count = 0;
+
+    for (size_t i=0; i<MEM_SITE_COUNT; ++i) {
+        if (atomic_load_explicit(&mem_site[i].file, memory_order_acquire)) {
+            sites[count++] = &mem_site[i];
+        }
+    }
+
+    qsort(sites, count, sizeof(sites[0]), mem_compare_allocations);
+
+    LOG("mem: the call sites that allocate the most");
+
+    for (size_t i=0; i<count && i<MEM_REPORT_COUNT; ++i) {
+        mem_report_site(sites[i]);
+    }
+
+    qsort(sites, count, sizeof(sites[0]), mem_compare_live_bytes);
+
+    LOG("mem: the call sites whose memory is in use");
+
+    for (size_t i=0; i<count; ++i) {
+        if (atomic_load_explicit(&sites[i]->live, memory_order_relaxed)) {
+            mem_report_site(sites[i]);
+        }
+    }
+#endif
+}
+
+void mem_recycle() {
+    // Releases the free blocks and the empty pages of the calling thread and
+    // of the depot. The blocks that were freed remotely to the orphaned pools
+    // end up in the depot first.
+
+    struct mem_pool_type *pool = mem_get_pool();
+
+    if (mem_arena.chunk && !mem_arena.begun) {
+        mem_free(mem_arena.chunk);
+        mem_arena.chunk = nullptr;
+    }
+
+    if (pool) {
+        mem_collect(pool);
+
+        for (size_t i=0; i<MEM_CLASS_COUNT; ++i) {
+            for (size_t j=0; j<MEM_ALIGN_COUNT; ++j) {
+                mem_count(
+                    &pool->count.cached, 0,
+                    mem_free_list(pool->free.memory[i][j])
+                );
+                pool->free.memory[i][j] = nullptr;
+                pool->free.count[i][j] = 0;
+                pool->free.low[i][j] = 0;
+            }
+        }
+
+        mem_drop_empty_pages(pool, true);
+    }
+
+    pthread_mutex_lock(&mem_depot.lock);
+
+    for (auto next = mem_depot.pools; next; next = next->next) {
+        if (next->orphaned) {
+            mem_collect(next);
+
+            for (size_t i=0; i<MEM_CLASS_COUNT; ++i) {
+                for (size_t j=0; j<MEM_ALIGN_COUNT; ++j) {
+                    mem_count(
+                        &next->count.cached, 0,
+                        mem_free_list(next->free.memory[i][j])
+                    );
+                    next->free.memory[i][j] = nullptr;
+                    next->free.count[i][j] = 0;
+                    next->free.low[i][j] = 0;
+                }
+            }
+
+            mem_drop_empty_pages(next, false);
+        }
+    }
+
+    for (size_t i=0; i<MEM_CLASS_COUNT; ++i) {
+        for (size_t j=0; j<MEM_ALIGN_COUNT; ++j) {
+            mem_count(
+                &mem_depot.cached, 0,
+                mem_free_list(mem_depot.free.memory[i][j])
+            );
+            mem_depot.free.memory[i][j] = nullptr;
+            mem_depot.free.count[i][j] = 0;
+            mem_depot.free.low[i][j] = 0;
+        }
+    }
+
+    atomic_store_explicit(&mem_depot.advised, 0, memory_order_relaxed);
+    mem_release_pages(0);
+
+    pthread_mutex_unlock(&mem_depot.lock);
+}
+
+void mem_clear() {
+    mem_recycle();
+
+    struct mem_pool_type *pool = mem_get_pool();
+
+    if (!pool) {
+        return;
+    }
+
+    mem_count(&pool->count.live, 0, mem_free_list(pool->list.memory));
+    pool->list.memory = nullptr;
+
+    // The pages of the slots still in use are dropped as if the slots had
+    // been freed.
+
+    for (size_t i=0; i<MEM_PAGE_COUNT && mem_slab.base; ++i) {
+        struct mem_page_type *page = mem_slab.page[i];
+
+        if (!page || page->pool != pool) {
+            continue;
+        }
+
+        const size_t footprint = page->used * (sizeof(MEM) + page->slot_size);
+
+        if (page->used == page->slot_count) {
+            mem_link_page(pool, page);
+        }
+
+        if (page->used) {
+            pool->slab.empty[page->class]++;
+            page->used = 0;
+        }
+
+        mem_count(&pool->count.live, 0, footprint);
+        mem_count(&pool->count.cached, footprint, 0);
+        mem_drop_page(pool, page, true);
+    }
+
+    for (size_t i=0; i<MEM_CLASS_COUNT; ++i) {
+        atomic_store_explicit(&pool->count.blocks[i], 0, memory_order_relaxed);
+    }
+}
+
+void mem_set_policy(const struct mem_policy_type *policy) {
+    atomic_store_explicit(
+        &mem_policy.cache_size, policy->cache_size, memory_order_relaxed
+    );
+    atomic_store_explicit(
+        &mem_policy.depot_size, policy->depot_size, memory_order_relaxed
+    );
+    atomic_store_explicit(
+        &mem_policy.advise_size, policy->advise_size, memory_order_relaxed
+    );
+    atomic_store_explicit(
+        &mem_policy.trim_msec, policy->trim_msec, memory_order_relaxed
+    );
+}
+
+void mem_get_policy(struct mem_policy_type *policy) {
+    *policy = (struct mem_policy_type) {
+        .cache_size = atomic_load_explicit(
+            &mem_policy.cache_size, memory_order_relaxed
+        ),
+        .depot_size = atomic_load_explicit(
+            &mem_policy.depot_size, memory_order_relaxed
+        ),
+        .advise_size = atomic_load_explicit(
+            &mem_policy.advise_size, memory_order_relaxed
+        ),
+        .trim_msec = atomic_load_explicit(
+            &mem_policy.trim_msec, memory_order_relaxed
+        )
+    };
+}
+
+size_t mem_trim() {
+    // Trims the free memory of the calling thread if the interval of the
+    // policy has passed since it was last trimmed. The orphaned pools and the
+    // depot are trimmed by whichever thread gets to them first.
+    //
+    // Returns the milliseconds until the next trim is due, or zero if another
+    // trim would give nothing back, so that the caller could sleep for as long
+    // as it has nothing else to do. That is the case once a trim has moved no
+    // memory and the thread has neither allocated nor freed any since the one
+    // before it, because only the blocks that stayed unused between two trims
+    // are moved.
+
+    const uint64_t trim_msec = atomic_load_explicit(
+        &mem_policy.trim_msec, memory_order_relaxed
+    );
+    struct mem_pool_type *pool = mem_get_pool();
+
+    if (!pool || !trim_msec) {
+        return 0;
+    }
+
+    mem_collect(pool);
+
+    if (!mem_is_trim_due(pool)) {
+        return 0;
+    }
+
+    const uint64_t now = mem_get_msec();
+
+    if (now - pool->trim.time < trim_msec) {
+        return (size_t) (trim_msec - (now - pool->trim.time));
+    }
+
+    const size_t cached = atomic_load_explicit(
+        &pool->count.cached, memory_order_relaxed
+    );
+
+    pool->trim.time = now;
+
+    pthread_mutex_lock(&mem_depot.lock);
+
+    const size_t depot_cached = atomic_load_explicit(
+        &mem_depot.cached, memory_order_relaxed
+    );
+    const size_t depot_advised = atomic_load_explicit(
+        &mem_depot.advised, memory_order_relaxed
+    );
+
+    mem_trim_pool(pool);
+
+    for (auto next = mem_depot.pools; next; next = next->next) {
+        if (next->orphaned) {
+            mem_collect(next);
+            mem_trim_pool(next);
+        }
+    }
+
+    if (now - mem_depot.time >= trim_msec) {
+        mem_depot.time = now;
+        mem_trim_depot();
+    }
+
+    const bool moved = (
+        cached != atomic_load_explicit(
+            &pool->count.cached, memory_order_relaxed
+        ) || depot_cached != atomic_load_explicit(
+            &mem_depot.cached, memory_order_relaxed
+        ) || depot_advised != atomic_load_explicit(
+            &mem_depot.advised, memory_order_relaxed
+        )
+    );
+
+    pthread_mutex_unlock(&mem_depot.lock);
+
+    const size_t requested = atomic_load_explicit(
+        &pool->count.requested, memory_order_relaxed
+    );
+    const size_t live = atomic_load_explicit(
+        &pool->count.live, memory_order_relaxed
+    );
+
+    pool->trim.due = (
+        moved || requested != pool->trim.requested || live != pool->trim.live
+    );
+    pool->trim.requested = requested;
+    pool->trim.live = live;
+
+    return pool->trim.due ? (size_t) trim_msec : 0;
+}
+
+void mem_arena_begin() {
+    // Starts a scope whose allocations from the arena are released together
+    // by mem_arena_reset.
+
+    if (mem_arena.begun) {
+        BUG("the arena is already in use");
+        return;
+    }
+
+    mem_arena.begun = true;
+    mem_arena.used = MEM_ARENA_HEADER;
+}
+
+void *mem_arena_alloc(size_t alignment, size_t size) {
+    // Returns nullptr if no scope has been started, so that the caller could
+    // allocate the memory elsewhere.
+
+    if (!mem_arena.begun) {
+        return nullptr;
+    }
+
     if (!size) {
         FUSE();
         return nullptr;
     }
 
-    size = stdc_bit_ceil(size);
+    if (!stdc_has_single_bit(alignment)
+    || alignof(max_align_t) < alignment) {
+        BUG_ONCE("alignment of %lu is unacceptable", alignment);
+        return nullptr;
+    }
+
+    MEM *chunk = mem_arena.chunk;
+    size_t offset = (mem_arena.used + alignment - 1) & ~(alignment - 1);
+
+    if (!chunk
+    ||  offset > chunk->capacity
+    ||  size > chunk->capacity - offset) {
+        chunk = mem_new(
+            alignof(max_align_t),
+            umax_size(MEM_ARENA_SIZE, MEM_ARENA_HEADER + size)
+        );
+
+        if (!chunk) {
+            return nullptr;
+        }
+
+        *((MEM **) chunk->data) = mem_arena.chunk;
+        mem_arena.chunk = chunk;
+        offset = MEM_ARENA_HEADER;
+    }
+
+    mem_arena.used = offset + size;
+
+    return ((char *) chunk->data) + offset;
+}
+
+void mem_arena_reset() {
+    // Releases all the memory of the arena except for the first chunk, which
+    // is kept for the next scope.
+
+    MEM *chunk = mem_arena.chunk;
+
+    while (chunk && *((MEM **) chunk->data)) {
+        MEM *chunk_prev = *((MEM **) chunk->data);
+
+        mem_free(chunk);
+        chunk = chunk_prev;
+    }
+
+    mem_arena.chunk = chunk;
+    mem_arena.used = MEM_ARENA_HEADER;
+    mem_arena.begun = false;
+}
+
+static struct mem_pool_type *mem_get_pool() {
+    if (mem_pool) {
+        return mem_pool;
+    }
+
+    pthread_once(&mem_depot.once, mem_init_depot);
+    pthread_mutex_lock(&mem_depot.lock);
+
+    struct mem_pool_type *pool = mem_depot.pools;
+
+    while (pool && !pool->orphaned) {
+        pool = pool->next;
+    }
+
+    if (pool) {
+        pool->orphaned = false;
+    }
+    else if ((pool = calloc(1, sizeof(*pool))) != nullptr) {
+        pool->next = mem_depot.pools;
+        mem_depot.pools = pool;
+    }
+
+    pthread_mutex_unlock(&mem_depot.lock);
+
+    if (!pool) {
+        BUG_ONCE("failed to allocate %lu bytes", sizeof(*pool));
+        return nullptr;
+    }
+
+    // The key only serves to get the pool orphaned when the thread exits.
+
+    pthread_setspecific(mem_depot.key, pool);
+
+    return (mem_pool = pool);
+}
+
+static void mem_init_depot() {
+    if (pthread_key_create(&mem_depot.key, mem_orphan_pool)) {
+        BUG("failed to create a thread-specific key");
+    }
+
+    mem_slab.free = MEM_PAGE_NONE;
+    mem_slab.released = MEM_PAGE_NONE;
+
+    const long page_size = sysconf(_SC_PAGESIZE);
+
+    mem_depot.page_size = page_size > 0 ? (size_t) page_size : 4096;
+
+    // The region is only backed by memory where the pages are touched. One
+    // extra page is reserved to align the region to the size of a page.
+
+    const size_t size = (MEM_PAGE_COUNT + 1) * MEM_PAGE_SIZE;
+    void *region = mmap(
+        nullptr, size, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0
+    );
+
+    if (region == MAP_FAILED) {
+        WARN("failed to reserve %lu bytes for the slabs", size);
+        return;
+    }
+
+    const uintptr_t address = (uintptr_t) region + MEM_PAGE_SIZE - 1;
+
+    mem_slab.base = (char *) (address - address % MEM_PAGE_SIZE);
+}
+
+static void mem_orphan_pool(void *arg) {
+    struct mem_pool_type *pool = arg;
+
+    mem_collect(pool);
+
+    pthread_mutex_lock(&mem_depot.lock);
+
+    for (size_t i=0; i<MEM_CLASS_COUNT; ++i) {
+        for (size_t j=0; j<MEM_ALIGN_COUNT; ++j) {
+            struct mem_block_type *list = pool->free.memory[i][j];
+            const size_t count = pool->free.count[i][j];
+
+            if (list) {
+                mem_count(
+                    &pool->count.cached, 0,
+                    count * mem_get_footprint(&list->mem)
+                );
+                mem_deposit(list, count, i, j);
+            }
+
+            pool->free.memory[i][j] = nullptr;
+            pool->free.count[i][j] = 0;
+            pool->free.low[i][j] = 0;
+        }
+    }
+
+    mem_drop_empty_pages(pool, false);
+
+    pool->orphaned = true;
+
+    pthread_mutex_unlock(&mem_depot.lock);
+
+    mem_pool = nullptr;
+}
+
+static void mem_collect(struct mem_pool_type *pool) {
+    MEM *mem = atomic_exchange_explicit(
+        &pool->remote, nullptr, memory_order_acquire
+    );
+
+    while (mem) {
+        MEM *mem_next = *((MEM **) mem->data);
+
+        mem_release(pool, mem);
+        mem = mem_next;
+    }
+}
+
+static void mem_release(struct mem_pool_type *pool, MEM *mem) {
+    struct mem_page_type *page = mem_find_page(mem->data);
+    const size_t class = mem_get_class(mem->capacity);
+    const size_t footprint = (
+        page ? sizeof(*mem) + mem->capacity : mem_get_footprint(mem)
+    );
+
+    mem_count(&pool->count.live, 0, footprint);
+    mem_count(&pool->count.cached, footprint, 0);
+    mem_count(&pool->count.blocks[class], 0, 1);
+
+    if (page) {
+        *((MEM **) mem->data) = page->free;
+        page->free = mem;
+
+        if (page->used-- == page->slot_count) {
+            mem_link_page(pool, page);
+        }
+
+        if (!page->used && pool->slab.empty[class]++ && !pool->orphaned) {
+            mem_drop_page(pool, page, true);
+        }
+
+        return;
+    }
+
+    struct mem_block_type *block = (struct mem_block_type *) mem;
+    const size_t align_index = stdc_trailing_zeros(block->alignment);
 
-    static MEM mem_zero;
-    const size_t cap_index = stdc_trailing_zeros(size);
+    mem_unlink_block(pool, block);
 
-    MEM *mem;
+    struct mem_block_type **free = &pool->free.memory[class][align_index];
+    size_t *count = &pool->free.count[class][align_index];
 
-    if (cap_index >= ARRAY_LENGTH(global.free.memory)) {
-        FUSE();
-        return nullptr;
+    block->prev = nullptr;
+    block->next = *free;
+    *free = block;
+
+    const size_t cache_size = atomic_load_explicit(
+        &mem_policy.cache_size, memory_order_relaxed
+    );
+
+    if (++(*count) * mem->capacity <= cache_size
+    ||  *count < 2
+    ||  pool->orphaned) {
+        return;
     }
 
-    if (!stdc_has_single_bit(alignment)
-    || alignof(max_align_t) < alignment) {
-        BUG_ONCE("alignment of %lu is unacceptable", alignment);
-        return nullptr;
+    // Half of the cache of the class goes to the depot in one batch.
+
+    const size_t batch_size = *count / 2;
+    struct mem_block_type *batch = mem_split(free, batch_size);
+    size_t *low = &pool->free.low[class][align_index];
+
+    *count -= batch_size;
+    *low = umin_size(*low, *count);
+
+    mem_count(&pool->count.cached, 0, batch_size * footprint);
+
+    pthread_mutex_lock(&mem_depot.lock);
+    mem_deposit(batch, batch_size, class, align_index);
+    pthread_mutex_unlock(&mem_depot.lock);
+}
+
+static void mem_refill(
+    struct mem_pool_type *pool, size_t class, size_t align_index
+) {
+    // Takes a batch of free blocks from the depot, half as many as the cache
+    // of the class can hold.
+
+    const size_t capacity = mem_get_class_size(class);
+    const size_t cache_size = atomic_load_explicit(
+        &mem_policy.cache_size, memory_order_relaxed
+    );
+    const size_t batch = umax_size(cache_size / capacity / 2, 1);
+    struct mem_block_type **free = &mem_depot.free.memory[class][align_index];
+    size_t *depot_count = &mem_depot.free.count[class][align_index];
+    size_t *depot_low = &mem_depot.free.low[class][align_index];
+
+    pthread_mutex_lock(&mem_depot.lock);
+
+    struct mem_block_type *list = *free;
+    struct mem_block_type *last = list;
+    size_t count = list ? 1 : 0;
+
+    while (last && last->next && count < batch) {
+        last = last->next;
+        count++;
     }
 
-    alignment = umax_size(alignment, alignof(MEM));
+    const size_t footprint = list ? count * mem_get_footprint(&list->mem) : 0;
 
-    const size_t align_index = stdc_trailing_zeros(alignment);
+    if (last) {
+        *free = last->next;
+        last->next = nullptr;
+    }
 
-    if (align_index >= ARRAY_LENGTH(global.free.memory[cap_index])) {
-        FUSE();
-        return nullptr;
+    // The pages that were given back get touched again as soon as the blocks
+    // are used.
+
+    for (auto block = list; block; block = block->next) {
+        mem_count(&mem_depot.advised, 0, block->advised);
+        block->advised = 0;
     }
 
-    if (global.free.memory[cap_index][align_index] == nullptr) {
-        size_t padding = 0;
+    *depot_count -= count;
+    *depot_low = umin_size(*depot_low, *depot_count);
+    mem_count(&mem_depot.cached, 0, footprint);
 
-        if (sizeof(MEM) % alignment) {
-            padding = (
-                alignment + (sizeof(MEM) / alignment) * alignment
-            ) - sizeof(MEM);
-        }
+    pthread_mutex_unlock(&mem_depot.lock);
+
+    pool->free.memory[class][align_index] = list;
+    pool->free.count[class][align_index] = count;
+    mem_count(&pool->count.cached, footprint, 0);
+}
+
+static MEM *mem_take(
+    struct mem_pool_type *pool, size_t class, size_t alignment
+) {
+    // Returns a block that is preceded by its metadata, either from the free
+    // list of the class or newly allocated.
+
+    const size_t align_index = stdc_trailing_zeros(alignment);
+    struct mem_block_type **free = &pool->free.memory[class][align_index];
+    struct mem_block_type *block;
 
-        size_t total_size = sizeof(MEM) + padding + size;
+    if (*free == nullptr) {
+        mem_refill(pool, class, align_index);
+    }
+
+    if ((block = *free) != nullptr) {
+        size_t *count = &pool->free.count[class][align_index];
+        size_t *low = &pool->free.low[class][align_index];
+
+        *free = block->next;
+        *low = umin_size(*low, --(*count));
+        mem_count(&pool->count.cached, 0, mem_get_footprint(&block->mem));
+    }
+    else {
+        const size_t capacity = mem_get_class_size(class);
+        const size_t padding = mem_get_padding(alignment);
+        const size_t total_size = mem_get_block_size(capacity, alignment);
 
-        mem = aligned_alloc(alignment, total_size);
+        block = aligned_alloc(alignment, total_size);
 
-        if (!mem) {
+        if (!block) {
             BUG_ONCE("failed to allocate %lu bytes", total_size);
             return nullptr;
         }
 
-        *mem = mem_zero;
+        *block = (struct mem_block_type) {
+            .mem = {
+                .data = ((char *) block) + sizeof(*block) + padding,
+                .capacity = capacity
+            },
+            .alignment = alignment
+        };
+    }
+
+    block->pool = pool;
+    mem_link_block(pool, block);
+
+    return &block->mem;
+}
+
+static MEM *mem_carve(struct mem_pool_type *pool, size_t class) {
+    // Returns a slot from the first page of the class that has any free. The
+    // freed slots are reused before the page is cut any further.
+
+    struct mem_page_type *page = pool->slab.page[class];
+
+    if (!page && (page = mem_new_page(pool, class)) == nullptr) {
+        return nullptr;
+    }
 
-        mem->capacity = size;
-        mem->alignment = alignment;
-        mem->data = ((char *) mem) + sizeof(MEM) + padding;
+    MEM *mem = page->free;
+
+    if (mem) {
+        page->free = *((MEM **) mem->data);
     }
     else {
-        mem = global.free.memory[cap_index][align_index];
-        global.free.memory[cap_index][align_index] = mem->next;
+        mem = &page->mem[page->carved];
+        mem->data = page->data + page->carved++ * page->slot_size;
+        mem->capacity = page->slot_size;
+    }
+
+    if (!page->used++) {
+        pool->slab.low[class] = umin_size(
+            pool->slab.low[class], --pool->slab.empty[class]
+        );
+    }
+
+    if (page->used == page->slot_count) {
+        mem_unlink_page(pool, page);
+    }
+
+    mem_count(&pool->count.cached, 0, sizeof(*mem) + mem->capacity);
+
+    return mem;
+}
+
+static struct mem_page_type *mem_new_page(
+    struct mem_pool_type *pool, size_t class
+) {
+    // Takes a free page from the depot or an unused one from the region. The
+    // pages that have been given back to the system are only reused when
+    // there are no others.
+
+    if (!mem_slab.base) {
+        return nullptr;
+    }
+
+    const size_t slot_size = mem_get_class_size(class);
+    const size_t slot_count = MEM_PAGE_SIZE / slot_size;
+    const size_t size = sizeof(struct mem_page_type) + slot_count * sizeof(MEM);
+    struct mem_page_type *page = malloc(size);
+
+    if (!page) {
+        BUG_ONCE("failed to allocate %lu bytes", size);
+        return nullptr;
+    }
+
+    uint32_t index = MEM_PAGE_NONE;
+
+    pthread_mutex_lock(&mem_depot.lock);
+
+    if (mem_slab.free != MEM_PAGE_NONE) {
+        index = mem_slab.free;
+        mem_slab.free = mem_slab.next[index];
+        mem_slab.low = umin_size(mem_slab.low, --mem_slab.count);
+        mem_count(&mem_depot.cached, 0, MEM_PAGE_SIZE);
+    }
+    else if (mem_slab.released != MEM_PAGE_NONE) {
+        index = mem_slab.released;
+        mem_slab.released = mem_slab.next[index];
+    }
+    else if (mem_slab.carved < MEM_PAGE_COUNT) {
+        index = mem_slab.carved++;
+    }
+
+    pthread_mutex_unlock(&mem_depot.lock);
+
+    if (index == MEM_PAGE_NONE) {
+        free(page);
+        return nullptr;
+    }
+
+    *page = (struct mem_page_type) {
+        .pool = pool,
+        .data = mem_slab.base + index * MEM_PAGE_SIZE,
+        .class = class,
+        .slot_size = slot_size,
+        .slot_count = slot_count
+    };
+
+    mem_slab.page[index] = page;
+    mem_link_page(pool, page);
+    pool->slab.empty[class]++;
+    mem_count(&pool->count.cached, mem_get_page_footprint(page), 0);
+
+    return page;
+}
+
+static struct mem_page_type *mem_find_page(const void *data) {
+    const uintptr_t base = (uintptr_t) mem_slab.base;
+    const uintptr_t address = (uintptr_t) data;
+
+    if (!base
+    ||  address < base
+    ||  address - base >= MEM_PAGE_COUNT * MEM_PAGE_SIZE) {
+        return nullptr;
+    }
+
+    return mem_slab.page[(address - base) / MEM_PAGE_SIZE];
+}
+
+static void mem_drop_page(
+    struct mem_pool_type *pool, struct mem_page_type *page, bool lock
+) {
+    // Gives an empty page to the depot. Unless lock is set, the caller must
+    // hold the lock of the depot.
+
+    const uint32_t index = (uint32_t) (
+        (size_t) (page->data - mem_slab.base) / MEM_PAGE_SIZE
+    );
+
+    mem_unlink_page(pool, page);
+    pool->slab.low[page->class] = umin_size(
+        pool->slab.low[page->class], --pool->slab.empty[page->class]
+    );
+    mem_count(&pool->count.cached, 0, mem_get_page_footprint(page));
+    mem_slab.page[index] = nullptr;
+    free(page);
+
+    if (lock) {
+        pthread_mutex_lock(&mem_depot.lock);
+    }
+
+    mem_slab.next[index] = mem_slab.free;
+    mem_slab.free = index;
+    mem_slab.count++;
+    mem_count(&mem_depot.cached, MEM_PAGE_SIZE, 0);
+
+    if (lock) {
+        pthread_mutex_unlock(&mem_depot.lock);
+    }
+}
+
+static void mem_drop_empty_pages(struct mem_pool_type *pool, bool lock) {
+    for (size_t i=0; i<MEM_SLAB_CLASS_COUNT; ++i) {
+        struct mem_page_type *page = pool->slab.page[i];
 
-        if (mem->next) {
-            mem->next->prev = nullptr;
+        while (page && pool->slab.empty[i]) {
+            struct mem_page_type *page_next = page->next;
+
+            if (!page->used) {
+                mem_drop_page(pool, page, lock);
+            }
+
+            page = page_next;
         }
+    }
+}
+
+static void mem_link_page(
+    struct mem_pool_type *pool, struct mem_page_type *page
+) {
+    page->prev = nullptr;
+    page->next = pool->slab.page[page->class];
 
-        mem->prev = nullptr;
+    if (page->next) {
+        page->next->prev = page;
     }
 
-    mem->next = global.list.memory;
+    pool->slab.page[page->class] = page;
+}
+
+static void mem_unlink_page(
+    struct mem_pool_type *pool, struct mem_page_type *page
+) {
+    if (page->prev) {
+        page->prev->next = page->next;
+    }
+    else {
+        pool->slab.page[page->class] = page->next;
+    }
 
-    if (mem->next) {
-        mem->next->prev = mem;
+    if (page->next) {
+        page->next->prev = page->prev;
     }
 
-    global.list.memory = mem;
+    page->next = nullptr;
+    page->prev = nullptr;
+}
 
-    return mem;
+static size_t mem_get_page_footprint(const struct mem_page_type *page) {
+    return (
+        MEM_PAGE_SIZE + sizeof(*page) + page->slot_count * sizeof(page->mem[0])
+    );
 }
 
-void mem_free(MEM *mem) {
-    if (!mem) {
-        return;
+static size_t mem_get_class(size_t size) {
+    if (size <= 256) {
+        return size ? (size - 1) / 16 : 0;
     }
 
-    if (!mem->capacity) {
-        FUSE();
-        return;
+    const size_t order = stdc_bit_width(size - 1) - 1;
+
+    const size_t step = (size - 1 - ((size_t) 1 << order)) >> (order - 2);
+
+    return 16 + (order - 8) * 4 + step;
+}
+
+static size_t mem_get_class_size(size_t class) {
+    if (class < 16) {
+        return (class + 1) * 16;
     }
 
-    const size_t cap_index = stdc_trailing_zeros(mem->capacity);
+    const size_t order = 8 + (class - 16) / 4;
 
-    if (cap_index >= ARRAY_LENGTH(global.free.memory)) {
-        FUSE();
-        return;
+    const size_t step = (class - 16) % 4 + 1;
+
+    return ((size_t) 1 << order) + (step << (order - 2));
+}
+
+static size_t mem_get_block_size(size_t capacity, size_t alignment) {
+    // Returns the footprint of a block, which is a multiple of its alignment
+    // as the size given to aligned_alloc must be.
+
+    size_t size = (
+        sizeof(struct mem_block_type) + mem_get_padding(alignment) + capacity
+    );
+
+    if (size % alignment) {
+        size += alignment - size % alignment;
     }
 
-    const size_t align_index = stdc_trailing_zeros(mem->alignment);
+    return size;
+}
 
-    if (align_index >= ARRAY_LENGTH(global.free.memory[cap_index])) {
-        FUSE();
-        return;
+static void mem_link_block(
+    struct mem_pool_type *pool, struct mem_block_type *block
+) {
+    block->prev = nullptr;
+    block->next = pool->list.memory;
+
+    if (block->next) {
+        block->next->prev = block;
     }
 
-    if (global.list.memory == mem) {
-        global.list.memory = mem->next;
+    pool->list.memory = block;
+}
+
+static void mem_unlink_block(
+    struct mem_pool_type *pool, struct mem_block_type *block
+) {
+    if (pool->list.memory == block) {
+        pool->list.memory = block->next;
 
-        if (mem->next) {
-            mem->next->prev = nullptr;
+        if (block->next) {
+            block->next->prev = nullptr;
         }
     }
     else {
-        if (mem->prev == nullptr) {
+        if (block->prev == nullptr) {
             BUG_ONCE("memory not found in the list");
         }
         else {
-            mem->prev->next = mem->next;
+            block->prev->next = block->next;
 
-            if (mem->next) {
-                mem->next->prev = mem->prev;
+            if (block->next) {
+                block->next->prev = block->prev;
             }
         }
     }
+}
+
+static size_t mem_get_padding(size_t alignment) {
+    // Returns the distance from the end of the header of a block to its data.
+
+    const size_t remainder = sizeof(struct mem_block_type) % alignment;
+
+    return remainder ? alignment - remainder : 0;
+}
+
+static struct mem_block_type *mem_split(
+    struct mem_block_type **list, size_t count
+) {
+    // Detaches the first count blocks of the list and returns them.
 
-    mem->prev = nullptr;
-    mem->next = global.free.memory[cap_index][align_index];
+    struct mem_block_type *head = *list;
+    struct mem_block_type *last = head;
 
-    if (mem->next) {
-        mem->next->prev = mem;
+    for (size_t i=1; i<count && last->next; ++i) {
+        last = last->next;
     }
 
-    global.free.memory[cap_index][align_index] = mem;
+    *list = last->next;
+    last->next = nullptr;
+
+    return head;
 }
 
-size_t mem_get_footprint(const MEM *mem) {
-    size_t padding = 0;
+static void mem_deposit(
+    struct mem_block_type *list, size_t count, size_t class, size_t align_index
+) {
+    // Gives a list of count free blocks to the depot, which must be locked.
+    // The blocks that do not fit within the limit of the depot are released.
+
+    const size_t footprint = mem_get_footprint(&list->mem);
+    const size_t limit = (
+        atomic_load_explicit(&mem_policy.depot_size, memory_order_relaxed) /
+        footprint
+    );
+    size_t *depot_count = &mem_depot.free.count[class][align_index];
+    const size_t accepted = (
+        *depot_count < limit ? umin_size(limit - *depot_count, count) : 0
+    );
+
+    if (accepted) {
+        struct mem_block_type *batch = mem_split(&list, accepted);
+        struct mem_block_type *last = batch;
+
+        while (last->next) {
+            last = last->next;
+        }
 
-    if (sizeof(MEM) % mem->alignment) {
-        padding = (
-            mem->alignment + (sizeof(*mem) / mem->alignment) * mem->alignment
-        ) - sizeof(MEM);
+        last->next = mem_depot.free.memory[class][align_index];
+        mem_depot.free.memory[class][align_index] = batch;
+        *depot_count += accepted;
+        mem_count(&mem_depot.cached, accepted * footprint, 0);
     }
 
-    size_t footprint = sizeof(*mem) + padding + mem->capacity;
+    mem_count(&mem_depot.trimmed, mem_free_list(list), 0);
+}
+
+static void mem_trim_pool(struct mem_pool_type *pool) {
+    // Hands the blocks and the empty pages that the pool has not needed since
+    // it was last trimmed over to the depot, which must be locked. An orphaned
+    // pool hands over everything.
+
+    for (size_t i=0; i<MEM_CLASS_COUNT; ++i) {
+        for (size_t j=0; j<MEM_ALIGN_COUNT; ++j) {
+            struct mem_block_type **free = &pool->free.memory[i][j];
+            size_t *count = &pool->free.count[i][j];
+            const size_t low = pool->orphaned ? *count : pool->free.low[i][j];
+            const size_t idle = umin_size(low, *count);
+
+            if (idle) {
+                struct mem_block_type *tail = mem_cut(free, *count - idle);
+
+                *count -= idle;
+                mem_count(
+                    &pool->count.cached, 0,
+                    idle * mem_get_footprint(&tail->mem)
+                );
+                mem_deposit(tail, idle, i, j);
+            }
+
+            pool->free.low[i][j] = *count;
+        }
+    }
 
-    if (footprint % mem->alignment) {
-        footprint = (
-            mem->alignment + (footprint / mem->alignment) * mem->alignment
+    for (size_t i=0; i<MEM_SLAB_CLASS_COUNT; ++i) {
+        struct mem_page_type *page = pool->slab.page[i];
+        size_t idle = (
+            pool->orphaned ? pool->slab.empty[i] : pool->slab.low[i]
         );
+
+        while (page && idle) {
+            struct mem_page_type *page_next = page->next;
+
+            if (!page->used) {
+                mem_drop_page(pool, page, false);
+                idle--;
+            }
+
+            page = page_next;
+        }
+
+        pool->slab.low[i] = pool->slab.empty[i];
     }
+}
 
-    return footprint;
+static bool mem_is_trim_due(const struct mem_pool_type *pool) {
+    // Tells whether a trim might give back more of the free memory, which it
+    // can only do if the last one might have or the memory has been used since.
+
+    return (
+        pool->trim.due || pool->trim.requested != atomic_load_explicit(
+            &pool->count.requested, memory_order_relaxed
+        ) || pool->trim.live != atomic_load_explicit(
+            &pool->count.live, memory_order_relaxed
+        )
+    );
 }
 
-size_t mem_get_usage() {
-    size_t usage = 0;
+static void mem_trim_depot() {
+    // Gives back the memory of the free blocks and pages that the depot, which
+    // must be locked, has not needed since it was last trimmed. The pages of
+    // the big blocks are given back first and the blocks themselves released
+    // if they stay unused until the next trim.
+
+    const size_t advise_size = atomic_load_explicit(
+        &mem_policy.advise_size, memory_order_relaxed
+    );
+
+    for (size_t i=0; i<MEM_CLASS_COUNT; ++i) {
+        for (size_t j=0; j<MEM_ALIGN_COUNT; ++j) {
+            struct mem_block_type **list = &mem_depot.free.memory[i][j];
+            size_t *count = &mem_depot.free.count[i][j];
+            const size_t idle = umin_size(mem_depot.free.low[i][j], *count);
+
+            if (!idle) {
+                mem_depot.free.low[i][j] = *count;
+                continue;
+            }
+
+            struct mem_block_type *tail = mem_cut(list, *count - idle);
+            struct mem_block_type *advised = nullptr;
+
+            while (tail) {
+                struct mem_block_type *block = tail;
+
+                tail = block->next;
 
-    for (size_t i=0; i<ARRAY_LENGTH(global.free.memory); ++i) {
-        for (size_t j=0; j<ARRAY_LENGTH(global.free.memory[i]); ++j) {
-            MEM *mem = global.free.memory[i][j];
+                if (!block->advised
+                &&  block->mem.capacity >= advise_size
+                &&  (block->advised = mem_advise(block)) != 0) {
+                    mem_count(&mem_depot.advised, block->advised, 0);
+                    block->next = advised;
+                    advised = block;
+                    continue;
+                }
 
-            while (mem) {
-                usage += mem_get_footprint(mem);
-                mem = mem->next;
+                const size_t footprint = mem_get_footprint(&block->mem);
+
+                mem_count(&mem_depot.advised, 0, block->advised);
+                mem_count(&mem_depot.cached, 0, footprint);
+                mem_count(&mem_depot.trimmed, footprint, 0);
+                free(block);
+                (*count)--;
+            }
+
+            // The blocks that were given back stay at the end of the list, so
+            // that they are the last to be reused.
+
+            while (*list) {
+                list = &(*list)->next;
             }
+
+            *list = advised;
+            mem_depot.free.low[i][j] = *count;
         }
     }
 
-    MEM *mem = global.list.memory;
+    const size_t idle = umin_size(mem_slab.low, mem_slab.count);
 
-    while (mem) {
-        usage += mem_get_footprint(mem);
-        mem = mem->next;
+    mem_count(&mem_depot.trimmed, idle * MEM_PAGE_SIZE, 0);
+    mem_release_pages(mem_slab.count - idle);
+    mem_slab.low = mem_slab.count;
+}
+
+static size_t mem_advise(struct mem_block_type *block) {
+    // Gives the whole pages of the data of the block back to the system and
+    // returns their size.
+
+    const size_t page_size = mem_depot.page_size;
+    const uintptr_t data = (uintptr_t) block->mem.data;
+    const uintptr_t start = data + (page_size - data % page_size) % page_size;
+    const uintptr_t end = (
+        (data + block->mem.capacity) - (data + block->mem.capacity) % page_size
+    );
+
+    if (end <= start) {
+        return 0;
+    }
+
+    if (madvise((void *) start, end - start, MADV_DONTNEED)) {
+        BUG_ONCE("failed to release %lu bytes", end - start);
+        return 0;
     }
 
-    return usage;
+    return end - start;
 }
 
-void mem_recycle() {
-    for (size_t i=0; i<ARRAY_LENGTH(global.free.memory); ++i) {
-        for (size_t j=0; j<ARRAY_LENGTH(global.free.memory[i]); ++j) {
-            MEM *mem = global.free.memory[i][j];
-
-            while (mem) {
-                MEM *mem_next = mem->next;
-                free(mem);
-                mem = mem_next;
-            }
+static void mem_release_pages(size_t keep) {
+    // Gives the free pages after the first ones to keep back to the system.
+    // They keep their place in the region. The depot must be locked.
+
+    uint32_t *next = &mem_slab.free;
+
+    for (size_t i=0; i<keep && *next != MEM_PAGE_NONE; ++i) {
+        next = &mem_slab.next[*next];
+    }
+
+    while (*next != MEM_PAGE_NONE) {
+        const uint32_t index = *next;
 
-            global.free.memory[i][j] = nullptr;
+        if (madvise(
+            mem_slab.base + index * MEM_PAGE_SIZE, MEM_PAGE_SIZE, MADV_DONTNEED
+        )) {
+            BUG_ONCE("failed to release a page");
         }
+
+        *next = mem_slab.next[index];
+        mem_slab.next[index] = mem_slab.released;
+        mem_slab.released = index;
+        mem_slab.count--;
+        mem_count(&mem_depot.cached, 0, MEM_PAGE_SIZE);
     }
+
+    mem_slab.low = umin_size(mem_slab.low, mem_slab.count);
 }
 
-void mem_clear() {
-    mem_recycle();
+static struct mem_block_type *mem_cut(
+    struct mem_block_type **list, size_t count
+) {
+    // Detaches the blocks after the first count blocks of the list and returns
+    // them.
 
-    MEM *mem = global.list.memory;
+    while (*list && count--) {
+        list = &(*list)->next;
+    }
 
-    while (mem) {
-        MEM *mem_next = mem->next;
-        free(mem);
-        mem = mem_next;
+    struct mem_block_type *tail = *list;
+
+    *list = nullptr;
+
+    return tail;
+}
+
+static uint64_t mem_get_msec() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000 + (uint64_t) ts.tv_nsec / 1000000;
+}
+
+static size_t mem_free_list(struct mem_block_type *block) {
+    // Returns the footprint of the released blocks.
+
+    size_t footprint = 0;
+
+    while (block) {
+        struct mem_block_type *block_next = block->next;
+
+        footprint += mem_get_footprint(&block->mem);
+        free(block);
+        block = block_next;
     }
 
-    global.list.memory = nullptr;
+    return footprint;
 }
 
-MEM *mem_get_metadata(const void *data, size_t alignment) {
-    size_t padding = 0;
+static void mem_count(atomic_size_t *counter, size_t add, size_t sub) {
+    // Having a single writer at a time, the counters need no locked
+    // instructions to be updated.
+
+    atomic_store_explicit(
+        counter,
+        atomic_load_explicit(counter, memory_order_relaxed) + add - sub,
+        memory_order_relaxed
+    );
+}
 
-    alignment = umax_size(alignment, alignof(MEM));
+MEM *mem_get_metadata(const void *data, size_t alignment) {
+    struct mem_page_type *page = mem_find_page(data);
+    MEM *metadata;
 
-    if (sizeof(MEM) % alignment) {
-        padding = (
-            alignment + (sizeof(MEM) / alignment) * alignment
-        ) - sizeof(MEM);
+    if (page) {
+        metadata = &page->mem[
+            (size_t) ((const char *) data - page->data) / page->slot_size
+        ];
     }
+    else {
+        alignment = umax_size(alignment, alignof(struct mem_block_type));
+
+        struct mem_block_type *block = (struct mem_block_type *) (
+            ((const char *) data) - (
+                sizeof(struct mem_block_type) + mem_get_padding(alignment)
+            )
+        );
 
-    MEM *metadata = (MEM *) (((const char *) data) - (sizeof(MEM) + padding));
+        if (block->alignment != alignment) {
+            FUSE();
+            abort();
+        }
+
+        metadata = &block->mem;
+    }
 
-    if (metadata->data != data || metadata->alignment != alignment) {
+    if (metadata->data != data) {
         FUSE();
         abort();
     }
@@ -235,7 +1785,111 @@ MEM *mem_get_metadata(const void *data, size_t alignment) {
     return metadata;
 }
 
-CLIP *mem_new_clip() {
+#ifdef ANSICRAWL_DEBUG
+MEM *mem_new_at(
+    size_t alignment, size_t size, const char *file, int line,
+    const char *function
+) {
+    MEM *mem = (mem_new)(alignment, size);
+
+    if (!mem) {
+        return nullptr;
+    }
+
+    struct mem_site_type *site = mem_find_site(file, line, function);
+
+    if (site) {
+        atomic_fetch_add_explicit(&site->allocations, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&site->bytes, size, memory_order_relaxed);
+        atomic_fetch_add_explicit(&site->live, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(
+            &site->live_bytes, size, memory_order_relaxed
+        );
+    }
+
+    mem->site = site;
+    mem->size = size;
+
+    return mem;
+}
+
+static struct mem_site_type *mem_find_site(
+    const char *file, int line, const char *function
+) {
+    // Returns nullptr if the table is full. The file names of the same
+    // translation unit are the same string, so they are compared by address.
+
+    const size_t hash = (size_t) ((uintptr_t) file >> 4) * 31 + (size_t) line;
+
+    for (size_t i=0; i<MEM_SITE_COUNT; ++i) {
+        struct mem_site_type *site = &mem_site[(hash + i) % MEM_SITE_COUNT];
+        const char *site_file = atomic_load_explicit(
+            &site->file, memory_order_acquire
+        );
+
+        if (!site_file) {
+            pthread_mutex_lock(&mem_site_lock);
+
+            site_file = atomic_load_explicit(&site->file, memory_order_relaxed);
+
+            if (!site_file) {
+                site->function = function;
+                site->line = line;
+                atomic_store_explicit(&site->file, file, memory_order_release);
+                site_file = file;
+            }
+
+            pthread_mutex_unlock(&mem_site_lock);
+        }
+
+        if (site_file == file && site->line == line) {
+            return site;
+        }
+    }
+
+    return nullptr;
+}
+
+static void mem_report_site(const struct mem_site_type *site) {
+    LOG(
+        "mem: %10lu allocations %12lu bytes %8lu in use %10lu bytes  %s:%d %s",
+        atomic_load_explicit(&site->allocations, memory_order_relaxed),
+        atomic_load_explicit(&site->bytes, memory_order_relaxed),
+        atomic_load_explicit(&site->live, memory_order_relaxed),
+        atomic_load_explicit(&site->live_bytes, memory_order_relaxed),
+        atomic_load_explicit(&site->file, memory_order_relaxed),
+        site->line, site->function
+    );
+}
+
+static int mem_compare_allocations(const void *a, const void *b) {
+    const size_t x = atomic_load_explicit(
+        &(*(struct mem_site_type *const *) a)->allocations,
+        memory_order_relaxed
+    );
+    const size_t y = atomic_load_explicit(
+        &(*(struct mem_site_type *const *) b)->allocations,
+        memory_order_relaxed
+    );
+
+    return (x < y) - (x > y);
+}
+
+static int mem_compare_live_bytes(const void *a, const void *b) {
+    const size_t x = atomic_load_explicit(
+        &(*(struct mem_site_type *const *) a)->live_bytes,
+        memory_order_relaxed
+    );
+    const size_t y = atomic_load_explicit(
+        &(*(struct mem_site_type *const *) b)->live_bytes,
+        memory_order_relaxed
+    );
+
+    return (x < y) - (x > y);
+}
+#endif
+
+CLIP *(mem_new_clip)() {
     static CLIP zero;
     CLIP *ds = mem_new(alignof(typeof(zero)), sizeof(zero))->data;
 
@@ -244,6 +1898,27 @@ CLIP *mem_new_clip() {
     return ds;
 }
 
+#ifdef ANSICRAWL_DEBUG
+CLIP *mem_new_clip_at(const char *file, int line, const char *function) {
+    static CLIP zero;
+    MEM *mem = mem_new_at(
+        alignof(typeof(zero)), sizeof(zero), file, line, function
+    );
+    CLIP *ds = mem ? mem->data : nullptr;
+
+    if (ds) {
+        *ds = zero;
+        ds->site = (struct clip_site_type) {
+            .file = file,
+            .function = function,
+            .line = line
+        };
+    }
+
+    return ds;
+}
+#endif
+
 void mem_free_clip(CLIP *ds) {
     mem_free(ds->memory);
     mem_free(mem_get_metadata(ds, alignof(typeof(*ds))));
@@ -333,3 +2008,20 @@ DISPATCHER *mem_new_dispatcher() {
 void mem_free_dispatcher(DISPATCHER *dispatcher) {
     mem_free(mem_get_metadata(dispatcher, alignof(typeof(*dispatcher))));
 }
+
+WORKER *mem_new_worker() {
+    static WORKER zero;
+
+    MEM *mem = mem_new(alignof(typeof(zero)), sizeof(zero));
+    WORKER *worker = mem ? mem->data : nullptr;
+
+    if (worker) {
+        *worker = zero;
+    }
+
+    return worker;
+}
+
+void mem_free_worker(WORKER *worker) {
+    mem_free(mem_get_metadata(worker, alignof(typeof(*worker))));
+}
@@ -6,22 +6,72 @@
 ////////////////////////////////////////////////////////////////////////////////
 
 
+// The size classes are 16 bytes apart up to 256 bytes. Beyond that, there are
+// four classes between every two powers of two, up to 2 GiB.
+
+static constexpr size_t MEM_CLASS_COUNT = 108;
+static constexpr size_t MEM_ALIGN_COUNT = 8;
+
+struct mem_stats_type {
+    size_t live;    // footprint of the blocks in use
+    size_t cached;  // footprint of the free blocks kept by the threads
+    size_t depot;   // footprint of the free blocks in the shared depot
+    size_t advised; // bytes of the depot given back to the system
+    size_t trimmed; // footprint released by the limits and trims
+    size_t peak;    // the sum of the highest live footprints of the threads
+    size_t requested;   // bytes asked for since the start
+    size_t reserved;    // footprint of the blocks given for those requests
+
+    struct {
+        size_t blocks;      // in use
+        size_t allocations; // since the start
+    } size_class[MEM_CLASS_COUNT];
+
+    struct {
+        size_t allocations; // since the start
+    } align_class[MEM_ALIGN_COUNT];
+};
+
+// The policy limits how much free memory is kept around. A thread caches at
+// most cache_size bytes of free blocks per class and the depot depot_size
+// bytes. The free memory that goes unused for trim_msec is given back to the
+// system, the pages of the blocks of at least advise_size bytes first.
+
+struct mem_policy_type {
+    size_t cache_size;  // bytes per class and thread
+    size_t depot_size;  // bytes per class
+    size_t advise_size; // bytes
+    size_t trim_msec;   // zero to never trim
+};
+
 struct MEM {
-    MEM     *next;
-    MEM     *prev;
     void    *data;
     size_t  capacity;
-    size_t  alignment;
+#ifdef ANSICRAWL_DEBUG
+    struct mem_site_type *site; // of the call that allocated the memory
+    size_t  size;               // as it was asked for
+#endif
 };
 
 MEM *               mem_new             (size_t alignment, size_t size);
 void                mem_free            (MEM *);
+MEM *               mem_resize          (MEM *, size_t alignment, size_t size);
 void                mem_recycle         ();
 void                mem_clear           ();
 size_t              mem_get_usage       ();
+size_t              mem_get_thread_usage();
+void                mem_get_stats       (struct mem_stats_type *);
+void                mem_report          ();
+size_t              mem_trim            ();
+void                mem_set_policy      (const struct mem_policy_type *);
+void                mem_get_policy      (struct mem_policy_type *);
 size_t              mem_get_footprint   (const MEM *);
 MEM *               mem_get_metadata    (const void *data, size_t alignment);
 
+void                mem_arena_begin     ();
+void *              mem_arena_alloc     (size_t alignment, size_t size);
+void                mem_arena_reset     ();
+
 CLIP *              mem_new_clip        ();
 void                mem_free_clip       (CLIP *);
 USER *              mem_new_user        ();
@@ -34,6 +84,30 @@ TERMINAL *          mem_new_terminal    ();
 void                mem_free_terminal   (TERMINAL *);
 DISPATCHER *        mem_new_dispatcher  ();
 void                mem_free_dispatcher (DISPATCHER *);
+WORKER *            mem_new_worker      ();
+void                mem_free_worker     (WORKER *);
+
+#ifdef ANSICRAWL_DEBUG
+MEM *               mem_new_at          (
+    size_t alignment, size_t size, const char *file, int line,
+    const char *function
+);
+
+// In the debug build, every allocation is counted by the call site of mem_new.
+
+#define mem_new(alignment, size) mem_new_at(                                   \
+    (alignment), (size), __builtin_FILE(), __builtin_LINE(),                   \
+    __builtin_FUNCTION()                                                       \
+)
+
+CLIP *              mem_new_clip_at     (
+    const char *file, int line, const char *function
+);
+
+#define mem_new_clip() mem_new_clip_at(                                        \
+    __builtin_FILE(), __builtin_LINE(), __builtin_FUNCTION()                   \
+)
+#endif
 
 
 #endif
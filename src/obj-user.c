@@ -2,6 +2,8 @@
 ////////////////////////////////////////////////////////////////////////////////
 #include "all.h"
 ////////////////////////////////////////////////////////////////////////////////
+#include <unistd.h>
+////////////////////////////////////////////////////////////////////////////////
 
 
 USER *user_create() {
@@ -11,13 +13,18 @@ USER *user_create() {
         return nullptr;
     }
 
+    user->fd = -1;
+
     if ((user->io.incoming.clip = clip_create_byte_array()) == nullptr
-    || !(user->io.outgoing.clip = clip_create_byte_array())) {
+    || !(user->io.outgoing.queue = clip_create_clip_array())
+    || !(user->client = client_create())) {
         user_destroy(user);
 
         return nullptr;
     }
 
+    user->client->user = user;
+
     return user;
 }
 
@@ -26,8 +33,13 @@ void user_destroy(USER *user) {
         return;
     }
 
+    if (user->fd != -1) {
+        close(user->fd);
+    }
+
+    client_destroy(user->client);
     clip_destroy(user->io.incoming.clip);
-    clip_destroy(user->io.outgoing.clip);
+    clip_destroy(user->io.outgoing.queue);
 
     mem_free_user(user);
 }
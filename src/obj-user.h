@@ -13,9 +13,20 @@ struct USER {
         } incoming;
 
         struct {
-            CLIP *clip;
+            CLIP *queue; // byte array CLIPs waiting to be written to the socket
         } outgoing;
     } io;
+
+    CLIENT *client; // the session of the user
+    int fd;         // the socket of the connection or -1
+    size_t index;   // position among the users of the server
+
+    struct {
+        bool ready:1;   // queued for the next server update
+        bool waiting:1; // the socket is watched for being writable
+        bool hangup:1;  // the connection has been closed by the peer
+        bool full:1;    // the socket is not read until the input is parsed
+    } bitset;
 };
 
 USER *  user_create();
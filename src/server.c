@@ -2,6 +2,44 @@
 ////////////////////////////////////////////////////////////////////////////////
 #include "all.h"
 ////////////////////////////////////////////////////////////////////////////////
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+////////////////////////////////////////////////////////////////////////////////
+
+
+static constexpr size_t SERVER_EVENT_COUNT = 64;
+static constexpr size_t SERVER_IOV_COUNT = 64;
+static constexpr int SERVER_BACKLOG = 1024;
+
+// A connection with more output than this waiting to be sent is closed. The
+// sessions hold back their frames long before that, so only a peer that has
+// stopped reading altogether gets this far.
+static constexpr size_t SERVER_UNSENT_MAX = 4 * 1024 * 1024;
+
+// A connection is read for at most this many bytes per event, so that a peer
+// flooding the server with input would not keep the others waiting.
+static constexpr size_t SERVER_RECEIVE_SIZE = 64 * 1024;
+
+// While a session has this much input yet to be parsed, its socket is not
+// watched for more. The kernel buffers fill up and the peer has to wait.
+static constexpr size_t SERVER_INCOMING_MAX = 256 * 1024;
+
+static void server_accept(SERVER *);
+static void server_receive(SERVER *, USER *);
+static void server_send(SERVER *, USER *);
+static void server_close(SERVER *, USER *);
+static void server_make_ready(SERVER *, USER *);
+static bool server_update_user(SERVER *, USER *);
+static size_t server_get_incoming_size(const USER *);
+static void server_watch_user(SERVER *, USER *);
+static bool server_watch(SERVER *, int op, int fd, uint32_t events, void *);
 
 
 SERVER *server_create() {
@@ -11,8 +49,19 @@ SERVER *server_create() {
         return nullptr;
     }
 
-    if ((server->io.incoming.clip = clip_create_byte_array()) == nullptr
-    || !(server->io.outgoing.clip = clip_create_byte_array())) {
+    server->listener = -1;
+    server->epoll = epoll_create1(EPOLL_CLOEXEC);
+
+    if (server->epoll == -1) {
+        BUG("%s", strerror(errno));
+    }
+
+    if (server->epoll == -1
+    || (server->io.incoming.clip = clip_create_byte_array()) == nullptr
+    || !(server->io.outgoing.clip = clip_create_byte_array())
+    || !(server->users = clip_create_voidptr_array())
+    || !(server->ready = clip_create_voidptr_array())
+    || !(server->workers = clip_create_voidptr_array())) {
         server_destroy(server);
 
         return nullptr;
@@ -26,8 +75,617 @@ void server_destroy(SERVER *server) {
         return;
     }
 
+    if (server->workers) {
+        // The workers are stopped first, so that they could still flush the
+        // output of their sessions.
+
+        while (!clip_is_empty(server->workers)) {
+            const size_t last = clip_get_size(server->workers) - 1;
+
+            worker_destroy(clip_get_voidptr_at(server->workers, last));
+            clip_pop_voidptr(server->workers);
+        }
+    }
+
+    if (server->users) {
+        while (!clip_is_empty(server->users)) {
+            server_close(server, clip_get_voidptr_at(server->users, 0));
+        }
+    }
+
+    if (server->listener != -1) {
+        close(server->listener);
+    }
+
+    if (server->epoll != -1) {
+        close(server->epoll);
+    }
+
     clip_destroy(server->io.incoming.clip);
     clip_destroy(server->io.outgoing.clip);
+    clip_destroy(server->users);
+    clip_destroy(server->ready);
+    clip_destroy(server->workers);
 
     mem_free_server(server);
 }
+
+bool server_listen(SERVER *server, const char *host, const char *port) {
+    // Binds a non-blocking socket to the first address that the host and port
+    // resolve to. Without a host, every local address is listened on.
+
+    if (server->listener != -1) {
+        FUSE();
+        return false;
+    }
+
+    struct addrinfo hints = {
+        .ai_family = AF_UNSPEC,
+        .ai_socktype = SOCK_STREAM,
+        .ai_flags = AI_PASSIVE
+    };
+    struct addrinfo *info = nullptr;
+    int error = getaddrinfo(host, port, &hints, &info);
+
+    if (error) {
+        WARN("server: %s: %s", port, gai_strerror(error));
+        return false;
+    }
+
+    for (struct addrinfo *next = info; next; next = next->ai_next) {
+        int fd = socket(
+            next->ai_family, next->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+            next->ai_protocol
+        );
+
+        if (fd == -1) {
+            continue;
+        }
+
+        int reuse = 1;
+
+        if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse))
+        ||  bind(fd, next->ai_addr, next->ai_addrlen)
+        ||  listen(fd, SERVER_BACKLOG)) {
+            WARN("server: %s", strerror(errno));
+            close(fd);
+            continue;
+        }
+
+        server->listener = fd;
+        break;
+    }
+
+    freeaddrinfo(info);
+
+    if (server->listener == -1) {
+        return false;
+    }
+
+    if (!server_watch(
+        server, EPOLL_CTL_ADD, server->listener, EPOLLIN, nullptr
+    )) {
+        close(server->listener);
+        server->listener = -1;
+
+        return false;
+    }
+
+    LOG("server: listening on port %u", (unsigned) server_get_port(server));
+
+    return true;
+}
+
+uint16_t server_get_port(const SERVER *server) {
+    struct sockaddr_storage address;
+    socklen_t size = sizeof(address);
+
+    if (server->listener == -1
+    ||  getsockname(server->listener, (struct sockaddr *) &address, &size)) {
+        return 0;
+    }
+
+    switch (address.ss_family) {
+        case AF_INET: {
+            return ntohs(((struct sockaddr_in *) &address)->sin_port);
+        }
+        case AF_INET6: {
+            return ntohs(((struct sockaddr_in6 *) &address)->sin6_port);
+        }
+        default: break;
+    }
+
+    return 0;
+}
+
+bool server_is_listening(const SERVER *server) {
+    return server && server->listener != -1;
+}
+
+size_t server_get_user_count(const SERVER *server) {
+    if (!server) {
+        return 0;
+    }
+
+    size_t count = clip_get_size(server->users);
+
+    for (size_t i=0; i<clip_get_size(server->workers); ++i) {
+        count += worker_get_session_count(
+            clip_get_voidptr_at(server->workers, i)
+        );
+    }
+
+    return count;
+}
+
+bool server_spawn_workers(SERVER *server, size_t count) {
+    // From now on the accepted connections are handed over to the workers, so
+    // that every worker thread serves a shard of the sessions.
+
+    for (size_t i=0; i<count; ++i) {
+        WORKER *worker = worker_create(clip_get_size(server->workers));
+
+        if (!worker) {
+            return false;
+        }
+
+        if (!clip_push_voidptr(server->workers, worker)) {
+            FUSE();
+            worker_destroy(worker);
+
+            return false;
+        }
+    }
+
+    LOG("server: %lu worker threads", clip_get_size(server->workers));
+
+    return true;
+}
+
+void server_shutdown(SERVER *server) {
+    if (!server || server->bitset.shutdown) {
+        return;
+    }
+
+    server->bitset.shutdown = true;
+
+    for (size_t i=0; i<clip_get_size(server->users); ++i) {
+        server_make_ready(server, clip_get_voidptr_at(server->users, i));
+    }
+
+    const struct worker_message_type shutdown = {
+        .type = WORKER_MESSAGE_SHUTDOWN,
+        .fd = -1
+    };
+
+    for (size_t i=0; i<clip_get_size(server->workers); ++i) {
+        if (!worker_post(clip_get_voidptr_at(server->workers, i), shutdown)) {
+            WARN("server: inbox of worker %lu is full", i);
+        }
+    }
+}
+
+bool server_adopt(SERVER *server, int fd) {
+    // Starts a session on the connected socket. Unless false is returned, the
+    // socket is closed by the server from now on.
+
+    if (!server) {
+        return false;
+    }
+
+    // The frames are written as soon as they are ready, so there is nothing
+    // to gain from delaying the small ones.
+
+    int nodelay = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+    USER *user = user_create();
+
+    if (!user) {
+        BUG("failed to create a user");
+        return false;
+    }
+
+    user->index = clip_get_size(server->users);
+
+    if (!clip_push_voidptr(server->users, user)) {
+        FUSE();
+        user_destroy(user);
+
+        return false;
+    }
+
+    user->fd = fd;
+
+    if (!server_watch(server, EPOLL_CTL_ADD, fd, EPOLLIN, user)) {
+        server_close(server, user);
+        return true;
+    }
+
+    client_init(user->client);
+    server_make_ready(server, user);
+
+    return true;
+}
+
+bool server_poll(SERVER *server) {
+    // Handles the events of the sockets without blocking. The connections that
+    // had any are updated by the next call to server_update.
+
+    if (!server) {
+        return false;
+    }
+
+    struct epoll_event events[SERVER_EVENT_COUNT];
+    const int count = epoll_wait(
+        server->epoll, events, (int) ARRAY_LENGTH(events), 0
+    );
+
+    if (count == -1) {
+        if (errno != EINTR) {
+            BUG("%s", strerror(errno));
+        }
+
+        return false;
+    }
+
+    for (int i=0; i<count; ++i) {
+        USER *user = events[i].data.ptr;
+
+        if (!user) {
+            server_accept(server);
+            continue;
+        }
+
+        if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+            server_receive(server, user);
+        }
+
+        if (events[i].events & EPOLLOUT) {
+            server_send(server, user);
+        }
+
+        server_make_ready(server, user);
+    }
+
+    return count > 0;
+}
+
+bool server_update(SERVER *server) {
+    // Only the connections that have received something, have output pending
+    // or have just been accepted are updated, so the idle ones cost nothing.
+    // After server_shutdown, every session is shut down on its next update.
+
+    if (!server) {
+        return false;
+    }
+
+    const size_t count = clip_get_size(server->ready);
+    bool updated = false;
+
+    for (size_t i=0; i<count; ++i) {
+        USER *user = clip_get_voidptr_at(server->ready, i);
+
+        if (!user) {
+            continue; // closed after it was queued
+        }
+
+        user->bitset.ready = false;
+        updated |= server_update_user(server, user);
+    }
+
+    clip_consume(server->ready, count);
+
+    return updated;
+}
+
+static bool server_update_user(SERVER *server, USER *user) {
+    CLIENT *client = user->client;
+    CLIP *src = user->io.incoming.clip;
+    bool updated = false;
+
+    if (!clip_is_empty(src)) {
+        CLIP *dst = client->io.dispatcher.incoming.clip;
+
+        if (!clip_is_empty(dst) || !clip_swap(dst, src)) {
+            bool appended = clip_append_clip(dst, src);
+
+            if (!appended) {
+                FUSE();
+            }
+
+            clip_clear(src);
+        }
+
+        updated = true;
+    }
+
+    if (server->bitset.shutdown) {
+        client_shutdown(client);
+    }
+
+    while (client_update(client)) {
+        updated = true;
+    }
+
+    if (user->bitset.full) {
+        const size_t size = server_get_incoming_size(user);
+
+        if (size >= SERVER_INCOMING_MAX) {
+            // The session has stopped parsing its input, so more of it would
+            // never be read either.
+
+            WARN("server: %lu bytes of input left unparsed", size);
+            user->bitset.hangup = true;
+        }
+        else {
+            user->bitset.full = false;
+            server_watch_user(server, user);
+        }
+    }
+
+    server_send(server, user);
+
+    if (user->bitset.hangup
+    || (client->bitset.shutdown && clip_is_empty(user->io.outgoing.queue))) {
+        server_close(server, user);
+    }
+
+    return updated;
+}
+
+static void server_accept(SERVER *server) {
+    for (;;) {
+        int fd = accept(server->listener, nullptr, nullptr);
+
+        if (fd == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                WARN("server: %s", strerror(errno));
+            }
+
+            return;
+        }
+
+        if (fcntl(fd, F_SETFD, FD_CLOEXEC) == -1
+        ||  fcntl(fd, F_SETFL, O_NONBLOCK) == -1) {
+            WARN("server: %s", strerror(errno));
+            close(fd);
+            continue;
+        }
+
+        if (!clip_is_empty(server->workers)) {
+            // The sockets are dealt out to the workers in turns.
+
+            const size_t index = (
+                server->count.accepted % clip_get_size(server->workers)
+            );
+            const struct worker_message_type adopt = {
+                .type = WORKER_MESSAGE_ADOPT,
+                .fd = fd
+            };
+            WORKER *worker = clip_get_voidptr_at(server->workers, index);
+
+            if (!worker_post(worker, adopt)) {
+                WARN("server: inbox of worker %lu is full", index);
+                close(fd);
+                continue;
+            }
+        }
+        else if (!server_adopt(server, fd)) {
+            close(fd);
+            continue;
+        }
+
+        server->count.accepted++;
+
+        LOG("server: accepted connection %lu", server->count.accepted);
+    }
+}
+
+static void server_receive(SERVER *server, USER *user) {
+    // Whatever is left unread is reported again by the next poll, because the
+    // sockets are watched level-triggered.
+
+    uint8_t buf[MAX_STACKBUF_SIZE];
+    size_t received = 0;
+
+    while (!user->bitset.full && received < SERVER_RECEIVE_SIZE) {
+        ssize_t count = read(user->fd, buf, sizeof(buf));
+
+        if (count > 0) {
+            if (!clip_append_byte_array(
+                user->io.incoming.clip, buf, (size_t) count
+            )) {
+                FUSE();
+                user->bitset.hangup = true;
+                return;
+            }
+
+            received += (size_t) count;
+
+            if (server_get_incoming_size(user) >= SERVER_INCOMING_MAX) {
+                user->bitset.full = true;
+                server_watch_user(server, user);
+            }
+
+            if ((size_t) count < sizeof(buf)) {
+                return;
+            }
+
+            continue;
+        }
+
+        if (count == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return;
+            }
+        }
+
+        user->bitset.hangup = true;
+
+        return;
+    }
+}
+
+static void server_send(SERVER *server, USER *user) {
+    CLIP *queue = user->io.outgoing.queue;
+
+    while (!clip_is_empty(queue) && !user->bitset.hangup) {
+        struct iovec iov[SERVER_IOV_COUNT];
+        size_t iov_count = 0;
+
+        for (size_t i=0; i<clip_get_size(queue); ++i) {
+            CLIP *segment = clip_get_clip_at(queue, i);
+
+            if (clip_is_empty(segment)) {
+                continue;
+            }
+
+            if (iov_count >= ARRAY_LENGTH(iov)) {
+                break;
+            }
+
+            iov[iov_count++] = (struct iovec) {
+                .iov_base = clip_get_byte_array(segment),
+                .iov_len  = clip_get_size(segment)
+            };
+        }
+
+        if (!iov_count) {
+            clip_clear(queue); // Only empty segments were queued.
+            break;
+        }
+
+        // Unlike writev, sendmsg can be told not to raise SIGPIPE when the
+        // peer has already gone away.
+
+        struct msghdr message = {
+            .msg_iov = iov,
+            .msg_iovlen = iov_count
+        };
+
+        auto written = sendmsg(user->fd, &message, MSG_NOSIGNAL);
+
+        if (written > 0) {
+            clip_dequeue(queue, (size_t) written);
+            continue;
+        }
+
+        if (written == -1 && errno == EINTR) {
+            continue;
+        }
+
+        if (written == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+
+        user->bitset.hangup = true;
+    }
+
+    const size_t unsent = clip_get_queue_size(queue);
+
+    if (unsent > SERVER_UNSENT_MAX && !user->bitset.hangup) {
+        WARN("server: %lu bytes unsent, closing the connection", unsent);
+        user->bitset.hangup = true;
+    }
+
+    const bool waiting = !clip_is_empty(queue) && !user->bitset.hangup;
+
+    if (waiting != user->bitset.waiting) {
+        // Whatever did not fit is written once the socket becomes writable.
+
+        user->bitset.waiting = waiting;
+        server_watch_user(server, user);
+    }
+}
+
+static size_t server_get_incoming_size(const USER *user) {
+    // Counts the input received from the peer that the session has yet to
+    // parse, including what it is holding on to for being incomplete.
+
+    const CLIENT *client = user->client;
+
+    return (
+        clip_get_size(user->io.incoming.clip) +
+        clip_get_size(client->io.dispatcher.incoming.clip) +
+        clip_get_size(client->io.terminal.incoming.clip)
+    );
+}
+
+static void server_watch_user(SERVER *server, USER *user) {
+    server_watch(
+        server, EPOLL_CTL_MOD, user->fd, (
+            (user->bitset.full ? 0 : EPOLLIN) |
+            (user->bitset.waiting ? EPOLLOUT : 0)
+        ), user
+    );
+}
+
+static void server_close(SERVER *server, USER *user) {
+    // The last user takes the place of the closed one in the list of users.
+
+    const size_t last = clip_get_size(server->users) - 1;
+    USER *moved = clip_get_voidptr_at(server->users, last);
+
+    if (clip_get_voidptr_at(server->users, user->index) != user) {
+        FUSE();
+        return;
+    }
+
+    clip_set_voidptr_at(server->users, user->index, moved);
+    moved->index = user->index;
+    clip_pop_voidptr(server->users);
+
+    if (user->bitset.ready) {
+        for (size_t i=0; i<clip_get_size(server->ready); ++i) {
+            if (clip_get_voidptr_at(server->ready, i) == user) {
+                clip_set_voidptr_at(server->ready, i, nullptr);
+            }
+        }
+    }
+
+    LOG(
+        "server: the session wrote %lu frames and dropped %lu, at most %lu "
+        "bytes were unsent", user->client->output.frames,
+        user->client->output.dropped, user->client->output.peak
+    );
+
+    epoll_ctl(server->epoll, EPOLL_CTL_DEL, user->fd, nullptr);
+    user_destroy(user);
+    server->count.closed++;
+
+    LOG("server: closed a connection (%lu left)", last);
+}
+
+static void server_make_ready(SERVER *server, USER *user) {
+    if (user->bitset.ready) {
+        return;
+    }
+
+    if (!clip_push_voidptr(server->ready, user)) {
+        FUSE();
+        return;
+    }
+
+    user->bitset.ready = true;
+}
+
+static bool server_watch(
+    SERVER *server, int op, int fd, uint32_t events, void *ptr
+) {
+    struct epoll_event event = {
+        .events = events,
+        .data.ptr = ptr
+    };
+
+    if (epoll_ctl(server->epoll, op, fd, &event) == -1) {
+        BUG("%s", strerror(errno));
+        return false;
+    }
+
+    return true;
+}
@@ -4,6 +4,8 @@
 ////////////////////////////////////////////////////////////////////////////////
 #include "global.h"
 ////////////////////////////////////////////////////////////////////////////////
+#include <stdint.h>
+////////////////////////////////////////////////////////////////////////////////
 
 
 struct SERVER {
@@ -16,9 +18,33 @@ struct SERVER {
             CLIP *clip;
         } outgoing;
     } io;
+
+    CLIP *users; // every connected USER
+    CLIP *ready; // the USERs that have something to do on the next update
+    CLIP *workers; // the WORKERs that the accepted connections are handed to
+    int listener; // the listening socket or -1
+    int epoll; // the event loop of the listener and the connections
+
+    struct {
+        size_t accepted;
+        size_t closed;
+    } count;
+
+    struct {
+        bool shutdown:1;
+    } bitset;
 };
 
-SERVER *server_create();
-void    server_destroy(SERVER *);
+SERVER *    server_create();
+void        server_destroy(SERVER *);
+bool        server_listen(SERVER *, const char *host, const char *port);
+uint16_t    server_get_port(const SERVER *);
+bool        server_is_listening(const SERVER *);
+size_t      server_get_user_count(const SERVER *);
+bool        server_spawn_workers(SERVER *, size_t count);
+bool        server_adopt(SERVER *, int fd);
+void        server_shutdown(SERVER *);
+bool        server_poll(SERVER *);
+bool        server_update(SERVER *);
 
 #endif
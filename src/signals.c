@@ -3,19 +3,39 @@
 ////////////////////////////////////////////////////////////////////////////////
 #include <string.h>
 #include <errno.h>
+#include <unistd.h>
+#include <sys/signalfd.h>
 ////////////////////////////////////////////////////////////////////////////////
 
 
 static bool signals_init_signal(int sig);
 static void signals_handle_signal(int sig);
+static bool signals_get_set(sigset_t *set);
 
 bool signals_init() {
+    // The signals that the main loop reacts to are blocked and delivered
+    // through a file descriptor instead, so that they wake up the event loop
+    // like any other input. The rest keep their default disposition.
+
+    sigset_t set;
+
+    if (!signals_get_set(&set)) {
+        return false;
+    }
+
+    if (sigprocmask(SIG_BLOCK, &set, nullptr) == -1) {
+        BUG("%s", strerror(errno));
+        return false;
+    }
+
+    global.signal.fd = signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC);
+
+    if (global.signal.fd == -1) {
+        BUG("%s", strerror(errno));
+        return false;
+    }
+
     return (
-        signals_init_signal(SIGALRM) &&
-        signals_init_signal(SIGPIPE) &&
-        signals_init_signal(SIGINT ) &&
-        signals_init_signal(SIGTERM) &&
-        signals_init_signal(SIGQUIT) &&
         signals_init_signal(SIGSEGV) &&
         signals_init_signal(SIGILL ) &&
         signals_init_signal(SIGABRT) &&
@@ -23,43 +43,74 @@ bool signals_init() {
         signals_init_signal(SIGBUS ) &&
         signals_init_signal(SIGIOT ) &&
         signals_init_signal(SIGTRAP) &&
-        signals_init_signal(SIGSYS ) &&
-        signals_init_signal(SIGWINCH)
+        signals_init_signal(SIGSYS )
     );
 }
 
-int signals_next() {
-    if (global.signal.interrupt) {
-        global.signal.interrupt = 0;
-        return SIGINT;
+void signals_deinit() {
+    sigset_t set;
+
+    if (global.signal.fd != -1) {
+        close(global.signal.fd);
+        global.signal.fd = -1;
     }
 
-    if (global.signal.terminate) {
-        global.signal.terminate = 0;
-        return SIGTERM;
+    if (signals_get_set(&set)
+    &&  sigprocmask(SIG_UNBLOCK, &set, nullptr) == -1) {
+        BUG("%s", strerror(errno));
     }
+}
 
-    if (global.signal.alarm) {
-        global.signal.alarm = 0;
-        return SIGALRM;
+int signals_next() {
+    if (global.signal.fd == -1) {
+        return 0;
     }
 
-    if (global.signal.pipe) {
-        global.signal.pipe = 0;
-        return SIGPIPE;
+    struct signalfd_siginfo info;
+    ssize_t count = read(global.signal.fd, &info, sizeof(info));
+
+    if (count == -1) {
+        if (errno != EAGAIN && errno != EINTR) {
+            BUG("%s", strerror(errno));
+        }
+
+        return 0;
     }
+    else if (count != sizeof(info)) {
+        FUSE();
+        return 0;
+    }
+
+    int sig = (int) info.ssi_signo;
 
-    if (global.signal.quit) {
-        global.signal.quit = 0;
-        return SIGQUIT;
+    if (sig == SIGINT) {
+        if (global.signal.interrupt) {
+            // Receiving it again will force termination immediately.
+
+            signals_deinit();
+            signals_handle_signal(sig);
+        }
+
+        global.signal.interrupt = true;
     }
 
-    if (global.signal.window) {
-        global.signal.window = 0;
-        return SIGWINCH;
+    return sig;
+}
+
+static bool signals_get_set(sigset_t *set) {
+    if (sigemptyset(set) == -1
+    ||  sigaddset(set, SIGALRM) == -1
+    ||  sigaddset(set, SIGPIPE) == -1
+    ||  sigaddset(set, SIGINT ) == -1
+    ||  sigaddset(set, SIGTERM) == -1
+    ||  sigaddset(set, SIGQUIT) == -1
+    ||  sigaddset(set, SIGUSR1) == -1
+    ||  sigaddset(set, SIGWINCH) == -1) {
+        BUG("%s", strerror(errno));
+        return false;
     }
 
-    return 0;
+    return true;
 }
 
 static bool signals_init_signal(int sig) {
@@ -81,25 +132,6 @@ static bool signals_init_signal(int sig) {
 }
 
 static void signals_handle_signal(int sig) {
-    switch (sig) {
-        case SIGINT:  {
-            if (global.signal.interrupt) {
-                // Receiving it again will force termination immediately.
-
-                break;
-            }
-
-            global.signal.interrupt = 1;
-            return;
-        }
-        case SIGTERM:   global.signal.terminate   = 1; return;
-        case SIGQUIT:   global.signal.quit        = 1; return;
-        case SIGPIPE:   global.signal.pipe        = 1; return;
-        case SIGALRM:   global.signal.alarm       = 1; return;
-        case SIGWINCH:  global.signal.window      = 1; return;
-        default: break;
-    }
-
     // The only portable use of signal() is to set a signal's disposition to
     // SIG_DFL or SIG_IGN.
     signal(sig, SIG_DFL);
@@ -4,6 +4,7 @@
 
 
 bool    signals_init();
+void    signals_deinit();
 int     signals_next();
 
 #endif
@@ -6,7 +6,17 @@
 #include <unistdio.h>
 #include <errno.h>
 ////////////////////////////////////////////////////////////////////////////////
+#if SIMD_X86
+#include <immintrin.h>
+#endif
+////////////////////////////////////////////////////////////////////////////////
+
 
+static size_t str_seg_find_ctrl_scalar(const char *str, size_t str_sz);
+#if SIMD_X86
+static size_t str_seg_find_ctrl_sse2(const char *str, size_t str_sz);
+static size_t str_seg_find_ctrl_avx2(const char *str, size_t str_sz);
+#endif
 
 void str_erase(char *str, char c) {
     char *keep = str;
@@ -88,7 +98,7 @@ const char *str_seg_skip_utf8_symbol(const char *str, size_t str_sz) {
 const char *str_seg_skip_digits(const char *str, size_t str_sz) {
     const char *s = str;
 
-    while (*s && s < str + str_sz) {
+    while (s < str + str_sz && *s) {
         const char *next = str_seg_skip_utf8_symbol(
             s, str_sz - SIZEVAL(s - str)
         );
@@ -128,6 +138,21 @@ const char *str_seg_skip_digits(const char *str, size_t str_sz) {
     return s;
 }
 
+size_t str_seg_find_ctrl(const char *str, size_t str_sz) {
+    // Returns the index of the first C0 control character or the byte 0xFF in
+    // the given segment, or the segment size if there are none. The latter is
+    // the telnet IAC and never appears in valid UTF-8, so the text between the
+    // found positions can be passed on without looking at it any further.
+
+    switch (get_simd()) {
+#if SIMD_X86
+        case SIMD_AVX2: return str_seg_find_ctrl_avx2(str, str_sz);
+        case SIMD_SSE2: return str_seg_find_ctrl_sse2(str, str_sz);
+#endif
+        default: return str_seg_find_ctrl_scalar(str, str_sz);
+    }
+}
+
 size_t str_hash(const char *str) {
     size_t hash = 5381;
     unsigned char c = 0;
@@ -213,3 +238,81 @@ char *str_mem_vnprintf(char *buf, size_t bufsz, const char *fmt, va_list args) {
 
     return bufptr;
 }
+
+static size_t str_seg_find_ctrl_scalar(const char *str, size_t str_sz) {
+    const unsigned char *s = (const unsigned char *) str;
+    size_t i = 0;
+
+    while (i < str_sz && s[i] >= ' ' && s[i] != 0xff) {
+        ++i;
+    }
+
+    return i;
+}
+
+#if SIMD_X86
+static inline uint32_t str_ctrl_mask_sse2(const char *str) {
+    // Adding one wraps 0xFF around to zero and moves the C0 range to 1..32,
+    // so a single unsigned comparison against 32 classifies all 16 bytes.
+
+    const __m128i limit = _mm_set1_epi8(' ');
+    const __m128i bytes = _mm_add_epi8(
+        _mm_loadu_si128((const __m128i *) str), _mm_set1_epi8(1)
+    );
+
+    return (uint32_t) _mm_movemask_epi8(
+        _mm_cmpeq_epi8(_mm_max_epu8(bytes, limit), limit)
+    );
+}
+
+__attribute__((target("avx2")))
+static inline uint32_t str_ctrl_mask_avx2(const char *str) {
+    const __m256i limit = _mm256_set1_epi8(' ');
+    const __m256i bytes = _mm256_add_epi8(
+        _mm256_loadu_si256((const __m256i *) str), _mm256_set1_epi8(1)
+    );
+
+    return (uint32_t) _mm256_movemask_epi8(
+        _mm256_cmpeq_epi8(_mm256_max_epu8(bytes, limit), limit)
+    );
+}
+
+static size_t str_seg_find_ctrl_sse2(const char *str, size_t str_sz) {
+    size_t i = 0;
+
+    for (; i + 16 <= str_sz; i += 16) {
+        uint32_t mask = str_ctrl_mask_sse2(str + i);
+
+        if (mask) {
+            return i + (size_t) __builtin_ctz(mask);
+        }
+    }
+
+    return i + str_seg_find_ctrl_scalar(str + i, str_sz - i);
+}
+
+__attribute__((target("avx2")))
+static size_t str_seg_find_ctrl_avx2(const char *str, size_t str_sz) {
+    size_t i = 0;
+
+    for (; i + 32 <= str_sz; i += 32) {
+        uint32_t mask = str_ctrl_mask_avx2(str + i);
+
+        if (mask) {
+            return i + (size_t) __builtin_ctz(mask);
+        }
+    }
+
+    if (i + 16 <= str_sz) {
+        uint32_t mask = str_ctrl_mask_sse2(str + i);
+
+        if (mask) {
+            return i + (size_t) __builtin_ctz(mask);
+        }
+
+        i += 16;
+    }
+
+    return i + str_seg_find_ctrl_scalar(str + i, str_sz - i);
+}
+#endif
@@ -15,6 +15,7 @@ int str_vnprintf(char *buf, size_t bufsz, const char *fmt, va_list args);
 char *str_mem_vnprintf(char *buf, size_t bufsz, const char *fmt, va_list);
 const char *str_seg_skip_utf8_symbol(const char *str, size_t str_sz);
 const char *str_seg_skip_digits(const char *str, size_t str_sz);
+size_t str_seg_find_ctrl(const char *str, size_t str_sz);
 
 char *str_format(
     char *buf, size_t len, char *fmt, ...
@@ -98,87 +98,172 @@ const char *telnet_get_iac_sequence_code(
     return telnet_iac_byte_to_code(data[index]);
 }
 
-size_t telnet_get_iac_sequence_length(
-    const unsigned char *data, size_t length
+static bool telnet_is_layout_char(uint8_t c) {
+    return c == '\r' || c == '\n' || c == '\t';
+}
+
+static struct telnet_event_type telnet_parser_emit(
+    struct telnet_parser_type *parser, TELNET_EVENT type, size_t size
+) {
+    parser->offset = 0;
+    parser->state = TELNET_PARSER_DATA;
+    parser->discard = false;
+
+    return (struct telnet_event_type) {
+        .type = type,
+        .size = size
+    };
+}
+
+struct telnet_event_type telnet_parse(
+    struct telnet_parser_type *parser, const uint8_t *data, size_t size
 ) {
-    if (!data) {
+    // The data is expected to be the same buffer from one call to another,
+    // consumed from the front by exactly the size of the returned events and
+    // appended to at the back. This lets the parser remember how far into an
+    // incomplete sequence it has already looked, so that a subnegotiation
+    // arriving one byte at a time is not scanned from the start every time.
+
+    if (!parser || !data) {
         FUSE();
-        return 0;
+        return (struct telnet_event_type) {};
     }
 
-    bool iac_active = false;
-    size_t i = 0;
+    if (parser->offset > size) {
+        // The data was consumed without us knowing about it.
+        BUG("offset %lu exceeds size %lu", parser->offset, size);
 
-    for (; i < length; ++i) {
-        if (!iac_active) {
-            if (data[i] == TELNET_IAC) {
-                iac_active = true;
+        *parser = (struct telnet_parser_type) {
+            .sb_max = parser->sb_max,
+            .ctrl   = parser->ctrl
+        };
+    }
 
-                continue;
+    if (parser->offset == size) {
+        return (struct telnet_event_type) {};
+    }
+
+    if (parser->state == TELNET_PARSER_DATA && *data != TELNET_IAC) {
+        if (parser->ctrl) {
+            // Finding the next IAC and the next control character is then a
+            // single pass over the data, which matters for large pastes. Line
+            // breaks and tabs belong to the text and do not end it, while any
+            // other control character comes as text of its own.
+
+            size_t text_size = 0;
+
+            while (text_size < size) {
+                text_size += str_seg_find_ctrl(
+                    (const char *) data + text_size, size - text_size
+                );
+
+                if (text_size == size
+                ||  !telnet_is_layout_char(data[text_size])) {
+                    break;
+                }
+
+                ++text_size;
             }
 
-            return 0;
+            return (struct telnet_event_type) {
+                .type = TELNET_EVENT_TEXT,
+                .size = text_size ? text_size : 1
+            };
         }
 
-        switch (data[i]) {
-            case TELNET_DO:
-            case TELNET_DONT:
-            case TELNET_WILL:
-            case TELNET_WONT: {
-                return length < 3 ? 0 : 3;
-            }
-            case TELNET_SB: {
-                // subnegotiation
+        const uint8_t *iac = memchr(data, TELNET_IAC, size);
 
-                for (size_t j = i + 2; ; j++) {
-                    if (j + 1 >= length) {
-                        return 0;
-                    }
+        return (struct telnet_event_type) {
+            .type = TELNET_EVENT_TEXT,
+            .size = iac ? SIZEVAL(iac - data) : size
+        };
+    }
 
-                    if (data[j] != TELNET_IAC) {
+    for (size_t i = parser->offset; i < size; ++i) {
+        switch (parser->state) {
+            case TELNET_PARSER_DATA: {
+                parser->state = TELNET_PARSER_IAC;
+                continue;
+            }
+            case TELNET_PARSER_IAC: {
+                switch (data[i]) {
+                    case TELNET_DO:
+                    case TELNET_DONT:
+                    case TELNET_WILL:
+                    case TELNET_WONT: {
+                        parser->state = TELNET_PARSER_OPTION;
                         continue;
                     }
-
-                    switch (data[j+1]) {
-                        case TELNET_SE: return j+2;
-                        case TELNET_IAC: {
-                            ++j;
-                            continue;
-                        }
-                        default: {
-                            // Anything other than SE or IAC after IAC actually
-                            // violates the telnet option subnegotiation
-                            // protcol because the meaning of it has not been
-                            // defined.
-
-                            continue;
-                        }
+                    case TELNET_SB: {
+                        parser->state = TELNET_PARSER_SB_OPTION;
+                        continue;
+                    }
+                    default: {
+                        // 2-byte commands such as IAC IAC or IAC GA
+                        return telnet_parser_emit(
+                            parser, TELNET_EVENT_COMMAND, i + 1
+                        );
                     }
                 }
+            }
+            case TELNET_PARSER_OPTION: {
+                return telnet_parser_emit(parser, TELNET_EVENT_COMMAND, i + 1);
+            }
+            case TELNET_PARSER_SB_OPTION: {
+                parser->state = TELNET_PARSER_SB;
+                continue;
+            }
+            case TELNET_PARSER_SB: {
+                const uint8_t *iac = memchr(data + i, TELNET_IAC, size - i);
 
-                return 0;
+                if (iac) {
+                    parser->state = TELNET_PARSER_SB_IAC;
+                    i = SIZEVAL(iac - data);
+                }
+                else {
+                    i = size - 1;
+                }
+
+                continue;
             }
-            default: {
-                // 2-byte commands such as IAC IAC or IAC GA
-                return 2;
+            case TELNET_PARSER_SB_IAC: {
+                if (data[i] == TELNET_SE) {
+                    return telnet_parser_emit(
+                        parser,
+                        parser->discard || i + 1 > parser->sb_max ? (
+                            TELNET_EVENT_OVERFLOW
+                        ) : TELNET_EVENT_SUBNEGOTIATION,
+                        i + 1
+                    );
+                }
+
+                // Anything other than SE or IAC after IAC actually violates
+                // the telnet option subnegotiation protocol because the
+                // meaning of it has not been defined.
+
+                parser->state = TELNET_PARSER_SB;
+                continue;
             }
         }
     }
 
-    return 0;
-}
+    if (parser->state >= TELNET_PARSER_SB_OPTION
+    && (parser->discard || size > parser->sb_max)) {
+        // Whatever is left of an oversized subnegotiation is thrown away as
+        // it arrives instead of buffering it until the end of it is found.
 
-size_t telnet_get_iac_nonblocking_length(
-    const unsigned char *data, size_t length
-) {
-    if (!data) {
-        FUSE();
-        return 0;
+        parser->offset = 0;
+        parser->discard = true;
+
+        return (struct telnet_event_type) {
+            .type = TELNET_EVENT_OVERFLOW,
+            .size = size
+        };
     }
 
-    const char *iac = memchr(data, TELNET_IAC, length);
+    parser->offset = size;
 
-    return iac ? SIZEVAL(iac - ((const char *) data)) : length;
+    return (struct telnet_event_type) {};
 }
 
 static struct telnet_opt_handler_response_type telnet_opt_handle_local(
@@ -31,6 +31,38 @@ struct telnet_opt_handler_response_type {
     uint8_t size;
 };
 
+static constexpr size_t TELNET_SB_MAX_SIZE = 4096;
+
+typedef enum : uint8_t {
+    TELNET_EVENT_NONE = 0,          // more data is needed to tell anything
+    TELNET_EVENT_TEXT,              // plain data up to the next IAC
+    TELNET_EVENT_COMMAND,           // IAC and a command with its option
+    TELNET_EVENT_SUBNEGOTIATION,    // IAC SB ... IAC SE
+    TELNET_EVENT_OVERFLOW           // part of an oversized subnegotiation
+} TELNET_EVENT;
+
+typedef enum : uint8_t {
+    TELNET_PARSER_DATA = 0,
+    TELNET_PARSER_IAC,
+    TELNET_PARSER_OPTION,
+    TELNET_PARSER_SB_OPTION,
+    TELNET_PARSER_SB,
+    TELNET_PARSER_SB_IAC
+} TELNET_PARSER_STATE;
+
+struct telnet_event_type {
+    TELNET_EVENT type;
+    size_t size; // how many bytes from the front of the data the event spans
+};
+
+struct telnet_parser_type {
+    size_t sb_max;  // the longest subnegotiation let through to the handlers
+    size_t offset;  // how many bytes of the pending sequence have been seen
+    TELNET_PARSER_STATE state;
+    bool discard:1; // the pending subnegotiation is being thrown away
+    bool ctrl:1;    // control characters other than line breaks end the text
+};
+
 typedef enum : uint8_t {
     TELNET_FLAG_LOCAL   = (1 << 0),
     TELNET_FLAG_REMOTE  = (1 << 1)
@@ -78,7 +110,7 @@ typedef enum : uint8_t {
     TELNET_OPT_CHARSET      = 42,
     TELNET_OPT_MSDP         = 69,
     TELNET_OPT_MSSP         = 70,  // mud server status protocol
-    TELNET_OPT_MCCP         = 86,
+    TELNET_OPT_MCCP         = 86,  // mud client compression protocol v2
     TELNET_EOF              = 236,
     TELNET_EOR              = 239, // end of record (transparent mode)
     TELNET_SE               = 240,
@@ -147,6 +179,10 @@ static const char TELNET_IAC_DO_EOR[] = {
     (char) TELNET_IAC, (char) TELNET_DO, (char) TELNET_OPT_EOR, 0
 };
 
+static const char TELNET_IAC_WILL_MCCP[] = {
+    (char) TELNET_IAC, (char) TELNET_WILL, (char) TELNET_OPT_MCCP, 0
+};
+
 static const char TELNET_IAC_WONT_NAWS[] = {
     (char) TELNET_IAC, (char) TELNET_WONT, (char) TELNET_OPT_NAWS, 0
 };
@@ -171,6 +207,11 @@ static const char TELNET_IAC_SB_NAWS[] = {
     (char) TELNET_IAC, (char) TELNET_SB, (char) TELNET_OPT_NAWS, 0
 };
 
+static const char TELNET_IAC_SB_MCCP_SE[] = {
+    (char) TELNET_IAC, (char) TELNET_SB, (char) TELNET_OPT_MCCP,
+    (char) TELNET_IAC, (char) TELNET_SE, 0
+};
+
 static const char TELNET_IAC_SE[] = {
     (char) TELNET_IAC, (char) TELNET_SE, 0
 };
@@ -197,8 +238,9 @@ const char *telnet_get_iac_sequence_code(
     const unsigned char *data, size_t size, size_t index
 );
 
-size_t telnet_get_iac_nonblocking_length(const unsigned char *, size_t size);
-size_t telnet_get_iac_sequence_length(const unsigned char *, size_t size);
+struct telnet_event_type telnet_parse(
+    struct telnet_parser_type *, const uint8_t *data, size_t size
+);
 
 static inline struct telnet_naws_packet_type {
     uint8_t data[13];
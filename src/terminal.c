@@ -33,19 +33,13 @@ static void terminal_handle_incoming_dispatcher_iac(
     TERMINAL *, const uint8_t *data, size_t sz
 );
 static void terminal_handle_incoming_dispatcher_esc(
-    TERMINAL *, const uint8_t *data, size_t sz
+    TERMINAL *, const uint8_t *data, struct terminal_esc_event_type
 );
 static void terminal_handle_incoming_dispatcher_txt(
     TERMINAL *, const uint8_t *data, size_t sz
 );
 static bool terminal_handle_incoming_dispatcher_esc_screen_size(
-    TERMINAL *terminal, const uint8_t *data, size_t size
-);
-static size_t terminal_get_esc_blocking_length(
-    const uint8_t *, size_t size
-);
-static size_t terminal_get_esc_nonblocking_length(
-    const uint8_t *, size_t size
+    TERMINAL *terminal, struct terminal_esc_event_type
 );
 
 
@@ -65,6 +59,10 @@ TERMINAL *terminal_create() {
         return nullptr;
     }
 
+    terminal->io.dispatcher.incoming.telnet.sb_max = TELNET_SB_MAX_SIZE;
+    terminal->io.dispatcher.incoming.telnet.ctrl = true;
+    terminal->io.client.incoming.telnet.sb_max = TELNET_SB_MAX_SIZE;
+
     return terminal;
 }
 
@@ -168,7 +166,7 @@ static void terminal_enable_raw_mode(TERMINAL *terminal) {
     raw.c_cflag |= (CS8);
     raw.c_lflag &= (tcflag_t) ~(ECHO | ICANON | IEXTEN | ISIG);
     raw.c_cc[VMIN] = 0;
-    raw.c_cc[VTIME] = 10;
+    raw.c_cc[VTIME] = 0; // the main loop only reads when there is input
 
     if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) {
         BUG("%s", strerror(errno));
@@ -442,8 +440,10 @@ static void terminal_handle_incoming_dispatcher_iac(
 }
 
 static void terminal_handle_incoming_dispatcher_esc(
-    TERMINAL *terminal, const uint8_t *data, size_t size
+    TERMINAL *terminal, const uint8_t *data, struct terminal_esc_event_type esc
 ) {
+    const size_t size = esc.size;
+
     if (!data || size < 1 || data[0] != TERMINAL_ESC) {
         FUSE();
         return;
@@ -452,7 +452,7 @@ static void terminal_handle_incoming_dispatcher_esc(
     log_esc("dispatcher", "terminal", data, size);
 
     bool handled = terminal_handle_incoming_dispatcher_esc_screen_size(
-        terminal, data, size
+        terminal, esc
     );
 
     if (handled) {
@@ -492,83 +492,86 @@ static bool terminal_read_from_dispatcher(TERMINAL *terminal) {
 
     const uint8_t *data = clip_get_byte_array(clip);
     const size_t data_size = clip_get_size(clip);
-    const size_t nonblocking_iac_sz = telnet_get_iac_nonblocking_length(
-        data, data_size
+    auto event = telnet_parse(
+        &terminal->io.dispatcher.incoming.telnet, data, data_size
     );
 
-    if (nonblocking_iac_sz) {
-        size_t nonblocking_esc_sz = terminal_get_esc_nonblocking_length(
-            data, nonblocking_iac_sz
-        );
+    switch (event.type) {
+        case TELNET_EVENT_NONE: {
+            return false;
+        }
+        case TELNET_EVENT_COMMAND:
+        case TELNET_EVENT_SUBNEGOTIATION: {
+            terminal_handle_incoming_dispatcher_iac(terminal, data, event.size);
+            clip_consume(clip, event.size);
 
-        if (!nonblocking_esc_sz) {
-            const size_t blocking_esc_sz = terminal_get_esc_blocking_length(
-                data, nonblocking_iac_sz
-            );
+            return true;
+        }
+        case TELNET_EVENT_OVERFLOW: {
+            if (!terminal->io.dispatcher.incoming.telnet.discard) {
+                LOG("dispatcher:iac -> terminal: oversized SB discarded");
+            }
 
-            if (blocking_esc_sz > 1
-            || (blocking_esc_sz == 1 && nonblocking_iac_sz == 1)) {
-                // Either an ESC sequence that needs to be handled or just a
-                // single escape key character.
+            clip_consume(clip, event.size);
 
-                CLIP *blocking = clip_shift(clip, blocking_esc_sz);
+            return true;
+        }
+        case TELNET_EVENT_TEXT: {
+            break;
+        }
+    }
 
-                terminal_handle_incoming_dispatcher_esc(
-                    terminal,
-                    clip_get_byte_array(blocking), clip_get_size(blocking)
-                );
+    if (*data == TERMINAL_ESC) {
+        struct terminal_esc_parser_type *parser = (
+            &terminal->io.dispatcher.incoming.esc
+        );
 
-                clip_destroy(blocking);
+        auto esc = terminal_parse_esc(parser, data, data_size);
+
+        switch (esc.type) {
+            case TERMINAL_ESC_EVENT_SEQUENCE: {
+                terminal_handle_incoming_dispatcher_esc(terminal, data, esc);
+                clip_consume(clip, esc.size);
 
                 return true;
             }
-            else if (nonblocking_iac_sz > 1) {
-                // This ESC character has something immediately following it but
-                // we did not recognize the sequence to be relevant for handling
-                // by the terminal. If this was a single escape key stroke, then
-                // it wouldn't have anything following it because the user would
-                // not be able to type so fast. Hence, we pass it on to the
-                // client as it is.
-
-                log_txt("dispatcher", "terminal", data, 1);
-                terminal_write_to_client(terminal, (const char *) data, 1);
-                clip_destroy(clip_shift(clip, 1));
+            case TERMINAL_ESC_EVENT_ABORTED: {
+                // This ESC character has something immediately following it
+                // that does not make up a sequence. If this was a single
+                // escape key stroke, then it wouldn't have anything following
+                // it because the user would not be able to type so fast.
+                // Hence, we pass it on to the client as it is.
+
+                log_txt("dispatcher", "terminal", data, esc.size);
+                terminal_write_to_client(
+                    terminal, (const char *) data, esc.size
+                );
+                clip_consume(clip, esc.size);
 
                 return true;
             }
+            case TERMINAL_ESC_EVENT_NONE: {
+                // Either just a single escape key character or a sequence
+                // that was cut short. The terminal does not wait for the rest
+                // of it because it reads the keys as they are typed. An IAC
+                // would have aborted the sequence, so the rest of the data is
+                // plain text.
+
+                terminal_reset_esc_parser(parser);
+                terminal_handle_incoming_dispatcher_txt(
+                    terminal, data, data_size
+                );
+                clip_consume(clip, data_size);
 
-            nonblocking_esc_sz = nonblocking_iac_sz;
+                return true;
+            }
         }
-
-        CLIP *nonblocking = clip_shift(clip, nonblocking_esc_sz);
-
-        terminal_handle_incoming_dispatcher_txt(
-            terminal,
-            clip_get_byte_array(nonblocking), clip_get_size(nonblocking)
-        );
-
-        clip_destroy(nonblocking);
-
-        return true;
     }
 
-    const size_t blocking_iac_sz = telnet_get_iac_sequence_length(
-        data, data_size
-    );
-
-    if (blocking_iac_sz) {
-        CLIP *blocking = clip_shift(clip, blocking_iac_sz);
-
-        terminal_handle_incoming_dispatcher_iac(
-            terminal, clip_get_byte_array(blocking), clip_get_size(blocking)
-        );
-
-        clip_destroy(blocking);
-
-        return true;
-    }
+    terminal_handle_incoming_dispatcher_txt(terminal, data, event.size);
+    clip_consume(clip, event.size);
 
-    return false;
+    return true;
 }
 
 static bool terminal_read_from_client(TERMINAL *terminal) {
@@ -580,40 +583,53 @@ static bool terminal_read_from_client(TERMINAL *terminal) {
 
     const uint8_t *data = clip_get_byte_array(clip);
     const size_t data_size = clip_get_size(clip);
-    const size_t nonblocking_iac_sz = telnet_get_iac_nonblocking_length(
-        data, data_size
+    auto event = telnet_parse(
+        &terminal->io.client.incoming.telnet, data, data_size
     );
 
-    if (nonblocking_iac_sz) {
-        CLIP *nonblocking = clip_shift(clip, nonblocking_iac_sz);
+    switch (event.type) {
+        case TELNET_EVENT_NONE: {
+            return false;
+        }
+        case TELNET_EVENT_COMMAND:
+        case TELNET_EVENT_SUBNEGOTIATION: {
+            terminal_handle_incoming_client_iac(terminal, data, event.size);
+            clip_consume(clip, event.size);
 
-        terminal_handle_incoming_client_txt(
-            terminal, clip_get_byte_array(nonblocking),
-            clip_get_size(nonblocking)
-        );
+            return true;
+        }
+        case TELNET_EVENT_OVERFLOW: {
+            if (!terminal->io.client.incoming.telnet.discard) {
+                LOG("client:iac -> terminal: oversized SB discarded");
+            }
 
-        clip_destroy(nonblocking);
+            clip_consume(clip, event.size);
 
-        return true;
+            return true;
+        }
+        case TELNET_EVENT_TEXT: {
+            break;
+        }
     }
 
-    const size_t blocking_iac_sz = telnet_get_iac_sequence_length(
-        data, data_size
-    );
-
-    if (blocking_iac_sz) {
-        CLIP *blocking = clip_shift(clip, blocking_iac_sz);
+    if (event.size == data_size
+    &&  clip_is_empty(terminal->io.dispatcher.outgoing.clip)
+    &&  clip_swap(terminal->io.dispatcher.outgoing.clip, clip)) {
+        // The whole clip is plain text (typically a full screen frame), so it
+        // is handed over to the dispatcher as it is instead of being copied.
 
-        terminal_handle_incoming_client_iac(
-            terminal, clip_get_byte_array(blocking), clip_get_size(blocking)
+        LOG(
+            "client:txt -> terminal: %lu byte%s",
+            data_size, data_size == 1 ? "" : "s"
         );
 
-        clip_destroy(blocking);
-
         return true;
     }
 
-    return false;
+    terminal_handle_incoming_client_txt(terminal, data, event.size);
+    clip_consume(clip, event.size);
+
+    return true;
 }
 
 static bool terminal_write_to_dispatcher(
@@ -649,16 +665,10 @@ static bool terminal_flush_outgoing(TERMINAL *terminal) {
         CLIP *src = terminal->io.dispatcher.outgoing.clip;
 
         if (!clip_is_empty(src)) {
-            CLIP *dst = global.io.outgoing.clip;
-
-            bool appended = clip_append_clip(dst, src);
-
-            if (!appended) {
+            if (!clip_enqueue(global.io.outgoing.queue, src)) {
                 FUSE();
             }
 
-            clip_clear(src);
-
             flushed = true;
         }
     }
@@ -684,168 +694,408 @@ static bool terminal_flush_outgoing(TERMINAL *terminal) {
     return flushed;
 }
 
-static size_t terminal_get_esc_nonblocking_length(
-    const uint8_t *data, size_t length
+static bool terminal_handle_incoming_dispatcher_esc_screen_size(
+    TERMINAL *terminal, struct terminal_esc_event_type esc
 ) {
-    if (!data) {
-        FUSE();
-        return 0;
+    if (terminal->state != TERMINAL_GET_SCREEN_SIZE) {
+        return false;
+    }
+
+    if (esc.introducer != '['
+    ||  esc.final != 'R'
+    ||  esc.marker
+    ||  esc.intermediate
+    ||  esc.param_count != 2
+    ||  esc.param[0] == 0
+    ||  esc.param[1] == 0) {
+        return false; // Sequence does not contain the screen size.
     }
 
-    const char *esc = memchr(data, TERMINAL_ESC, length);
+    long rows = esc.param[0];
+    long cols = esc.param[1];
 
-    return esc ? SIZEVAL(esc - ((const char *) data)) : length;
-}
+    terminal->screen.width = cols;
+    terminal->screen.height = rows;
+    terminal->bitset.reformat = false;
 
-static struct terminal_incoming_dispatcher_esc_screen_size_type{
-    const char *end;
-    struct {
-        const char *str;
-        uint8_t size;
-        long value;
-    } height;
-    struct {
-        const char *str;
-        uint8_t size;
-        long value;
-    } width;
-} terminal_parse_incoming_dispatcher_esc_screen_size(
-    const char *str, size_t str_sz
-) {
-    const struct terminal_incoming_dispatcher_esc_screen_size_type
-    incomplete = { .end = nullptr },
-    invalid    = { .end = str };
+    terminal->state = TERMINAL_IDLE;
 
-    if (!str_sz) {
-        return incomplete;
+    return true;
+}
+
+typedef enum : uint8_t {
+    TERMINAL_ESC_CLASS_C0 = 0,          // the other control characters
+    TERMINAL_ESC_CLASS_BEL,
+    TERMINAL_ESC_CLASS_ESC,
+    TERMINAL_ESC_CLASS_INTERMEDIATE,    // from SP to '/'
+    TERMINAL_ESC_CLASS_DIGIT,
+    TERMINAL_ESC_CLASS_COLON,
+    TERMINAL_ESC_CLASS_SEMICOLON,
+    TERMINAL_ESC_CLASS_MARKER,          // from '<' to '?'
+    TERMINAL_ESC_CLASS_CSI,             // '['
+    TERMINAL_ESC_CLASS_SS3,             // 'O'
+    TERMINAL_ESC_CLASS_STRING,          // ']', 'P', 'X', '^' and '_'
+    TERMINAL_ESC_CLASS_ST,              // '\'
+    TERMINAL_ESC_CLASS_FINAL,           // the rest from '@' to '~'
+    TERMINAL_ESC_CLASS_DEL,
+    TERMINAL_ESC_CLASS_HIGH,            // bytes with the 8th bit set
+    TERMINAL_ESC_CLASS_IAC,             // the telnet IAC aborts everything
+    ////////////////////////////////////////////////////////////////////////////
+    MAX_TERMINAL_ESC_CLASS
+} TERMINAL_ESC_CLASS;
+
+// The parser follows the VT500 state machine for the sequences that terminals
+// send as input: CSI and SS3 with their parameters, and the strings such as
+// OSC. The next state is looked up by the current state and the class of the
+// byte at hand. A transition back to the ground state means that the bytes
+// seen so far do not make up a sequence.
+static const TERMINAL_ESC_PARSER_STATE terminal_esc_table[
+    MAX_TERMINAL_ESC_PARSER_STATE
+][MAX_TERMINAL_ESC_CLASS] = {
+    [TERMINAL_ESC_PARSER_GROUND] = {
+        [TERMINAL_ESC_CLASS_ESC]            = TERMINAL_ESC_PARSER_ESCAPE
+    },
+    [TERMINAL_ESC_PARSER_ESCAPE] = {
+        [TERMINAL_ESC_CLASS_CSI]            = TERMINAL_ESC_PARSER_CSI_ENTRY,
+        [TERMINAL_ESC_CLASS_SS3]            = TERMINAL_ESC_PARSER_SS3,
+        [TERMINAL_ESC_CLASS_STRING]         = TERMINAL_ESC_PARSER_STRING
+    },
+    [TERMINAL_ESC_PARSER_CSI_ENTRY] = {
+        [TERMINAL_ESC_CLASS_INTERMEDIATE]   = (
+            TERMINAL_ESC_PARSER_CSI_INTERMEDIATE
+        ),
+        [TERMINAL_ESC_CLASS_DIGIT]          = TERMINAL_ESC_PARSER_CSI_PARAM,
+        [TERMINAL_ESC_CLASS_COLON]          = TERMINAL_ESC_PARSER_CSI_IGNORE,
+        [TERMINAL_ESC_CLASS_SEMICOLON]      = TERMINAL_ESC_PARSER_CSI_PARAM,
+        [TERMINAL_ESC_CLASS_MARKER]         = TERMINAL_ESC_PARSER_CSI_PARAM,
+        [TERMINAL_ESC_CLASS_CSI]            = TERMINAL_ESC_PARSER_DISPATCH,
+        [TERMINAL_ESC_CLASS_SS3]            = TERMINAL_ESC_PARSER_DISPATCH,
+        [TERMINAL_ESC_CLASS_STRING]         = TERMINAL_ESC_PARSER_DISPATCH,
+        [TERMINAL_ESC_CLASS_ST]             = TERMINAL_ESC_PARSER_DISPATCH,
+        [TERMINAL_ESC_CLASS_FINAL]          = TERMINAL_ESC_PARSER_DISPATCH
+    },
+    [TERMINAL_ESC_PARSER_CSI_PARAM] = {
+        [TERMINAL_ESC_CLASS_INTERMEDIATE]   = (
+            TERMINAL_ESC_PARSER_CSI_INTERMEDIATE
+        ),
+        [TERMINAL_ESC_CLASS_DIGIT]          = TERMINAL_ESC_PARSER_CSI_PARAM,
+        [TERMINAL_ESC_CLASS_COLON]          = TERMINAL_ESC_PARSER_CSI_IGNORE,
+        [TERMINAL_ESC_CLASS_SEMICOLON]      = TERMINAL_ESC_PARSER_CSI_PARAM,
+        [TERMINAL_ESC_CLASS_MARKER]         = TERMINAL_ESC_PARSER_CSI_IGNORE,
+        [TERMINAL_ESC_CLASS_CSI]            = TERMINAL_ESC_PARSER_DISPATCH,
+        [TERMINAL_ESC_CLASS_SS3]            = TERMINAL_ESC_PARSER_DISPATCH,
+        [TERMINAL_ESC_CLASS_STRING]         = TERMINAL_ESC_PARSER_DISPATCH,
+        [TERMINAL_ESC_CLASS_ST]             = TERMINAL_ESC_PARSER_DISPATCH,
+        [TERMINAL_ESC_CLASS_FINAL]          = TERMINAL_ESC_PARSER_DISPATCH
+    },
+    [TERMINAL_ESC_PARSER_CSI_INTERMEDIATE] = {
+        [TERMINAL_ESC_CLASS_INTERMEDIATE]   = (
+            TERMINAL_ESC_PARSER_CSI_INTERMEDIATE
+        ),
+        [TERMINAL_ESC_CLASS_DIGIT]          = TERMINAL_ESC_PARSER_CSI_IGNORE,
+        [TERMINAL_ESC_CLASS_COLON]          = TERMINAL_ESC_PARSER_CSI_IGNORE,
+        [TERMINAL_ESC_CLASS_SEMICOLON]      = TERMINAL_ESC_PARSER_CSI_IGNORE,
+        [TERMINAL_ESC_CLASS_MARKER]         = TERMINAL_ESC_PARSER_CSI_IGNORE,
+        [TERMINAL_ESC_CLASS_CSI]            = TERMINAL_ESC_PARSER_DISPATCH,
+        [TERMINAL_ESC_CLASS_SS3]            = TERMINAL_ESC_PARSER_DISPATCH,
+        [TERMINAL_ESC_CLASS_STRING]         = TERMINAL_ESC_PARSER_DISPATCH,
+        [TERMINAL_ESC_CLASS_ST]             = TERMINAL_ESC_PARSER_DISPATCH,
+        [TERMINAL_ESC_CLASS_FINAL]          = TERMINAL_ESC_PARSER_DISPATCH
+    },
+    [TERMINAL_ESC_PARSER_CSI_IGNORE] = {
+        [TERMINAL_ESC_CLASS_INTERMEDIATE]   = TERMINAL_ESC_PARSER_CSI_IGNORE,
+        [TERMINAL_ESC_CLASS_DIGIT]          = TERMINAL_ESC_PARSER_CSI_IGNORE,
+        [TERMINAL_ESC_CLASS_COLON]          = TERMINAL_ESC_PARSER_CSI_IGNORE,
+        [TERMINAL_ESC_CLASS_SEMICOLON]      = TERMINAL_ESC_PARSER_CSI_IGNORE,
+        [TERMINAL_ESC_CLASS_MARKER]         = TERMINAL_ESC_PARSER_CSI_IGNORE,
+        [TERMINAL_ESC_CLASS_CSI]            = TERMINAL_ESC_PARSER_IGNORE,
+        [TERMINAL_ESC_CLASS_SS3]            = TERMINAL_ESC_PARSER_IGNORE,
+        [TERMINAL_ESC_CLASS_STRING]         = TERMINAL_ESC_PARSER_IGNORE,
+        [TERMINAL_ESC_CLASS_ST]             = TERMINAL_ESC_PARSER_IGNORE,
+        [TERMINAL_ESC_CLASS_FINAL]          = TERMINAL_ESC_PARSER_IGNORE
+    },
+    [TERMINAL_ESC_PARSER_SS3] = {
+        [TERMINAL_ESC_CLASS_DIGIT]          = TERMINAL_ESC_PARSER_SS3,
+        [TERMINAL_ESC_CLASS_SEMICOLON]      = TERMINAL_ESC_PARSER_SS3,
+        [TERMINAL_ESC_CLASS_CSI]            = TERMINAL_ESC_PARSER_DISPATCH,
+        [TERMINAL_ESC_CLASS_SS3]            = TERMINAL_ESC_PARSER_DISPATCH,
+        [TERMINAL_ESC_CLASS_STRING]         = TERMINAL_ESC_PARSER_DISPATCH,
+        [TERMINAL_ESC_CLASS_ST]             = TERMINAL_ESC_PARSER_DISPATCH,
+        [TERMINAL_ESC_CLASS_FINAL]          = TERMINAL_ESC_PARSER_DISPATCH
+    },
+    [TERMINAL_ESC_PARSER_STRING] = {
+        [TERMINAL_ESC_CLASS_C0]             = TERMINAL_ESC_PARSER_STRING,
+        [TERMINAL_ESC_CLASS_BEL]            = TERMINAL_ESC_PARSER_IGNORE,
+        [TERMINAL_ESC_CLASS_ESC]            = TERMINAL_ESC_PARSER_STRING_ESC,
+        [TERMINAL_ESC_CLASS_INTERMEDIATE]   = TERMINAL_ESC_PARSER_STRING,
+        [TERMINAL_ESC_CLASS_DIGIT]          = TERMINAL_ESC_PARSER_STRING,
+        [TERMINAL_ESC_CLASS_COLON]          = TERMINAL_ESC_PARSER_STRING,
+        [TERMINAL_ESC_CLASS_SEMICOLON]      = TERMINAL_ESC_PARSER_STRING,
+        [TERMINAL_ESC_CLASS_MARKER]         = TERMINAL_ESC_PARSER_STRING,
+        [TERMINAL_ESC_CLASS_CSI]            = TERMINAL_ESC_PARSER_STRING,
+        [TERMINAL_ESC_CLASS_SS3]            = TERMINAL_ESC_PARSER_STRING,
+        [TERMINAL_ESC_CLASS_STRING]         = TERMINAL_ESC_PARSER_STRING,
+        [TERMINAL_ESC_CLASS_ST]             = TERMINAL_ESC_PARSER_STRING,
+        [TERMINAL_ESC_CLASS_FINAL]          = TERMINAL_ESC_PARSER_STRING,
+        [TERMINAL_ESC_CLASS_DEL]            = TERMINAL_ESC_PARSER_STRING,
+        [TERMINAL_ESC_CLASS_HIGH]           = TERMINAL_ESC_PARSER_STRING
+    },
+    [TERMINAL_ESC_PARSER_STRING_ESC] = {
+        [TERMINAL_ESC_CLASS_ST]             = TERMINAL_ESC_PARSER_IGNORE
+    }
+};
+
+static TERMINAL_ESC_CLASS terminal_esc_get_class(uint8_t c) {
+    if (c == TELNET_IAC) {
+        return TERMINAL_ESC_CLASS_IAC;
+    }
+    else if (c >= 0x80) {
+        return TERMINAL_ESC_CLASS_HIGH;
+    }
+    else if (c == 0x7f) {
+        return TERMINAL_ESC_CLASS_DEL;
+    }
+    else if (c >= '@') {
+        switch (c) {
+            case '[':   return TERMINAL_ESC_CLASS_CSI;
+            case 'O':   return TERMINAL_ESC_CLASS_SS3;
+            case ']':
+            case 'P':
+            case 'X':
+            case '^':
+            case '_':   return TERMINAL_ESC_CLASS_STRING;
+            case '\\':  return TERMINAL_ESC_CLASS_ST;
+            default:    return TERMINAL_ESC_CLASS_FINAL;
+        }
     }
-    else if (*str != TERMINAL_ESC) {
-        return invalid;
+    else if (c >= '<') {
+        return TERMINAL_ESC_CLASS_MARKER;
     }
-    else if (str_sz < 2) {
-        return incomplete;
+    else if (c == ';') {
+        return TERMINAL_ESC_CLASS_SEMICOLON;
     }
-    else if (str[1] != '[') {
-        return invalid;
+    else if (c == ':') {
+        return TERMINAL_ESC_CLASS_COLON;
     }
-    else if (str_sz < 3) {
-        return incomplete;
+    else if (c >= '0') {
+        return TERMINAL_ESC_CLASS_DIGIT;
     }
-
-    const char *s = str + 2;
-    const char *next = s;
-
-    next = str_seg_skip_digits(s, str_sz - SIZEVAL(s - str));
-
-    if (next == s) {
-        return invalid;
+    else if (c >= ' ') {
+        return TERMINAL_ESC_CLASS_INTERMEDIATE;
     }
-    else if (next == str + str_sz) {
-        return incomplete;
+    else if (c == TERMINAL_ESC) {
+        return TERMINAL_ESC_CLASS_ESC;
     }
-    else if (*next != ';') {
-        return invalid;
+    else if (c == '\a') {
+        return TERMINAL_ESC_CLASS_BEL;
     }
 
-    const char *height_str = s;
-    uint8_t height_size = UINT8VAL(next - s);
-    long height_value = 0;
-
-    if (!str_seg_to_long(s, height_size, &height_value)) {
-        return invalid;
-    }
+    return TERMINAL_ESC_CLASS_C0;
+}
 
-    s = ++next;
+static bool terminal_esc_collect_param(
+    struct terminal_esc_event_type *event, uint8_t c
+) {
+    if (c == ';') {
+        if (event->param_count >= TERMINAL_ESC_PARAM_COUNT) {
+            return false;
+        }
 
-    if (s == str + str_sz) return incomplete;
+        event->param[event->param_count++] = 0;
 
-    next = str_seg_skip_digits(s, str_sz - SIZEVAL(s - str));
+        if (event->param_count == 1) {
+            // The separator ended a parameter that was left empty.
+            event->param[event->param_count++] = 0;
+        }
 
-    if (next == s) {
-        return invalid;
+        return true;
     }
-    else if (next == str + str_sz) {
-        return incomplete;
+    else if (c < '0' || c > '9') {
+        event->marker = c;
+        return true;
     }
-    else if (*next != 'R') {
-        return invalid;
+
+    if (event->param_count == 0) {
+        event->param_count = 1;
     }
 
-    const char *width_str = s;
-    uint8_t width_size = UINT8VAL(next - s);
-    long width_value = 0;
+    uint16_t *param = &event->param[event->param_count - 1];
+    const unsigned value = *param * 10u + (unsigned) (c - '0');
 
-    if (!str_seg_to_long(s, width_size, &width_value)) {
-        return invalid;
-    }
+    *param = (uint16_t) (value > UINT16_MAX ? UINT16_MAX : value);
 
-    return (struct terminal_incoming_dispatcher_esc_screen_size_type) {
-        .end = ++next,
-        .height = {
-            .str = height_str,
-            .size = height_size,
-            .value = height_value
-        },
-        .width = {
-            .str = width_str,
-            .size = width_size,
-            .value = width_value
-        }
-    };
+    return true;
 }
 
-static bool terminal_handle_incoming_dispatcher_esc_screen_size(
-    TERMINAL *terminal, const uint8_t *data, size_t size
-) {
-    if (terminal->state != TERMINAL_GET_SCREEN_SIZE) {
-        return false;
+static void terminal_esc_map_key(struct terminal_esc_event_type *event) {
+    if (event->marker || event->intermediate) {
+        return;
     }
 
-    const char *str = (const char *) data;
-    auto result = terminal_parse_incoming_dispatcher_esc_screen_size(str, size);
+    TERMINAL_KEY key = TERMINAL_KEY_NONE;
+    size_t mod_param = 1; // the index of the parameter holding the modifiers
 
-    if (result.end == str) {
-        return false; // Sequence does not contain the screen size.
+    switch (event->final) {
+        case 'A': key = TERMINAL_KEY_UP;    break;
+        case 'B': key = TERMINAL_KEY_DOWN;  break;
+        case 'C': key = TERMINAL_KEY_RIGHT; break;
+        case 'D': key = TERMINAL_KEY_LEFT;  break;
+        case 'E': key = TERMINAL_KEY_NOP;   break;
+        case 'H': key = TERMINAL_KEY_HOME;  break;
+        case 'F': key = TERMINAL_KEY_END;   break;
+        case '~': {
+            if (event->introducer != '[' || event->param_count == 0) {
+                return;
+            }
+
+            switch (event->param[0]) {
+                case 1: key = TERMINAL_KEY_HOME; break;
+                case 2: key = TERMINAL_KEY_INS;  break;
+                case 3: key = TERMINAL_KEY_DEL;  break;
+                case 4: key = TERMINAL_KEY_END;  break;
+                case 5: key = TERMINAL_KEY_PGUP; break;
+                case 6: key = TERMINAL_KEY_PGDN; break;
+                case 7: key = TERMINAL_KEY_HOME; break;
+                case 8: key = TERMINAL_KEY_END;  break;
+                default: return;
+            }
+
+            break;
+        }
+        default: return;
     }
 
-    if (result.end != str + size) {
-        BUG("failed to get screen size");
-        terminal_die(terminal);
-        return false;
+    if (event->introducer == 'O' && event->param_count == 1) {
+        mod_param = 0; // some terminals send ESC O 5 A for CTRL+UP
     }
 
-    long rows = result.height.value;
-    long cols = result.width.value;
+    if (mod_param < event->param_count && event->param[mod_param] > 1) {
+        event->mod = (TERMINAL_MOD) ((event->param[mod_param] - 1) & 0x0f);
+    }
 
-    terminal->screen.width = cols;
-    terminal->screen.height = rows;
-    terminal->bitset.reformat = false;
+    event->key = key;
+}
 
-    terminal->state = TERMINAL_IDLE;
+static struct terminal_esc_event_type terminal_esc_parser_emit(
+    struct terminal_esc_parser_type *parser, TERMINAL_ESC_EVENT type,
+    size_t size
+) {
+    struct terminal_esc_event_type event = parser->event;
 
-    return true;
+    event.type = type;
+    event.size = size;
+
+    terminal_reset_esc_parser(parser);
+
+    return event;
 }
 
-static size_t terminal_get_esc_blocking_length(
-    const uint8_t *data, size_t size
+struct terminal_esc_event_type terminal_parse_esc(
+    struct terminal_esc_parser_type *parser, const uint8_t *data, size_t size
 ) {
-    if (!data) {
+    // The data is expected to start with ESC and to be the same buffer from
+    // one call to another, consumed from the front by exactly the size of the
+    // returned events and appended to at the back. Each byte is looked at only
+    // once, no matter in how many pieces a sequence arrives.
+
+    if (!parser || !data) {
         FUSE();
-        return 0;
+        return (struct terminal_esc_event_type) {};
     }
 
-    if (size < 1 || *data != TERMINAL_ESC) {
-        return 0;
+    if (parser->offset > size) {
+        // The data was consumed without us knowing about it.
+        BUG("offset %lu exceeds size %lu", parser->offset, size);
+        terminal_reset_esc_parser(parser);
     }
 
-    const char *str = (const char *) data;
-    const char *next = str;
+    struct terminal_esc_event_type *event = &parser->event;
+
+    for (size_t i = parser->offset; i < size; ++i) {
+        const uint8_t c = data[i];
+        const TERMINAL_ESC_PARSER_STATE state = terminal_esc_table[
+            parser->state
+        ][terminal_esc_get_class(c)];
+
+        if (i >= TERMINAL_ESC_MAX_SIZE) {
+            return terminal_esc_parser_emit(
+                parser, TERMINAL_ESC_EVENT_ABORTED, i
+            );
+        }
+
+        switch (state) {
+            case TERMINAL_ESC_PARSER_GROUND: {
+                // The bytes before this one are not a sequence. If this is the
+                // first byte, then it was not even an ESC to begin with.
+
+                if (i == 0) {
+                    FUSE();
+                    i = 1;
+                }
+                else if (parser->state == TERMINAL_ESC_PARSER_STRING_ESC) {
+                    --i; // the ESC that ended the string may start another
+                }
+
+                return terminal_esc_parser_emit(
+                    parser, TERMINAL_ESC_EVENT_ABORTED, i
+                );
+            }
+            case TERMINAL_ESC_PARSER_DISPATCH: {
+                event->final = c;
+                terminal_esc_map_key(event);
+
+                return terminal_esc_parser_emit(
+                    parser, TERMINAL_ESC_EVENT_SEQUENCE, i + 1
+                );
+            }
+            case TERMINAL_ESC_PARSER_IGNORE: {
+                // Whatever was collected is not to be interpreted.
+
+                *event = (struct terminal_esc_event_type) {
+                    .introducer = event->introducer,
+                    .final = c
+                };
+
+                return terminal_esc_parser_emit(
+                    parser, TERMINAL_ESC_EVENT_SEQUENCE, i + 1
+                );
+            }
+            case TERMINAL_ESC_PARSER_CSI_ENTRY:
+            case TERMINAL_ESC_PARSER_STRING: {
+                if (parser->state == TERMINAL_ESC_PARSER_ESCAPE) {
+                    event->introducer = c;
+                }
+
+                break;
+            }
+            case TERMINAL_ESC_PARSER_SS3:
+            case TERMINAL_ESC_PARSER_CSI_PARAM: {
+                if (parser->state == TERMINAL_ESC_PARSER_ESCAPE) {
+                    event->introducer = c;
+                }
+                else if (!terminal_esc_collect_param(event, c)) {
+                    // Too many parameters to make any sense of them.
+                    parser->state = TERMINAL_ESC_PARSER_CSI_IGNORE;
+                    continue;
+                }
 
-    if (next == str) {
-        next = terminal_parse_incoming_dispatcher_esc_screen_size(
-            str, size
-        ).end;
+                break;
+            }
+            case TERMINAL_ESC_PARSER_CSI_INTERMEDIATE: {
+                event->intermediate = c;
+                break;
+            }
+            default: break;
+        }
+
+        parser->state = state;
     }
 
-    return next == nullptr ? 0 : next == str ? 1 : SIZEVAL(next - str);
+    parser->offset = size;
+
+    return (struct terminal_esc_event_type) {};
+}
+
+void terminal_reset_esc_parser(struct terminal_esc_parser_type *parser) {
+    *parser = (struct terminal_esc_parser_type) {};
 }
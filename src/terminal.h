@@ -28,6 +28,36 @@ typedef enum : uint8_t {
     TERMINAL_ESC = 27   // ANSI escape character
 } TERMINAL_CODE;
 
+typedef enum : uint8_t {
+    TERMINAL_MOD_NONE   = 0,
+    TERMINAL_MOD_SHIFT  = (1 << 0),
+    TERMINAL_MOD_ALT    = (1 << 1),
+    TERMINAL_MOD_CTRL   = (1 << 2),
+    TERMINAL_MOD_META   = (1 << 3)
+} TERMINAL_MOD;
+
+typedef enum : uint8_t {
+    TERMINAL_ESC_EVENT_NONE = 0,    // more data is needed to tell anything
+    TERMINAL_ESC_EVENT_SEQUENCE,    // a complete control sequence
+    TERMINAL_ESC_EVENT_ABORTED      // bytes that turned out not to be one
+} TERMINAL_ESC_EVENT;
+
+typedef enum : uint8_t {
+    TERMINAL_ESC_PARSER_GROUND = 0,
+    TERMINAL_ESC_PARSER_ESCAPE,
+    TERMINAL_ESC_PARSER_CSI_ENTRY,
+    TERMINAL_ESC_PARSER_CSI_PARAM,
+    TERMINAL_ESC_PARSER_CSI_INTERMEDIATE,
+    TERMINAL_ESC_PARSER_CSI_IGNORE,
+    TERMINAL_ESC_PARSER_SS3,
+    TERMINAL_ESC_PARSER_STRING,
+    TERMINAL_ESC_PARSER_STRING_ESC,
+    TERMINAL_ESC_PARSER_DISPATCH,
+    TERMINAL_ESC_PARSER_IGNORE,
+    ////////////////////////////////////////////////////////////////////////////
+    MAX_TERMINAL_ESC_PARSER_STATE
+} TERMINAL_ESC_PARSER_STATE;
+
 static constexpr size_t TERMINAL_DEFAULT_WIDTH          = 80;
 static constexpr size_t TERMINAL_DEFAULT_HEIGHT         = 24;
 static constexpr char   TERMINAL_ESC_LINE_WRAPPING_ON[] = "\x1b[?7h";
@@ -53,6 +83,28 @@ static constexpr char   TERMINAL_ESC_REVERSE[]          = "\x1b[7m";
 static constexpr char   TERMINAL_ESC_STRIKETHROUGH[]    = "\x1b[9m";
 static constexpr char   TERMINAL_ESC_RESET[]            = "\x1b[0m";
 static constexpr char   TERMINAL_ESC_CLEAR_SCREEN[]     = "\x1b[H\x1b[2J";
+static constexpr char   TERMINAL_ESC_CLEAR_LINE_RIGHT[] = "\x1b[K";
+static constexpr size_t TERMINAL_ESC_PARAM_COUNT        = 16;
+static constexpr size_t TERMINAL_ESC_MAX_SIZE           = 4096;
+
+struct terminal_esc_event_type {
+    size_t size; // how many bytes from the front of the data the event spans
+    TERMINAL_ESC_EVENT type;
+    TERMINAL_KEY key;
+    TERMINAL_MOD mod;
+    uint8_t introducer;     // '[' for CSI, 'O' for SS3, ']' for OSC and so on
+    uint8_t marker;         // private parameter marker such as '?'
+    uint8_t intermediate;
+    uint8_t final;
+    uint8_t param_count;
+    uint16_t param[TERMINAL_ESC_PARAM_COUNT];
+};
+
+struct terminal_esc_parser_type {
+    struct terminal_esc_event_type event; // what has been parsed so far
+    size_t offset;  // how many bytes of the pending sequence have been seen
+    TERMINAL_ESC_PARSER_STATE state;
+};
 
 typedef enum : unsigned char {
     TERMINAL_STATE_NONE = 0,
@@ -72,6 +124,8 @@ struct TERMINAL {
         struct {
             struct {
                 CLIP *clip;
+                struct telnet_parser_type telnet;
+                struct terminal_esc_parser_type esc;
             } incoming;
 
             struct {
@@ -82,6 +136,7 @@ struct TERMINAL {
         struct {
             struct {
                 CLIP *clip;
+                struct telnet_parser_type telnet;
             } incoming;
 
             struct {
@@ -132,4 +187,9 @@ void        terminal_init(TERMINAL *);
 void        terminal_deinit(TERMINAL *);
 bool        terminal_update(TERMINAL *);
 
+struct terminal_esc_event_type terminal_parse_esc(
+    struct terminal_esc_parser_type *, const uint8_t *data, size_t size
+);
+void terminal_reset_esc_parser(struct terminal_esc_parser_type *);
+
 #endif
@@ -3,9 +3,23 @@
 #include "all.h"
 ////////////////////////////////////////////////////////////////////////////////
 #include <stdlib.h>
+#include <stdatomic.h>
+#include <threads.h>
 ////////////////////////////////////////////////////////////////////////////////
 
 
+static void detect_simd();
+
+// The instruction set of the vectorized scans is detected once for the whole
+// process, on first use. The one in use may be lowered with set_simd.
+static struct simd_type {
+    once_flag once;
+    SIMD detected;
+    atomic_int used;
+} simd = {
+    .once = ONCE_FLAG_INIT
+};
+
 uint8_t to_uint8(long a, const char *file, int line) {
     if (a > UINT8_MAX) {
         a = UINT8_MAX;
@@ -45,8 +59,12 @@ size_t umax_size(size_t a, size_t b) {
     return a > b ? a : b;
 }
 
+size_t umin_size(size_t a, size_t b) {
+    return a < b ? a : b;
+}
+
 bool fuse(const char *path, int line) {
-    static unsigned char fuses[4096];
+    static atomic_uchar fuses[4096]; // worker threads blow fuses too
     char buf[128];
     const char *file = path;
 
@@ -69,12 +87,44 @@ bool fuse(const char *path, int line) {
     size_t byte = (hash / 8) % sizeof(fuses);
     unsigned char bit  = 1 << (hash % 8);
 
-    if (fuses[byte] & bit) {
+    if (atomic_fetch_or(&fuses[byte], bit) & bit) {
         return false;
     }
 
-    fuses[byte] |= bit;
     WIZNET_BUG("%s", buf);
 
     return true;
 }
+
+SIMD get_simd() {
+    call_once(&simd.once, detect_simd);
+
+    return (SIMD) atomic_load_explicit(&simd.used, memory_order_relaxed);
+}
+
+void set_simd(SIMD to) {
+    // Instruction sets that the processor does not support are ignored and
+    // the detected one is used instead.
+
+    call_once(&simd.once, detect_simd);
+
+    if (to == SIMD_AUTO || to > simd.detected) {
+        to = simd.detected;
+    }
+
+    atomic_store_explicit(&simd.used, to, memory_order_relaxed);
+}
+
+static void detect_simd() {
+#if SIMD_X86
+    __builtin_cpu_init();
+
+    simd.detected = (
+        __builtin_cpu_supports("avx2") ? SIMD_AVX2 : SIMD_SSE2
+    );
+#else
+    simd.detected = SIMD_NONE;
+#endif
+
+    atomic_store_explicit(&simd.used, simd.detected, memory_order_relaxed);
+}
@@ -1,10 +1,26 @@
 // SPDX-License-Identifier: MIT
 #ifndef UTILS_H_06_01_2026
 #define UTILS_H_06_01_2026
+////////////////////////////////////////////////////////////////////////////////
+#if defined(__x86_64__) && defined(__GNUC__)
+#define SIMD_X86 1
+#else
+#define SIMD_X86 0
+#endif
+////////////////////////////////////////////////////////////////////////////////
+
 
+typedef enum : uint8_t {
+    SIMD_AUTO = 0,
+    ////////////////////////////////////////////////////////////////////////////
+    SIMD_NONE, SIMD_SSE2, SIMD_AVX2
+} SIMD;
 
 bool fuse(const char *file, int line);
+SIMD get_simd();
+void set_simd(SIMD);
 size_t umax_size(size_t, size_t);
+size_t umin_size(size_t, size_t);
 size_t to_size(long a, const char *file, int line);
 unsigned short to_ushort(long a, const char *file, int line);
 uint8_t to_uint8(long a, const char *file, int line);
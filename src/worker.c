@@ -0,0 +1,332 @@
+// SPDX-License-Identifier: MIT
+////////////////////////////////////////////////////////////////////////////////
+#include "all.h"
+////////////////////////////////////////////////////////////////////////////////
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+////////////////////////////////////////////////////////////////////////////////
+
+
+static constexpr size_t WORKER_EVENT_COUNT = 8;
+static constexpr int WORKER_LINGER_MSEC = 1000;
+
+static_assert(
+    (WORKER_INBOX_SIZE & (WORKER_INBOX_SIZE - 1)) == 0,
+    "WORKER_INBOX_SIZE must be a power of two"
+);
+
+static void *worker_main(void *);
+static bool worker_take(WORKER *, struct worker_message_type *);
+static bool worker_receive(WORKER *, SERVER *);
+
+
+WORKER *worker_create(size_t index) {
+    WORKER *worker = mem_new_worker();
+
+    if (!worker) {
+        return nullptr;
+    }
+
+    worker->index = index;
+    worker->epoll = -1;
+    worker->inbox.event = -1;
+
+    for (size_t i=0; i<WORKER_INBOX_SIZE; ++i) {
+        atomic_init(&worker->inbox.slot[i].sequence, i);
+    }
+
+    // With a terminal attached to the main thread, the log lines of the
+    // workers would end up on the screen of the local session. They are
+    // handed over to the main thread instead, which logs them along with its
+    // own once the screen can be written to.
+
+    worker->bitset.queued = global.terminal != nullptr;
+
+    worker->inbox.event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    worker->epoll = epoll_create1(EPOLL_CLOEXEC);
+
+    struct epoll_event event = {
+        .events = EPOLLIN,
+        .data.ptr = nullptr
+    };
+
+    if (worker->inbox.event == -1
+    ||  worker->epoll == -1
+    ||  epoll_ctl(
+            worker->epoll, EPOLL_CTL_ADD, worker->inbox.event, &event
+        ) == -1) {
+        BUG("%s", strerror(errno));
+        worker_destroy(worker);
+
+        return nullptr;
+    }
+
+    // The bitset shares its bytes with the flags that the thread reads, so it
+    // must not be written after the thread has been started.
+
+    worker->bitset.started = true;
+
+    int error = pthread_create(&worker->thread, nullptr, worker_main, worker);
+
+    if (error) {
+        BUG("%s", strerror(error));
+        worker->bitset.started = false;
+        worker_destroy(worker);
+
+        return nullptr;
+    }
+
+    return worker;
+}
+
+void worker_destroy(WORKER *worker) {
+    if (!worker) {
+        return;
+    }
+
+    if (worker->bitset.started) {
+        const struct worker_message_type shutdown = {
+            .type = WORKER_MESSAGE_SHUTDOWN,
+            .fd = -1
+        };
+
+        while (!worker_post(worker, shutdown)) {
+            sched_yield(); // the inbox is full
+        }
+
+        pthread_join(worker->thread, nullptr);
+        worker->bitset.started = false;
+    }
+
+    // The sockets that were handed over too late are closed unserved.
+
+    for (struct worker_message_type message; worker_take(worker, &message);) {
+        if (message.type == WORKER_MESSAGE_ADOPT) {
+            close(message.fd);
+        }
+    }
+
+    if (worker->inbox.event != -1) {
+        close(worker->inbox.event);
+    }
+
+    if (worker->epoll != -1) {
+        close(worker->epoll);
+    }
+
+    mem_free_worker(worker);
+}
+
+bool worker_post(WORKER *worker, struct worker_message_type message) {
+    // Producers claim a slot by advancing the head. A slot is free for the
+    // position whose number its sequence equals, and it has been filled once
+    // the sequence is one past that.
+
+    size_t position = atomic_load_explicit(
+        &worker->inbox.head, memory_order_relaxed
+    );
+    typeof(&worker->inbox.slot[0]) slot;
+
+    for (;;) {
+        slot = &worker->inbox.slot[position % WORKER_INBOX_SIZE];
+
+        size_t sequence = atomic_load_explicit(
+            &slot->sequence, memory_order_acquire
+        );
+        intptr_t difference = (intptr_t) (sequence - position);
+
+        if (difference == 0) {
+            if (atomic_compare_exchange_weak_explicit(
+                &worker->inbox.head, &position, position + 1,
+                memory_order_relaxed, memory_order_relaxed
+            )) {
+                break;
+            }
+        }
+        else if (difference < 0) {
+            return false;
+        }
+        else {
+            position = atomic_load_explicit(
+                &worker->inbox.head, memory_order_relaxed
+            );
+        }
+    }
+
+    slot->message = message;
+    atomic_store_explicit(&slot->sequence, position + 1, memory_order_release);
+
+    const uint64_t one = 1;
+
+    if (write(worker->inbox.event, &one, sizeof(one)) == -1
+    &&  errno != EAGAIN) {
+        BUG("%s", strerror(errno));
+    }
+
+    return true;
+}
+
+size_t worker_get_session_count(WORKER *worker) {
+    return atomic_load_explicit(
+        &worker->count.sessions, memory_order_relaxed
+    );
+}
+
+static bool worker_take(WORKER *worker, struct worker_message_type *message) {
+    const size_t position = worker->inbox.tail;
+    auto slot = &worker->inbox.slot[position % WORKER_INBOX_SIZE];
+    const size_t sequence = atomic_load_explicit(
+        &slot->sequence, memory_order_acquire
+    );
+
+    if (sequence != position + 1) {
+        return false;
+    }
+
+    *message = slot->message;
+    worker->inbox.tail = position + 1;
+
+    atomic_store_explicit(
+        &slot->sequence, position + WORKER_INBOX_SIZE, memory_order_release
+    );
+
+    return true;
+}
+
+static bool worker_receive(WORKER *worker, SERVER *server) {
+    // Returns false once the worker has been told to shut down.
+
+    uint64_t count;
+    bool running = true;
+
+    (void)!read(worker->inbox.event, &count, sizeof(count));
+
+    for (struct worker_message_type message; worker_take(worker, &message);) {
+        switch (message.type) {
+            case WORKER_MESSAGE_ADOPT: {
+                atomic_fetch_add_explicit(
+                    &worker->count.adopted, 1, memory_order_relaxed
+                );
+
+                if (!server_adopt(server, message.fd)) {
+                    close(message.fd);
+                }
+
+                break;
+            }
+            case WORKER_MESSAGE_SHUTDOWN: {
+                server_shutdown(server);
+                running = false;
+                break;
+            }
+            default: {
+                BUG("unexpected message (%d)", (int) message.type);
+                break;
+            }
+        }
+    }
+
+    return running;
+}
+
+static void *worker_main(void *arg) {
+    // Every worker serves its shard of the sessions with a server of its own,
+    // allocating from the memory pool of its own thread. Once told to shut
+    // down, it lingers for as long as the sessions keep flushing their output.
+
+    WORKER *worker = arg;
+    bool running = true;
+
+    log_detach(worker->bitset.queued);
+
+    SERVER *server = server_create();
+    struct epoll_event event = {
+        .events = EPOLLIN,
+        .data.ptr = server
+    };
+
+    if (!server) {
+        // The inbox is still emptied so that whoever posts to it would not
+        // wait forever. The sockets handed over are closed right away.
+
+        BUG("worker %lu failed to create a server", worker->index);
+    }
+    else if (epoll_ctl(worker->epoll, EPOLL_CTL_ADD, server->epoll, &event)) {
+        BUG("%s", strerror(errno));
+    }
+
+    LOG("worker %lu started", worker->index);
+
+    for (;;) {
+        // The free memory that has not been needed lately is given back once
+        // a trim is due. Until then, or for good if there is nothing left to
+        // trim, the worker sleeps until there are events.
+
+        struct epoll_event events[WORKER_EVENT_COUNT];
+        const size_t trim_msec = mem_trim();
+        const int count = epoll_wait(
+            worker->epoll, events, (int) ARRAY_LENGTH(events), (
+                !running ? WORKER_LINGER_MSEC :
+                trim_msec ? (int) umin_size(trim_msec, INT_MAX) : -1
+            )
+        );
+
+        if (count == -1 && errno != EINTR) {
+            BUG("%s", strerror(errno));
+            break;
+        }
+
+        if (count == 0 && !running) {
+            break;
+        }
+
+        mem_arena_begin();
+
+        for (int i=0; i<count; ++i) {
+            if (events[i].data.ptr) {
+                server_poll(server);
+            }
+            else if (!worker_receive(worker, server)) {
+                running = false;
+            }
+        }
+
+        server_update(server);
+        mem_arena_reset();
+
+        const size_t sessions = server_get_user_count(server);
+
+        atomic_store_explicit(
+            &worker->count.sessions, sessions, memory_order_relaxed
+        );
+
+        if (!running && !sessions) {
+            break;
+        }
+    }
+
+    server_destroy(server);
+
+    LOG("worker %lu stopped", worker->index);
+
+    mem_recycle();
+
+    // What the worker still has in use may be referenced from other threads,
+    // such as the shared contents of a CLIP. It is reported but not cleared,
+    // and gets freed to the orphaned pool later on.
+
+    const size_t usage = mem_get_thread_usage();
+
+    if (usage) {
+        WARN(
+            "worker %lu: %lu bytes of memory left hanging", worker->index,
+            usage
+        );
+    }
+
+    return nullptr;
+}
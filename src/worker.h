@@ -0,0 +1,61 @@
+// SPDX-License-Identifier: MIT
+#ifndef WORKER_H_16_10_2026
+#define WORKER_H_16_10_2026
+////////////////////////////////////////////////////////////////////////////////
+#include "global.h"
+////////////////////////////////////////////////////////////////////////////////
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+////////////////////////////////////////////////////////////////////////////////
+
+
+static constexpr size_t WORKER_INBOX_SIZE = 1024; // must be a power of two
+
+typedef enum : uint8_t {
+    WORKER_MESSAGE_NONE = 0,
+    WORKER_MESSAGE_ADOPT,   // serve the accepted socket in fd
+    WORKER_MESSAGE_SHUTDOWN // shut the sessions down and stop
+} WORKER_MESSAGE;
+
+struct worker_message_type {
+    WORKER_MESSAGE type;
+    int fd;
+};
+
+struct WORKER {
+    // The inbox is a bounded queue that any thread can post to without locks.
+    // Only the worker itself takes the messages out of it.
+
+    struct {
+        struct {
+            atomic_size_t sequence;
+            struct worker_message_type message;
+        } slot[WORKER_INBOX_SIZE];
+
+        atomic_size_t head; // the position of the next message to post
+        size_t tail;        // the position of the next message to take
+        int event;          // eventfd that wakes the worker up
+    } inbox;
+
+    pthread_t thread;
+    size_t index;
+    int epoll; // the event loop of the worker
+
+    struct {
+        atomic_size_t sessions; // the number of sessions in the shard
+        atomic_size_t adopted;  // the number of sockets handed over
+    } count;
+
+    struct {
+        bool started:1;
+        bool queued:1;
+    } bitset;
+};
+
+WORKER *    worker_create(size_t index);
+void        worker_destroy(WORKER *);
+bool        worker_post(WORKER *, struct worker_message_type);
+size_t      worker_get_session_count(WORKER *);
+
+#endif